@@ -0,0 +1,285 @@
+﻿#include "LoadGenerator.h"
+
+#include "FrameProtocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <boost/asio.hpp>
+
+namespace {
+
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief 受信バッファから応答を1つずつ切り出す読み取り器。
+ *        応答は改行で終わる文字列か、definite-length block ("#<n><len><data>") とそれに続く改行です。
+ */
+class ReplyReader {
+public:
+    explicit ReplyReader(tcp::socket& socket) : socket_(socket) {}
+
+    /**
+     * @brief 応答を1つ受信し、そのバイト数を返します。先頭が "エラー" なら isError を true にします。
+     */
+    std::size_t read(bool& isError) {
+        std::size_t length = 0;
+        while ((length = completeLength()) == 0) {
+            fill();
+        }
+
+        static const std::string errorPrefix = "エラー";
+        isError = buffer_.size() - start_ >= errorPrefix.size()
+            && std::equal(errorPrefix.begin(), errorPrefix.end(), buffer_.begin() + start_);
+
+        start_ += length;
+        if (start_ == buffer_.size()) {
+            buffer_.clear();
+            start_ = 0;
+        }
+        return length;
+    }
+
+private:
+    /**
+     * @brief 受信済みのデータに完全な応答があればその長さを、なければ 0 を返します。
+     */
+    std::size_t completeLength() const {
+        const std::size_t available = buffer_.size() - start_;
+        const char* data = buffer_.data() + start_;
+        std::size_t from = 0;
+
+        if (available >= 2 && data[0] == '#' && data[1] >= '1' && data[1] <= '9') {
+            const std::size_t digits = static_cast<std::size_t>(data[1] - '0');
+            if (available < 2 + digits) {
+                return 0;
+            }
+            std::size_t payload = 0;
+            for (std::size_t i = 0; i < digits; ++i) {
+                payload = payload * 10 + static_cast<std::size_t>(data[2 + i] - '0');
+            }
+            from = 2 + digits + payload;
+            if (available < from) {
+                return 0;
+            }
+        }
+
+        for (std::size_t i = from; i < available; ++i) {
+            if (data[i] == '\n') {
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    void fill() {
+        if (start_ > 0 && start_ * 2 >= buffer_.size()) {
+            buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<std::ptrdiff_t>(start_));
+            start_ = 0;
+        }
+        const std::size_t used = buffer_.size();
+        buffer_.resize(used + 256 * 1024);
+        const std::size_t received = socket_.read_some(boost::asio::buffer(buffer_.data() + used, buffer_.size() - used));
+        buffer_.resize(used + received);
+    }
+
+    tcp::socket& socket_;
+    std::vector<char> buffer_;
+    std::size_t start_ = 0;
+};
+
+/**
+ * @brief 1クライアント分の計測結果。
+ */
+struct ClientResult {
+    uint64_t commands = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    std::vector<uint32_t> latenciesUs;
+};
+
+void runClient(tcp::socket& socket, const Scenario& scenario, ClientResult& result) {
+    const std::string line = scenario.command + "\n";
+    const int depth = scenario.pipelineDepth > 0 ? scenario.pipelineDepth : 1;
+
+    ReplyReader reader(socket);
+    std::deque<Clock::time_point> inFlight;
+    int sent = 0;
+    result.latenciesUs.reserve(static_cast<std::size_t>(scenario.commandsPerClient));
+
+    while (result.commands < static_cast<uint64_t>(scenario.commandsPerClient)) {
+        // パイプラインの深さまで先に送っておく
+        std::string batch;
+        while (sent < scenario.commandsPerClient && static_cast<int>(inFlight.size()) < depth) {
+            batch += line;
+            inFlight.push_back(Clock::now());
+            ++sent;
+        }
+        if (!batch.empty()) {
+            boost::asio::write(socket, boost::asio::buffer(batch));
+        }
+
+        bool isError = false;
+        result.bytes += reader.read(isError);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - inFlight.front());
+        inFlight.pop_front();
+
+        result.latenciesUs.push_back(static_cast<uint32_t>(elapsed.count()));
+        ++result.commands;
+        if (isError) {
+            ++result.errors;
+        }
+    }
+}
+
+/**
+ * @brief フレームモードで QUERY 要求を送り、応答の最後のフレームまでを1コマンドとして数えます。
+ *        1接続は1台の計測器だけに送るため、応答は要求の順に返ります。
+ */
+void runFramedClient(tcp::socket& socket, const Scenario& scenario, uint16_t instrument, ClientResult& result) {
+    const int depth = scenario.pipelineDepth > 0 ? scenario.pipelineDepth : 1;
+
+    std::deque<Clock::time_point> inFlight;
+    uint32_t nextId = 1;
+    int sent = 0;
+    std::vector<char> payload;
+    result.latenciesUs.reserve(static_cast<std::size_t>(scenario.commandsPerClient));
+
+    while (result.commands < static_cast<uint64_t>(scenario.commandsPerClient)) {
+        std::string batch;
+        while (sent < scenario.commandsPerClient && static_cast<int>(inFlight.size()) < depth) {
+            FrameRequestHeader header;
+            header.opcode = FrameOpcode::Query;
+            header.instrument = instrument;
+            header.requestId = nextId++;
+            header.length = static_cast<uint32_t>(scenario.command.size());
+            const auto bytes = encodeFrameRequestHeader(header);
+            batch.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            batch += scenario.command;
+            inFlight.push_back(Clock::now());
+            ++sent;
+        }
+        if (!batch.empty()) {
+            boost::asio::write(socket, boost::asio::buffer(batch));
+        }
+
+        FrameResponseHeader header;
+        do {
+            std::array<uint8_t, FRAME_RESPONSE_HEADER_SIZE> bytes;
+            boost::asio::read(socket, boost::asio::buffer(bytes));
+            header = decodeFrameResponseHeader(bytes.data());
+            payload.resize(header.length);
+            if (header.length > 0) {
+                boost::asio::read(socket, boost::asio::buffer(payload));
+            }
+            result.bytes += header.length;
+        } while (header.flags & FRAME_MORE);
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - inFlight.front());
+        inFlight.pop_front();
+
+        result.latenciesUs.push_back(static_cast<uint32_t>(elapsed.count()));
+        ++result.commands;
+        if (header.status != FrameStatus::Ok) {
+            ++result.errors;
+        }
+    }
+}
+
+} // namespace
+
+double ScenarioResult::commandsPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(commands) / seconds : 0.0;
+}
+
+double ScenarioResult::megabytesPerSecond() const {
+    return seconds > 0.0 ? static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds : 0.0;
+}
+
+uint32_t ScenarioResult::percentileMicros(double quantile) const {
+    if (latenciesUs.empty()) {
+        return 0;
+    }
+    const std::size_t last = latenciesUs.size() - 1;
+    const std::size_t index = static_cast<std::size_t>(quantile * static_cast<double>(last) + 0.5);
+    return latenciesUs[index < last ? index : last];
+}
+
+ScenarioResult runScenario(const std::string& host, unsigned short port, const Scenario& scenario, std::size_t instruments) {
+    boost::asio::io_context io;
+    tcp::resolver resolver(io);
+    const auto endpoints = resolver.resolve(host, std::to_string(port));
+
+    // 先に全接続を確立し、宛先の計測器を割り当てておく
+    std::vector<tcp::socket> sockets;
+    for (int i = 0; i < scenario.clients; ++i) {
+        tcp::socket socket(io);
+        boost::asio::connect(socket, endpoints);
+        socket.set_option(tcp::no_delay(true));
+
+        if (instruments > 1 && !scenario.framed) {
+            const std::string select = ":SERVER:SELECT " + std::to_string(static_cast<std::size_t>(i) % instruments + 1) + "\n";
+            boost::asio::write(socket, boost::asio::buffer(select));
+            boost::asio::streambuf reply;
+            boost::asio::read_until(socket, reply, "\n");
+        }
+        sockets.push_back(std::move(socket));
+    }
+
+    std::vector<ClientResult> results(sockets.size());
+    std::promise<void> go;
+    std::shared_future<void> started = go.get_future().share();
+    std::mutex errorMutex;
+    std::string firstError;
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < sockets.size(); ++i) {
+        threads.emplace_back([&, i] {
+            started.wait();
+            try {
+                if (scenario.framed) {
+                    runFramedClient(sockets[i], scenario, static_cast<uint16_t>(i % instruments + 1), results[i]);
+                }
+                else {
+                    runClient(sockets[i], scenario, results[i]);
+                }
+            }
+            catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (firstError.empty()) {
+                    firstError = e.what();
+                }
+            }
+        });
+    }
+
+    const auto begin = Clock::now();
+    go.set_value();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const auto end = Clock::now();
+
+    if (!firstError.empty()) {
+        std::cerr << "クライアントで通信エラーが発生しました (" << scenario.name << "): " << firstError << std::endl;
+    }
+
+    ScenarioResult total;
+    total.name = scenario.name;
+    total.seconds = std::chrono::duration<double>(end - begin).count();
+    for (auto& result : results) {
+        total.commands += result.commands;
+        total.errors += result.errors;
+        total.bytes += result.bytes;
+        total.latenciesUs.insert(total.latenciesUs.end(), result.latenciesUs.begin(), result.latenciesUs.end());
+    }
+    std::sort(total.latenciesUs.begin(), total.latenciesUs.end());
+    return total;
+}
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief 負荷試験の1シナリオ。clients 本の接続から同じクエリを commandsPerClient 回ずつ送ります。
+ */
+struct Scenario {
+    std::string name;
+    std::string command;         // 送信するクエリ (改行なし)
+    int clients = 4;
+    int commandsPerClient = 1000;
+    int pipelineDepth = 1;       // 応答を待たずに送っておくコマンド数。1 なら1問1答
+    bool framed = false;         // フレームモード (QUERY 要求) で送る
+};
+
+/**
+ * @brief シナリオの計測結果。
+ */
+struct ScenarioResult {
+    std::string name;
+    uint64_t commands = 0; // 応答を受け取ったコマンド数
+    uint64_t errors = 0;   // "エラー" で始まる応答 (フレームモードでは Ok 以外のステータス) の数
+    uint64_t bytes = 0;    // 受信した応答の合計バイト数
+    double seconds = 0.0;
+    std::vector<uint32_t> latenciesUs; // コマンド送信から応答受信完了までの時間 (昇順)
+
+    double commandsPerSecond() const;
+    double megabytesPerSecond() const;
+    uint32_t percentileMicros(double quantile) const;
+};
+
+/**
+ * @brief 複数のクライアント接続からサーバーへ負荷をかけ、結果を集計します。
+ *        全接続の確立後に一斉に送信を開始します。instruments が2以上の場合、接続ごとに
+ *        ":SERVER:SELECT" (フレームモードでは要求ヘッダの計測器番号) で計測器を順番に割り当てます。
+ * @param host 接続先ホスト。
+ * @param port 接続先ポート。フレームモードのシナリオではフレームモードの待ち受けポートを指定します。
+ * @param scenario 実行するシナリオ。
+ * @param instruments サーバーが公開している計測器の数。
+ */
+ScenarioResult runScenario(const std::string& host, unsigned short port, const Scenario& scenario, std::size_t instruments);
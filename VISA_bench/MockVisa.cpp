@@ -0,0 +1,504 @@
+﻿#include "MockVisa.h"
+
+#include <visa.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+/**
+ * @brief viInstallHandler / viEnableEvent で登録されたイベントハンドラ。
+ */
+struct MockHandler {
+    ViHndlr handler = nullptr;
+    ViAddr context = nullptr;
+    bool enabled = false;
+};
+
+/**
+ * @brief 1つの模擬セッション。未読の応答と読み取り位置を保持します。
+ */
+struct MockSession {
+    std::size_t instrument = 0;
+    std::string pending;
+    std::size_t position = 0;
+    std::chrono::steady_clock::time_point readyAt; // 応答を読み取れるようになる時刻 (この時刻から MAV が立つ)
+    bool operationComplete = false;                 // *OPC 受信後、*ESR? で読み出されるまで ESB が立つ
+    ViUInt32 timeoutMs = 2000;                      // VI_ATTR_TMO_VALUE
+    std::map<ViEventType, MockHandler> handlers;
+
+    std::mutex mutex;    // 通知スレッドと計測器のワーカースレッドの間で状態を守る
+    std::mutex busMutex; // 読み取りは1つずつ (非同期読み取りのスレッドと同期読み取りで共有)
+};
+
+/**
+ * @brief 非同期読み取りの完了イベント。ハンドラの呼び出し中だけ viGetAttribute から参照できます。
+ */
+struct MockEvent {
+    ViJobId jobId;
+    ViStatus status;
+    ViUInt32 count;
+};
+
+constexpr ViSession RESOURCE_MANAGER = 1;
+constexpr ViFindList FIND_LIST = 2;
+
+std::mutex configMutex;
+MockVisaConfig config;
+
+std::mutex sessionsMutex;
+std::map<ViSession, std::shared_ptr<MockSession>> sessions;
+ViSession nextSession = 100;
+
+std::mutex eventsMutex;
+std::map<ViEvent, MockEvent> events;
+std::atomic<ViEvent> nextEvent{ 1000000 };
+std::atomic<ViJobId> nextJob{ 1 };
+
+// 同じ内容のブロックを毎回作らないよう、サイズごとに1つだけ保持する
+std::string cachedBlock;
+
+MockVisaConfig currentConfig() {
+    std::lock_guard<std::mutex> lock(configMutex);
+    return config;
+}
+
+std::shared_ptr<MockSession> findSession(ViSession vi) {
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto it = sessions.find(vi);
+    return it == sessions.end() ? nullptr : it->second;
+}
+
+std::string blockResponse(std::size_t size) {
+    std::lock_guard<std::mutex> lock(configMutex);
+    const std::string length = std::to_string(size);
+    const std::string header = "#" + std::to_string(length.size()) + length;
+    if (cachedBlock.size() != header.size() + size + 1 || cachedBlock.compare(0, header.size(), header) != 0) {
+        cachedBlock = header;
+        cachedBlock.reserve(header.size() + size + 1);
+        for (std::size_t i = 0; i < size; ++i) {
+            cachedBlock += static_cast<char>(i & 0xFF);
+        }
+        cachedBlock += '\n';
+    }
+    return cachedBlock;
+}
+
+/**
+ * @brief コマンド (改行を含む可能性あり) に対する模擬応答を返します。応答のないコマンドは空文字列。
+ */
+std::string respond(const MockVisaConfig& settings, std::size_t instrument, const std::string& command) {
+    if (command.find('?') == std::string::npos) {
+        return "";
+    }
+    if (command.find("*ESR?") != std::string::npos) {
+        return "1\n";
+    }
+    if (command.find("*IDN?") != std::string::npos) {
+        return (instrument < settings.idns.size() ? settings.idns[instrument] : "MOCK,BENCH,0,1.0") + "\n";
+    }
+    if (command.find(":WAV") != std::string::npos) {
+        return blockResponse(settings.blockSize);
+    }
+    return std::string(settings.responseSize, '1') + "\n";
+}
+
+/**
+ * @brief 登録されていれば、指定したイベントのハンドラを返します。
+ */
+MockHandler enabledHandler(MockSession& session, ViEventType eventType) {
+    auto it = session.handlers.find(eventType);
+    return it != session.handlers.end() && it->second.enabled ? it->second : MockHandler{};
+}
+
+/**
+ * @brief 応答を最大 cnt バイト読み取ります。応答の準備ができるまでと、バスの転送時間だけ待ちます。
+ */
+ViStatus readPending(MockSession& session, char* buf, ViUInt32 cnt, ViUInt32& retCnt) {
+    std::lock_guard<std::mutex> bus(session.busMutex);
+    retCnt = 0;
+
+    std::unique_lock<std::mutex> lock(session.mutex);
+    if (session.position >= session.pending.size()) {
+        return VI_ERROR_TMO;
+    }
+    if (session.position == 0) {
+        const auto readyAt = session.readyAt;
+        lock.unlock();
+        std::this_thread::sleep_until(readyAt);
+        lock.lock();
+    }
+
+    const std::size_t remaining = session.pending.size() - session.position;
+    const std::size_t count = remaining < cnt ? remaining : cnt;
+    std::memcpy(buf, session.pending.data() + session.position, count);
+    session.position += count;
+    const bool more = session.position < session.pending.size();
+    lock.unlock();
+
+    const double rate = currentConfig().busBytesPerSecond;
+    if (rate > 0.0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(static_cast<double>(count) / rate));
+    }
+
+    retCnt = static_cast<ViUInt32>(count);
+    return more ? VI_SUCCESS_MAX_CNT : VI_SUCCESS;
+}
+
+} // namespace
+
+void configureMockVisa(const MockVisaConfig& settings) {
+    std::lock_guard<std::mutex> lock(configMutex);
+    config = settings;
+}
+
+std::string mockResourceName(std::size_t index) {
+    return "MOCK0::" + std::to_string(index + 1) + "::INSTR";
+}
+
+extern "C" {
+
+ViStatus _VI_FUNC viOpenDefaultRM(ViPSession vi) {
+    *vi = RESOURCE_MANAGER;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viFindRsrc(ViSession, ViConstString, ViPFindList vi, ViPUInt32 retCnt, ViChar desc[]) {
+    const std::size_t count = currentConfig().idns.size();
+    if (count == 0) {
+        return VI_ERROR_RSRC_NFOUND;
+    }
+    *vi = FIND_LIST;
+    *retCnt = static_cast<ViUInt32>(count);
+    std::strcpy(desc, mockResourceName(0).c_str());
+
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    auto cursor = std::make_shared<MockSession>();
+    cursor->instrument = 1;
+    sessions[FIND_LIST] = cursor;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viFindNext(ViFindList vi, ViChar desc[]) {
+    auto cursor = findSession(vi);
+    if (!cursor || cursor->instrument >= currentConfig().idns.size()) {
+        return VI_ERROR_RSRC_NFOUND;
+    }
+    std::strcpy(desc, mockResourceName(cursor->instrument++).c_str());
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viOpen(ViSession, ViConstRsrc name, ViAccessMode, ViUInt32, ViPSession vi) {
+    const std::size_t count = currentConfig().idns.size();
+    for (std::size_t i = 0; i < count; ++i) {
+        if (mockResourceName(i) == name) {
+            auto session = std::make_shared<MockSession>();
+            session->instrument = i;
+
+            std::lock_guard<std::mutex> lock(sessionsMutex);
+            *vi = nextSession++;
+            sessions[*vi] = session;
+            return VI_SUCCESS;
+        }
+    }
+    return VI_ERROR_RSRC_NFOUND;
+}
+
+ViStatus _VI_FUNC viClose(ViObject vi) {
+    std::lock_guard<std::mutex> lock(sessionsMutex);
+    sessions.erase(vi);
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viSetAttribute(ViObject vi, ViAttr attrName, ViAttrState attrValue) {
+    auto session = findSession(vi);
+    if (session && attrName == VI_ATTR_TMO_VALUE) {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->timeoutMs = static_cast<ViUInt32>(attrValue);
+    }
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viGetAttribute(ViObject vi, ViAttr attrName, void* attrValue) {
+    {
+        std::lock_guard<std::mutex> lock(eventsMutex);
+        auto it = events.find(vi);
+        if (it != events.end()) {
+            switch (attrName) {
+            case VI_ATTR_JOB_ID:
+                *static_cast<ViJobId*>(attrValue) = it->second.jobId;
+                return VI_SUCCESS;
+            case VI_ATTR_STATUS:
+                *static_cast<ViStatus*>(attrValue) = it->second.status;
+                return VI_SUCCESS;
+            case VI_ATTR_RET_COUNT_32:
+                *static_cast<ViUInt32*>(attrValue) = it->second.count;
+                return VI_SUCCESS;
+            default:
+                return VI_ERROR_NSUP_ATTR;
+            }
+        }
+    }
+
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+    if (attrName != VI_ATTR_TMO_VALUE) {
+        return VI_ERROR_NSUP_ATTR;
+    }
+    std::lock_guard<std::mutex> lock(session->mutex);
+    *static_cast<ViUInt32*>(attrValue) = session->timeoutMs;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viSetBuf(ViSession vi, ViUInt16, ViUInt32) {
+    return findSession(vi) ? VI_SUCCESS : VI_ERROR_INV_OBJECT;
+}
+
+ViStatus _VI_FUNC viWrite(ViSession vi, ViConstBuf buf, ViUInt32 cnt, ViPUInt32 retCnt) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    const MockVisaConfig settings = currentConfig();
+    if (settings.writeLatency.count() > 0) {
+        std::this_thread::sleep_for(settings.writeLatency);
+    }
+
+    const std::string command(reinterpret_cast<const char*>(buf), cnt);
+    MockHandler srq;
+    std::chrono::steady_clock::time_point readyAt;
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->pending = respond(settings, session->instrument, command);
+        session->position = 0;
+        session->readyAt = std::chrono::steady_clock::now() + settings.readLatency;
+        if (command.find("*CLS") != std::string::npos || command.find("*ESR?") != std::string::npos) {
+            session->operationComplete = false;
+        }
+        if (command.find("*OPC") != std::string::npos && command.find("*OPC?") == std::string::npos) {
+            session->operationComplete = true;
+        }
+        if (!session->pending.empty() || session->operationComplete) {
+            srq = enabledHandler(*session, VI_EVENT_SERVICE_REQ);
+        }
+        readyAt = session->readyAt;
+    }
+
+    // 実機と同様に、応答の準備ができた時点で別スレッドから SRQ を通知する
+    if (srq.handler) {
+        std::thread([vi, srq, readyAt] {
+            std::this_thread::sleep_until(readyAt);
+            if (findSession(vi)) {
+                srq.handler(vi, VI_EVENT_SERVICE_REQ, 0, srq.context);
+            }
+        }).detach();
+    }
+
+    if (retCnt) {
+        *retCnt = cnt;
+    }
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viRead(ViSession vi, ViPBuf buf, ViUInt32 cnt, ViPUInt32 retCnt) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    ViUInt32 count = 0;
+    const ViStatus status = readPending(*session, reinterpret_cast<char*>(buf), cnt, count);
+    if (retCnt) {
+        *retCnt = count;
+    }
+    return status;
+}
+
+ViStatus _VI_FUNC viReadAsync(ViSession vi, ViPBuf buf, ViUInt32 cnt, ViPJobId jobId) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    MockHandler completion;
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        completion = enabledHandler(*session, VI_EVENT_IO_COMPLETION);
+    }
+    if (!completion.handler) {
+        return VI_ERROR_INV_SETUP;
+    }
+
+    const ViJobId id = nextJob++;
+    *jobId = id;
+
+    // 読み取りは別スレッドで行い、完了をハンドラで通知する (ハンドラが jobId の返却より先に呼ばれることもある)
+    std::thread([vi, session, buf, cnt, id, completion] {
+        ViUInt32 count = 0;
+        const ViStatus status = readPending(*session, reinterpret_cast<char*>(buf), cnt, count);
+
+        const ViEvent event = nextEvent++;
+        {
+            std::lock_guard<std::mutex> lock(eventsMutex);
+            events[event] = { id, status, count };
+        }
+        completion.handler(vi, VI_EVENT_IO_COMPLETION, event, completion.context);
+        {
+            std::lock_guard<std::mutex> lock(eventsMutex);
+            events.erase(event);
+        }
+    }).detach();
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viTerminate(ViObject, ViUInt16, ViJobId) {
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viAssertTrigger(ViSession vi, ViUInt16) {
+    return findSession(vi) ? VI_SUCCESS : VI_ERROR_INV_OBJECT;
+}
+
+ViStatus _VI_FUNC viReadSTB(ViSession vi, ViPUInt16 status) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    ViUInt16 stb = 0;
+    if (session->position < session->pending.size() && std::chrono::steady_clock::now() >= session->readyAt) {
+        stb |= 0x10; // MAV
+    }
+    if (session->operationComplete) {
+        stb |= 0x20; // ESB
+    }
+    *status = stb;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viClear(ViSession vi) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->pending.clear();
+    session->position = 0;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viLock(ViSession vi, ViAccessMode /*lockType*/, ViUInt32 /*timeout*/, ViConstKeyId requestedKey, ViChar accessKey[]) {
+    // 模擬計測器を開くのはこのプロセスだけなので、ロックは常に取れる
+    if (!findSession(vi)) {
+        return VI_ERROR_INV_OBJECT;
+    }
+    if (accessKey != nullptr) {
+        accessKey[0] = '\0';
+        if (requestedKey != VI_NULL) {
+            std::strncat(accessKey, requestedKey, 255);
+        }
+    }
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viUnlock(ViSession vi) {
+    if (!findSession(vi)) {
+        return VI_ERROR_INV_OBJECT;
+    }
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viInstallHandler(ViSession vi, ViEventType eventType, ViHndlr handler, ViAddr userHandle) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+    if (eventType != VI_EVENT_SERVICE_REQ && eventType != VI_EVENT_IO_COMPLETION) {
+        return VI_ERROR_INV_EVENT;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    MockHandler& slot = session->handlers[eventType];
+    slot.handler = handler;
+    slot.context = userHandle;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viUninstallHandler(ViSession vi, ViEventType eventType, ViHndlr, ViAddr) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    session->handlers.erase(eventType);
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viEnableEvent(ViSession vi, ViEventType eventType, ViUInt16 mechanism, ViEventFilter) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+    if (mechanism != VI_HNDLR) {
+        return VI_ERROR_INV_MECH;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    auto it = session->handlers.find(eventType);
+    if (it == session->handlers.end()) {
+        return VI_ERROR_HNDLR_NINSTALLED;
+    }
+    it->second.enabled = true;
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNC viDisableEvent(ViSession vi, ViEventType eventType, ViUInt16) {
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mutex);
+    auto it = session->handlers.find(eventType);
+    if (it != session->handlers.end()) {
+        it->second.enabled = false;
+    }
+    return VI_SUCCESS;
+}
+
+ViStatus _VI_FUNCC viQueryf(ViSession vi, ViConstString writeFmt, ViConstString readFmt, ...) {
+    // サーバーは viQueryf(vi, "%s", "%255t", コマンド, 応答先) の形でのみ使うため、その形に限って対応する
+    auto session = findSession(vi);
+    if (!session) {
+        return VI_ERROR_INV_OBJECT;
+    }
+
+    (void)writeFmt;
+    va_list args;
+    va_start(args, readFmt);
+    const char* command = va_arg(args, const char*);
+    char* reply = va_arg(args, char*);
+    va_end(args);
+
+    std::string response = respond(currentConfig(), session->instrument, command);
+    if (!response.empty() && response.back() == '\n') {
+        response.pop_back();
+    }
+    std::strncpy(reply, response.c_str(), 255);
+    reply[255] = '\0';
+    return VI_SUCCESS;
+}
+
+} // extern "C"
@@ -0,0 +1,42 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @brief ベンチマーク用の模擬VISA実装の設定。
+ *        MockVisa.cpp はサーバーが使う VISA 関数 (viOpenDefaultRM / viFindRsrc / viFindNext / viOpen / viClose /
+ *        viWrite / viRead / viSetAttribute / viQueryf / viReadSTB / viClear / viInstallHandler / viUninstallHandler /
+ *        viEnableEvent / viDisableEvent / viReadAsync / viTerminate / viGetAttribute) を実機なしで置き換えます。
+ *        リソースは "MOCK0::<番号>::INSTR" として idns の数だけ列挙されます。
+ *
+ *        応答の規則:
+ *        - "*IDN?" を含むクエリ: idns の該当要素
+ *        - ":WAV" を含むクエリ: blockSize バイトの definite-length block ("#<n><len><data>\n")
+ *        - その他のクエリ: responseSize バイトの文字列 + "\n"
+ *        - 設定コマンド: 応答なし
+ *
+ *        STB は応答が読み取れるようになると MAV、*OPC の受信後 *ESR? までは ESB を返します。
+ *        SRQ のハンドラが有効な場合、応答の準備ができた時点 (readLatency 経過後) に別スレッドから呼び出します。
+ *        viReadAsync は別スレッドで読み取りを行い、VI_EVENT_IO_COMPLETION のハンドラで完了を通知します。
+ */
+struct MockVisaConfig {
+    std::vector<std::string> idns{ "MOCK,BENCH,0,1.0" };
+    std::chrono::microseconds writeLatency{ 0 }; // viWrite 1回あたりの遅延
+    std::chrono::microseconds readLatency{ 0 };  // viWrite から応答を読み取れるようになるまでの遅延
+    double busBytesPerSecond = 0.0;              // 計測器からの読み取り速度 (0 は無制限)
+    std::size_t responseSize = 10;
+    std::size_t blockSize = 1024 * 1024;
+};
+
+/**
+ * @brief 模擬VISAの設定を差し替えます。セッションを開く前に呼び出してください。
+ */
+void configureMockVisa(const MockVisaConfig& config);
+
+/**
+ * @brief 模擬VISAが列挙するリソース記述子を返します。
+ */
+std::string mockResourceName(std::size_t index);
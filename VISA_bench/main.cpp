@@ -0,0 +1,241 @@
+﻿#include <visa.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "InstrumentPool.h"
+#include "LoadGenerator.h"
+#include "Logger.h"
+#include "MockVisa.h"
+#include "TcpServer.h"
+
+/**
+ * @brief ベンチマークのコマンドライン設定。
+ */
+struct BenchOptions {
+    unsigned short port = 55556;
+    std::size_t instruments = 1;
+    int clients = 4;
+    int commands = 2000;
+    int pipelineDepth = 16;
+    std::string scenario = "all"; // small / block / pipelined / framed / all
+    bool srq = false;             // 計測器を SRQ による完了通知で動かす
+    unsigned ioThreads = 1;       // サーバーのネットワーク処理のスレッド数
+    MockVisaConfig mock;
+};
+
+void printUsage() {
+    std::cout
+        << "使い方: VISA_bench [オプション]\n"
+        << "  --scenario <small|block|pipelined|framed|all>  実行するシナリオ (既定: all)\n"
+        << "  --clients <n>          同時接続数 (既定: 4)\n"
+        << "  --commands <n>         1接続あたりのコマンド数 (既定: 2000)\n"
+        << "  --pipeline <n>         pipelined / framed シナリオで応答を待たずに送るコマンド数 (既定: 16)\n"
+        << "  --instruments <n>      模擬計測器の台数 (既定: 1)\n"
+        << "  --write-latency <us>   viWrite 1回あたりの遅延 (既定: 0)\n"
+        << "  --read-latency <us>    viWrite から応答を読み取れるようになるまでの遅延 (既定: 0)\n"
+        << "  --bus-rate <MB/s>      計測器からの読み取り速度 (既定: 0 = 無制限)\n"
+        << "  --response-size <n>    通常のクエリの応答バイト数 (既定: 10)\n"
+        << "  --block-size <n>       :WAV:DATA? のブロックのバイト数 (既定: 1048576)\n"
+        << "  --srq                  SRQ による完了通知 (サーバーの --srq) で動かす\n"
+        << "  --io-threads <n>       サーバーのネットワーク処理のスレッド数 (サーバーの --io-threads、既定: 1)\n"
+        << "  --port <n>             サーバーの待ち受けポート。フレームモードは次の番号 (既定: 55556)\n";
+}
+
+/**
+ * @brief コマンドライン引数を解釈します。不正な引数は std::invalid_argument を送出します。
+ */
+BenchOptions parseOptions(int argc, char* argv[]) {
+    BenchOptions options;
+    auto value = [&](int& i) -> std::string {
+        if (i + 1 >= argc) {
+            throw std::invalid_argument(std::string(argv[i]) + " には値が必要です");
+        }
+        return argv[++i];
+    };
+    auto number = [&](int& i) -> long long {
+        const std::string name = argv[i];
+        const std::string text = value(i);
+        try {
+            const long long parsed = std::stoll(text);
+            if (parsed < 0) {
+                throw std::invalid_argument(text);
+            }
+            return parsed;
+        }
+        catch (const std::exception&) {
+            throw std::invalid_argument(name + " の値が不正です: " + text);
+        }
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--scenario") {
+            options.scenario = value(i);
+        }
+        else if (arg == "--clients") {
+            options.clients = static_cast<int>(number(i));
+        }
+        else if (arg == "--commands") {
+            options.commands = static_cast<int>(number(i));
+        }
+        else if (arg == "--pipeline") {
+            options.pipelineDepth = static_cast<int>(number(i));
+        }
+        else if (arg == "--instruments") {
+            options.instruments = static_cast<std::size_t>(number(i));
+        }
+        else if (arg == "--write-latency") {
+            options.mock.writeLatency = std::chrono::microseconds(number(i));
+        }
+        else if (arg == "--read-latency") {
+            options.mock.readLatency = std::chrono::microseconds(number(i));
+        }
+        else if (arg == "--bus-rate") {
+            options.mock.busBytesPerSecond = static_cast<double>(number(i)) * 1024.0 * 1024.0;
+        }
+        else if (arg == "--response-size") {
+            options.mock.responseSize = static_cast<std::size_t>(number(i));
+        }
+        else if (arg == "--block-size") {
+            options.mock.blockSize = static_cast<std::size_t>(number(i));
+        }
+        else if (arg == "--srq") {
+            options.srq = true;
+        }
+        else if (arg == "--io-threads") {
+            options.ioThreads = static_cast<unsigned>(number(i));
+            if (options.ioThreads == 0) {
+                throw std::invalid_argument("--io-threads は1以上にしてください");
+            }
+        }
+        else if (arg == "--port") {
+            options.port = static_cast<unsigned short>(number(i));
+        }
+        else {
+            throw std::invalid_argument("不明な引数です: " + arg);
+        }
+    }
+
+    if (options.instruments == 0 || options.clients == 0) {
+        throw std::invalid_argument("--instruments と --clients は1以上を指定してください");
+    }
+    options.mock.idns.clear();
+    for (std::size_t i = 0; i < options.instruments; ++i) {
+        options.mock.idns.push_back("MOCK,BENCH" + std::to_string(i + 1) + ",0,1.0");
+    }
+    return options;
+}
+
+/**
+ * @brief 実行するシナリオの一覧を作ります。
+ */
+std::vector<Scenario> buildScenarios(const BenchOptions& options) {
+    std::vector<Scenario> scenarios;
+    const bool all = options.scenario == "all";
+
+    if (all || options.scenario == "small") {
+        // 小さなクエリを1問1答で繰り返す。ラウンドトリップあたりのオーバーヘッドを見る
+        scenarios.push_back({ "small", ":MEAS:VAL?", options.clients, options.commands, 1 });
+    }
+    if (all || options.scenario == "block") {
+        // 大きなバイナリブロックを読み出す。転送路のスループットを見る
+        const int blockCommands = options.commands / 20 > 0 ? options.commands / 20 : 1;
+        scenarios.push_back({ "block", ":WAV:DATA?", options.clients, blockCommands, 1 });
+    }
+    if (all || options.scenario == "pipelined") {
+        // 応答を待たずに複数のクエリを送る。キューイングと応答の送出を見る
+        scenarios.push_back({ "pipelined", ":MEAS:VAL?", options.clients, options.commands, options.pipelineDepth });
+    }
+    if (all || options.scenario == "framed") {
+        // pipelined と同じ負荷をフレームモードで送る。テキストモードとのプロトコルの差を見る
+        Scenario framed{ "framed", ":MEAS:VAL?", options.clients, options.commands, options.pipelineDepth };
+        framed.framed = true;
+        scenarios.push_back(framed);
+    }
+    if (scenarios.empty()) {
+        throw std::invalid_argument("不明なシナリオです: " + options.scenario);
+    }
+    return scenarios;
+}
+
+void printResult(const ScenarioResult& result) {
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-10s %10llu %8llu %12.1f %9u %9u %9u %10.2f",
+        result.name.c_str(),
+        static_cast<unsigned long long>(result.commands),
+        static_cast<unsigned long long>(result.errors),
+        result.commandsPerSecond(),
+        result.percentileMicros(0.50),
+        result.percentileMicros(0.99),
+        result.latenciesUs.empty() ? 0u : result.latenciesUs.back(),
+        result.megabytesPerSecond());
+    std::cout << line << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    try {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::invalid_argument& e) {
+        std::cerr << "エラー: " << e.what() << std::endl;
+        printUsage();
+        return 1;
+    }
+
+    // データ経路上のログは計測を歪めるため警告以上だけにする
+    Logger::instance().start(LogLevel::Warning, "");
+    configureMockVisa(options.mock);
+
+    ViSession defaultRM;
+    viOpenDefaultRM(&defaultRM);
+
+    int exitCode = 0;
+    {
+        InstrumentPool pool;
+        for (std::size_t i = 0; i < options.instruments; ++i) {
+            Instrument* instrument = pool.open(defaultRM, "mock" + std::to_string(i + 1), mockResourceName(i));
+            if (instrument != nullptr && options.srq) {
+                instrument->enableServiceRequest(std::chrono::seconds(10));
+            }
+        }
+
+        boost::asio::io_context io;
+        TcpServer server(io, options.port, pool);
+        const unsigned short framedPort = static_cast<unsigned short>(options.port + 1);
+        TcpServer framedServer(io, framedPort, pool, TcpServer::Protocol::Framed);
+        std::vector<std::thread> network;
+        for (unsigned i = 0; i < options.ioThreads; ++i) {
+            network.emplace_back([&io] { io.run(); });
+        }
+
+        std::cout << "シナリオ   コマンド数  エラー     コマンド/秒   p50(us)   p99(us)   max(us)       MB/秒" << std::endl;
+        try {
+            for (const Scenario& scenario : buildScenarios(options)) {
+                printResult(runScenario("127.0.0.1", scenario.framed ? framedPort : options.port, scenario, options.instruments));
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "エラー: " << e.what() << std::endl;
+            exitCode = 1;
+        }
+
+        io.stop();
+        for (auto& thread : network) {
+            thread.join();
+        }
+        pool.closeAll();
+    }
+
+    viClose(defaultRM);
+    Logger::instance().stop();
+    return exitCode;
+}
@@ -0,0 +1,139 @@
+﻿#include "BufferPool.h"
+
+#include <utility>
+
+/**
+ * @brief プール本体。貸し出し中のバッファがプールより長く生きても返却先が残るよう、共有で持つ。
+ */
+struct BufferPool::State {
+    std::size_t bufferSize;
+    std::size_t maxBuffers;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<char[]>> free;
+    std::size_t allocated = 0;
+    std::size_t maxExtra;
+    std::size_t extra = 0; // 貸し出し中の上限の外のバッファ
+    bool closed = false;
+};
+
+BufferPool::Buffer::Buffer(std::shared_ptr<State> state, std::unique_ptr<char[]> storage, std::size_t capacity, bool extra)
+    : state_(std::move(state)), storage_(std::move(storage)), capacity_(capacity), extra_(extra) {}
+
+BufferPool::Buffer::~Buffer() {
+    release();
+}
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept
+    : state_(std::move(other.state_)), storage_(std::move(other.storage_)),
+      capacity_(other.capacity_), size_(other.size_), extra_(other.extra_) {
+    other.capacity_ = 0;
+    other.size_ = 0;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        state_ = std::move(other.state_);
+        storage_ = std::move(other.storage_);
+        capacity_ = other.capacity_;
+        size_ = other.size_;
+        extra_ = other.extra_;
+        other.capacity_ = 0;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+void BufferPool::Buffer::release() {
+    if (!storage_) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        if (extra_) {
+            --state_->extra;
+            storage_.reset();
+            extra_ = false;
+        }
+        else if (state_->closed) {
+            --state_->allocated;
+            storage_.reset();
+        }
+        else {
+            state_->free.push_back(std::move(storage_));
+        }
+    }
+    state_->cv.notify_one();
+    state_.reset();
+    capacity_ = 0;
+    size_ = 0;
+}
+
+BufferPool::BufferPool(std::size_t bufferSize, std::size_t maxBuffers, std::size_t maxExtraBuffers)
+    : state_(std::make_shared<State>()) {
+    state_->bufferSize = bufferSize;
+    state_->maxBuffers = maxBuffers < 2 ? 2 : maxBuffers;
+    state_->maxExtra = maxExtraBuffers;
+}
+
+BufferPool::~BufferPool() {
+    close();
+}
+
+BufferPool::Buffer BufferPool::acquire() {
+    return acquire([] { return false; });
+}
+
+BufferPool::Buffer BufferPool::acquire(const std::function<bool()>& unbounded) {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    bool extra = false;
+    state_->cv.wait(lock, [this, &unbounded, &extra] {
+        if (state_->closed || !state_->free.empty() || state_->allocated < state_->maxBuffers) {
+            return true;
+        }
+        extra = state_->extra < state_->maxExtra && unbounded();
+        return extra;
+    });
+    if (state_->closed) {
+        return Buffer();
+    }
+    if (extra) {
+        ++state_->extra;
+        return Buffer(state_, std::unique_ptr<char[]>(new char[state_->bufferSize]), state_->bufferSize, true);
+    }
+
+    std::unique_ptr<char[]> storage;
+    if (!state_->free.empty()) {
+        storage = std::move(state_->free.back());
+        state_->free.pop_back();
+    }
+    else {
+        // 初回だけ確保する。中身は読み取りで上書きするため初期化しない
+        storage.reset(new char[state_->bufferSize]);
+        ++state_->allocated;
+    }
+    return Buffer(state_, std::move(storage), state_->bufferSize);
+}
+
+void BufferPool::wake() {
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+    }
+    state_->cv.notify_all();
+}
+
+void BufferPool::close() {
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->closed = true;
+        state_->allocated -= state_->free.size();
+        state_->free.clear();
+    }
+    state_->cv.notify_all();
+}
+
+std::size_t BufferPool::bufferSize() const {
+    return state_->bufferSize;
+}
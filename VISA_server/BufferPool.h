@@ -0,0 +1,101 @@
+﻿#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief 固定サイズのバッファを使い回す上限付きのプール。
+ *        計測器からの読み取り (生産者) とクライアントへの送信 (消費者) の間でバッファを受け渡し、
+ *        応答がどれだけ大きくても使用メモリは「バッファサイズ × 上限数」に収まります。
+ *        空きがなければ acquire() は送信が進んでバッファが返却されるまで待つため、これがそのまま背圧になります。
+ */
+class BufferPool {
+    struct State;
+
+public:
+    /**
+     * @brief プールから借りたバッファ。ムーブのみ可能で、破棄されるとプールに返却されます。
+     */
+    class Buffer {
+    public:
+        Buffer() = default;
+        ~Buffer();
+        Buffer(Buffer&& other) noexcept;
+        Buffer& operator=(Buffer&& other) noexcept;
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+
+        char* data() { return storage_.get(); }
+        const char* data() const { return storage_.get(); }
+        std::size_t capacity() const { return capacity_; }
+
+        /**
+         * @brief 有効なデータのバイト数。capacity() を超えてはいけません。
+         */
+        std::size_t size() const { return size_; }
+        void resize(std::size_t size) { size_ = size; }
+
+        explicit operator bool() const { return storage_ != nullptr; }
+
+        /**
+         * @brief 上限の外で確保したバッファなら true。
+         */
+        bool outsidePool() const { return extra_; }
+
+    private:
+        friend class BufferPool;
+        Buffer(std::shared_ptr<State> state, std::unique_ptr<char[]> storage, std::size_t capacity, bool extra = false);
+        void release();
+
+        std::shared_ptr<State> state_;
+        std::unique_ptr<char[]> storage_;
+        std::size_t capacity_ = 0;
+        std::size_t size_ = 0;
+        bool extra_ = false; // 上限の外で確保したバッファ。返却時にプールへ戻さず解放する
+    };
+
+    /**
+     * @param bufferSize 1つのバッファのバイト数。
+     * @param maxBuffers 同時に貸し出せるバッファの数 (2以上)。バッファは必要になった時点で確保し、以後は再利用します。
+     * @param maxExtraBuffers acquire(unbounded) が上限の外で同時に確保できるバッファの数。
+     */
+    BufferPool(std::size_t bufferSize, std::size_t maxBuffers, std::size_t maxExtraBuffers = 0);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /**
+     * @brief バッファを1つ借ります。すべて貸し出し中なら返却を待ちます。
+     * @return close() 後は空のバッファ (operator bool が false)。
+     */
+    Buffer acquire();
+
+    /**
+     * @brief バッファを1つ借ります。すべて貸し出し中なら返却を待ちますが、待っている間に unbounded() が true になれば
+     *        待つのをやめて上限の外で新しく確保します (そのバッファは返却時に解放します)。unbounded() は wake() のたびに確認します。
+     *        上限の外のバッファも maxExtraBuffers 個までで、それを超える分は返却を待ちます。
+     *        背圧を一時的に外して読み取りを先に進めたい場合 (上のクラスのジョブが待っている場合など) に使います。
+     * @return close() 後は空のバッファ (operator bool が false)。
+     */
+    Buffer acquire(const std::function<bool()>& unbounded);
+
+    /**
+     * @brief acquire(unbounded) で待っているスレッドに条件を確認し直させます。
+     */
+    void wake();
+
+    /**
+     * @brief 待機中の acquire() を起こし、以後の貸し出しを止めます。貸し出し中のバッファは返却時に解放されます。
+     */
+    void close();
+
+    std::size_t bufferSize() const;
+
+private:
+    std::shared_ptr<State> state_;
+};
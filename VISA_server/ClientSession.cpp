@@ -0,0 +1,929 @@
+﻿#include "ClientSession.h"
+
+#include "Logger.h"
+#include "Lz4.h"
+#include "ScpiParser.h"
+#include "StringUtil.h"
+
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <istream>
+#include <utility>
+
+ClientSession::ClientSession(boost::asio::ip::tcp::socket socket, InstrumentPool& pool, SessionServices services)
+    : socket_(std::move(socket)), pool_(pool), services_(services), target_(pool.defaultInstrument()) {
+    boost::system::error_code ec;
+    auto endpoint = socket_.remote_endpoint(ec);
+    peer_ = ec ? "不明" : endpoint.address().to_string();
+}
+
+void ClientSession::start() {
+    LOG_INFO("クライアントが接続しました: " << peer_);
+    readCommand();
+}
+
+void ClientSession::readCommand() {
+    if (eof_) {
+        closing_ = true;
+        closeWhenIdle();
+        return;
+    }
+
+    readStartedAt_ = std::chrono::steady_clock::now();
+    auto self = shared_from_this();
+    boost::asio::async_read_until(socket_, buffer_, "\n",
+        [this, self](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            onCommandRead(error);
+        });
+}
+
+void ClientSession::onCommandRead(const boost::system::error_code& error) {
+    lastReadTime_ = std::chrono::steady_clock::now() - readStartedAt_;
+
+    if (error == boost::asio::error::eof) {
+        if (buffer_.size() == 0) {
+            closing_ = true;
+            closeWhenIdle();
+            return;
+        }
+        // 改行なしで終わった最後のコマンドも処理する
+        eof_ = true;
+    }
+    else if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            LOG_ERROR("コマンド受信中にエラーが発生しました (" << peer_ << "): " << error.message());
+        }
+        close();
+        return;
+    }
+
+    std::istream is(&buffer_);
+    std::string command;
+    std::getline(is, command);
+
+    command.erase(command.find_last_not_of("\r\n") + 1);
+    if (definingMacro_) {
+        collectMacroLine(std::move(command));
+        return;
+    }
+    if (command.empty()) {
+        readCommand();
+        return;
+    }
+
+    LOG_INFO("受信: " << command);
+    dispatchCommand(std::move(command));
+}
+
+void ClientSession::dispatchCommand(std::string command) {
+    const bool isServerCommand = startsWithIgnoreCase(command, ":SERVER:");
+
+    if (target_ == nullptr) {
+        // 起動時に計測器がなかった場合は、後から接続された (ResourceWatcher) 既定の計測器を宛先にする
+        target_ = pool_.defaultInstrument();
+    }
+    Instrument* instrument = target_;
+    std::string instrumentCommand = command;
+    if (!isServerCommand && command.front() == '@') {
+        // "@<計測器名> <コマンド>" はこのコマンドだけ宛先を切り替える
+        const size_t space = command.find_first_of(" \t");
+        instrument = pool_.find(command.substr(1, space == std::string::npos ? std::string::npos : space - 1));
+        instrumentCommand = space == std::string::npos ? "" : trim(command.substr(space));
+    }
+
+    // 未完了の設定コマンドがある間は、同じ計測器のキューに積むコマンド以外は応答順が崩れるため保留する
+    if (pendingWrites_ > 0 && (isServerCommand || instrument == nullptr || instrument != pendingInstrument_)) {
+        deferred_ = std::move(command);
+        hasDeferred_ = true;
+        return;
+    }
+
+    if (isServerCommand) {
+        // マクロの登録と実行は返答を後で送るため、ここで振り分ける
+        const size_t space = command.find_first_of(" \t");
+        const std::string header = toLower(command.substr(0, space));
+        const std::string argument = space == std::string::npos ? "" : trim(command.substr(space));
+        if (header == ":server:macro:define") {
+            beginMacroDefinition(argument);
+            return;
+        }
+        if (header == ":server:macro:run") {
+            startMacro(argument);
+            return;
+        }
+        if (header == ":server:lock") {
+            startLock(argument);
+            return;
+        }
+        if (header == ":server:unlock") {
+            startUnlock();
+            return;
+        }
+        sendReply(handleServerCommand(command));
+        return;
+    }
+    if (instrument == nullptr) {
+        sendReply(command.front() == '@'
+            ? "エラー: 計測器が見つかりません: " + command.substr(1, command.find_first_of(" \t") - 1) + "\n"
+            : "エラー: 計測器が選択されていません\n");
+        return;
+    }
+    if (instrumentCommand.empty()) {
+        sendReply("エラー: コマンドが指定されていません\n");
+        return;
+    }
+
+    instrument->metrics().socketRead.record(lastReadTime_);
+    instrument->metrics().addCommand();
+    instrument->cache().observe(instrumentCommand);
+
+    if (!containsQuery(instrumentCommand)) {
+        submitWriteToInstrument(*instrument, std::move(instrumentCommand));
+        return;
+    }
+
+    // 静的な問い合わせはキャッシュから即座に返す (未完了の書き込みがあれば順序を守るためワーカー側で判定する)
+    std::string cached;
+    if (pendingWrites_ == 0 && instrument->cache().lookup(instrumentCommand, cached)) {
+        sendReply(timestamps_ ? "0,0,0;" + cached : std::move(cached));
+        return;
+    }
+
+    submitToInstrument(*instrument, std::move(instrumentCommand));
+}
+
+void ClientSession::submitToInstrument(Instrument& instrument, std::string command) {
+    // 計測器への入出力はワーカースレッドで実行し、応答はチャンクごとにこのセッションのstrandで送信する
+    responseOpen_ = true;
+    auto self = shared_from_this();
+    instrument.submit([this, self, &instrument, command = std::move(command), compress = compressResponses_,
+                          timestamps = timestamps_](ViSession instr) {
+        ResponseFrame frame;
+        frame.compress = compress;
+        ResponseCache& cache = instrument.cache();
+        const bool cacheable = cache.isCacheable(command);
+        std::string captured;
+        bool capturedAll = true;
+
+        // ":SERVER:TIMESTAMP ON" では応答の先頭に "<通し番号>,<viWrite の時刻>,<最初の viRead の時刻>;" を付ける。
+        // 最初のチャンクを渡す時点で読み取りの時刻は記録済み。計測していない値 (キャッシュの応答やエラー) は 0
+        ResponseTiming timing;
+        bool prefixed = !timestamps;
+        const auto sendPrefix = [&] {
+            if (!prefixed) {
+                prefixed = true;
+                sendFromWorker(instrument, std::to_string(timing.sequence) + "," + std::to_string(monotonicNanoseconds(timing.written))
+                    + "," + std::to_string(monotonicNanoseconds(timing.firstRead)) + ";", frame);
+            }
+        };
+
+        const ResponseSink sink = [&](BufferPool::Buffer buffer) {
+            sendPrefix();
+            if (cacheable && capturedAll) {
+                capturedAll = captured.size() + buffer.size() <= ResponseCache::MAX_RESPONSE_SIZE;
+                if (capturedAll) {
+                    captured.append(buffer.data(), buffer.size());
+                }
+            }
+            return sendFromWorker(instrument, std::move(buffer), frame);
+        };
+
+        try {
+            std::string cached;
+            if (cacheable && cache.lookup(command, cached)) {
+                sendPrefix();
+                sendFromWorker(instrument, std::move(cached), frame);
+            }
+            else if (executeCommand(instr, command, sink, instrument, timestamps ? &timing : nullptr) >= VI_SUCCESS
+                && cacheable && capturedAll) {
+                cache.store(command, std::move(captured));
+            }
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("コマンド処理中に例外発生: " << e.what());
+            sendPrefix();
+            sendFromWorker(instrument, std::string("サーバーエラー: ") + e.what() + "\n", frame);
+        }
+        finishFrame(instrument, frame);
+
+        boost::asio::post(socket_.get_executor(), [this, self] {
+            endResponse();
+            readCommand();
+        });
+    }, priority_, this);
+}
+
+void ClientSession::submitWriteToInstrument(Instrument& instrument, std::string command) {
+    // 設定コマンドは完了を待たずに次を読み進める。計測器のキュー上で後続の設定コマンドとまとめて書き込まれる
+    ++pendingWrites_;
+    pendingInstrument_ = &instrument;
+
+    auto self = shared_from_this();
+    instrument.submitWrite(std::move(command), [this, self](ViStatus status) {
+        boost::asio::post(socket_.get_executor(), [this, self, status] { onWriteCompleted(status); });
+    }, priority_, this);
+
+    readCommand();
+}
+
+void ClientSession::onWriteCompleted(ViStatus status) {
+    std::string reply = status < VI_SUCCESS
+        ? "エラー: 計測器への書き込みに失敗しました\n"
+        : "コマンド送信完了 (応答なし)\n";
+    LOG_INFO("送信: " << summarizePayload(reply.data(), reply.size()));
+    enqueueText(std::move(reply));
+
+    if (--pendingWrites_ > 0) {
+        return;
+    }
+    pendingInstrument_ = nullptr;
+
+    if (hasDeferred_) {
+        hasDeferred_ = false;
+        dispatchCommand(std::move(deferred_));
+        return;
+    }
+    closeWhenIdle();
+}
+
+std::string ClientSession::handleServerCommand(const std::string& command) {
+    const size_t space = command.find_first_of(" \t");
+    const std::string header = toLower(command.substr(0, space));
+    const std::string argument = space == std::string::npos ? "" : trim(command.substr(space));
+
+    if (header == ":server:select") {
+        Instrument* instrument = pool_.find(argument);
+        if (instrument == nullptr) {
+            return "エラー: 計測器が見つかりません: " + argument + "\n";
+        }
+        target_ = instrument;
+        return target_->name() + "\n";
+    }
+    if (header == ":server:select?") {
+        return (target_ ? target_->name() : "") + "\n";
+    }
+    if (header == ":server:list?") {
+        // "<番号>,<名前>,<リソース記述子>" をセミコロン区切りで返す
+        std::string reply;
+        const auto instruments = pool_.instruments();
+        for (size_t i = 0; i < instruments.size(); ++i) {
+            if (i > 0) {
+                reply += ";";
+            }
+            reply += std::to_string(i + 1) + "," + instruments[i]->name() + "," + instruments[i]->address();
+        }
+        return reply + "\n";
+    }
+    if (header == ":server:stats?") {
+        // {"instruments":[{...},...]} の1行JSONで返す
+        std::string reply = "{\"instruments\":[";
+        const auto instruments = pool_.instruments();
+        for (size_t i = 0; i < instruments.size(); ++i) {
+            if (i > 0) {
+                reply += ",";
+            }
+            reply += instruments[i]->metrics().toJson(instruments[i]->name());
+        }
+        return reply + "]}\n";
+    }
+    if (header == ":server:stats:reset") {
+        for (const auto& instrument : pool_.instruments()) {
+            instrument->metrics().reset();
+        }
+        return "統計をリセットしました\n";
+    }
+    if (header == ":server:priority") {
+        JobPriority priority;
+        if (!parseJobPriority(argument, priority)) {
+            return "エラー: 優先度は HIGH / NORMAL / LOW のいずれかです: " + argument + "\n";
+        }
+        priority_ = priority;
+        return std::string(jobPriorityName(priority_)) + "\n";
+    }
+    if (header == ":server:priority?") {
+        return std::string(jobPriorityName(priority_)) + "\n";
+    }
+    if (header == ":server:timestamp") {
+        const std::string mode = toLower(argument);
+        if (mode != "on" && mode != "off") {
+            return "エラー: ON か OFF を指定してください: " + argument + "\n";
+        }
+        timestamps_ = mode == "on";
+        return std::string(timestamps_ ? "ON" : "OFF") + "\n";
+    }
+    if (header == ":server:timestamp?") {
+        return std::string(timestamps_ ? "ON" : "OFF") + "\n";
+    }
+    if (header == ":server:lock?") {
+        // "<EXCLUSIVE|SHARED|NONE>,<保持している接続数>,<待っている要求数>,<この接続が保持しているか 0|1>"
+        if (target_ == nullptr) {
+            return "エラー: 計測器が選択されていません\n";
+        }
+        const Instrument::LockInfo info = target_->lockInfo(this);
+        return std::string(!info.locked ? "NONE" : lockModeName(info.mode)) + "," + std::to_string(info.holders) + ","
+            + std::to_string(info.waiting) + "," + (info.held ? "1" : "0") + "\n";
+    }
+    if (header == ":server:compress") {
+        const std::string mode = toLower(argument);
+        if (mode != "lz4" && mode != "off") {
+            return "エラー: 圧縮方式は LZ4 か OFF です: " + argument + "\n";
+        }
+        compressAfterReply_ = mode == "lz4";
+        return (compressAfterReply_ ? "LZ4" : "OFF") + std::string("\n");
+    }
+    if (header == ":server:compress?") {
+        return (compressResponses_ ? "LZ4" : "OFF") + std::string("\n");
+    }
+    if (header == ":server:subscribe") {
+        return subscribe(argument);
+    }
+    if (header == ":server:subscribe?") {
+        // "<購読ID>,<計測器名>,<間隔ms>,<クエリ>" をセミコロン区切りで返す
+        std::string reply;
+        for (const auto& entry : subscriptions_) {
+            if (!reply.empty()) {
+                reply += ";";
+            }
+            reply += std::to_string(entry.first) + "," + entry.second.instrument->name() + ","
+                + std::to_string(entry.second.interval.count()) + "," + entry.second.query;
+        }
+        return reply + "\n";
+    }
+    if (header == ":server:unsubscribe") {
+        return unsubscribe(argument);
+    }
+    if (startsWithIgnoreCase(header, ":server:record")) {
+        return handleRecordCommand(header, argument);
+    }
+    if (startsWithIgnoreCase(header, ":server:macro")) {
+        return handleMacroCommand(header, argument);
+    }
+
+    return "エラー: 不明なサーバーコマンドです: " + command + "\n";
+}
+
+std::string ClientSession::subscribe(const std::string& argument) {
+    if (services_.subscriptions == nullptr) {
+        return "エラー: 購読は利用できません\n";
+    }
+    if (target_ == nullptr) {
+        return "エラー: 計測器が選択されていません\n";
+    }
+
+    // "<間隔ms>,<クエリ>"。クエリ自体にカンマを含んでもよいよう、最初のカンマで分ける
+    const size_t comma = argument.find(',');
+    const std::string intervalText = trim(argument.substr(0, comma));
+    const std::string query = comma == std::string::npos ? "" : trim(argument.substr(comma + 1));
+    char* end = nullptr;
+    const unsigned long intervalMs = std::strtoul(intervalText.c_str(), &end, 10);
+    if (intervalText.empty() || *end != '\0' || intervalMs == 0) {
+        return "エラー: 購読の間隔が不正です: " + intervalText + "\n";
+    }
+    if (query.empty() || !containsQuery(query)) {
+        return "エラー: 購読するクエリが指定されていません\n";
+    }
+
+    auto interval = std::chrono::milliseconds(intervalMs);
+    if (interval < SubscriptionHub::MIN_INTERVAL) {
+        interval = SubscriptionHub::MIN_INTERVAL;
+    }
+
+    // ハブの strand から届いた結果をこのセッションの strand で送る。切断後に届いた結果は捨てる
+    std::weak_ptr<ClientSession> weak = shared_from_this();
+    auto executor = socket_.get_executor();
+    const std::size_t id = services_.subscriptions->subscribe(*target_, query, interval, [weak, executor](std::size_t id, const std::string& response) {
+        boost::asio::post(executor, [weak, id, response] {
+            if (auto self = weak.lock()) {
+                self->push(id, response);
+            }
+        });
+    });
+    subscriptions_[id] = { target_, interval, query };
+    LOG_INFO("購読を開始しました (" << peer_ << "): " << id << " " << target_->name() << " " << query << " " << interval.count() << "ms");
+    return std::to_string(id) + "\n";
+}
+
+std::string ClientSession::unsubscribe(const std::string& argument) {
+    if (toLower(argument) == "all") {
+        cancelSubscriptions();
+        return "購読をすべて解除しました\n";
+    }
+
+    char* end = nullptr;
+    const unsigned long id = std::strtoul(argument.c_str(), &end, 10);
+    const auto it = argument.empty() || *end != '\0' ? subscriptions_.end() : subscriptions_.find(id);
+    if (it == subscriptions_.end()) {
+        return "エラー: 購読が見つかりません: " + argument + "\n";
+    }
+    services_.subscriptions->unsubscribe(it->first);
+    subscriptions_.erase(it);
+    return "購読を解除しました: " + argument + "\n";
+}
+
+std::string ClientSession::handleRecordCommand(const std::string& header, const std::string& argument) {
+    Recorder* recorder = services_.recorder;
+    if (recorder == nullptr) {
+        return "エラー: 記録は利用できません\n";
+    }
+
+    if (header == ":server:record?") {
+        // "<記録名>,<計測器名>,RUN|STOP,<件数>,<バイト数>" をセミコロン区切りで返す
+        std::string reply;
+        for (const auto& status : recorder->list()) {
+            if (!reply.empty()) {
+                reply += ";";
+            }
+            reply += status.name + "," + status.instrument + "," + (status.running ? "RUN" : "STOP") + ","
+                + std::to_string(status.records) + "," + std::to_string(status.bytes);
+        }
+        return reply + "\n";
+    }
+    if (header == ":server:record:stop") {
+        return recorder->stop(argument)
+            ? "記録を停止しました: " + argument + "\n"
+            : "エラー: 実行中の記録が見つかりません: " + argument + "\n";
+    }
+
+    const std::vector<std::string> fields = splitList(argument);
+    if (header == ":server:record:start") {
+        // "<記録名>,<間隔ms>,<クエリ>"。クエリ自体にカンマを含んでもよいよう、2つ目のカンマより後ろはそのまま使う
+        const size_t second = argument.find(',', argument.find(',') + 1);
+        const std::string query = fields.size() < 3 || second == std::string::npos ? "" : trim(argument.substr(second + 1));
+        char* end = nullptr;
+        const unsigned long intervalMs = fields.size() < 2 ? 0 : std::strtoul(fields[1].c_str(), &end, 10);
+        if (fields.size() < 2 || fields[1].empty() || *end != '\0') {
+            return "エラー: 記録の間隔が不正です\n";
+        }
+        if (query.empty() || !containsQuery(query)) {
+            return "エラー: 記録するクエリが指定されていません\n";
+        }
+        if (target_ == nullptr) {
+            return "エラー: 計測器が選択されていません\n";
+        }
+        try {
+            recorder->start(fields[0], *target_, query, std::chrono::milliseconds(intervalMs));
+        }
+        catch (const std::exception& e) {
+            return std::string("エラー: ") + e.what() + "\n";
+        }
+        return "記録を開始しました: " + fields[0] + "\n";
+    }
+    if (header == ":server:record:fetch?") {
+        // "<記録名>,<先頭>,<件数>" のレコードを、ファイル上の並びのまま definite-length block で返す
+        if (fields.size() != 3) {
+            return "エラー: 引数は <記録名>,<先頭>,<件数> です\n";
+        }
+        char* firstEnd = nullptr;
+        char* countEnd = nullptr;
+        const unsigned long long first = std::strtoull(fields[1].c_str(), &firstEnd, 10);
+        const unsigned long long count = std::strtoull(fields[2].c_str(), &countEnd, 10);
+        if (fields[1].empty() || fields[2].empty() || *firstEnd != '\0' || *countEnd != '\0') {
+            return "エラー: 先頭と件数は数値で指定してください\n";
+        }
+        std::string records;
+        try {
+            records = recorder->fetch(fields[0], first, count);
+        }
+        catch (const std::exception& e) {
+            return std::string("エラー: ") + e.what() + "\n";
+        }
+        const std::string length = std::to_string(records.size());
+        return "#" + std::to_string(length.size()) + length + records + "\n";
+    }
+
+    return "エラー: 不明なサーバーコマンドです: " + header + "\n";
+}
+
+std::string ClientSession::handleMacroCommand(const std::string& header, const std::string& argument) {
+    MacroLibrary* macros = services_.macros;
+    if (macros == nullptr) {
+        return "エラー: マクロは利用できません\n";
+    }
+
+    if (header == ":server:macro?") {
+        // "<マクロ名>,<ステップ数>,<クエリ数>" をセミコロン区切りで返す
+        std::string reply;
+        for (const auto& macro : macros->list()) {
+            if (!reply.empty()) {
+                reply += ";";
+            }
+            reply += macro->name + "," + std::to_string(macro->steps.size()) + "," + std::to_string(macro->queries);
+        }
+        return reply + "\n";
+    }
+    if (header == ":server:macro:delete") {
+        return macros->remove(argument)
+            ? "マクロを削除しました: " + argument + "\n"
+            : "エラー: マクロが見つかりません: " + argument + "\n";
+    }
+    if (header == ":server:macro:end") {
+        return "エラー: :SERVER:MACRO:DEFINE の後に送ってください\n";
+    }
+
+    return "エラー: 不明なサーバーコマンドです: " + header + "\n";
+}
+
+void ClientSession::beginMacroDefinition(const std::string& name) {
+    definingMacro_ = true;
+    macroName_ = name;
+    macroLines_.clear();
+    macroError_.clear();
+
+    if (services_.macros == nullptr) {
+        macroError_ = "マクロは利用できません";
+    }
+    else if (name.empty() || name.find_first_of(" \t,;") != std::string::npos) {
+        macroError_ = "マクロ名が不正です: " + name;
+    }
+    readCommand();
+}
+
+void ClientSession::collectMacroLine(std::string line) {
+    if (toLower(trim(line)) != ":server:macro:end") {
+        if (macroError_.empty() && macroLines_.size() >= MacroLibrary::MAX_LINES) {
+            macroError_ = "マクロの行数が上限 (" + std::to_string(MacroLibrary::MAX_LINES) + " 行) を超えました";
+        }
+        if (macroError_.empty()) {
+            macroLines_.push_back(std::move(line));
+        }
+        readCommand();
+        return;
+    }
+
+    definingMacro_ = false;
+    std::string reply;
+    if (macroError_.empty()) {
+        try {
+            auto macro = std::make_shared<Macro>(parseMacro(macroName_, macroLines_));
+            reply = "マクロを登録しました: " + macroName_ + " (" + std::to_string(macro->steps.size()) + " ステップ)\n";
+            LOG_INFO("マクロを登録しました (" << peer_ << "): " << macroName_ << " " << macro->steps.size() << " ステップ");
+            services_.macros->define(std::move(macro));
+        }
+        catch (const std::exception& e) {
+            macroError_ = e.what();
+        }
+    }
+    if (!macroError_.empty()) {
+        reply = "エラー: マクロ " + macroName_ + " を登録できません: " + macroError_ + "\n";
+    }
+    macroLines_.clear();
+    macroLines_.shrink_to_fit();
+    sendReply(std::move(reply));
+}
+
+void ClientSession::startMacro(const std::string& argument) {
+    // "<マクロ名>[,<変数>=<値>...]"
+    const std::vector<std::string> fields = splitList(argument);
+    const std::string name = fields.empty() ? "" : fields[0];
+    if (services_.macros == nullptr) {
+        sendReply("エラー: マクロは利用できません\n");
+        return;
+    }
+    std::shared_ptr<const Macro> macro = services_.macros->find(name);
+    if (macro == nullptr) {
+        sendReply("エラー: マクロが見つかりません: " + name + "\n");
+        return;
+    }
+    if (target_ == nullptr) {
+        sendReply("エラー: 計測器が選択されていません\n");
+        return;
+    }
+
+    std::map<std::string, std::string> variables;
+    for (size_t i = 1; i < fields.size(); ++i) {
+        const size_t equal = fields[i].find('=');
+        if (equal == std::string::npos || equal == 0) {
+            sendReply("エラー: 変数は <変数>=<値> で指定してください: " + fields[i] + "\n");
+            return;
+        }
+        variables[trim(fields[i].substr(0, equal))] = trim(fields[i].substr(equal + 1));
+    }
+
+    Instrument& instrument = *target_;
+    instrument.metrics().socketRead.record(lastReadTime_);
+
+    // マクロ全体を1つのジョブとして実行し、途中に他の接続のコマンドを挟まない
+    responseOpen_ = true;
+    auto self = shared_from_this();
+    instrument.submit([this, self, &instrument, macro = std::move(macro), variables = std::move(variables), compress = compressResponses_](ViSession instr) mutable {
+        ResponseFrame frame;
+        frame.compress = compress;
+        std::string reply;
+
+        try {
+            std::vector<std::string> results;
+            std::string error;
+            if (!runMacro(instr, instrument, *macro, variables, results, error)) {
+                reply = "エラー: " + error + "\n";
+            }
+            else if (results.empty()) {
+                reply = "マクロ実行完了 (応答なし)\n";
+            }
+            else {
+                for (size_t i = 0; i < results.size(); ++i) {
+                    if (i > 0) {
+                        reply += ";";
+                    }
+                    reply += results[i];
+                }
+                reply += "\n";
+            }
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("マクロの実行中に例外発生: " << e.what());
+            reply = std::string("サーバーエラー: ") + e.what() + "\n";
+        }
+        LOG_INFO("送信: " << summarizePayload(reply.data(), reply.size()));
+        sendFromWorker(instrument, std::move(reply), frame);
+        finishFrame(instrument, frame);
+
+        boost::asio::post(socket_.get_executor(), [this, self] {
+            endResponse();
+            readCommand();
+        });
+    }, priority_, this);
+}
+
+void ClientSession::startLock(const std::string& argument) {
+    // "[EXCLUSIVE|SHARED,<キー>][,<タイムアウトms>]"
+    const std::vector<std::string> fields = splitList(argument);
+    LockMode mode = LockMode::Exclusive;
+    std::string key;
+    size_t next = 0;
+    if (!fields.empty() && toLower(fields[0]) == "shared") {
+        if (fields.size() < 2 || fields[1].empty()) {
+            sendReply("エラー: 共有ロックにはキーを指定してください\n");
+            return;
+        }
+        mode = LockMode::Shared;
+        key = fields[1];
+        next = 2;
+    }
+    else if (!fields.empty() && (toLower(fields[0]) == "exclusive" || fields[0].empty())) {
+        next = 1;
+    }
+    std::chrono::milliseconds timeout = DEFAULT_LOCK_TIMEOUT;
+    if (next < fields.size()) {
+        char* end = nullptr;
+        const unsigned long timeoutMs = std::strtoul(fields[next].c_str(), &end, 10);
+        if (fields[next].empty() || *end != '\0' || next + 1 < fields.size()) {
+            sendReply("エラー: 引数は [EXCLUSIVE|SHARED,<キー>][,<タイムアウトms>] です: " + argument + "\n");
+            return;
+        }
+        timeout = std::chrono::milliseconds(timeoutMs);
+    }
+    if (target_ == nullptr) {
+        sendReply("エラー: 計測器が選択されていません\n");
+        return;
+    }
+
+    // 切断時に解放するため、要求した計測器を覚えておく。ロックの待ち中はこの接続の後続のコマンドを読まない
+    Instrument& instrument = *target_;
+    lockedInstruments_.insert(&instrument);
+    auto self = shared_from_this();
+    instrument.lock(this, mode, std::move(key), timeout, [this, self](ViStatus status, LockMode held) {
+        std::string reply;
+        if (status >= VI_SUCCESS) {
+            reply = std::string(lockModeName(held)) + "\n";
+        }
+        else if (status == VI_ERROR_TMO) {
+            reply = "エラー: ロックを待つ間にタイムアウトしました\n";
+        }
+        else {
+            reply = "エラー: 計測器をロックできませんでした (Status: " + std::to_string(status) + ")\n";
+        }
+        boost::asio::post(socket_.get_executor(), [this, self, reply = std::move(reply)]() mutable { sendReply(std::move(reply)); });
+    }, priority_);
+}
+
+void ClientSession::startUnlock() {
+    if (target_ == nullptr) {
+        sendReply("エラー: 計測器が選択されていません\n");
+        return;
+    }
+
+    // 先に投入したコマンドを終えてから解放する
+    auto self = shared_from_this();
+    target_->unlock(this, [this, self](ViStatus status, LockMode) {
+        std::string reply = status >= VI_SUCCESS ? "ロックを解放しました\n" : "エラー: ロックを保持していません\n";
+        boost::asio::post(socket_.get_executor(), [this, self, reply = std::move(reply)]() mutable { sendReply(std::move(reply)); });
+    }, priority_);
+}
+
+void ClientSession::push(std::size_t id, std::string response) {
+    // 解除済みの購読の結果が遅れて届くことがある
+    if (closed_ || subscriptions_.count(id) == 0) {
+        return;
+    }
+
+    if (response.empty() || response.back() != '\n') {
+        response += '\n';
+    }
+    std::string line = "!" + std::to_string(id) + " " + response;
+    if (responseOpen_) {
+        // 計測器の応答を送っている間は割り込まず、終わってから送る。溜めすぎたら古い結果を捨てる
+        if (pendingPushes_.size() >= MAX_PENDING_PUSHES) {
+            pendingPushes_.pop_front();
+        }
+        pendingPushes_.push_back(std::move(line));
+        return;
+    }
+    enqueueText(std::move(line));
+}
+
+void ClientSession::endResponse() {
+    responseOpen_ = false;
+    while (!pendingPushes_.empty()) {
+        enqueueText(std::move(pendingPushes_.front()));
+        pendingPushes_.pop_front();
+    }
+}
+
+void ClientSession::cancelSubscriptions() {
+    for (const auto& entry : subscriptions_) {
+        services_.subscriptions->unsubscribe(entry.first);
+    }
+    subscriptions_.clear();
+    pendingPushes_.clear();
+}
+
+void ClientSession::sendReply(std::string reply) {
+    LOG_INFO("送信: " << summarizePayload(reply.data(), reply.size()));
+
+    enqueueText(std::move(reply));
+    compressResponses_ = compressAfterReply_;
+    readCommand();
+}
+
+bool ClientSession::sendFromWorker(Instrument& instrument, BufferPool::Buffer buffer, ResponseFrame& frame) {
+    // バッファごと送信キューへ渡し、送信完了は待たない。送信後にバッファはプールへ戻る。
+    // 圧縮はワーカーが次のチャンクを読めるよう、ネットワーク処理のスレッド (この接続の strand) で行う
+    Outgoing message;
+    message.pooled = std::move(buffer);
+    if (frame.compress) {
+        openFrame(frame, instrument.buffers().bufferSize(), message.owned);
+        message.compressBlockSize = frame.blockSize;
+    }
+    message.metrics = &instrument.metrics();
+    message.queuedAt = std::chrono::steady_clock::now();
+
+    auto self = shared_from_this();
+    auto shared = std::make_shared<Outgoing>(std::move(message));
+    boost::asio::post(socket_.get_executor(), [this, self, shared] {
+        if (shared->compressBlockSize != 0 && !closed_) {
+            compressChunk(*shared);
+        }
+        enqueueWrite(std::move(*shared));
+    });
+    return !failed_.load();
+}
+
+bool ClientSession::sendFromWorker(Instrument& instrument, std::string data, ResponseFrame& frame) {
+    Outgoing message;
+    if (!frame.compress) {
+        message.owned = std::move(data);
+    }
+    else {
+        openFrame(frame, instrument.buffers().bufferSize(), message.owned);
+        lz4AppendBlocks(data.data(), data.size(), frame.blockSize, message.owned);
+    }
+    message.metrics = &instrument.metrics();
+    message.queuedAt = std::chrono::steady_clock::now();
+
+    auto self = shared_from_this();
+    auto shared = std::make_shared<Outgoing>(std::move(message));
+    boost::asio::post(socket_.get_executor(), [this, self, shared] { enqueueWrite(std::move(*shared)); });
+    return !failed_.load();
+}
+
+void ClientSession::finishFrame(Instrument& instrument, ResponseFrame& frame) {
+    // 応答が空でもフレームは1つ送り、クライアントが応答の区切りを見失わないようにする
+    if (!frame.compress) {
+        return;
+    }
+    std::string end;
+    openFrame(frame, instrument.buffers().bufferSize(), end);
+    end.append(LZ4_FRAME_END, sizeof(LZ4_FRAME_END));
+    ResponseFrame raw; // 組み立て済みのフレームの末尾をそのまま送る
+    sendFromWorker(instrument, std::move(end), raw);
+}
+
+void ClientSession::compressChunk(Outgoing& message) {
+    // チャンクを1ブロックに圧縮する。小さくならなければブロックの先頭だけを付けてバッファをそのまま送る
+    BufferPool::Buffer buffer = std::move(message.pooled);
+    if (buffer.size() > message.compressBlockSize) {
+        lz4AppendBlocks(buffer.data(), buffer.size(), message.compressBlockSize, message.owned);
+    }
+    else if (!lz4AppendCompressedBlock(buffer.data(), buffer.size(), message.owned)) {
+        lz4AppendBlockHeader(static_cast<std::uint32_t>(buffer.size()), false, message.owned);
+        message.pooled = std::move(buffer);
+    }
+    message.compressBlockSize = 0;
+}
+
+void ClientSession::openFrame(ResponseFrame& frame, std::size_t blockSize, std::string& out) {
+    if (frame.open) {
+        return;
+    }
+    frame.open = true;
+    frame.blockSize = blockSize < LZ4_MAX_BLOCK_SIZE ? blockSize : LZ4_MAX_BLOCK_SIZE;
+    out += lz4FrameHeader(frame.blockSize);
+}
+
+void ClientSession::enqueueText(std::string text) {
+    Outgoing message;
+    message.owned = compressResponses_ ? lz4EncodeFrame(text) : std::move(text);
+    enqueueWrite(std::move(message));
+}
+
+void ClientSession::enqueueWrite(Outgoing message) {
+    if (closed_) {
+        return; // バッファは message の破棄とともにプールへ戻る
+    }
+
+    outbox_.push_back(std::move(message));
+    writeNext();
+}
+
+void ClientSession::writeNext() {
+    if (writing_ || outbox_.empty()) {
+        return;
+    }
+    writing_ = true;
+
+    const Outgoing& front = outbox_.front();
+    auto self = shared_from_this();
+    auto onWritten = [this, self](const boost::system::error_code& error, std::size_t /*bytes*/) {
+        onMessageWritten(error);
+    };
+    if (front.pooled && !front.owned.empty()) {
+        // 圧縮モードの非圧縮ブロック: 先頭とバッファをまとめて書く
+        const std::array<boost::asio::const_buffer, 2> buffers = {
+            boost::asio::buffer(front.owned),
+            boost::asio::buffer(front.pooled.data(), front.pooled.size()),
+        };
+        boost::asio::async_write(socket_, buffers, std::move(onWritten));
+    }
+    else {
+        const auto buffer = front.pooled
+            ? boost::asio::buffer(front.pooled.data(), front.pooled.size())
+            : boost::asio::buffer(front.owned);
+        boost::asio::async_write(socket_, buffer, std::move(onWritten));
+    }
+}
+
+void ClientSession::onMessageWritten(const boost::system::error_code& error) {
+    writing_ = false;
+    Outgoing sent = std::move(outbox_.front());
+    outbox_.pop_front();
+    if (sent.metrics) {
+        sent.metrics->socketWrite.record(std::chrono::steady_clock::now() - sent.queuedAt);
+    }
+
+    if (error || closed_) {
+        if (error) {
+            LOG_ERROR("応答の送信に失敗しました (" << peer_ << "): " << error.message());
+        }
+        close();
+        failPendingWrites();
+        return;
+    }
+
+    writeNext();
+    closeWhenIdle();
+}
+
+void ClientSession::closeWhenIdle() {
+    // クライアントが送信を終えても、未送信の応答と未完了の書き込みを片付けてから閉じる
+    if (closing_ && !writing_ && outbox_.empty() && pendingWrites_ == 0 && !hasDeferred_) {
+        close();
+    }
+}
+
+void ClientSession::failPendingWrites() {
+    outbox_.clear(); // 未送信のプールのバッファはここで返却される
+}
+
+void ClientSession::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    failed_ = true;
+    cancelSubscriptions();
+    for (Instrument* instrument : lockedInstruments_) {
+        instrument->releaseLocks(this);
+    }
+    lockedInstruments_.clear();
+
+    // 送信中のデータがあれば、その完了ハンドラで残りを片付ける
+    if (!writing_) {
+        failPendingWrites();
+    }
+
+    boost::system::error_code ignored;
+    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+    LOG_INFO("クライアントが切断しました: " << peer_);
+}
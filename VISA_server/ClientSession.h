@@ -0,0 +1,197 @@
+﻿#pragma once
+
+#include "Instrument.h"
+#include "InstrumentPool.h"
+#include "Macro.h"
+#include "Recorder.h"
+#include "SubscriptionHub.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief テキストモードの接続が共有するサーバー側の機能。nullptr の機能のコマンドはエラーを返します。
+ */
+struct SessionServices {
+    SubscriptionHub* subscriptions = nullptr; // :SERVER:SUBSCRIBE の実行先
+    Recorder* recorder = nullptr;             // :SERVER:RECORD の実行先
+    MacroLibrary* macros = nullptr;           // :SERVER:MACRO の登録先
+};
+
+/**
+ * @brief 1つのTCPクライアント接続を非同期に処理するクラス。
+ *        改行区切りのコマンドを読み取り、宛先の計測器のコマンドキューへ投入し、応答をクライアントへ返します。
+ *        ソケットの操作はすべてソケットのエグゼキュータ (strand) 上で行われます。
+ *
+ *        宛先の計測器は接続ごとに ":SERVER:SELECT <名前>" で切り替えるか、
+ *        コマンドの先頭に "@<名前> " を付けてコマンド単位で指定します。
+ *
+ *        クエリを含まない設定コマンド (ScpiParser で判定) は書き込み完了を待たずに次のコマンドを読み進め、計測器側でまとめ書きされます。
+ *        ":MEAS:VOLT?;:MEAS:CURR?" や ":DATA? 1,100" のようにクエリを含むメッセージは、1つの応答メッセージを END まで読み取ります。
+ *        応答の順序はコマンドの順序と一致します。
+ *
+ *        ":SERVER:STATS?" で計測器ごとの処理時間 (p50/p99/最大) とスループットをJSONで返します。
+ *
+ *        ":SERVER:SUBSCRIBE <間隔ms>,<クエリ>" で選択中の計測器のクエリを購読すると、サーバーが間隔ごとに問い合わせ、
+ *        結果を "!<購読ID> <応答>" の1行として送ってきます。プッシュは応答の途中には割り込みません。
+ *        ":SERVER:UNSUBSCRIBE <購読ID>|ALL" で解除し、":SERVER:SUBSCRIBE?" で "<購読ID>,<計測器名>,<間隔ms>,<クエリ>" の一覧を返します。
+ *
+ *        ":SERVER:RECORD:START <記録名>,<間隔ms>,<クエリ>" で選択中の計測器の連続取得をサーバー内のファイルへ記録し、
+ *        ":SERVER:RECORD:STOP <記録名>" で止めます。":SERVER:RECORD:FETCH? <記録名>,<先頭>,<件数>" はレコードを
+ *        definite-length block で返し、":SERVER:RECORD?" は "<記録名>,<計測器名>,RUN|STOP,<件数>,<バイト数>" の一覧を返します。
+ *
+ *        接続直後に ":SERVER:COMPRESS LZ4" を送ると、それ以降にサーバーから送るデータ (応答、プッシュ、サーバーコマンドの返答) は
+ *        1つずつ LZ4 フレーム形式になります。計測器の応答は読み取ったチャンクごとに1ブロックとして圧縮して送るため、全体を溜めません。
+ *        ":SERVER:COMPRESS OFF" で元に戻ります。COMPRESS 自体の返答は切り替え前の形式で送ります。
+ *
+ *        ":SERVER:PRIORITY HIGH|NORMAL|LOW" でこの接続のコマンドの優先度クラスを切り替えます。計測器は待っているコマンドのうち
+ *        高いクラスから、同じクラスの接続を順番に処理し、大きな転送はチャンクの区切りで高いクラスのコマンドにセッションを早く譲ります。
+ *
+ *        ":SERVER:MACRO:DEFINE <マクロ名>" に続く行から ":SERVER:MACRO:END" までをマクロとして登録します (本体の行には返答しません)。
+ *        ":SERVER:MACRO:RUN <マクロ名>[,<変数>=<値>...]" は選択中の計測器でマクロ全体を1つのジョブとして実行し、
+ *        クエリの応答をセミコロン区切りの1行で返します。":SERVER:MACRO?" は登録済みのマクロ名の一覧、
+ *        ":SERVER:MACRO:DELETE <マクロ名>" は削除です。マクロはすべての接続で共有します。
+ *
+ *        ":SERVER:LOCK [EXCLUSIVE|SHARED,<キー>][,<タイムアウトms>]" で選択中の計測器をロックします (既定は排他、10秒)。
+ *        ロック中は保持している接続のコマンドだけが実行され、他の接続のコマンドは解放まで計測器のキューで待ちます。
+ *        共有ロックは同じキーを指定した接続の間で共有します。返答はロックが取れた時点で "EXCLUSIVE" / "SHARED" を返します。
+ *        ":SERVER:UNLOCK" で解放し (先に送ったコマンドの後に処理します)、切断時にも自動的に解放します。
+ *        ":SERVER:LOCK?" は "<EXCLUSIVE|SHARED|NONE>,<保持している接続数>,<待っている要求数>,<この接続が保持しているか 0|1>" を返します。
+ *
+ *        ":SERVER:TIMESTAMP ON" にすると、計測器の応答の先頭に "<通し番号>,<viWrite の時刻>,<最初の viRead の時刻>;" を付けます。
+ *        通し番号は計測器ごと (他の接続の応答の分も進む)、時刻は VISA 呼び出しが戻った時点のサーバー内で共通の単調増加のナノ秒で、
+ *        複数の計測器の測定の時刻合わせと、応答の欠落・順序の入れ替わりの検出に使えます。計測していない値 (キャッシュの応答など) は 0 です。
+ *        END を受けた時刻はフレームモードの FRAME_REQUEST_TIMESTAMP で得られます。":SERVER:TIMESTAMP OFF" で元に戻ります。
+ */
+class ClientSession : public std::enable_shared_from_this<ClientSession> {
+public:
+    ClientSession(boost::asio::ip::tcp::socket socket, InstrumentPool& pool, SessionServices services = SessionServices());
+
+    /**
+     * @brief コマンドの受信を開始します。
+     */
+    void start();
+
+private:
+    /**
+     * @brief 送信待ちのデータ。pooled が有効ならワーカーが読み取ったプールのバッファを、そうでなければ owned を送ります。
+     *        metrics が設定されている場合は、キューに入ってから送信完了までの時間を記録します。
+     *        両方ある場合は owned (圧縮モードのブロックの先頭など) に続けて pooled を送ります。
+     */
+    struct Outgoing {
+        std::string owned;
+        BufferPool::Buffer pooled;
+        InstrumentMetrics* metrics = nullptr;
+        std::chrono::steady_clock::time_point queuedAt;
+        std::size_t compressBlockSize = 0; // 0 以外なら、strand 上で pooled をこの大きさ以下のブロックに圧縮して owned の後ろに加える
+    };
+
+    /**
+     * @brief 1つの応答の LZ4 フレームの状態。クエリのジョブを実行するワーカーだけが使います。
+     */
+    struct ResponseFrame {
+        bool compress = false;      // 圧縮モードで送るか
+        bool open = false;          // フレームの先頭を送ったか
+        std::size_t blockSize = 0;  // フレーム記述子に書いたブロックの最大バイト数
+    };
+
+    /**
+     * @brief この接続の購読。
+     */
+    struct Subscription {
+        Instrument* instrument;
+        std::chrono::milliseconds interval;
+        std::string query;
+    };
+
+    // 応答の送信中に溜めておくプッシュの上限。超えた分は古いものから捨てる
+    static constexpr std::size_t MAX_PENDING_PUSHES = 64;
+
+    // ":SERVER:LOCK" でタイムアウトを省略した場合に、他の接続のロックの解放を待つ時間
+    static constexpr std::chrono::milliseconds DEFAULT_LOCK_TIMEOUT{ 10000 };
+
+    void readCommand();
+    void onCommandRead(const boost::system::error_code& error);
+    void dispatchCommand(std::string command);
+    void submitToInstrument(Instrument& instrument, std::string command);
+    void submitWriteToInstrument(Instrument& instrument, std::string command);
+    void onWriteCompleted(ViStatus status);
+    std::string handleServerCommand(const std::string& command);
+    std::string subscribe(const std::string& argument);
+    std::string unsubscribe(const std::string& argument);
+    std::string handleRecordCommand(const std::string& header, const std::string& argument);
+    std::string handleMacroCommand(const std::string& header, const std::string& argument);
+    void beginMacroDefinition(const std::string& name);
+    void collectMacroLine(std::string line);
+    void startMacro(const std::string& argument);
+    void startLock(const std::string& argument);
+    void startUnlock();
+    void push(std::size_t id, std::string response);
+    void endResponse();
+    void cancelSubscriptions();
+    void sendReply(std::string reply);
+    bool sendFromWorker(Instrument& instrument, BufferPool::Buffer buffer, ResponseFrame& frame);
+    bool sendFromWorker(Instrument& instrument, std::string data, ResponseFrame& frame);
+    void finishFrame(Instrument& instrument, ResponseFrame& frame);
+    // blockSize は応答のチャンクの大きさ (計測器のバッファプールのバッファ)。最初に送るデータの長さではなく、これでフレームのブロックの上限を決める
+    static void openFrame(ResponseFrame& frame, std::size_t blockSize, std::string& out);
+    static void compressChunk(Outgoing& message);
+    void enqueueText(std::string text);
+    void enqueueWrite(Outgoing message);
+    void writeNext();
+    void onMessageWritten(const boost::system::error_code& error);
+    void closeWhenIdle();
+    void failPendingWrites();
+    void close();
+
+    boost::asio::ip::tcp::socket socket_;
+    InstrumentPool& pool_;
+    SessionServices services_;
+    Instrument* target_;
+    boost::asio::streambuf buffer_;
+    std::string peer_;
+    bool eof_ = false;
+    bool closing_ = false;
+    bool closed_ = false;
+    bool compressResponses_ = false;   // 送るデータを LZ4 フレームにするか
+    bool compressAfterReply_ = false;  // 次の返答を送った後の compressResponses_ (:SERVER:COMPRESS の返答は切り替え前の形式で送る)
+    JobPriority priority_ = JobPriority::Normal; // この接続のコマンドを計測器のキューに積む優先度クラス
+    bool timestamps_ = false;                    // 計測器の応答の先頭に通し番号と時刻を付けるか
+    std::set<Instrument*> lockedInstruments_;    // ":SERVER:LOCK" を要求した計測器。切断時にロックを解放する
+
+    // 直前のコマンド1行の受信にかかった時間 (統計用)
+    std::chrono::steady_clock::time_point readStartedAt_;
+    std::chrono::steady_clock::duration lastReadTime_{};
+
+    // 送信キュー (strand 上でのみ操作する)
+    std::deque<Outgoing> outbox_;
+    bool writing_ = false;
+    std::atomic<bool> failed_{ false }; // 送信に失敗したか切断済み。ワーカーが以後の送信をやめる判断に使う
+
+    // 完了待ちの設定コマンド。書き込み中は別の宛先へのコマンドを deferred_ に保留して順序を守る
+    std::size_t pendingWrites_ = 0;
+    Instrument* pendingInstrument_ = nullptr;
+    std::string deferred_;
+    bool hasDeferred_ = false;
+
+    // 購読 (strand 上でのみ操作する)。計測器の応答を送っている間のプッシュは pendingPushes_ に溜め、応答の後に送る
+    std::map<std::size_t, Subscription> subscriptions_;
+    bool responseOpen_ = false;
+    std::deque<std::string> pendingPushes_;
+
+    // ":SERVER:MACRO:DEFINE" から ":SERVER:MACRO:END" までの行 (strand 上でのみ操作する)。
+    // 名前が不正などで登録できない場合も END までは読み続け、本体の行を計測器へ送らないようにする
+    bool definingMacro_ = false;
+    std::string macroName_;
+    std::vector<std::string> macroLines_;
+    std::string macroError_;
+};
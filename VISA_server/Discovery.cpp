@@ -0,0 +1,256 @@
+﻿#include "Discovery.h"
+
+#include "Logger.h"
+#include "StringUtil.h"
+
+#include <array>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+std::vector<std::string> listResources(ViSession resourceManager) {
+    ViStatus status;
+    ViFindList findList;
+    ViUInt32 numInstrs = 0;
+
+    std::array<ViChar, VI_FIND_BUFLEN> instrDesc;
+    std::vector<std::string> resources;
+
+    status = viFindRsrc(resourceManager, "?*INSTR", &findList, &numInstrs, instrDesc.data());
+    if (status == VI_ERROR_RSRC_NFOUND) {
+        return resources; // 1つも接続されていない
+    }
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("listResources: 計測器の検索 (viFindRsrc) に失敗しました (Status: " << status << ")");
+        return resources;
+    }
+
+    for (ViUInt32 i = 0; i < numInstrs; ++i) {
+        if (i > 0) {
+            status = viFindNext(findList, instrDesc.data());
+            if (status < VI_SUCCESS) continue;
+        }
+        resources.emplace_back(instrDesc.data());
+    }
+
+    viClose(findList);
+    return resources;
+}
+
+std::string getInstrumentIdn(ViSession resourceManager, const ViChar* instrDesc, ViUInt32 timeoutMs) {
+    ViSession instrument;
+    ViStatus status;
+
+    status = viOpen(resourceManager, instrDesc, VI_NULL, VI_NULL, &instrument);
+    if (status < VI_SUCCESS) {
+        LOG_WARN("getInstrumentIdn: 計測器のオープンに失敗しました (" << instrDesc << ", Status: " << status << ")");
+        return "";
+    }
+
+    // 応答しないリソースで待たされ続けないよう、問い合わせのタイムアウトを短くする
+    viSetAttribute(instrument, VI_ATTR_TMO_VALUE, timeoutMs);
+
+    std::array<char, 256> idnBuffer = { 0 };
+    status = viQueryf(instrument, "%s", "%255t", "*IDN?\n", idnBuffer.data());
+
+    viClose(instrument);
+
+    if (status < VI_SUCCESS) {
+        LOG_WARN("getInstrumentIdn: *IDN? の問い合わせに失敗しました (" << instrDesc << ", Status: " << status << ")");
+        return "";
+    }
+
+    return std::string(idnBuffer.data());
+}
+
+namespace {
+
+/**
+ * @brief 並列プローブの結果を集約する共有状態。プローブスレッドは findInstrument より長く生きることがあるため shared_ptr で保持する。
+ */
+struct ProbeState {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> idns;
+    std::vector<bool> done;
+};
+
+} // namespace
+
+std::vector<DiscoveredInstrument> findInstruments(ViSession resourceManager, const std::vector<std::string>& keys,
+    std::map<std::string, std::string>* idns) {
+    std::vector<DiscoveredInstrument> found(keys.size());
+
+    const std::vector<std::string> resources = listResources(resourceManager);
+    if (resources.empty()) {
+        LOG_INFO("findInstrument: 計測器が見つかりませんでした。");
+        return found;
+    }
+
+    LOG_INFO("見つかった計測器の数: " << resources.size());
+
+    auto state = std::make_shared<ProbeState>();
+    state->idns.resize(resources.size());
+    state->done.resize(resources.size(), false);
+
+    // 全リソースを同時にプローブする。起動時間は最も遅い1台のプローブ時間で頭打ちになる
+    for (size_t i = 0; i < resources.size(); ++i) {
+        std::thread([state, resourceManager, i, desc = resources[i]] {
+            std::string idn = getInstrumentIdn(resourceManager, desc.c_str());
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            LOG_INFO("  " << (i + 1) << ": " << desc
+                << (idn.empty() ? " (IDN取得失敗)" : " (IDN: " + idn + ")"));
+            state->idns[i] = std::move(idn);
+            state->done[i] = true;
+            state->cv.notify_all();
+        }).detach();
+    }
+
+    std::vector<std::string> lowerKeys;
+    for (const auto& key : keys) {
+        lowerKeys.push_back(toLower(key));
+    }
+
+    // 一覧の順序でリソースを確認し、まだ決まっていないキーに割り当てる。
+    // 全キーが決まった時点で、残りのプローブの完了を待たずに戻る
+    size_t unresolved = keys.size();
+    {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        for (size_t i = 0; i < resources.size() && unresolved > 0; ++i) {
+            state->cv.wait(lock, [&] { return state->done[i]; });
+            if (state->idns[i].empty()) {
+                continue;
+            }
+
+            const std::string lower_idn = toLower(state->idns[i]);
+            for (size_t k = 0; k < keys.size(); ++k) {
+                if (found[k].address.empty() && lower_idn.find(lowerKeys[k]) != std::string::npos) {
+                    LOG_INFO("==> 対象の計測器が見つかりました (" << keys[k] << "): " << resources[i]);
+                    found[k] = { resources[i], state->idns[i] };
+                    --unresolved;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (idns != nullptr) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        for (size_t i = 0; i < resources.size(); ++i) {
+            if (state->done[i]) {
+                (*idns)[resources[i]] = state->idns[i];
+            }
+        }
+    }
+
+    for (size_t k = 0; k < keys.size(); ++k) {
+        if (found[k].address.empty()) {
+            LOG_INFO("findInstrument: 対象の計測器 (" << keys[k] << ") が見つかりませんでした (大文字小文字無視)。");
+        }
+    }
+
+    return found;
+}
+
+std::vector<DiscoveredInstrument> findCachedInstruments(ViSession resourceManager, const std::vector<std::string>& keys,
+    const std::vector<std::string>& candidates, std::map<std::string, std::string>* idns) {
+    std::vector<DiscoveredInstrument> found(keys.size());
+
+    // 同じリソースが複数のキーに割り当てられていればファイルが壊れているとみなし、そのリソースは使わない
+    std::map<std::string, int> uses;
+    for (const auto& candidate : candidates) {
+        if (!candidate.empty()) {
+            ++uses[candidate];
+        }
+    }
+
+    // 候補だけを並列に問い合わせ、今も同じキーの計測器かを確かめる
+    std::vector<std::string> probed(keys.size());
+    std::vector<std::thread> probes;
+    for (size_t k = 0; k < keys.size() && k < candidates.size(); ++k) {
+        if (!candidates[k].empty() && uses[candidates[k]] == 1) {
+            probes.emplace_back([resourceManager, &candidates, &probed, k] {
+                probed[k] = getInstrumentIdn(resourceManager, candidates[k].c_str());
+            });
+        }
+    }
+    for (auto& probe : probes) {
+        probe.join();
+    }
+
+    for (size_t k = 0; k < keys.size() && k < candidates.size(); ++k) {
+        if (candidates[k].empty() || uses[candidates[k]] != 1) {
+            continue;
+        }
+        if (idns != nullptr) {
+            (*idns)[candidates[k]] = probed[k];
+        }
+        if (!probed[k].empty() && toLower(probed[k]).find(toLower(keys[k])) != std::string::npos) {
+            LOG_INFO("==> 前回の検索結果の計測器を確認しました (" << keys[k] << "): " << candidates[k]);
+            found[k] = { candidates[k], probed[k] };
+        }
+        else {
+            LOG_INFO("前回の検索結果の計測器 (" << keys[k] << ": " << candidates[k] << ") を確認できませんでした");
+        }
+    }
+    return found;
+}
+
+std::map<std::string, CachedInstrument> loadDiscoveryCache(const std::string& path) {
+    std::map<std::string, CachedInstrument> cache;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        line = trim(line);
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+        const size_t first = line.find('\t');
+        const size_t second = first == std::string::npos ? std::string::npos : line.find('\t', first + 1);
+        if (second == std::string::npos) {
+            continue;
+        }
+        const std::string name = trim(line.substr(0, first));
+        CachedInstrument instrument{ trim(line.substr(first + 1, second - first - 1)), trim(line.substr(second + 1)) };
+        if (!name.empty() && !instrument.address.empty() && !instrument.idn.empty()) {
+            cache[name] = std::move(instrument);
+        }
+    }
+    return cache;
+}
+
+bool saveDiscoveryCache(const std::string& path, const std::map<std::string, CachedInstrument>& instruments) {
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        file << "# VISA_server の計測器の検索結果。<計測器名>\t<リソース記述子>\t<IDN>\n";
+        for (const auto& entry : instruments) {
+            const std::string idn = trim(entry.second.idn);
+            if (!idn.empty()) {
+                file << entry.first << '\t' << entry.second.address << '\t' << idn << '\n';
+            }
+        }
+        if (!file.flush()) {
+            LOG_WARN("計測器の検索結果を保存できませんでした: " << path);
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        LOG_WARN("計測器の検索結果を保存できませんでした: " << path << " (" << error.message() << ")");
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+std::string findInstrument(ViSession resourceManager, const std::string& key) {
+    return findInstruments(resourceManager, { key }).front().address;
+}
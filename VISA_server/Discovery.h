@@ -0,0 +1,88 @@
+﻿#pragma once
+
+#include <visa.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// 計測器の検索時に *IDN? 応答を待つ時間 (ミリ秒)。応答しないリソースで起動が長引かないよう短めにする
+constexpr ViUInt32 PROBE_TIMEOUT_MS = 2000;
+
+/**
+ * @brief 検索で見つかった計測器。
+ */
+struct DiscoveredInstrument {
+    std::string address; // リソース記述子。見つからなかった場合は空文字列
+    std::string idn;     // 検索時に取得した *IDN? の応答
+};
+
+/**
+ * @brief VISAリソースマネージャに登録されているすべての計測器リソース (?*INSTR) を列挙します。
+ * @param resourceManager VISAリソースマネージャのセッション。
+ * @return リソース記述子の一覧。検索に失敗した場合や見つからない場合は空 (見つからないだけならエラーのログは出しません)。
+ */
+std::vector<std::string> listResources(ViSession resourceManager);
+
+/**
+ * @brief 指定されたリソース記述子 (instrDesc) の計測器を一時的に開き、*IDN? を問い合わせます。
+ * @param resourceManager VISAリソースマネージャのセッション。
+ * @param instrDesc 問い合わせ対象の計測器のリソース記述子。
+ * @param timeoutMs 問い合わせのタイムアウト (VI_ATTR_TMO_VALUE、ミリ秒)。
+ * @return 計測器のIDN文字列。失敗した場合は空文字列。
+ */
+std::string getInstrumentIdn(ViSession resourceManager, const ViChar* instrDesc, ViUInt32 timeoutMs = PROBE_TIMEOUT_MS);
+
+/**
+ * @brief 接続されている計測器を検索し、キー文字列ごとにIDNにそれを含む最初の計測器を見つけます。(大文字小文字を区別しない)
+ *        すべてのリソースへの *IDN? 問い合わせを並列に行い、全キーの一致が確定した時点で結果を返します。
+ *        1つのリソースが複数のキーに割り当てられることはありません。
+ * @param resourceManager VISAリソースマネージャのセッション。
+ * @param keys IDNに含まれるべきキーワードの一覧。
+ * @param idns nullptr 以外なら、戻るまでに問い合わせが終わったリソースの IDN (失敗は空文字列) を追加します。
+ *             見つからなかったキーがあれば、すべてのリソースの問い合わせを待ってから戻ります。
+ * @return keys と同じ順序の検索結果。見つからなかったキーの要素は address が空文字列。
+ */
+std::vector<DiscoveredInstrument> findInstruments(ViSession resourceManager, const std::vector<std::string>& keys,
+    std::map<std::string, std::string>* idns = nullptr);
+
+/**
+ * @brief 前回の起動で計測器名に割り当てたリソース (discovery cache の1件)。
+ */
+struct CachedInstrument {
+    std::string address; // リソース記述子
+    std::string idn;     // 割り当てた時点の *IDN? 応答
+};
+
+/**
+ * @brief 前回の起動で各キーに割り当てたリソースだけに *IDN? を並列に問い合わせ、今もそのキーに一致するかを確かめます。
+ *        全リソースの検索より速く、計測器の構成が前回と同じなら起動時の検索はこれだけで済みます。
+ *        割り当ては前回の全リソースの検索 (一覧の順序) で決まったものをそのまま使うため、同じ機種が複数あっても入れ替わりません。
+ * @param candidates keys と同じ順序の、前回割り当てたリソース記述子。空文字列のキーは問い合わせません。
+ * @param idns nullptr 以外なら、問い合わせたリソースの IDN (失敗は空文字列) を追加します。
+ * @return keys と同じ順序の検索結果。候補がないキーや、IDN が一致しなくなったキーの要素は address が空文字列。
+ */
+std::vector<DiscoveredInstrument> findCachedInstruments(ViSession resourceManager, const std::vector<std::string>& keys,
+    const std::vector<std::string>& candidates, std::map<std::string, std::string>* idns = nullptr);
+
+/**
+ * @brief 検索結果のファイル (1行に "<計測器名>\t<リソース記述子>\t<IDN>"、'#' で始まる行はコメント) を読み込みます。
+ * @return 計測器名から割り当てへの対応。ファイルがない場合や読めない場合は空。形式が不正な行は無視します。
+ */
+std::map<std::string, CachedInstrument> loadDiscoveryCache(const std::string& path);
+
+/**
+ * @brief 検索結果をファイルに書き込みます。一時ファイルに書いてから置き換えるため、途中で止まっても前の内容が残ります。
+ *        IDN が空 (問い合わせ失敗) の割り当ては書きません。
+ * @return 書き込めた場合 true。
+ */
+bool saveDiscoveryCache(const std::string& path, const std::map<std::string, CachedInstrument>& instruments);
+
+/**
+ * @brief 接続されている計測器を検索し、IDNに指定されたキー文字列 (key) を含む最初の計測器を見つけます。(大文字小文字を区別しない)
+ *        すべてのリソースへの *IDN? 問い合わせを並列に行い、一致が確定した時点で結果を返します。
+ * @param resourceManager VISAリソースマネージャのセッション。
+ * @param key IDNに含まれるべきキーワード (例: "TEKTRONIX")。
+ * @return 見つかった計測器のリソース記述子文字列。見つからない場合は空文字列。
+ */
+std::string findInstrument(ViSession resourceManager, const std::string& key);
@@ -0,0 +1,114 @@
+﻿#include "FrameProtocol.h"
+
+namespace {
+
+uint16_t readU16(const uint8_t* data) {
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+uint32_t readU32(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16)
+        | (static_cast<uint32_t>(data[2]) << 8) | static_cast<uint32_t>(data[3]);
+}
+
+void writeU16(uint8_t* data, uint16_t value) {
+    data[0] = static_cast<uint8_t>(value >> 8);
+    data[1] = static_cast<uint8_t>(value);
+}
+
+void writeU32(uint8_t* data, uint32_t value) {
+    data[0] = static_cast<uint8_t>(value >> 24);
+    data[1] = static_cast<uint8_t>(value >> 16);
+    data[2] = static_cast<uint8_t>(value >> 8);
+    data[3] = static_cast<uint8_t>(value);
+}
+
+uint64_t readU64(const uint8_t* data) {
+    return (static_cast<uint64_t>(readU32(data)) << 32) | readU32(data + 4);
+}
+
+void writeU64(uint8_t* data, uint64_t value) {
+    writeU32(data, static_cast<uint32_t>(value >> 32));
+    writeU32(data + 4, static_cast<uint32_t>(value));
+}
+
+} // namespace
+
+FrameRequestHeader decodeFrameRequestHeader(const uint8_t* data) {
+    FrameRequestHeader header;
+    header.opcode = static_cast<FrameOpcode>(data[0]);
+    header.flags = data[1];
+    header.instrument = readU16(data + 2);
+    header.requestId = readU32(data + 4);
+    header.length = readU32(data + 8);
+    return header;
+}
+
+std::array<uint8_t, FRAME_REQUEST_HEADER_SIZE> encodeFrameRequestHeader(const FrameRequestHeader& header) {
+    std::array<uint8_t, FRAME_REQUEST_HEADER_SIZE> data{};
+    data[0] = static_cast<uint8_t>(header.opcode);
+    data[1] = header.flags;
+    writeU16(data.data() + 2, header.instrument);
+    writeU32(data.data() + 4, header.requestId);
+    writeU32(data.data() + 8, header.length);
+    return data;
+}
+
+FrameResponseHeader decodeFrameResponseHeader(const uint8_t* data) {
+    FrameResponseHeader header;
+    header.opcode = static_cast<FrameOpcode>(data[0]);
+    header.flags = data[1];
+    header.status = static_cast<FrameStatus>(readU16(data + 2));
+    header.requestId = readU32(data + 4);
+    header.visaStatus = static_cast<int32_t>(readU32(data + 8));
+    header.length = readU32(data + 12);
+    return header;
+}
+
+std::array<uint8_t, FRAME_RESPONSE_HEADER_SIZE> encodeFrameResponseHeader(const FrameResponseHeader& header) {
+    std::array<uint8_t, FRAME_RESPONSE_HEADER_SIZE> data{};
+    data[0] = static_cast<uint8_t>(header.opcode);
+    data[1] = header.flags;
+    writeU16(data.data() + 2, static_cast<uint16_t>(header.status));
+    writeU32(data.data() + 4, header.requestId);
+    writeU32(data.data() + 8, static_cast<uint32_t>(header.visaStatus));
+    writeU32(data.data() + 12, header.length);
+    return data;
+}
+
+FrameTimestamp decodeFrameTimestamp(const uint8_t* data) {
+    FrameTimestamp timestamp;
+    timestamp.sequence = readU64(data);
+    timestamp.written = readU64(data + 8);
+    timestamp.firstRead = readU64(data + 16);
+    timestamp.lastRead = readU64(data + 24);
+    return timestamp;
+}
+
+std::array<uint8_t, FRAME_TIMESTAMP_SIZE> encodeFrameTimestamp(const FrameTimestamp& timestamp) {
+    std::array<uint8_t, FRAME_TIMESTAMP_SIZE> data{};
+    writeU64(data.data(), timestamp.sequence);
+    writeU64(data.data() + 8, timestamp.written);
+    writeU64(data.data() + 16, timestamp.firstRead);
+    writeU64(data.data() + 24, timestamp.lastRead);
+    return data;
+}
+
+bool isValidFrameOpcode(uint8_t opcode) {
+    return opcode == static_cast<uint8_t>(FrameOpcode::Write)
+        || opcode == static_cast<uint8_t>(FrameOpcode::Query)
+        || opcode == static_cast<uint8_t>(FrameOpcode::Read);
+}
+
+FrameStatus frameStatusFromVisa(ViStatus status) {
+    if (status >= VI_SUCCESS) {
+        return FrameStatus::Ok;
+    }
+    if (status == VI_ERROR_TMO) {
+        return FrameStatus::Timeout;
+    }
+    if (status == VI_ERROR_ABORT) {
+        return FrameStatus::Aborted;
+    }
+    return FrameStatus::VisaError;
+}
@@ -0,0 +1,112 @@
+﻿#pragma once
+
+#include <visa.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief 長さ付きバイナリフレームのプロトコル定義 (フレームモード用の待ち受けポート)。
+ *        改行区切りのテキストモードと違い、書き込み・問い合わせ・読み取りをオペコードで明示するため、
+ *        '?' の有無から応答の有無を推測せず、応答のないコマンドで viRead を待つことがありません。
+ *        整数はすべてビッグエンディアン (ネットワークバイトオーダー) です。
+ *
+ *        要求 (12バイトのヘッダ + ペイロード):
+ *          u8 opcode, u8 flags, u16 instrument, u32 requestId, u32 length, u8[length] payload
+ *          instrument は ":SERVER:LIST?" の番号 (1 始まり)。0 は既定の計測器です。
+ *          flags は計測器のキューの優先度クラス (FRAME_REQUEST_HIGH_PRIORITY / FRAME_REQUEST_LOW_PRIORITY、どちらもなければ通常)。
+ *          同じ計測器宛てでも優先度の違う要求同士は処理の順序が入れ替わることがあります。
+ *          QUERY / READ に FRAME_REQUEST_TIMESTAMP を立てると、最後のフレームの直前に応答の時刻のフレームが加わります。
+ *
+ *        応答 (16バイトのヘッダ + ペイロード):
+ *          u8 opcode, u8 flags, u16 status, u32 requestId, i32 visaStatus, u32 length, u8[length] payload
+ *          1つの要求への応答は1つ以上のフレームに分かれ、最後以外のフレームには FRAME_MORE が立ちます。
+ *          最後のフレームの status と visaStatus がその要求の結果です。
+ *          FRAME_TIMESTAMP が立ったフレームは応答データではなく、FRAME_TIMESTAMP_SIZE バイトの時刻です:
+ *            u64 sequence, u64 written, u64 firstRead, u64 lastRead
+ *          sequence は計測器ごとの応答の通し番号 (1 始まり、他の接続の応答の分も進む)、残りは viWrite / 応答の最初の viRead /
+ *          END を受けた viRead が戻った時刻で、サーバー内で共通の単調増加のナノ秒です。計測していない値 (キャッシュの応答など) は 0 です。
+ *
+ *        要求はパイプライン化でき、応答は requestId で対応付けます。同じ計測器宛ての要求は送信順に処理されますが、
+ *        別の計測器宛ての応答は前後し、フレーム単位で混ざることがあります。
+ */
+
+/**
+ * @brief 要求の種類。
+ */
+enum class FrameOpcode : uint8_t {
+    Write = 0x01, // ペイロードを書き込む。応答はステータスのみ
+    Query = 0x02, // ペイロードを書き込み、応答を END まで読み取って返す
+    Read = 0x03,  // 書き込まずに応答を END まで読み取って返す
+};
+
+/**
+ * @brief 要求の処理結果。
+ */
+enum class FrameStatus : uint16_t {
+    Ok = 0,
+    VisaError = 1,    // VISA 操作の失敗。visaStatus に ViStatus が入る
+    Timeout = 2,      // 計測器の応答待ちがタイムアウトした
+    NoInstrument = 3, // 指定された番号の計測器がない
+    BadRequest = 4,   // 不明なオペコードや空のコマンド
+    ServerError = 5,  // サーバー内部の例外
+    Aborted = 6,      // サーバーの停止により中断した
+};
+
+constexpr uint8_t FRAME_MORE = 0x01;      // 同じ要求への応答フレームが続く
+constexpr uint8_t FRAME_TIMESTAMP = 0x02; // ペイロードは応答の時刻 (FrameTimestamp)
+
+constexpr uint8_t FRAME_REQUEST_HIGH_PRIORITY = 0x01; // 要求を優先度の高いクラスで処理する
+constexpr uint8_t FRAME_REQUEST_LOW_PRIORITY = 0x02;  // 要求を優先度の低いクラス (大きな転送など) で処理する
+constexpr uint8_t FRAME_REQUEST_TIMESTAMP = 0x04;     // 応答の時刻のフレームを返す (QUERY / READ のみ)
+
+constexpr std::size_t FRAME_REQUEST_HEADER_SIZE = 12;
+constexpr std::size_t FRAME_RESPONSE_HEADER_SIZE = 16;
+constexpr std::size_t FRAME_TIMESTAMP_SIZE = 32;
+
+// 1つの要求のペイロードの上限。これを超える要求を受けると接続を閉じる
+constexpr uint32_t FRAME_MAX_REQUEST_PAYLOAD = 1024 * 1024;
+
+struct FrameRequestHeader {
+    FrameOpcode opcode = FrameOpcode::Write;
+    uint8_t flags = 0;
+    uint16_t instrument = 0;
+    uint32_t requestId = 0;
+    uint32_t length = 0;
+};
+
+struct FrameResponseHeader {
+    FrameOpcode opcode = FrameOpcode::Write;
+    uint8_t flags = 0;
+    FrameStatus status = FrameStatus::Ok;
+    uint32_t requestId = 0;
+    int32_t visaStatus = VI_SUCCESS;
+    uint32_t length = 0;
+};
+
+struct FrameTimestamp {
+    uint64_t sequence = 0;
+    uint64_t written = 0;
+    uint64_t firstRead = 0;
+    uint64_t lastRead = 0;
+};
+
+FrameRequestHeader decodeFrameRequestHeader(const uint8_t* data);
+std::array<uint8_t, FRAME_REQUEST_HEADER_SIZE> encodeFrameRequestHeader(const FrameRequestHeader& header);
+
+FrameResponseHeader decodeFrameResponseHeader(const uint8_t* data);
+std::array<uint8_t, FRAME_RESPONSE_HEADER_SIZE> encodeFrameResponseHeader(const FrameResponseHeader& header);
+
+FrameTimestamp decodeFrameTimestamp(const uint8_t* data);
+std::array<uint8_t, FRAME_TIMESTAMP_SIZE> encodeFrameTimestamp(const FrameTimestamp& timestamp);
+
+/**
+ * @brief オペコードが既知のものかを返します。
+ */
+bool isValidFrameOpcode(uint8_t opcode);
+
+/**
+ * @brief VISA のステータスを応答のステータスに変換します。警告 (VI_SUCCESS 以上) は Ok です。
+ */
+FrameStatus frameStatusFromVisa(ViStatus status);
@@ -0,0 +1,385 @@
+﻿#include "FramedSession.h"
+
+#include "Logger.h"
+#include "ScpiParser.h"
+#include "StringUtil.h"
+
+#include <utility>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief 要求の flags から計測器のキューの優先度クラスを決めます。
+ */
+JobPriority priorityOf(const FrameRequestHeader& header) {
+    if (header.flags & FRAME_REQUEST_HIGH_PRIORITY) {
+        return JobPriority::High;
+    }
+    return (header.flags & FRAME_REQUEST_LOW_PRIORITY) ? JobPriority::Low : JobPriority::Normal;
+}
+
+} // namespace
+
+FramedSession::FramedSession(boost::asio::ip::tcp::socket socket, InstrumentPool& pool)
+    : socket_(std::move(socket)), pool_(pool) {
+    boost::system::error_code ec;
+    auto endpoint = socket_.remote_endpoint(ec);
+    peer_ = ec ? "不明" : endpoint.address().to_string();
+}
+
+void FramedSession::start() {
+    LOG_INFO("クライアントが接続しました (フレームモード): " << peer_);
+    readHeader();
+}
+
+void FramedSession::readHeader() {
+    if (closing_ || closed_) {
+        return;
+    }
+    if (inFlight_ >= MAX_IN_FLIGHT) {
+        readPaused_ = true; // 要求が完了したら onRequestDone で再開する
+        return;
+    }
+
+    readStartedAt_ = std::chrono::steady_clock::now();
+    auto self = shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(headerBytes_),
+        [this, self](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            onHeaderRead(error);
+        });
+}
+
+void FramedSession::onHeaderRead(const boost::system::error_code& error) {
+    if (error == boost::asio::error::eof) {
+        // フレームの区切りで閉じられた場合は、処理中の要求の応答を送り終えてから閉じる
+        closing_ = true;
+        closeWhenIdle();
+        return;
+    }
+    if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            LOG_ERROR("要求の受信中にエラーが発生しました (" << peer_ << "): " << error.message());
+        }
+        close();
+        return;
+    }
+
+    const FrameRequestHeader header = decodeFrameRequestHeader(headerBytes_.data());
+    if (header.length > FRAME_MAX_REQUEST_PAYLOAD) {
+        // ペイロードを読み飛ばすと次のフレームの境界を信用できないため、接続ごと閉じる
+        LOG_ERROR("要求が大きすぎます (" << peer_ << ", " << header.length << " バイト)。接続を閉じます");
+        close();
+        return;
+    }
+
+    payload_.resize(header.length);
+    if (header.length == 0) {
+        onPayloadRead({}, header);
+        return;
+    }
+
+    auto self = shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(&payload_[0], payload_.size()),
+        [this, self, header](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            onPayloadRead(error, header);
+        });
+}
+
+void FramedSession::onPayloadRead(const boost::system::error_code& error, FrameRequestHeader header) {
+    if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            LOG_ERROR("要求の受信中にエラーが発生しました (" << peer_ << "): " << error.message());
+        }
+        close();
+        return;
+    }
+
+    std::string payload;
+    payload.swap(payload_);
+    dispatchRequest(header, std::move(payload));
+    readHeader();
+}
+
+void FramedSession::dispatchRequest(const FrameRequestHeader& header, std::string payload) {
+    if (!isValidFrameOpcode(static_cast<uint8_t>(header.opcode))) {
+        reject(header, FrameStatus::BadRequest, "エラー: 不明なオペコードです: " + std::to_string(static_cast<unsigned>(header.opcode)) + "\n");
+        return;
+    }
+
+    Instrument* instrument = resolveInstrument(header.instrument);
+    if (instrument == nullptr) {
+        reject(header, FrameStatus::NoInstrument, "エラー: 計測器が見つかりません: " + std::to_string(header.instrument) + "\n");
+        return;
+    }
+
+    payload.erase(payload.find_last_not_of("\r\n") + 1);
+    if (header.opcode != FrameOpcode::Read && payload.empty()) {
+        reject(header, FrameStatus::BadRequest, "エラー: コマンドが指定されていません\n");
+        return;
+    }
+
+    LOG_INFO("受信 (#" << header.requestId << "): " << (header.opcode == FrameOpcode::Read ? "<READ>" : payload));
+    instrument->metrics().socketRead.record(std::chrono::steady_clock::now() - readStartedAt_);
+    instrument->metrics().addCommand();
+
+    ++inFlight_;
+    if (header.opcode == FrameOpcode::Write) {
+        submitWrite(*instrument, header, std::move(payload));
+    }
+    else {
+        submitQuery(*instrument, header, std::move(payload));
+    }
+}
+
+Instrument* FramedSession::resolveInstrument(uint16_t index) const {
+    if (index == 0) {
+        return pool_.defaultInstrument();
+    }
+    return pool_.at(index - 1u);
+}
+
+void FramedSession::submitWrite(Instrument& instrument, const FrameRequestHeader& header, std::string command) {
+    instrument.cache().observe(command);
+    auto self = shared_from_this();
+
+    if (!containsQuery(command)) {
+        // 応答のない設定コマンドはテキストモードと同じキューでまとめ書きされる
+        instrument.submitWrite(std::move(command), [this, self, &instrument, header](ViStatus status) {
+            finishRequest(&instrument, header, frameStatusFromVisa(status), status,
+                status < VI_SUCCESS ? "エラー: 計測器への書き込みに失敗しました\n" : "");
+        }, priorityOf(header), this);
+        return;
+    }
+
+    // 問い合わせを含む書き込みの応答は後続の READ で読み取るため、まとめ書きせずにそのまま書き込む
+    instrument.submit([this, self, &instrument, header, command = std::move(command)](ViSession instr) {
+        std::string error;
+        ViStatus status = VI_SUCCESS;
+        try {
+            status = writeCommand(instr, command, instrument, error);
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("コマンド処理中に例外発生: " << e.what());
+            finishRequest(&instrument, header, FrameStatus::ServerError, VI_ERROR_SYSTEM_ERROR, std::string("サーバーエラー: ") + e.what() + "\n");
+            return;
+        }
+        finishRequest(&instrument, header, frameStatusFromVisa(status), status, std::move(error));
+    }, priorityOf(header), this);
+}
+
+void FramedSession::submitQuery(Instrument& instrument, const FrameRequestHeader& header, std::string command) {
+    if (header.opcode == FrameOpcode::Query) {
+        instrument.cache().observe(command);
+    }
+
+    auto self = shared_from_this();
+    instrument.submit([this, self, &instrument, header, command = std::move(command)](ViSession instr) {
+        ResponseCache& cache = instrument.cache();
+        const bool cacheable = header.opcode == FrameOpcode::Query && cache.isCacheable(command);
+        std::string captured;
+        bool capturedAll = true;
+        ResponseTiming timing;
+        ResponseTiming* const timed = (header.flags & FRAME_REQUEST_TIMESTAMP) ? &timing : nullptr;
+
+        const ResponseSink sink = [&](BufferPool::Buffer buffer) {
+            if (cacheable && capturedAll) {
+                capturedAll = captured.size() + buffer.size() <= ResponseCache::MAX_RESPONSE_SIZE;
+                if (capturedAll) {
+                    captured.append(buffer.data(), buffer.size());
+                }
+            }
+            return sendFromWorker(instrument, header, std::move(buffer));
+        };
+
+        ViStatus status = VI_SUCCESS;
+        std::string error;
+        try {
+            std::string cached;
+            if (cacheable && cache.lookup(command, cached)) {
+                sendFromWorker(instrument, header, std::move(cached));
+            }
+            else {
+                if (header.opcode == FrameOpcode::Query) {
+                    status = writeCommand(instr, command, instrument, error, timed);
+                }
+                if (status >= VI_SUCCESS) {
+                    status = readResponse(instr, sink, instrument, error, timed);
+                }
+                if (status >= VI_SUCCESS && cacheable && capturedAll) {
+                    cache.store(command, std::move(captured));
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("コマンド処理中に例外発生: " << e.what());
+            finishRequest(&instrument, header, FrameStatus::ServerError, VI_ERROR_SYSTEM_ERROR, std::string("サーバーエラー: ") + e.what() + "\n");
+            return;
+        }
+        if (timed != nullptr) {
+            sendTimestamp(instrument, header, timing);
+        }
+        finishRequest(&instrument, header, frameStatusFromVisa(status), status, std::move(error));
+    }, priorityOf(header), this);
+}
+
+void FramedSession::sendTimestamp(Instrument& instrument, const FrameRequestHeader& header, const ResponseTiming& timing) {
+    FrameTimestamp timestamp;
+    timestamp.sequence = timing.sequence;
+    timestamp.written = monotonicNanoseconds(timing.written);
+    timestamp.firstRead = monotonicNanoseconds(timing.firstRead);
+    timestamp.lastRead = monotonicNanoseconds(timing.lastRead);
+    const auto bytes = encodeFrameTimestamp(timestamp);
+
+    Outgoing message = makeFrame(header, FRAME_MORE | FRAME_TIMESTAMP, FrameStatus::Ok, VI_SUCCESS, bytes.size());
+    message.owned.assign(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    message.metrics = &instrument.metrics();
+    post(std::move(message));
+}
+
+FramedSession::Outgoing FramedSession::makeFrame(const FrameRequestHeader& request, uint8_t flags, FrameStatus status,
+    ViStatus visaStatus, std::size_t length) {
+    FrameResponseHeader header;
+    header.opcode = request.opcode;
+    header.flags = flags;
+    header.status = status;
+    header.requestId = request.requestId;
+    header.visaStatus = visaStatus;
+    header.length = static_cast<uint32_t>(length);
+
+    Outgoing message;
+    message.header = encodeFrameResponseHeader(header);
+    message.queuedAt = std::chrono::steady_clock::now();
+    return message;
+}
+
+void FramedSession::finishRequest(Instrument* instrument, const FrameRequestHeader& header, FrameStatus status,
+    ViStatus visaStatus, std::string message) {
+    Outgoing last = makeFrame(header, 0, status, visaStatus, message.size());
+    last.owned = std::move(message);
+    last.metrics = instrument ? &instrument->metrics() : nullptr;
+
+    auto self = shared_from_this();
+    auto shared = std::make_shared<Outgoing>(std::move(last));
+    boost::asio::post(socket_.get_executor(), [this, self, shared] {
+        enqueueWrite(std::move(*shared));
+        onRequestDone();
+    });
+}
+
+void FramedSession::reject(const FrameRequestHeader& header, FrameStatus status, std::string message) {
+    LOG_WARN("要求を拒否しました (" << peer_ << ", #" << header.requestId << "): " << summarizePayload(message.data(), message.size()));
+    Outgoing last = makeFrame(header, 0, status, VI_SUCCESS, message.size());
+    last.owned = std::move(message);
+    enqueueWrite(std::move(last));
+}
+
+bool FramedSession::sendFromWorker(Instrument& instrument, const FrameRequestHeader& header, BufferPool::Buffer buffer) {
+    Outgoing message = makeFrame(header, FRAME_MORE, FrameStatus::Ok, VI_SUCCESS, buffer.size());
+    message.pooled = std::move(buffer);
+    message.metrics = &instrument.metrics();
+    post(std::move(message));
+    return !failed_.load();
+}
+
+bool FramedSession::sendFromWorker(Instrument& instrument, const FrameRequestHeader& header, std::string data) {
+    Outgoing message = makeFrame(header, FRAME_MORE, FrameStatus::Ok, VI_SUCCESS, data.size());
+    message.owned = std::move(data);
+    message.metrics = &instrument.metrics();
+    post(std::move(message));
+    return !failed_.load();
+}
+
+void FramedSession::post(Outgoing message) {
+    auto self = shared_from_this();
+    auto shared = std::make_shared<Outgoing>(std::move(message));
+    boost::asio::post(socket_.get_executor(), [this, self, shared] { enqueueWrite(std::move(*shared)); });
+}
+
+void FramedSession::enqueueWrite(Outgoing message) {
+    if (closed_) {
+        return; // バッファは message の破棄とともにプールへ戻る
+    }
+
+    outbox_.push_back(std::move(message));
+    writeNext();
+}
+
+void FramedSession::writeNext() {
+    if (writing_ > 0 || outbox_.empty()) {
+        return;
+    }
+
+    // 小さなフレームが続くときに1フレームごとに送信しないよう、溜まっている分をまとめて送る
+    std::vector<boost::asio::const_buffer> buffers;
+    const std::size_t count = outbox_.size() < MAX_GATHER ? outbox_.size() : MAX_GATHER;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Outgoing& message = outbox_[i];
+        buffers.push_back(boost::asio::buffer(message.header));
+        if (message.pooled) {
+            buffers.push_back(boost::asio::buffer(message.pooled.data(), message.pooled.size()));
+        }
+        else if (!message.owned.empty()) {
+            buffers.push_back(boost::asio::buffer(message.owned));
+        }
+    }
+    writing_ = count;
+
+    auto self = shared_from_this();
+    boost::asio::async_write(socket_, buffers,
+        [this, self](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            const auto now = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < writing_; ++i) {
+                if (outbox_.front().metrics) {
+                    outbox_.front().metrics->socketWrite.record(now - outbox_.front().queuedAt);
+                }
+                outbox_.pop_front();
+            }
+            writing_ = 0;
+
+            if (error || closed_) {
+                if (error) {
+                    LOG_ERROR("応答の送信に失敗しました (" << peer_ << "): " << error.message());
+                }
+                close();
+                outbox_.clear();
+                return;
+            }
+
+            writeNext();
+            closeWhenIdle();
+        });
+}
+
+void FramedSession::onRequestDone() {
+    --inFlight_;
+    if (readPaused_) {
+        readPaused_ = false;
+        readHeader();
+    }
+    closeWhenIdle();
+}
+
+void FramedSession::closeWhenIdle() {
+    if (closing_ && inFlight_ == 0 && writing_ == 0 && outbox_.empty()) {
+        close();
+    }
+}
+
+void FramedSession::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    failed_ = true;
+
+    // 送信中のデータがあれば、その完了ハンドラで残りを片付ける
+    if (writing_ == 0) {
+        outbox_.clear();
+    }
+
+    boost::system::error_code ignored;
+    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+    LOG_INFO("クライアントが切断しました: " << peer_);
+}
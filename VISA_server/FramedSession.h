@@ -0,0 +1,107 @@
+﻿#pragma once
+
+#include "FrameProtocol.h"
+#include "Instrument.h"
+#include "InstrumentPool.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief フレームモード (FrameProtocol.h) の1つのTCPクライアント接続を非同期に処理するクラス。
+ *        要求は応答を待たずに読み進めて宛先の計測器のキューへ投入するため、クライアントは複数の要求をパイプライン化できます。
+ *        処理中の要求が MAX_IN_FLIGHT に達すると、いずれかが完了するまでソケットの読み取りを止めます。
+ *
+ *        WRITE はクエリを含まなければテキストモードと同じく計測器側でまとめ書きされます。
+ *        QUERY と READ の応答は計測器のバッファプールのバッファ単位でフレームにして送ります。
+ *        FRAME_REQUEST_TIMESTAMP を立てた要求には、viWrite / viRead が戻った時刻と計測器ごとの応答の通し番号を
+ *        最後のフレームの直前の FRAME_TIMESTAMP のフレームで返します。
+ *        ソケットの操作はすべてソケットのエグゼキュータ (strand) 上で行われます。
+ */
+class FramedSession : public std::enable_shared_from_this<FramedSession> {
+public:
+    FramedSession(boost::asio::ip::tcp::socket socket, InstrumentPool& pool);
+
+    /**
+     * @brief 要求の受信を開始します。
+     */
+    void start();
+
+private:
+    // 同時に処理する要求の上限。これを超える要求はソケットに残し、TCPの背圧でクライアントを待たせる
+    static constexpr std::size_t MAX_IN_FLIGHT = 64;
+
+    // 1回の async_write でまとめて送るフレームの上限
+    static constexpr std::size_t MAX_GATHER = 32;
+
+    /**
+     * @brief 送信待ちのフレーム。ペイロードは pooled が有効ならプールのバッファ、そうでなければ owned です。
+     */
+    struct Outgoing {
+        std::array<uint8_t, FRAME_RESPONSE_HEADER_SIZE> header{};
+        std::string owned;
+        BufferPool::Buffer pooled;
+        InstrumentMetrics* metrics = nullptr;
+        std::chrono::steady_clock::time_point queuedAt;
+    };
+
+    void readHeader();
+    void onHeaderRead(const boost::system::error_code& error);
+    void onPayloadRead(const boost::system::error_code& error, FrameRequestHeader header);
+    void dispatchRequest(const FrameRequestHeader& header, std::string payload);
+    Instrument* resolveInstrument(uint16_t index) const;
+    void submitWrite(Instrument& instrument, const FrameRequestHeader& header, std::string command);
+    void submitQuery(Instrument& instrument, const FrameRequestHeader& header, std::string command);
+
+    /**
+     * @brief 要求の最後のフレーム (結果のステータス) を送り、処理中の要求数を減らします。どのスレッドからでも呼べます。
+     */
+    void finishRequest(Instrument* instrument, const FrameRequestHeader& header, FrameStatus status, ViStatus visaStatus, std::string message);
+
+    /**
+     * @brief 計測器を介さずにエラーで応答します。strand 上で呼び出してください。
+     */
+    void reject(const FrameRequestHeader& header, FrameStatus status, std::string message);
+
+    /**
+     * @brief FRAME_REQUEST_TIMESTAMP の要求に、応答の時刻のフレーム (FRAME_TIMESTAMP) を送ります。ワーカースレッドから呼びます。
+     */
+    void sendTimestamp(Instrument& instrument, const FrameRequestHeader& header, const ResponseTiming& timing);
+
+    bool sendFromWorker(Instrument& instrument, const FrameRequestHeader& header, BufferPool::Buffer buffer);
+    bool sendFromWorker(Instrument& instrument, const FrameRequestHeader& header, std::string data);
+    void post(Outgoing message);
+    void enqueueWrite(Outgoing message);
+    void writeNext();
+    void onRequestDone();
+    void closeWhenIdle();
+    void close();
+
+    static Outgoing makeFrame(const FrameRequestHeader& request, uint8_t flags, FrameStatus status, ViStatus visaStatus, std::size_t length);
+
+    boost::asio::ip::tcp::socket socket_;
+    InstrumentPool& pool_;
+    std::string peer_;
+    std::array<uint8_t, FRAME_REQUEST_HEADER_SIZE> headerBytes_{};
+    std::string payload_;
+    bool closing_ = false;
+    bool closed_ = false;
+    std::chrono::steady_clock::time_point readStartedAt_;
+
+    // 処理中の要求 (strand 上でのみ操作する)
+    std::size_t inFlight_ = 0;
+    bool readPaused_ = false;
+
+    // 送信キュー (strand 上でのみ操作する)
+    std::deque<Outgoing> outbox_;
+    std::size_t writing_ = 0; // 送信中のフレーム数
+    std::atomic<bool> failed_{ false };
+};
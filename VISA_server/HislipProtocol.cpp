@@ -0,0 +1,34 @@
+﻿#include "HislipProtocol.h"
+
+bool decodeHislipHeader(const uint8_t* data, HislipHeader& header) {
+    if (data[0] != 'H' || data[1] != 'S') {
+        return false;
+    }
+    header.type = static_cast<HislipMessageType>(data[2]);
+    header.control = data[3];
+
+    header.parameter = 0;
+    for (size_t i = 4; i < 8; ++i) {
+        header.parameter = (header.parameter << 8) | data[i];
+    }
+    header.length = 0;
+    for (size_t i = 8; i < 16; ++i) {
+        header.length = (header.length << 8) | data[i];
+    }
+    return true;
+}
+
+std::array<uint8_t, HISLIP_HEADER_SIZE> encodeHislipHeader(const HislipHeader& header) {
+    std::array<uint8_t, HISLIP_HEADER_SIZE> data{};
+    data[0] = 'H';
+    data[1] = 'S';
+    data[2] = static_cast<uint8_t>(header.type);
+    data[3] = header.control;
+    for (size_t i = 0; i < 4; ++i) {
+        data[4 + i] = static_cast<uint8_t>(header.parameter >> (8 * (3 - i)));
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        data[8 + i] = static_cast<uint8_t>(header.length >> (8 * (7 - i)));
+    }
+    return data;
+}
@@ -0,0 +1,90 @@
+﻿#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief HiSLIP (IVI-6.1) のメッセージ定義。
+ *        各メッセージは16バイトのヘッダ ("HS", メッセージ種別, 制御コード, u32 パラメータ, u64 ペイロード長; ビッグエンディアン) と
+ *        ペイロードからなります。1つのクライアントは同期チャネルと非同期チャネルの2本のTCP接続を使います。
+ */
+enum class HislipMessageType : uint8_t {
+    Initialize = 0,
+    InitializeResponse = 1,
+    FatalError = 2,
+    Error = 3,
+    AsyncLock = 4,
+    AsyncLockResponse = 5,
+    Data = 6,
+    DataEnd = 7,
+    DeviceClearComplete = 8,
+    DeviceClearAcknowledge = 9,
+    AsyncRemoteLocalControl = 10,
+    AsyncRemoteLocalResponse = 11,
+    Trigger = 12,
+    Interrupted = 13,
+    AsyncInterrupted = 14,
+    AsyncMaximumMessageSize = 15,
+    AsyncMaximumMessageSizeResponse = 16,
+    AsyncInitialize = 17,
+    AsyncInitializeResponse = 18,
+    AsyncDeviceClear = 19,
+    AsyncServiceRequest = 20,
+    AsyncStatusQuery = 21,
+    AsyncStatusResponse = 22,
+    AsyncDeviceClearAcknowledge = 23,
+    AsyncLockInfo = 24,
+    AsyncLockInfoResponse = 25,
+};
+
+/**
+ * @brief FatalError の制御コード。送信後に接続を閉じます。
+ */
+enum class HislipFatalError : uint8_t {
+    Unidentified = 0,
+    PoorlyFormedHeader = 1,
+    ChannelsNotEstablished = 2,
+    InvalidInitialization = 3,
+    MaximumClientsExceeded = 4,
+};
+
+/**
+ * @brief Error (致命的でないエラー) の制御コード。
+ */
+enum class HislipError : uint8_t {
+    Unidentified = 0,
+    UnrecognizedMessageType = 1,
+    UnrecognizedControlCode = 2,
+    UnrecognizedVendorMessage = 3,
+    MessageTooLarge = 4,
+};
+
+constexpr unsigned short HISLIP_DEFAULT_PORT = 4880;
+constexpr std::size_t HISLIP_HEADER_SIZE = 16;
+constexpr uint16_t HISLIP_PROTOCOL_VERSION = 0x0100; // 1.0
+constexpr uint16_t HISLIP_VENDOR_ID = 0x5653;        // "VS"
+
+// InitializeResponse / DeviceClearAcknowledge の制御コード: overlapped モード
+constexpr uint8_t HISLIP_OVERLAPPED = 0x01;
+
+// 受け付けるプログラムメッセージ (Data ... DataEnd の合計) の上限。AsyncMaximumMessageSize で通知する
+constexpr uint64_t HISLIP_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+// Initialize のペイロード (サブアドレス) の上限
+constexpr uint64_t HISLIP_MAX_SUBADDRESS_SIZE = 256;
+
+struct HislipHeader {
+    HislipMessageType type = HislipMessageType::Data;
+    uint8_t control = 0;
+    uint32_t parameter = 0;
+    uint64_t length = 0;
+};
+
+/**
+ * @brief ヘッダを解析します。
+ * @return 先頭が "HS" でなければ false。
+ */
+bool decodeHislipHeader(const uint8_t* data, HislipHeader& header);
+
+std::array<uint8_t, HISLIP_HEADER_SIZE> encodeHislipHeader(const HislipHeader& header);
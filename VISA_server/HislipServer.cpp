@@ -0,0 +1,156 @@
+﻿#include "HislipServer.h"
+
+#include "Logger.h"
+#include "StringUtil.h"
+
+#include <algorithm>
+#include <cctype>
+#include <utility>
+
+HislipServer::HislipServer(boost::asio::io_context& io, unsigned short port, InstrumentPool& pool)
+    : io_(io),
+      acceptor_(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+      pool_(pool) {
+    accept();
+}
+
+void HislipServer::accept() {
+    acceptor_.async_accept(boost::asio::make_strand(io_),
+        [this](const boost::system::error_code& error, boost::asio::ip::tcp::socket socket) {
+            if (error) {
+                if (error == boost::asio::error::operation_aborted) {
+                    return; // サーバー停止
+                }
+                LOG_ERROR("HiSLIP 接続の受け付けに失敗しました: " << error.message());
+            }
+            else {
+                boost::system::error_code ignored;
+                socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+                readInitialization(std::make_shared<PendingConnection>(std::move(socket)));
+            }
+            accept();
+        });
+}
+
+void HislipServer::readInitialization(std::shared_ptr<PendingConnection> connection) {
+    boost::asio::async_read(connection->socket, boost::asio::buffer(connection->headerBytes),
+        [this, connection](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            if (error) {
+                return; // 初期化前に切断された
+            }
+            if (!decodeHislipHeader(connection->headerBytes.data(), connection->header)) {
+                reject(connection, HislipFatalError::PoorlyFormedHeader, "メッセージヘッダが不正です");
+                return;
+            }
+            if (connection->header.length > HISLIP_MAX_SUBADDRESS_SIZE) {
+                reject(connection, HislipFatalError::InvalidInitialization, "初期化メッセージが大きすぎます");
+                return;
+            }
+
+            connection->payload.resize(static_cast<size_t>(connection->header.length));
+            if (connection->payload.empty()) {
+                onInitialization(connection);
+                return;
+            }
+            boost::asio::async_read(connection->socket, boost::asio::buffer(&connection->payload[0], connection->payload.size()),
+                [this, connection](const boost::system::error_code& error, std::size_t /*bytes*/) {
+                    if (!error) {
+                        onInitialization(connection);
+                    }
+                });
+        });
+}
+
+void HislipServer::onInitialization(std::shared_ptr<PendingConnection> connection) {
+    const HislipHeader& header = connection->header;
+
+    if (header.type == HislipMessageType::Initialize) {
+        Instrument* instrument = resolveSubAddress(connection->payload);
+        if (instrument == nullptr) {
+            reject(connection, HislipFatalError::InvalidInitialization, "計測器が見つかりません: " + connection->payload);
+            return;
+        }
+
+        std::shared_ptr<HislipSession> session;
+        if (registerSession(connection, *instrument, session) == 0) {
+            reject(connection, HislipFatalError::MaximumClientsExceeded, "セッションIDに空きがありません");
+            return;
+        }
+        session->start();
+        return;
+    }
+
+    if (header.type == HislipMessageType::AsyncInitialize) {
+        const uint16_t sessionId = static_cast<uint16_t>(header.parameter & 0xFFFF);
+        std::shared_ptr<HislipSession> session;
+        {
+            std::lock_guard<std::mutex> lock(sessionsMutex_);
+            auto it = sessions_.find(sessionId);
+            if (it != sessions_.end()) {
+                session = it->second.lock();
+            }
+        }
+        if (!session) {
+            reject(connection, HislipFatalError::InvalidInitialization, "セッションが見つかりません: " + std::to_string(sessionId));
+            return;
+        }
+        session->attachAsyncChannel(std::move(connection->socket));
+        return;
+    }
+
+    reject(connection, HislipFatalError::InvalidInitialization, "最初のメッセージが Initialize / AsyncInitialize ではありません");
+}
+
+uint16_t HislipServer::registerSession(std::shared_ptr<PendingConnection> connection, Instrument& instrument,
+    std::shared_ptr<HislipSession>& session) {
+    std::lock_guard<std::mutex> lock(sessionsMutex_);
+    for (auto it = sessions_.begin(); it != sessions_.end();) {
+        it = it->second.expired() ? sessions_.erase(it) : std::next(it);
+    }
+
+    // 0 は使わず、使用中のIDを避けて順に割り当てる
+    for (size_t attempt = 0; attempt < 0xFFFF; ++attempt) {
+        const uint16_t id = nextSessionId_;
+        nextSessionId_ = static_cast<uint16_t>(nextSessionId_ == 0xFFFF ? 1 : nextSessionId_ + 1);
+        if (sessions_.count(id) == 0) {
+            session = std::make_shared<HislipSession>(std::move(connection->socket), instrument, id);
+            sessions_[id] = session;
+            return id;
+        }
+    }
+    return 0;
+}
+
+void HislipServer::reject(std::shared_ptr<PendingConnection> connection, HislipFatalError code, const std::string& message) {
+    LOG_WARN("HiSLIP 接続を拒否しました: " << message);
+
+    HislipHeader header;
+    header.type = HislipMessageType::FatalError;
+    header.control = static_cast<uint8_t>(code);
+    header.length = message.size();
+
+    auto data = std::make_shared<std::string>();
+    const auto bytes = encodeHislipHeader(header);
+    data->assign(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    *data += message;
+    boost::asio::async_write(connection->socket, boost::asio::buffer(*data),
+        [connection, data](const boost::system::error_code& /*error*/, std::size_t /*bytes*/) {
+            boost::system::error_code ignored;
+            connection->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            connection->socket.close(ignored);
+        });
+}
+
+Instrument* HislipServer::resolveSubAddress(const std::string& subAddress) const {
+    const std::string lower = toLower(trim(subAddress));
+    if (lower.empty() || lower == "hislip0") {
+        return pool_.defaultInstrument();
+    }
+
+    const std::string prefix = "hislip";
+    if (lower.size() > prefix.size() && lower.compare(0, prefix.size(), prefix) == 0
+        && std::all_of(lower.begin() + prefix.size(), lower.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        return pool_.find(lower.substr(prefix.size()));
+    }
+    return pool_.find(lower);
+}
@@ -0,0 +1,62 @@
+﻿#pragma once
+
+#include "HislipProtocol.h"
+#include "HislipSession.h"
+#include "InstrumentPool.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief HiSLIP (IVI-6.1) の接続を受け付けるクラス。標準の VISA から "TCPIP0::<IP>::hislip0::INSTR" で接続できます。
+ *        接続の最初のメッセージが Initialize なら同期チャネルとしてセッションを作り、
+ *        AsyncInitialize ならセッションIDで既存のセッションを探して非同期チャネルとして結び付けます。
+ *
+ *        Initialize のサブアドレスで宛先の計測器を選びます。"hislip0" は既定の計測器、"hislip<N>" は
+ *        ":SERVER:LIST?" の N 番、それ以外は計測器名 (大文字小文字を区別しない) です。
+ */
+class HislipServer {
+public:
+    HislipServer(boost::asio::io_context& io, unsigned short port, InstrumentPool& pool);
+
+private:
+    /**
+     * @brief 最初のメッセージを受信するまでの接続。
+     */
+    struct PendingConnection {
+        explicit PendingConnection(boost::asio::ip::tcp::socket socket) : socket(std::move(socket)) {}
+
+        boost::asio::ip::tcp::socket socket;
+        std::array<uint8_t, HISLIP_HEADER_SIZE> headerBytes{};
+        HislipHeader header;
+        std::string payload;
+    };
+
+    void accept();
+    void readInitialization(std::shared_ptr<PendingConnection> connection);
+    void onInitialization(std::shared_ptr<PendingConnection> connection);
+    void reject(std::shared_ptr<PendingConnection> connection, HislipFatalError code, const std::string& message);
+    Instrument* resolveSubAddress(const std::string& subAddress) const;
+
+    /**
+     * @brief 使われていないセッションIDを割り当ててセッションを登録します。
+     * @return 割り当てたセッションID。空きがなければ 0。
+     */
+    uint16_t registerSession(std::shared_ptr<PendingConnection> connection, Instrument& instrument,
+        std::shared_ptr<HislipSession>& session);
+
+    boost::asio::io_context& io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    InstrumentPool& pool_;
+
+    // 非同期チャネルの結び付けに使うセッションの一覧。切断されたセッションは次の登録時に取り除く
+    std::mutex sessionsMutex_;
+    std::map<uint16_t, std::weak_ptr<HislipSession>> sessions_;
+    uint16_t nextSessionId_ = 1;
+};
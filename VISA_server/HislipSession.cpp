@@ -0,0 +1,589 @@
+﻿#include "HislipSession.h"
+
+#include "Logger.h"
+#include "ScpiParser.h"
+
+#include <utility>
+
+namespace {
+
+// 1回の async_write でまとめて送るメッセージの上限
+constexpr std::size_t MAX_GATHER = 32;
+
+bool isDataMessage(HislipMessageType type) {
+    return type == HislipMessageType::Data || type == HislipMessageType::DataEnd;
+}
+
+uint64_t readU64(const std::string& data) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(data[i]);
+    }
+    return value;
+}
+
+std::string encodeU64(uint64_t value) {
+    std::string data(8, '\0');
+    for (size_t i = 0; i < 8; ++i) {
+        data[i] = static_cast<char>(value >> (8 * (7 - i)));
+    }
+    return data;
+}
+
+} // namespace
+
+HislipSession::HislipSession(boost::asio::ip::tcp::socket socket, Instrument& instrument, uint16_t sessionId)
+    : sync_(std::move(socket)),
+      async_(boost::asio::ip::tcp::socket(sync_.socket.get_executor())),
+      instrument_(instrument),
+      sessionId_(sessionId),
+      executor_(sync_.socket.get_executor()) {
+    boost::system::error_code ec;
+    auto endpoint = sync_.socket.remote_endpoint(ec);
+    peer_ = ec ? "不明" : endpoint.address().to_string();
+}
+
+HislipSession::~HislipSession() {
+    // 切断されないまま破棄される場合 (サーバー停止時) も、SRQ のリスナーが残らないようにする
+    instrument_.removeServiceRequestListener(srqListener_);
+}
+
+void HislipSession::start() {
+    LOG_INFO("HiSLIP クライアントが接続しました: " << peer_ << " (セッション " << sessionId_ << ", " << instrument_.name() << ")");
+    sync_.open = true;
+
+    // SRQ は VISA のコールバックスレッドから届くため、strand へ渡してから非同期チャネルへ送る
+    std::weak_ptr<HislipSession> weak = shared_from_this();
+    auto executor = executor_;
+    srqListener_ = instrument_.addServiceRequestListener([weak, executor](ViUInt16 statusByte) {
+        boost::asio::post(executor, [weak, statusByte] {
+            if (auto self = weak.lock()) {
+                self->onServiceRequest(statusByte);
+            }
+        });
+    });
+
+    send(sync_, HislipMessageType::InitializeResponse, HISLIP_OVERLAPPED,
+        (static_cast<uint32_t>(HISLIP_PROTOCOL_VERSION) << 16) | sessionId_);
+    readMessage(sync_);
+}
+
+void HislipSession::attachAsyncChannel(boost::asio::ip::tcp::socket socket) {
+    auto self = shared_from_this();
+    auto shared = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
+    boost::asio::post(executor_, [this, self, shared] {
+        if (closed_ || async_.open) {
+            boost::system::error_code ignored;
+            shared->close(ignored);
+            return;
+        }
+        async_.socket = std::move(*shared);
+        async_.open = true;
+        send(async_, HislipMessageType::AsyncInitializeResponse, 0, HISLIP_VENDOR_ID);
+        readMessage(async_);
+    });
+}
+
+void HislipSession::readMessage(Channel& channel) {
+    if (closing_ || closed_) {
+        return;
+    }
+    if (&channel == &sync_ && inFlight_ >= MAX_IN_FLIGHT) {
+        readPaused_ = true; // 要求が完了したら onRequestDone で再開する
+        return;
+    }
+
+    auto self = shared_from_this();
+    boost::asio::async_read(channel.socket, boost::asio::buffer(channel.headerBytes),
+        boost::asio::bind_executor(executor_, [this, self, &channel](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            onHeaderRead(channel, error);
+        }));
+}
+
+void HislipSession::onHeaderRead(Channel& channel, const boost::system::error_code& error) {
+    if (error) {
+        if (error == boost::asio::error::eof && &channel == &sync_) {
+            // 処理中のメッセージの応答を送り終えてから閉じる
+            closing_ = true;
+            closeWhenIdle();
+            return;
+        }
+        if (error != boost::asio::error::operation_aborted && error != boost::asio::error::eof) {
+            LOG_ERROR("HiSLIP メッセージの受信中にエラーが発生しました (" << peer_ << "): " << error.message());
+        }
+        close();
+        return;
+    }
+
+    HislipHeader header;
+    if (!decodeHislipHeader(channel.headerBytes.data(), header)) {
+        sendFatalError(channel, HislipFatalError::PoorlyFormedHeader, "メッセージヘッダが不正です");
+        return;
+    }
+    if (header.length > HISLIP_MAX_MESSAGE_SIZE) {
+        // ペイロードを読み飛ばすと次のヘッダの境界を信用できないため、接続ごと閉じる
+        sendFatalError(channel, HislipFatalError::Unidentified, "メッセージが大きすぎます");
+        return;
+    }
+
+    channel.payload.resize(static_cast<size_t>(header.length));
+    if (header.length == 0) {
+        onMessageRead(channel, {}, header);
+        return;
+    }
+
+    auto self = shared_from_this();
+    boost::asio::async_read(channel.socket, boost::asio::buffer(&channel.payload[0], channel.payload.size()),
+        boost::asio::bind_executor(executor_, [this, self, &channel, header](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            onMessageRead(channel, error, header);
+        }));
+}
+
+void HislipSession::onMessageRead(Channel& channel, const boost::system::error_code& error, HislipHeader header) {
+    if (error) {
+        if (error != boost::asio::error::operation_aborted && error != boost::asio::error::eof) {
+            LOG_ERROR("HiSLIP メッセージの受信中にエラーが発生しました (" << peer_ << "): " << error.message());
+        }
+        close();
+        return;
+    }
+
+    std::string payload;
+    payload.swap(channel.payload);
+    if (&channel == &sync_) {
+        handleSyncMessage(header, std::move(payload));
+    }
+    else {
+        handleAsyncMessage(header, std::move(payload));
+    }
+    readMessage(channel);
+}
+
+void HislipSession::handleSyncMessage(const HislipHeader& header, std::string payload) {
+    if (!async_.open) {
+        sendFatalError(sync_, HislipFatalError::ChannelsNotEstablished, "非同期チャネルが確立されていません");
+        return;
+    }
+
+    switch (header.type) {
+    case HislipMessageType::Data:
+    case HislipMessageType::DataEnd:
+        if (!discardingMessage_ && pendingMessage_.size() + payload.size() > HISLIP_MAX_MESSAGE_SIZE) {
+            send(sync_, HislipMessageType::Error, static_cast<uint8_t>(HislipError::MessageTooLarge), 0, "メッセージが大きすぎます");
+            pendingMessage_.clear();
+            discardingMessage_ = true;
+        }
+        if (!discardingMessage_) {
+            pendingMessage_ += payload;
+        }
+        if (header.type == HislipMessageType::DataEnd) {
+            std::string message;
+            message.swap(pendingMessage_);
+            if (!discardingMessage_) {
+                dispatchMessage(std::move(message), header.parameter);
+            }
+            discardingMessage_ = false;
+        }
+        return;
+
+    case HislipMessageType::DeviceClearComplete:
+        // デバイスクリアの後半。クリア済みであることを返し、以後のメッセージを受け付ける
+        send(sync_, HislipMessageType::DeviceClearAcknowledge, HISLIP_OVERLAPPED, 0);
+        return;
+
+    case HislipMessageType::Trigger: {
+        ++inFlight_;
+        auto self = shared_from_this();
+        const unsigned generation = generation_.load();
+        instrument_.submit([this, self, generation](ViSession instr) {
+            if (generation == generation_.load()) {
+                const ViStatus status = viAssertTrigger(instr, VI_TRIG_PROT_DEFAULT);
+                instrument_.reportStatus(status);
+                if (status < VI_SUCCESS) {
+                    LOG_ERROR("viAssertTrigger に失敗しました (Status: " << status << ")");
+                }
+            }
+            boost::asio::post(executor_, [this, self] { onRequestDone(); });
+        }, JobPriority::Normal, this);
+        return;
+    }
+
+    default:
+        send(sync_, HislipMessageType::Error, static_cast<uint8_t>(HislipError::UnrecognizedMessageType), 0,
+            "同期チャネルでは扱えないメッセージです");
+        return;
+    }
+}
+
+void HislipSession::handleAsyncMessage(const HislipHeader& header, std::string payload) {
+    switch (header.type) {
+    case HislipMessageType::AsyncMaximumMessageSize:
+        if (payload.size() == 8) {
+            clientMaxMessageSize_ = readU64(payload);
+        }
+        send(async_, HislipMessageType::AsyncMaximumMessageSizeResponse, 0, 0, encodeU64(HISLIP_MAX_MESSAGE_SIZE));
+        return;
+
+    case HislipMessageType::AsyncDeviceClear:
+        deviceClear();
+        return;
+
+    case HislipMessageType::AsyncStatusQuery:
+        queryStatus();
+        return;
+
+    case HislipMessageType::AsyncLock:
+        // 制御コード 1 はロック要求 (パラメータはタイムアウトms、ペイロードは共有ロックの名前。空なら排他ロック)、0 は解放
+        if (header.control == 1) {
+            requestLock(header.parameter, std::move(payload));
+        }
+        else {
+            releaseLock();
+        }
+        return;
+
+    case HislipMessageType::AsyncLockInfo: {
+        // 制御コードは排他ロックが取られていれば 1、パラメータはロックを保持しているクライアント数
+        const Instrument::LockInfo info = instrument_.lockInfo();
+        send(async_, HislipMessageType::AsyncLockInfoResponse, info.locked && info.mode == LockMode::Exclusive ? 1 : 0,
+            static_cast<uint32_t>(info.holders));
+        return;
+    }
+
+    case HislipMessageType::AsyncRemoteLocalControl:
+        send(async_, HislipMessageType::AsyncRemoteLocalResponse, 0, 0);
+        return;
+
+    default:
+        send(async_, HislipMessageType::Error, static_cast<uint8_t>(HislipError::UnrecognizedMessageType), 0,
+            "非同期チャネルでは扱えないメッセージです");
+        return;
+    }
+}
+
+void HislipSession::dispatchMessage(std::string message, uint32_t messageId) {
+    message.erase(message.find_last_not_of("\r\n") + 1);
+    if (message.empty()) {
+        return;
+    }
+
+    LOG_INFO("受信 (HiSLIP " << sessionId_ << "): " << message);
+    instrument_.metrics().addCommand();
+    instrument_.cache().observe(message);
+
+    ++inFlight_;
+    if (containsQuery(message)) {
+        submitQuery(std::move(message), messageId);
+        return;
+    }
+
+    // 応答のない設定コマンドは他のセッションと同じキューでまとめ書きされる。HiSLIP には書き込みの応答はない
+    auto self = shared_from_this();
+    instrument_.submitWrite(std::move(message), [this, self](ViStatus /*status*/) {
+        boost::asio::post(executor_, [this, self] { onRequestDone(); });
+    }, JobPriority::Normal, this);
+}
+
+void HislipSession::submitQuery(std::string command, uint32_t messageId) {
+    auto self = shared_from_this();
+    const unsigned generation = generation_.load();
+
+    instrument_.submit([this, self, command = std::move(command), messageId, generation](ViSession instr) {
+        if (generation != generation_.load()) {
+            // デバイスクリアで破棄されたメッセージ
+            boost::asio::post(executor_, [this, self] { onRequestDone(); });
+            return;
+        }
+
+        ResponseCache& cache = instrument_.cache();
+        const bool cacheable = cache.isCacheable(command);
+        std::string captured;
+        bool capturedAll = true;
+
+        // 最後のバッファを DataEnd で送るため、読み取ったバッファは1つ手前まで Data で送る
+        BufferPool::Buffer held;
+        const ResponseSink sink = [&](BufferPool::Buffer buffer) {
+            if (cacheable && capturedAll) {
+                capturedAll = captured.size() + buffer.size() <= ResponseCache::MAX_RESPONSE_SIZE;
+                if (capturedAll) {
+                    captured.append(buffer.data(), buffer.size());
+                }
+            }
+            const bool delivered = !held || sendFromWorker(messageId, HislipMessageType::Data, std::move(held), generation);
+            held = std::move(buffer);
+            return delivered && !failed_.load();
+        };
+
+        ViStatus status = VI_SUCCESS;
+        bool answered = false;
+        try {
+            std::string cached;
+            std::string error;
+            if (cacheable && cache.lookup(command, cached)) {
+                sendFromWorker(messageId, HislipMessageType::DataEnd, std::move(cached), generation);
+                answered = true;
+            }
+            else {
+                status = writeCommand(instr, command, instrument_, error);
+                if (status >= VI_SUCCESS) {
+                    status = readResponse(instr, sink, instrument_, error);
+                }
+                if (status >= VI_SUCCESS && cacheable && capturedAll) {
+                    cache.store(command, std::move(captured));
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("コマンド処理中に例外発生: " << e.what());
+            status = VI_ERROR_SYSTEM_ERROR;
+        }
+
+        // 応答を1バイトも読めなかった場合は何も送らず、応答しない計測器と同じくクライアントの読み取りをタイムアウトさせる
+        if (held) {
+            sendFromWorker(messageId, HislipMessageType::DataEnd, std::move(held), generation);
+        }
+        else if (!answered && status >= VI_SUCCESS) {
+            sendFromWorker(messageId, HislipMessageType::DataEnd, std::string(), generation);
+        }
+        boost::asio::post(executor_, [this, self] { onRequestDone(); });
+    }, JobPriority::Normal, this);
+}
+
+void HislipSession::deviceClear() {
+    LOG_INFO("HiSLIP デバイスクリア (" << peer_ << ", セッション " << sessionId_ << ")");
+
+    // 受信途中のメッセージ、キュー上のメッセージ、未送信の応答をすべて破棄する
+    ++generation_;
+    pendingMessage_.clear();
+    discardingMessage_ = false;
+    sync_.outbox.erase(sync_.outbox.begin() + static_cast<std::ptrdiff_t>(sync_.writing), sync_.outbox.end());
+
+    // 破棄したメッセージの後ろに並ばないよう、優先度の高いクラスで投入する
+    auto self = shared_from_this();
+    instrument_.submit([this, self](ViSession instr) {
+        const ViStatus status = viClear(instr);
+        instrument_.reportStatus(status);
+        if (status < VI_SUCCESS) {
+            LOG_ERROR("viClear に失敗しました (Status: " << status << ")");
+        }
+        boost::asio::post(executor_, [this, self] {
+            send(async_, HislipMessageType::AsyncDeviceClearAcknowledge, HISLIP_OVERLAPPED, 0);
+        });
+    }, JobPriority::High, this);
+}
+
+void HislipSession::queryStatus() {
+    // ステータスバイトは計測器のキュー上で読む。優先度の高いクラスで投入するため、待っているクエリより先に、実行中のジョブの完了後に返る
+    auto self = shared_from_this();
+    instrument_.submit([this, self](ViSession instr) {
+        ViUInt16 statusByte = 0;
+        const ViStatus status = viReadSTB(instr, &statusByte);
+        instrument_.reportStatus(status);
+        if (status < VI_SUCCESS) {
+            LOG_ERROR("viReadSTB に失敗しました (Status: " << status << ")");
+        }
+        boost::asio::post(executor_, [this, self, statusByte] {
+            send(async_, HislipMessageType::AsyncStatusResponse, static_cast<uint8_t>(statusByte), 0);
+        });
+    }, JobPriority::High, this);
+}
+
+void HislipSession::requestLock(uint32_t timeoutMs, std::string lockString) {
+    // 応答の制御コードは 1 = 成功、0 = 失敗 (タイムアウトを含む)
+    lockRequested_ = true;
+    const LockMode mode = lockString.empty() ? LockMode::Exclusive : LockMode::Shared;
+    auto self = shared_from_this();
+    instrument_.lock(this, mode, std::move(lockString), std::chrono::milliseconds(timeoutMs), [this, self](ViStatus status, LockMode) {
+        const uint8_t control = status >= VI_SUCCESS ? 1 : 0;
+        boost::asio::post(executor_, [this, self, control] {
+            send(async_, HislipMessageType::AsyncLockResponse, control, 0);
+        });
+    });
+}
+
+void HislipSession::releaseLock() {
+    // 先に受けたメッセージの処理を終えてから解放する。応答の制御コードは 1 = 排他ロックを解放、2 = 共有ロックを解放、3 = ロックしていない
+    auto self = shared_from_this();
+    instrument_.unlock(this, [this, self](ViStatus status, LockMode mode) {
+        const uint8_t control = status < VI_SUCCESS ? 3 : mode == LockMode::Exclusive ? 1 : 2;
+        boost::asio::post(executor_, [this, self, control] {
+            send(async_, HislipMessageType::AsyncLockResponse, control, 0);
+        });
+    });
+}
+
+void HislipSession::onServiceRequest(ViUInt16 statusByte) {
+    send(async_, HislipMessageType::AsyncServiceRequest, static_cast<uint8_t>(statusByte), 0);
+}
+
+void HislipSession::onRequestDone() {
+    --inFlight_;
+    if (readPaused_) {
+        readPaused_ = false;
+        readMessage(sync_);
+    }
+    closeWhenIdle();
+}
+
+void HislipSession::send(Channel& channel, HislipMessageType type, uint8_t control, uint32_t parameter, std::string payload) {
+    Outgoing message;
+    message.header.type = type;
+    message.header.control = control;
+    message.header.parameter = parameter;
+    message.header.length = payload.size();
+    message.owned = std::move(payload);
+    enqueueWrite(channel, std::move(message));
+}
+
+void HislipSession::sendFatalError(Channel& channel, HislipFatalError code, const std::string& message) {
+    LOG_ERROR("HiSLIP の致命的なエラー (" << peer_ << "): " << message);
+    send(channel, HislipMessageType::FatalError, static_cast<uint8_t>(code), 0, message);
+    closing_ = true; // 送信し終えたら閉じる
+    closeWhenIdle();
+}
+
+bool HislipSession::sendFromWorker(uint32_t messageId, HislipMessageType type, BufferPool::Buffer buffer, unsigned generation) {
+    Outgoing message;
+    message.header.type = type;
+    message.header.parameter = messageId;
+    message.header.length = buffer.size();
+    message.pooled = std::move(buffer);
+    postFromWorker(std::move(message), generation);
+    return !failed_.load() && generation == generation_.load();
+}
+
+bool HislipSession::sendFromWorker(uint32_t messageId, HislipMessageType type, std::string data, unsigned generation) {
+    Outgoing message;
+    message.header.type = type;
+    message.header.parameter = messageId;
+    message.header.length = data.size();
+    message.owned = std::move(data);
+    postFromWorker(std::move(message), generation);
+    return !failed_.load() && generation == generation_.load();
+}
+
+void HislipSession::postFromWorker(Outgoing message, unsigned generation) {
+    message.metrics = &instrument_.metrics();
+    message.queuedAt = std::chrono::steady_clock::now();
+
+    auto self = shared_from_this();
+    auto shared = std::make_shared<Outgoing>(std::move(message));
+    boost::asio::post(executor_, [this, self, shared, generation] {
+        if (generation == generation_.load()) {
+            enqueueWrite(sync_, std::move(*shared));
+        }
+    });
+}
+
+void HislipSession::enqueueWrite(Channel& channel, Outgoing message) {
+    if (closed_ || !channel.open) {
+        return; // バッファは message の破棄とともにプールへ戻る
+    }
+
+    channel.outbox.push_back(std::move(message));
+    writeNext(channel);
+}
+
+std::size_t HislipSession::maxPayloadSize() const {
+    const uint64_t limit = clientMaxMessageSize_ > 0 ? clientMaxMessageSize_ : 1;
+    return limit < SIZE_MAX ? static_cast<std::size_t>(limit) : SIZE_MAX;
+}
+
+void HislipSession::writeNext(Channel& channel) {
+    if (channel.writing > 0 || channel.outbox.empty()) {
+        return;
+    }
+
+    // Data / DataEnd はクライアントの最大メッセージ長で分割する (最後の断片だけが元の種別)。
+    // ヘッダの配列は送信完了まで参照されるため、先に必要な数を数えてから確保する
+    const std::size_t count = channel.outbox.size() < MAX_GATHER ? channel.outbox.size() : MAX_GATHER;
+    const std::size_t limit = maxPayloadSize();
+    std::size_t pieces = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Outgoing& message = channel.outbox[i];
+        const std::size_t size = static_cast<std::size_t>(message.header.length);
+        pieces += isDataMessage(message.header.type) && size > limit ? (size + limit - 1) / limit : 1;
+    }
+    channel.headers.clear();
+    channel.headers.reserve(pieces);
+
+    std::vector<boost::asio::const_buffer> buffers;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Outgoing& message = channel.outbox[i];
+        const char* data = message.pooled ? message.pooled.data() : message.owned.data();
+        const std::size_t size = static_cast<std::size_t>(message.header.length);
+        const std::size_t chunk = isDataMessage(message.header.type) ? limit : (size > 0 ? size : 1);
+
+        std::size_t offset = 0;
+        do {
+            const std::size_t length = size - offset < chunk ? size - offset : chunk;
+            HislipHeader header = message.header;
+            header.length = length;
+            if (offset + length < size) {
+                header.type = HislipMessageType::Data;
+            }
+            channel.headers.push_back(encodeHislipHeader(header));
+            buffers.push_back(boost::asio::buffer(channel.headers.back()));
+            if (length > 0) {
+                buffers.push_back(boost::asio::buffer(data + offset, length));
+            }
+            offset += length;
+        } while (offset < size);
+    }
+    channel.writing = count;
+
+    auto self = shared_from_this();
+    boost::asio::async_write(channel.socket, buffers,
+        boost::asio::bind_executor(executor_, [this, self, &channel](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            const auto now = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < channel.writing; ++i) {
+                if (channel.outbox.front().metrics) {
+                    channel.outbox.front().metrics->socketWrite.record(now - channel.outbox.front().queuedAt);
+                }
+                channel.outbox.pop_front();
+            }
+            channel.writing = 0;
+
+            if (error || closed_) {
+                if (error) {
+                    LOG_ERROR("HiSLIP メッセージの送信に失敗しました (" << peer_ << "): " << error.message());
+                }
+                close();
+                channel.outbox.clear();
+                return;
+            }
+
+            writeNext(channel);
+            closeWhenIdle();
+        }));
+}
+
+void HislipSession::closeWhenIdle() {
+    if (closing_ && inFlight_ == 0
+        && sync_.writing == 0 && sync_.outbox.empty() && async_.writing == 0 && async_.outbox.empty()) {
+        close();
+    }
+}
+
+void HislipSession::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    failed_ = true;
+    instrument_.removeServiceRequestListener(srqListener_);
+    if (lockRequested_) {
+        instrument_.releaseLocks(this);
+    }
+
+    // 送信中のデータがあれば、その完了ハンドラで残りを片付ける
+    for (Channel* channel : { &sync_, &async_ }) {
+        if (channel->writing == 0) {
+            channel->outbox.clear();
+        }
+        boost::system::error_code ignored;
+        channel->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+        channel->socket.close(ignored);
+    }
+    LOG_INFO("HiSLIP クライアントが切断しました: " << peer_ << " (セッション " << sessionId_ << ")");
+}
@@ -0,0 +1,135 @@
+﻿#pragma once
+
+#include "HislipProtocol.h"
+#include "Instrument.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief 1つの HiSLIP クライアント (同期チャネルと非同期チャネルの組) を処理するクラス。
+ *        overlapped モードで動作し、クライアントは応答を待たずに複数のメッセージを送れます。
+ *        応答は元のメッセージの MessageID を付けて送信順に返します。
+ *
+ *        同期チャネル: Data / DataEnd で受けたプログラムメッセージを計測器のキューへ投入し、
+ *        クエリを含むものは応答を計測器のバッファ単位の Data メッセージで送り、最後を DataEnd にします。
+ *        非同期チャネル: デバイスクリア、ステータスバイトの問い合わせ、最大メッセージ長の交換を処理し、
+ *        計測器の SRQ を AsyncServiceRequest で転送します。
+ *        ロック (AsyncLock) は計測器のロック (Instrument::lock) で実装し、テキストモードの ":SERVER:LOCK" と同じロックを共有します。
+ *
+ *        両チャネルのソケットの操作は、同期チャネルのソケットのエグゼキュータ (strand) 上で行います。
+ */
+class HislipSession : public std::enable_shared_from_this<HislipSession> {
+public:
+    /**
+     * @param socket Initialize を受信済みの同期チャネル。
+     * @param instrument このセッションの宛先の計測器。
+     * @param sessionId InitializeResponse で通知するセッションID。
+     */
+    HislipSession(boost::asio::ip::tcp::socket socket, Instrument& instrument, uint16_t sessionId);
+    ~HislipSession();
+
+    /**
+     * @brief InitializeResponse を送り、同期チャネルの受信を開始します。
+     */
+    void start();
+
+    /**
+     * @brief AsyncInitialize を受信した接続を非同期チャネルとして結び付けます。どのスレッドからでも呼べます。
+     */
+    void attachAsyncChannel(boost::asio::ip::tcp::socket socket);
+
+    uint16_t sessionId() const { return sessionId_; }
+
+private:
+    // 同時に処理するプログラムメッセージの上限。これを超えると同期チャネルの読み取りを止める
+    static constexpr std::size_t MAX_IN_FLIGHT = 64;
+
+    /**
+     * @brief 送信待ちのメッセージ。ペイロードは pooled が有効ならプールのバッファ、そうでなければ owned です。
+     */
+    struct Outgoing {
+        HislipHeader header;
+        std::string owned;
+        BufferPool::Buffer pooled;
+        InstrumentMetrics* metrics = nullptr;
+        std::chrono::steady_clock::time_point queuedAt;
+    };
+
+    /**
+     * @brief 1本のチャネルの受信バッファと送信キュー。
+     */
+    struct Channel {
+        explicit Channel(boost::asio::ip::tcp::socket socket) : socket(std::move(socket)) {}
+
+        boost::asio::ip::tcp::socket socket;
+        bool open = false;
+        std::array<uint8_t, HISLIP_HEADER_SIZE> headerBytes{};
+        std::string payload;
+        std::deque<Outgoing> outbox;
+        std::vector<std::array<uint8_t, HISLIP_HEADER_SIZE>> headers; // 送信中のメッセージのヘッダ
+        std::size_t writing = 0;                                        // 送信中のメッセージ数
+    };
+
+    void readMessage(Channel& channel);
+    void onHeaderRead(Channel& channel, const boost::system::error_code& error);
+    void onMessageRead(Channel& channel, const boost::system::error_code& error, HislipHeader header);
+    void handleSyncMessage(const HislipHeader& header, std::string payload);
+    void handleAsyncMessage(const HislipHeader& header, std::string payload);
+
+    void dispatchMessage(std::string message, uint32_t messageId);
+    void submitQuery(std::string command, uint32_t messageId);
+    void deviceClear();
+    void queryStatus();
+    void requestLock(uint32_t timeoutMs, std::string lockString);
+    void releaseLock();
+    void onServiceRequest(ViUInt16 statusByte);
+    void onRequestDone();
+
+    void send(Channel& channel, HislipMessageType type, uint8_t control, uint32_t parameter, std::string payload = {});
+    void sendFatalError(Channel& channel, HislipFatalError code, const std::string& message);
+    bool sendFromWorker(uint32_t messageId, HislipMessageType type, BufferPool::Buffer buffer, unsigned generation);
+    bool sendFromWorker(uint32_t messageId, HislipMessageType type, std::string data, unsigned generation);
+    void postFromWorker(Outgoing message, unsigned generation);
+    void enqueueWrite(Channel& channel, Outgoing message);
+    void writeNext(Channel& channel);
+
+    /**
+     * @brief クライアントが受け付ける最大長を超えないよう、Data / DataEnd のペイロードを分けて送るときの1つの長さを返します。
+     */
+    std::size_t maxPayloadSize() const;
+
+    void closeWhenIdle();
+    void close();
+
+    Channel sync_;
+    Channel async_;
+    Instrument& instrument_;
+    uint16_t sessionId_;
+    std::string peer_;
+    bool closing_ = false;
+    bool closed_ = false;
+    std::atomic<bool> failed_{ false };
+
+    boost::asio::any_io_executor executor_; // 両チャネルのハンドラを実行する strand
+    std::string pendingMessage_;            // DataEnd を受けるまでの Data の連結
+    bool discardingMessage_ = false;        // 上限を超えたメッセージを DataEnd まで読み捨てている
+    uint64_t clientMaxMessageSize_ = UINT64_MAX;
+    std::size_t inFlight_ = 0;
+    bool readPaused_ = false;
+
+    // デバイスクリアのたびに進める世代。古い世代のジョブは計測器に触れず、応答も送らない
+    std::atomic<unsigned> generation_{ 0 };
+
+    std::size_t srqListener_ = 0;
+    bool lockRequested_ = false; // AsyncLock でロックを要求したことがあれば、切断時に解放する
+};
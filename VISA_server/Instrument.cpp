@@ -0,0 +1,1032 @@
+﻿#include "Instrument.h"
+
+#include "Logger.h"
+#include "ScpiParser.h"
+#include "StringUtil.h"
+#include "ThreadAffinity.h"
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// IEEE 488.2 ステータスバイトのビット
+constexpr ViUInt16 STB_MAV = 0x10; // 出力キューに応答がある
+constexpr ViUInt16 STB_ESB = 0x20; // 標準イベントステータス (ここでは *OPC の完了) が立っている
+
+// SRQ モードで計測器に送る初期設定。*OPC の完了 (ESR bit0) を ESB に、ESB と MAV を SRQ に割り当てる
+const char* const SERVICE_REQUEST_SETUP = "*CLS;*ESE 1;*SRE 48\n";
+
+// まとめ書きする1つのプログラムメッセージの最大長。計測器の入力バッファを溢れさせないよう控えめにする
+constexpr size_t MAX_BATCH_SIZE = 1024;
+
+/**
+ * @brief プログラムメッセージに設定コマンドを ';' で連結します。
+ *        ';' の後ろは直前のコマンドの階層からの相対パスとして解釈されるため、ルート (':') から始まるように補います。
+ */
+void appendProgramUnit(std::string& message, const std::string& command) {
+    message += ';';
+    if (command.front() != ':' && command.front() != '*') {
+        message += ':';
+    }
+    message += command;
+}
+
+// 1台の計測器が同時に使う応答バッファの上限。
+// 応答の大きさによらず、送信待ちのデータは計測器ごとに チャンクサイズ × 16 (既定では 1 MiB) までに収まる
+constexpr size_t RESPONSE_BUFFER_COUNT = 16;
+
+// タイムアウトがこの回数続いたら、計測器が応答しなくなったとみなしてセッションを開き直す
+constexpr unsigned RECONNECT_AFTER_TIMEOUTS = 3;
+
+// 上のクラスのジョブにセッションを早く渡すため、送信待ちのままプールの外に持てる応答の最大バイト数 (計測器ごと)。
+// これを超えた分は通常どおりクライアントへの送信を待つ
+constexpr size_t MAX_SPILL_SIZE = 64 * 1024 * 1024;
+
+// ログに要約を出すときに参照する応答の先頭バイト数
+constexpr size_t LOG_HEAD_SIZE = 120;
+
+/**
+ * @brief 処理時間と転送量を記録しながら viWrite を呼び出します。
+ */
+ViStatus timedWrite(ViSession instr, const std::string& message, InstrumentMetrics& metrics) {
+    ScopedTimer timer(metrics.viWrite);
+    ViUInt32 writeCount = 0;
+    const ViStatus status = viWrite(instr, (ViBuf)message.c_str(), static_cast<ViUInt32>(message.length()), &writeCount);
+    metrics.addWritten(writeCount);
+    return status;
+}
+
+/**
+ * @brief 処理時間と転送量を記録しながら viRead を呼び出します。
+ */
+ViStatus timedRead(ViSession instr, char* buffer, size_t size, ViUInt32& retCount, InstrumentMetrics& metrics) {
+    ScopedTimer timer(metrics.viRead);
+    retCount = 0;
+    const ViStatus status = viRead(instr, (ViBuf)buffer, static_cast<ViUInt32>(size), &retCount);
+    metrics.addRead(retCount);
+    return status;
+}
+
+/**
+ * @brief 応答の残りをENDまで読み捨て、次のクエリに古いデータが混ざらないようにします。
+ */
+void discardResponse(ViSession instr, BufferPool::Buffer& scratch, ViStatus status) {
+    ViUInt32 retCount = 0;
+    while (status == VI_SUCCESS_MAX_CNT) {
+        status = viRead(instr, (ViBuf)scratch.data(), static_cast<ViUInt32>(scratch.capacity()), &retCount);
+    }
+}
+
+/**
+ * @brief 短い文字列の応答 (エラーメッセージなど) をプールのバッファに写して送信キューへ渡します。
+ */
+bool sendText(BufferPool& pool, const ResponseSink& sink, const std::string& text) {
+    size_t offset = 0;
+    do {
+        BufferPool::Buffer buffer = pool.acquire();
+        if (!buffer) {
+            return false;
+        }
+        const size_t left = text.size() - offset;
+        const size_t size = left < buffer.capacity() ? left : buffer.capacity();
+        std::memcpy(buffer.data(), text.data() + offset, size);
+        buffer.resize(size);
+        offset += size;
+        if (!sink(std::move(buffer))) {
+            return false;
+        }
+    } while (offset < text.size());
+    return true;
+}
+
+/**
+ * @brief 応答の内容をログに出します。バイナリや大きな応答は本文を出さずに要約だけ表示します。
+ */
+void logResponse(const std::string& head, size_t headSize, size_t total, bool isBlock) {
+    if (!Logger::instance().enabled(LogLevel::Info)) {
+        return;
+    }
+    // summarizePayload は先頭 LOG_HEAD_SIZE バイトまでしか参照しないため、控えた先頭部分だけで要約できる
+    if (isBlock) {
+        LOG_INFO("送信: バイナリブロック (" << total << " バイト)");
+    }
+    else if (headSize == total) {
+        LOG_INFO("送信: " << summarizePayload(head.data(), headSize, LOG_HEAD_SIZE));
+    }
+    else {
+        LOG_INFO("送信: " << summarizePayload(head.data(), headSize, LOG_HEAD_SIZE) << " (合計 " << total << " バイト)");
+    }
+}
+
+/**
+ * @brief 応答の次のチャンクを読むバッファを借ります。プールが空なら返却を待ちますが、
+ *        待っている間に上限を超えてよくなれば (Instrument::mayExceedBufferLimit) プールの外で確保します。
+ */
+BufferPool::Buffer acquireChunk(Instrument& instrument) {
+    return instrument.buffers().acquire([&instrument] { return instrument.mayExceedBufferLimit(); });
+}
+
+} // namespace
+
+const char* jobPriorityName(JobPriority priority) {
+    switch (priority) {
+    case JobPriority::High:
+        return "HIGH";
+    case JobPriority::Low:
+        return "LOW";
+    case JobPriority::Normal:
+        break;
+    }
+    return "NORMAL";
+}
+
+const char* lockModeName(LockMode mode) {
+    return mode == LockMode::Shared ? "SHARED" : "EXCLUSIVE";
+}
+
+bool parseJobPriority(const std::string& name, JobPriority& priority) {
+    const std::string lower = toLower(trim(name));
+    if (lower == "high") {
+        priority = JobPriority::High;
+    }
+    else if (lower == "normal") {
+        priority = JobPriority::Normal;
+    }
+    else if (lower == "low") {
+        priority = JobPriority::Low;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+Instrument::Instrument(ViSession session, std::string name, std::string address, std::size_t chunkSize,
+    SessionManager* sessions)
+    : session_(session), name_(std::move(name)), address_(std::move(address)), reader_(session),
+      buffers_(chunkSize, RESPONSE_BUFFER_COUNT, chunkSize < MAX_SPILL_SIZE ? MAX_SPILL_SIZE / chunkSize : 1), sessions_(sessions) {
+    reader_.enable();
+    worker_ = std::thread([this] { run(); });
+}
+
+void Instrument::pinWorker(unsigned cpu) {
+    submit([this, cpu](ViSession) {
+        if (!pinCurrentThread(cpu)) {
+            LOG_WARN("計測器のワーカースレッドを CPU " << cpu << " に固定できませんでした (" << name_ << ")");
+        }
+    }, JobPriority::High);
+}
+
+Instrument::~Instrument() {
+    stop();
+}
+
+void Instrument::submit(Job job, JobPriority priority, const void* owner) {
+    Entry entry;
+    entry.job = std::move(job);
+    entry.batchable = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enqueue({ priority, owner }, std::move(entry));
+    }
+    cv_.notify_one();
+}
+
+void Instrument::submitWrite(std::string command, WriteCallback done, JobPriority priority, const void* owner) {
+    // ユニットの区切りで組み直し、末尾の ';' や空のユニットが連結後のメッセージに残らないようにする
+    ProgramMessage parsed = parseProgramMessage(command);
+    const bool batchable = !parsed.indefiniteBlock;
+    if (batchable && !parsed.units.empty()) {
+        command = std::move(parsed.units.front());
+        for (size_t i = 1; i < parsed.units.size(); ++i) {
+            command += ';';
+            command += parsed.units[i];
+        }
+    }
+
+    Entry entry;
+    entry.command = std::move(command);
+    entry.onWritten = std::move(done);
+    entry.batchable = batchable;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enqueue({ priority, owner }, std::move(entry));
+    }
+    cv_.notify_one();
+}
+
+void Instrument::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    buffers_.close(); // 送信が止まっていてもバッファ待ちで止まらないようにする
+    {
+        std::lock_guard<std::mutex> lock(srqMutex_);
+    }
+    srqCv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+
+    // セッションのクローズ後にハンドラが this を参照しないよう、ここで登録を外す
+    reader_.disable();
+    srqEnabled_ = false;
+    uninstallServiceRequestHandler();
+}
+
+ViStatus Instrument::installServiceRequestHandler() {
+    std::lock_guard<std::mutex> lock(handlerMutex_);
+    if (handlerInstalled_) {
+        return VI_SUCCESS;
+    }
+    const ViStatus status = attachServiceRequestHandler();
+    handlerInstalled_ = status >= VI_SUCCESS;
+    return status;
+}
+
+void Instrument::uninstallServiceRequestHandler() {
+    std::lock_guard<std::mutex> lock(handlerMutex_);
+    if (!handlerInstalled_) {
+        return;
+    }
+    detachServiceRequestHandler();
+    handlerInstalled_ = false;
+}
+
+ViStatus Instrument::attachServiceRequestHandler() {
+    ViStatus status = viInstallHandler(session_, VI_EVENT_SERVICE_REQ, onServiceRequest, this);
+    if (status >= VI_SUCCESS) {
+        status = viEnableEvent(session_, VI_EVENT_SERVICE_REQ, VI_HNDLR, VI_NULL);
+        if (status < VI_SUCCESS) {
+            viUninstallHandler(session_, VI_EVENT_SERVICE_REQ, onServiceRequest, this);
+        }
+    }
+    return status;
+}
+
+void Instrument::detachServiceRequestHandler() {
+    viDisableEvent(session_, VI_EVENT_SERVICE_REQ, VI_HNDLR);
+    viUninstallHandler(session_, VI_EVENT_SERVICE_REQ, onServiceRequest, this);
+}
+
+void Instrument::reportStatus(ViStatus status) {
+    if (status >= VI_SUCCESS) {
+        consecutiveTimeouts_ = 0;
+        return;
+    }
+    if (status == VI_ERROR_TMO) {
+        if (++consecutiveTimeouts_ < RECONNECT_AFTER_TIMEOUTS) {
+            return;
+        }
+    }
+    else if (!SessionManager::isConnectionLost(status)) {
+        return;
+    }
+    consecutiveTimeouts_ = 0;
+
+    if (sessions_ == nullptr || sessionLost_) {
+        return;
+    }
+    sessionLost_ = true;
+    LOG_WARN("計測器との接続が失われました (" << name_ << ", Status: " << status << ")。セッションを開き直します");
+    sessions_->requestReconnect();
+}
+
+void Instrument::replaceSession() {
+    const ViSession next = sessions_->readyReplacement();
+    if (next == VI_NULL) {
+        return; // 開き直し中。ジョブは古いセッションのまま失敗する
+    }
+
+    // 古いセッションを閉じる前にハンドラを外し、新しいセッションへ登録し直す
+    const bool readerEnabled = reader_.enabled();
+    reader_.disable();
+    {
+        std::lock_guard<std::mutex> lock(handlerMutex_);
+        if (handlerInstalled_) {
+            detachServiceRequestHandler();
+        }
+        sessions_->commitReplacement();
+        session_ = next;
+        if (handlerInstalled_) {
+            const ViStatus status = attachServiceRequestHandler();
+            if (status < VI_SUCCESS) {
+                LOG_WARN("新しいセッションに SRQ のイベントハンドラを登録できませんでした (" << name_ << ", Status: " << status << ")");
+                handlerInstalled_ = false;
+            }
+        }
+    }
+    reader_.setSession(next);
+    if (locked_.load()) {
+        // ロックを保持している投入元がいれば、新しいセッションでも他のプロセスを締め出す
+        LockMode mode = LockMode::Exclusive;
+        std::string key;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            mode = lockMode_;
+            key = lockKey_;
+        }
+        ViChar accessKey[256] = {};
+        const ViStatus status = viLock(session_, mode == LockMode::Shared ? VI_SHARED_LOCK : VI_EXCLUSIVE_LOCK, 0,
+            mode == LockMode::Shared ? key.c_str() : VI_NULL, accessKey);
+        if (status < VI_SUCCESS) {
+            LOG_WARN("新しいセッションをロックできませんでした (" << name_ << ", Status: " << status << ")");
+        }
+    }
+    if (readerEnabled) {
+        reader_.enable();
+    }
+
+    // 電源の入れ直しで計測器のステータス設定は初期化されているため、SRQ モードの設定をやり直す
+    operationPending_ = false;
+    if (srqEnabled_.load()) {
+        ViUInt32 writeCount = 0;
+        const ViStatus status = viWrite(session_, (ViBuf)SERVICE_REQUEST_SETUP,
+            static_cast<ViUInt32>(std::char_traits<char>::length(SERVICE_REQUEST_SETUP)), &writeCount);
+        if (status < VI_SUCCESS) {
+            LOG_WARN("新しいセッションで SRQ の設定に失敗しました (" << name_ << ", Status: " << status << ")");
+        }
+    }
+
+    sessionLost_ = false;
+    consecutiveTimeouts_ = 0;
+    LOG_INFO("計測器のセッションを切り替えました (" << name_ << ")");
+}
+
+std::size_t Instrument::addServiceRequestListener(ServiceRequestListener listener) {
+    std::size_t id = 0;
+    {
+        std::lock_guard<std::mutex> lock(listenersMutex_);
+        id = nextListenerId_++;
+        srqListeners_.emplace(id, std::move(listener));
+    }
+    const ViStatus status = installServiceRequestHandler();
+    if (status < VI_SUCCESS) {
+        LOG_WARN("SRQ のイベントハンドラを登録できませんでした (" << name_ << ", Status: " << status << ")");
+    }
+    return id;
+}
+
+void Instrument::removeServiceRequestListener(std::size_t id) {
+    std::lock_guard<std::mutex> lock(listenersMutex_);
+    srqListeners_.erase(id);
+}
+
+bool Instrument::enableServiceRequest(std::chrono::milliseconds timeout) {
+    srqTimeout_ = timeout;
+
+    ViUInt32 writeCount = 0;
+    ViStatus status = viWrite(session_, (ViBuf)SERVICE_REQUEST_SETUP,
+        static_cast<ViUInt32>(std::char_traits<char>::length(SERVICE_REQUEST_SETUP)), &writeCount);
+    if (status >= VI_SUCCESS) {
+        status = installServiceRequestHandler();
+    }
+    if (status < VI_SUCCESS) {
+        LOG_WARN("SRQ による完了通知を有効にできませんでした (" << name_ << ", Status: " << status << ")。同期読み取りで動作します");
+        return false;
+    }
+
+    srqEnabled_ = true;
+    LOG_INFO("SRQ による完了通知を有効にしました (" << name_ << ", 待ち時間の上限: " << timeout.count() << " ms)");
+    return true;
+}
+
+ViStatus _VI_FUNCH Instrument::onServiceRequest(ViSession vi, ViEventType /*eventType*/, ViEvent /*event*/, ViAddr userHandle) {
+    auto* self = static_cast<Instrument*>(userHandle);
+
+    // GPIB ではシリアルポールで SRQ 線を下ろす必要があるため、ここで STB を読んでおく
+    ViUInt16 stb = 0;
+    viReadSTB(vi, &stb);
+
+    {
+        std::lock_guard<std::mutex> lock(self->srqMutex_);
+        self->srqSignalled_ = true;
+    }
+    self->srqCv_.notify_all();
+
+    // リスナーの登録解除と競合しないよう、ロックを保持したまま呼ぶ (リスナーは投げるだけで即座に戻る)
+    std::lock_guard<std::mutex> lock(self->listenersMutex_);
+    for (const auto& entry : self->srqListeners_) {
+        entry.second(stb);
+    }
+    return VI_SUCCESS;
+}
+
+ViStatus Instrument::waitForStatus(ViUInt16 mask) {
+    const auto deadline = std::chrono::steady_clock::now() + srqTimeout_;
+    while (true) {
+        // 先に通知を下ろしてから STB を読むことで、読み取りと待機の間に来た SRQ を取りこぼさない
+        {
+            std::lock_guard<std::mutex> lock(srqMutex_);
+            srqSignalled_ = false;
+        }
+
+        ViUInt16 stb = 0;
+        const ViStatus status = viReadSTB(session_, &stb);
+        if (status < VI_SUCCESS) {
+            return status;
+        }
+        if (stb & mask) {
+            return VI_SUCCESS;
+        }
+
+        std::unique_lock<std::mutex> lock(srqMutex_);
+        if (!srqCv_.wait_until(lock, deadline, [this] { return srqSignalled_ || stopping_.load(); })
+            || stopping_.load()) {
+            return VI_ERROR_TMO;
+        }
+    }
+}
+
+ViStatus Instrument::awaitResponse() {
+    if (!srqEnabled_.load()) {
+        return VI_SUCCESS;
+    }
+    return waitForStatus(STB_MAV);
+}
+
+ViStatus Instrument::awaitOperationComplete() {
+    if (!operationPending_) {
+        return VI_SUCCESS;
+    }
+    operationPending_ = false;
+
+    ViStatus status = waitForStatus(STB_ESB);
+    if (status < VI_SUCCESS) {
+        return status;
+    }
+
+    // *ESR? で標準イベントレジスタを読み出して ESB を下ろし、次の *OPC で再び SRQ が上がるようにする
+    const std::string query = "*ESR?\n";
+    ViUInt32 count = 0;
+    status = viWrite(session_, (ViBuf)query.c_str(), static_cast<ViUInt32>(query.length()), &count);
+    if (status >= VI_SUCCESS) {
+        char reply[64];
+        status = viRead(session_, (ViBuf)reply, sizeof(reply), &count);
+    }
+    return status;
+}
+
+bool Instrument::mayExceedBufferLimit() const {
+    const int running = running_.load(std::memory_order_relaxed);
+    if (running == static_cast<int>(JobPriority::High)) {
+        return true;
+    }
+    if (locked_.load(std::memory_order_relaxed)) {
+        return false; // 待っているジョブはロックが解放されるまで実行できない
+    }
+    for (int i = 0; i < running; ++i) {
+        if (waiting_[i].load(std::memory_order_relaxed) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Instrument::enqueue(QueueKey key, Entry entry) {
+    Queue& queue = queues_[key];
+    entry.queuedAt = std::chrono::steady_clock::now();
+    queue.entries.push_back(std::move(entry));
+    waiting_[static_cast<std::size_t>(key.priority)].fetch_add(1, std::memory_order_relaxed);
+    if (!queue.ready) {
+        queue.ready = true;
+        ready_[static_cast<std::size_t>(key.priority)].push_back(key.owner);
+    }
+    if (static_cast<int>(key.priority) < running_.load(std::memory_order_relaxed)) {
+        buffers_.wake(); // 実行中のジョブがバッファ待ちなら、上限を超えて読み進めるかを確認し直させる
+    }
+}
+
+bool Instrument::runnable(const QueueKey& key, const Queue& queue) const {
+    return lockHolders_.empty() || stopping_.load() || queue.entries.front().lockControl
+        || lockHolders_.count(key.owner) > 0;
+}
+
+bool Instrument::dequeue(QueueKey& key, Entry& entry) {
+    // ロック中は、ロックを保持していない投入元のキューを飛ばす。まとめ書きで空になったキューはここで片付ける
+    const auto hasRunnable = [this](std::size_t priority) {
+        if (waiting_[priority].load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+        if (lockHolders_.empty()) {
+            return true;
+        }
+        for (const void* owner : ready_[priority]) {
+            const QueueKey key{ static_cast<JobPriority>(priority), owner };
+            const Queue& queue = queues_.find(key)->second;
+            if (!queue.entries.empty() && runnable(key, queue)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // 最も高いクラスを選ぶ。ただし上のクラスに追い越され続けたクラスがあれば、そのクラスを先に1回実行する
+    std::size_t chosen = JOB_PRIORITY_COUNT;
+    for (std::size_t i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+        if (!hasRunnable(i)) {
+            continue;
+        }
+        if (chosen == JOB_PRIORITY_COUNT) {
+            chosen = i;
+        }
+        else if (overtaken_[i] >= PRIORITY_AGING_LIMIT) {
+            chosen = i;
+            break;
+        }
+    }
+    if (chosen == JOB_PRIORITY_COUNT) {
+        return false;
+    }
+    for (std::size_t i = chosen + 1; i < JOB_PRIORITY_COUNT; ++i) {
+        if (waiting_[i].load(std::memory_order_relaxed) > 0) {
+            ++overtaken_[i];
+        }
+    }
+    overtaken_[chosen] = 0;
+
+    // 同じクラスの投入元を巡回する。実行できないキューは順番を保ったまま後ろへ回す
+    std::deque<const void*>& ready = ready_[chosen];
+    while (true) {
+        key = { static_cast<JobPriority>(chosen), ready.front() };
+        ready.pop_front();
+        auto it = queues_.find(key);
+        if (it->second.entries.empty()) {
+            queues_.erase(it);
+            continue;
+        }
+        if (!runnable(key, it->second)) {
+            ready.push_back(key.owner);
+            continue;
+        }
+        entry = std::move(it->second.entries.front());
+        it->second.entries.pop_front();
+        waiting_[chosen].fetch_sub(1, std::memory_order_relaxed);
+        if (it->second.entries.empty()) {
+            queues_.erase(it);
+        }
+        else {
+            ready.push_back(key.owner);
+        }
+        return true;
+    }
+}
+
+void Instrument::enqueueLockControl(const void* owner, JobPriority priority, Job job) {
+    Entry entry;
+    entry.job = std::move(job);
+    entry.batchable = false;
+    entry.lockControl = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enqueue({ priority, owner }, std::move(entry));
+    }
+    cv_.notify_one();
+}
+
+void Instrument::lock(const void* owner, LockMode mode, std::string key, std::chrono::milliseconds timeout, LockCallback done,
+    JobPriority priority) {
+    LockRequest request{ owner, mode, mode == LockMode::Shared ? std::move(key) : std::string(), {}, std::move(done) };
+    enqueueLockControl(owner, priority, [this, request, timeout](ViSession) mutable {
+        request.deadline = std::chrono::steady_clock::now() + timeout;
+        std::unique_lock<std::mutex> lock(mutex_);
+        acquireLock(lock, std::move(request));
+    });
+}
+
+void Instrument::unlock(const void* owner, LockCallback done, JobPriority priority) {
+    enqueueLockControl(owner, priority, [this, owner, done](ViSession) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const LockMode mode = lockMode_;
+        const bool held = releaseOwner(lock, owner, true);
+        lock.unlock();
+        if (done) {
+            done(held ? VI_SUCCESS : VI_ERROR_SESN_NLOCKED, mode);
+        }
+    });
+}
+
+void Instrument::releaseLocks(const void* owner) {
+    // 投入済みのロックの要求より後に処理されるよう、各クラスの同じ投入元のキューに入れる
+    for (std::size_t i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+        enqueueLockControl(owner, static_cast<JobPriority>(i), [this, owner](ViSession) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            releaseOwner(lock, owner, false);
+        });
+    }
+}
+
+Instrument::LockInfo Instrument::lockInfo(const void* owner) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LockInfo info;
+    info.locked = !lockHolders_.empty();
+    info.mode = lockMode_;
+    info.holders = lockHolders_.size();
+    info.waiting = lockWaiters_.size();
+    info.held = owner != nullptr && lockHolders_.count(owner) > 0;
+    return info;
+}
+
+bool Instrument::lockCompatible(const LockRequest& request) const {
+    return lockHolders_.empty() || lockHolders_.count(request.owner) > 0
+        || (lockMode_ == LockMode::Shared && request.mode == LockMode::Shared && request.key == lockKey_);
+}
+
+ViStatus Instrument::lockSession(std::unique_lock<std::mutex>& lock, const LockRequest& request) {
+    if (lockHolders_.count(request.owner) > 0) {
+        return VI_SUCCESS; // 保持しているロックの入れ子の要求
+    }
+    if (!lockHolders_.empty()) {
+        lockHolders_.insert(request.owner); // 同じキーの共有ロックに加わる
+        return VI_SUCCESS;
+    }
+
+    // 同じ計測器を開いている他のプロセスが viLock で保持していれば、残りの待ち時間だけ VISA の中で待つ
+    const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(request.deadline - std::chrono::steady_clock::now());
+    const ViUInt32 timeoutMs = remaining.count() > 0 ? static_cast<ViUInt32>(remaining.count()) : 0;
+    ViChar accessKey[256] = {};
+    lock.unlock();
+    const ViStatus status = viLock(session_, request.mode == LockMode::Shared ? VI_SHARED_LOCK : VI_EXCLUSIVE_LOCK, timeoutMs,
+        request.mode == LockMode::Shared ? request.key.c_str() : VI_NULL, accessKey);
+    lock.lock();
+    if (status < VI_SUCCESS) {
+        LOG_WARN("計測器のロックに失敗しました (" << name_ << ", Status: " << status << ")");
+        return status;
+    }
+    lockHolders_.insert(request.owner);
+    lockMode_ = request.mode;
+    lockKey_ = request.key;
+    locked_ = true;
+    LOG_INFO("計測器をロックしました (" << name_ << ", " << (request.mode == LockMode::Shared ? "共有" : "排他") << ")");
+    return status;
+}
+
+void Instrument::acquireLock(std::unique_lock<std::mutex>& lock, LockRequest request) {
+    ViStatus status = VI_ERROR_ABORT; // 停止中
+    if (!lockCompatible(request)) {
+        if (!stopping_.load()) {
+            lockWaiters_.push_back(std::move(request));
+            return;
+        }
+    }
+    else {
+        status = lockSession(lock, request);
+    }
+    const LockMode mode = lockMode_;
+    lock.unlock();
+    request.done(status, mode);
+    lock.lock();
+}
+
+bool Instrument::releaseOwner(std::unique_lock<std::mutex>& lock, const void* owner, bool notifyWaiters) {
+    std::vector<LockRequest> cancelled;
+    for (auto it = lockWaiters_.begin(); it != lockWaiters_.end();) {
+        if (it->owner == owner) {
+            cancelled.push_back(std::move(*it));
+            it = lockWaiters_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    const bool held = lockHolders_.erase(owner) > 0;
+    const bool unlockSession = held && lockHolders_.empty();
+    if (unlockSession) {
+        locked_ = false;
+    }
+    lock.unlock();
+    if (unlockSession) {
+        const ViStatus status = viUnlock(session_);
+        if (status < VI_SUCCESS) {
+            LOG_WARN("計測器のロックの解放に失敗しました (" << name_ << ", Status: " << status << ")");
+        }
+        else {
+            LOG_INFO("計測器のロックを解放しました (" << name_ << ")");
+        }
+    }
+    if (notifyWaiters) {
+        for (auto& request : cancelled) {
+            request.done(VI_ERROR_ABORT, request.mode);
+        }
+    }
+    lock.lock();
+    return held;
+}
+
+std::chrono::steady_clock::time_point Instrument::serviceLockWaiters(std::unique_lock<std::mutex>& lock) {
+    auto earliest = std::chrono::steady_clock::time_point::max();
+    if (lockWaiters_.empty()) {
+        return earliest;
+    }
+
+    // 到着順に処理する。viLock と done の間は mutex_ を外すため、取り出してから処理する
+    std::deque<LockRequest> pending;
+    pending.swap(lockWaiters_);
+    while (!pending.empty()) {
+        LockRequest request = std::move(pending.front());
+        pending.pop_front();
+        const auto now = std::chrono::steady_clock::now();
+        if (lockCompatible(request)) {
+            acquireLock(lock, std::move(request));
+        }
+        else if (now >= request.deadline || stopping_.load()) {
+            const LockMode mode = request.mode;
+            lock.unlock();
+            request.done(stopping_.load() ? VI_ERROR_ABORT : VI_ERROR_TMO, mode);
+            lock.lock();
+        }
+        else {
+            if (request.deadline < earliest) {
+                earliest = request.deadline;
+            }
+            lockWaiters_.push_back(std::move(request));
+        }
+    }
+    return earliest;
+}
+
+void Instrument::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        QueueKey key{ JobPriority::Normal, nullptr };
+        Entry entry;
+        bool found = false;
+        while (true) {
+            // ロックの解放を待っている要求は、解放されたかタイムアウトしたかをジョブの合間に確かめる
+            const auto lockDeadline = serviceLockWaiters(lock);
+            found = dequeue(key, entry);
+            if (found || stopping_.load()) {
+                break;
+            }
+            if (lockDeadline == std::chrono::steady_clock::time_point::max()) {
+                cv_.wait(lock);
+            }
+            else {
+                cv_.wait_until(lock, lockDeadline);
+            }
+        }
+        if (!found) {
+            return; // 停止要求かつキューが空
+        }
+        running_ = static_cast<int>(key.priority);
+        metrics_.queueWait[static_cast<std::size_t>(key.priority)].record(std::chrono::steady_clock::now() - entry.queuedAt);
+
+        if (sessionLost_) {
+            lock.unlock();
+            replaceSession();
+            lock.lock();
+        }
+
+        if (!entry.job) {
+            flushWrites(lock, key, std::move(entry));
+            continue;
+        }
+
+        lock.unlock();
+        try {
+            entry.job(session_);
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("計測器ワーカーで例外発生 (" << name_ << "): " << e.what());
+        }
+        lock.lock();
+    }
+}
+
+void Instrument::flushWrites(std::unique_lock<std::mutex>& lock, QueueKey key, Entry first) {
+    std::string message = std::move(first.command);
+    const bool batchable = first.batchable;
+    std::vector<WriteCallback> callbacks;
+    callbacks.push_back(std::move(first.onWritten));
+
+    // 同じ投入元のキューの先頭に続く設定コマンドを連結する。どのキューも空ならまとめ待ち時間の間だけ後続を待つ
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(batchWindowUs_.load());
+    const auto anyWaiting = [this] {
+        for (const auto& count : waiting_) {
+            if (count.load(std::memory_order_relaxed) > 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+    while (batchable) {
+        auto it = queues_.find(key);
+        if (it != queues_.end()) {
+            std::deque<Entry>& entries = it->second.entries;
+            while (!entries.empty() && !entries.front().job && entries.front().batchable
+                && message.size() + entries.front().command.size() + 2 <= MAX_BATCH_SIZE) {
+                appendProgramUnit(message, entries.front().command);
+                callbacks.push_back(std::move(entries.front().onWritten));
+                entries.pop_front();
+                waiting_[static_cast<std::size_t>(key.priority)].fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        if (anyWaiting() || stopping_.load()
+            || !cv_.wait_until(lock, deadline, [this, &anyWaiting] { return stopping_.load() || anyWaiting(); })) {
+            break;
+        }
+    }
+
+    lock.unlock();
+
+    if (callbacks.size() > 1) {
+        LOG_INFO("まとめ書き (" << name_ << ", " << callbacks.size() << " コマンド): " << message);
+    }
+
+    // 前のまとめ書きの *OPC が完了していなければ、ここで待ってから ESB を下ろす
+    ViStatus status = awaitOperationComplete();
+    // indefinite-length block の後ろには何も連結できないため、*OPC による完了待ちもしない
+    const bool trackCompletion = srqEnabled_.load() && batchable;
+    if (status >= VI_SUCCESS) {
+        if (trackCompletion) {
+            message += ";*OPC";
+        }
+        message += "\n";
+        status = timedWrite(session_, message, metrics_);
+        operationPending_ = trackCompletion && status >= VI_SUCCESS;
+    }
+    reportStatus(status);
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("viWrite に失敗しました (Status: " << status << ")");
+    }
+
+    for (auto& callback : callbacks) {
+        try {
+            callback(status);
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("計測器ワーカーで例外発生 (" << name_ << "): " << e.what());
+        }
+    }
+
+    lock.lock();
+}
+
+uint64_t monotonicNanoseconds(std::chrono::steady_clock::time_point time) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count());
+}
+
+ViStatus writeCommand(ViSession instr, const std::string& command, Instrument& instrument, std::string& error,
+    ResponseTiming* timing) {
+    ViStatus status = instrument.awaitOperationComplete();
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("前の設定コマンドの完了待ちに失敗しました (Status: " << status << ")");
+        instrument.reportStatus(status);
+        error = "エラー: 前の設定コマンドが完了しませんでした\n";
+        return status;
+    }
+
+    status = timedWrite(instr, command + "\n", instrument.metrics());
+    if (timing != nullptr) {
+        timing->written = std::chrono::steady_clock::now();
+    }
+    instrument.reportStatus(status);
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("viWrite に失敗しました (Status: " << status << ")");
+        error = "エラー: 計測器への書き込みに失敗しました\n";
+    }
+    return status;
+}
+
+ViStatus readResponse(ViSession instr, const ResponseSink& sink, Instrument& instrument, std::string& error,
+    ResponseTiming* timing) {
+    InstrumentMetrics& metrics = instrument.metrics();
+
+    // SRQ モードでは応答の準備ができてから読み取りを始めるため、長い操作でも viRead がタイムアウトしない
+    ViStatus status = instrument.awaitResponse();
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("応答の準備完了 (SRQ) を待てませんでした (Status: " << status << ")");
+        instrument.reportStatus(status);
+        viClear(instr);
+        error = "エラー: 応答待ちがタイムアウトしました\n";
+        return status;
+    }
+
+    size_t spilled = 0;
+    BufferPool::Buffer current = acquireChunk(instrument);
+    if (!current) {
+        error = "エラー: サーバーの停止により応答の読み取りを中断しました\n";
+        return VI_ERROR_ABORT; // 停止中
+    }
+
+    ViUInt32 headSize = 0;
+    status = timedRead(instr, current.data(), current.capacity(), headSize, metrics);
+    const uint64_t sequence = instrument.nextResponseSequence();
+    if (timing != nullptr) {
+        timing->sequence = sequence;
+        timing->firstRead = std::chrono::steady_clock::now();
+        timing->lastRead = timing->firstRead;
+    }
+    instrument.reportStatus(status);
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("viRead に失敗しました (Status: " << status << ")");
+        error = "エラー: 応答の読み取りに失敗しました\n";
+        return status;
+    }
+    current.resize(headSize);
+    if (current.outsidePool()) {
+        spilled += headSize;
+    }
+
+    // バッファは送信後に別の応答で再利用されるため、ログ用に先頭だけ控えておく
+    const std::string head = Logger::instance().enabled(LogLevel::Info)
+        ? std::string(current.data(), headSize < LOG_HEAD_SIZE ? headSize : LOG_HEAD_SIZE)
+        : std::string();
+    BlockHeader header;
+    const bool isBlock = parseBlockHeader(current.data(), headSize, header);
+
+    // 残りは END までプールのバッファ単位で読み、読み終えたものから順に送信キューへ渡す。
+    // 送信は接続のstrandで進むため、ワーカーは送信完了を待たずに次を読む。プールが空になった時だけ送信を待つ
+    OverlappedReader& reader = instrument.reader();
+    size_t total = headSize;
+
+    while (true) {
+        const bool reading = status == VI_SUCCESS_MAX_CNT;
+        BufferPool::Buffer next;
+        if (reading) {
+            // チャンクの区切りごとに、上のクラスのジョブが待っていればクライアントへの送信を待たずに読み進め、
+            // 応答の残りを計測器の速さで読み切ってセッションを早く空ける。送信はプールの外のバッファから後で進む
+            next = acquireChunk(instrument);
+            if (!next) {
+                error = "エラー: サーバーの停止により応答の読み取りを中断しました\n";
+                return VI_ERROR_ABORT;
+            }
+            reader.start(next.data(), next.capacity());
+        }
+        const auto readStartedAt = std::chrono::steady_clock::now();
+
+        const bool delivered = current.size() == 0 || sink(std::move(current));
+        if (!reading) {
+            if (!delivered) {
+                return status;
+            }
+            break;
+        }
+
+        ViUInt32 retCount = 0;
+        status = reader.finish(retCount);
+        const auto readFinishedAt = std::chrono::steady_clock::now();
+        if (timing != nullptr) {
+            timing->lastRead = readFinishedAt;
+        }
+        metrics.viRead.record(readFinishedAt - readStartedAt);
+        metrics.addRead(retCount);
+
+        if (!delivered) {
+            discardResponse(instr, next, status);
+            return status;
+        }
+        if (status < VI_SUCCESS) {
+            LOG_ERROR("viRead に失敗しました (Status: " << status << ", 受信済み: " << total << " バイト)");
+            instrument.reportStatus(status);
+            error = "エラー: 応答の読み取りが途中で失敗しました\n";
+            return status;
+        }
+
+        total += retCount;
+        if (next.outsidePool()) {
+            spilled += retCount;
+        }
+        next.resize(retCount);
+        current = std::move(next);
+    }
+
+    if (spilled > 0) {
+        metrics.addSpilled(spilled);
+        LOG_INFO("送信の完了を待たずに、プールの外のバッファへ " << spilled << " バイトを読みました (" << instrument.name() << ")");
+    }
+    logResponse(head, headSize, total, isBlock);
+    return status;
+}
+
+ViStatus executeCommand(ViSession instr, const std::string& command, const ResponseSink& sink, Instrument& instrument,
+    ResponseTiming* timing) {
+    BufferPool& pool = instrument.buffers();
+    std::string error;
+
+    ViStatus status = writeCommand(instr, command, instrument, error, timing);
+    if (status < VI_SUCCESS) {
+        sendText(pool, sink, error);
+        return status;
+    }
+
+    if (!containsQuery(command)) {
+        const std::string reply = "コマンド送信完了 (応答なし)\n";
+        LOG_INFO("送信: " << summarizePayload(reply.data(), reply.size()));
+        sendText(pool, sink, reply);
+        return status;
+    }
+
+    status = readResponse(instr, sink, instrument, error, timing);
+    if (!error.empty()) {
+        sendText(pool, sink, error);
+    }
+    return status;
+}
@@ -0,0 +1,454 @@
+﻿#pragma once
+
+#include "BufferPool.h"
+#include "Metrics.h"
+#include "OverlappedReader.h"
+#include "ResponseCache.h"
+#include "SessionManager.h"
+
+#include <visa.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief ジョブの優先度クラス。値が小さいほど優先します。
+ */
+enum class JobPriority {
+    High = 0,   // 出力オフなど、大きな転送の最中でも待たせたくない対話的なコマンド
+    Normal = 1, // 既定
+    Low = 2,    // サーバー側の記録などのバックグラウンドの取得
+};
+
+constexpr std::size_t JOB_PRIORITY_COUNT = 3;
+
+/**
+ * @brief 優先度クラスの名前 ("HIGH" / "NORMAL" / "LOW") を返します。
+ */
+const char* jobPriorityName(JobPriority priority);
+
+/**
+ * @brief "HIGH" / "NORMAL" / "LOW" (大文字小文字は区別しない) を優先度クラスに変換します。
+ * @return 不明な名前なら false。
+ */
+bool parseJobPriority(const std::string& name, JobPriority& priority);
+
+/**
+ * @brief 計測器のロックの種類。
+ */
+enum class LockMode {
+    Exclusive, // 保持している投入元だけがジョブを実行できる
+    Shared,    // 同じキーで共有ロックを保持している投入元だけがジョブを実行できる
+};
+
+/**
+ * @brief ロックの種類の名前 ("EXCLUSIVE" / "SHARED") を返します。
+ */
+const char* lockModeName(LockMode mode);
+
+/**
+ * @brief 1台の計測器セッション (ViSession) を専用のワーカースレッドで操作するクラス。
+ *        VISA呼び出しはブロッキングのため、ネットワーク処理から切り離し、コマンドキュー経由で直列化します。
+ *        ジョブが reportStatus() で接続断を知らせると SessionManager が裏でセッションを開き直し、
+ *        ワーカーはジョブの合間に新しいセッションへ切り替えます。切り替えまでのジョブは古いセッションのまま失敗します。
+ *
+ *        キューは投入元 (owner) と優先度クラスの組ごとの FIFO で、ワーカーは待っているジョブのうち最も高いクラスから、
+ *        同じクラスの投入元を1ジョブずつ順番に (ラウンドロビンで) 取り出します。同じ投入元・同じクラスのジョブは投入順に実行されます。
+ *        低いクラスも、上のクラスに PRIORITY_AGING_LIMIT 回続けて追い越されると次の1ジョブを実行し、飢餓状態にはなりません。
+ *
+ *        lock() でロックを取った投入元があれば、ロックを保持していない投入元のジョブはキューで待ち、保持している投入元のジョブだけが
+ *        実行されます。ロックは計測器セッションの viLock でも取るため、同じ計測器を開いている他のプロセスも締め出します。
+ */
+class Instrument {
+public:
+    using Job = std::function<void(ViSession)>;
+    using WriteCallback = std::function<void(ViStatus)>;
+    using ServiceRequestListener = std::function<void(ViUInt16 statusByte)>;
+    using LockCallback = std::function<void(ViStatus status, LockMode mode)>;
+
+    /**
+     * @brief ロックの状態 (lockInfo() の結果)。
+     */
+    struct LockInfo {
+        bool locked = false;
+        LockMode mode = LockMode::Exclusive;
+        std::size_t holders = 0; // ロックを保持している投入元の数
+        std::size_t waiting = 0; // ロックを待っている要求の数
+        bool held = false;       // lockInfo() に渡した投入元が保持しているか
+    };
+
+    // 1回の viRead で読む最大バイト数 (応答を受け渡すバッファの大きさ) の既定値
+    static constexpr std::size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    // 低いクラスのジョブが待っている間に、上のクラスのジョブを続けて実行する最大回数
+    static constexpr unsigned PRIORITY_AGING_LIMIT = 16;
+
+    /**
+     * @param session オープン済みの計測器セッション。クローズは呼び出し側の責任です。
+     * @param name クライアントが宛先として指定する計測器名 (例: "scope")。
+     * @param address 計測器のリソース記述子。
+     * @param chunkSize 1回の viRead で読む最大バイト数。大きくすると大きな応答を少ない転送回数で読めます。
+     * @param sessions session を所有し、接続断のときに開き直すセッション管理。nullptr なら開き直しません。
+     */
+    Instrument(ViSession session, std::string name, std::string address, std::size_t chunkSize = DEFAULT_CHUNK_SIZE,
+        SessionManager* sessions = nullptr);
+    ~Instrument();
+
+    Instrument(const Instrument&) = delete;
+    Instrument& operator=(const Instrument&) = delete;
+
+    /**
+     * @brief ワーカースレッドで実行するジョブをキューに追加します。ジョブは1つずつ実行されます。
+     * @param job 計測器セッションを受け取って実行される処理。
+     * @param priority ジョブの優先度クラス。
+     * @param owner 投入元 (接続など) を表す任意のポインタ。同じ owner と priority のジョブは投入順に実行され、
+     *              別の owner のジョブとは公平に交互に実行されます。nullptr の投入元も1つの投入元として扱います。
+     */
+    void submit(Job job, JobPriority priority = JobPriority::Normal, const void* owner = nullptr);
+
+    /**
+     * @brief 応答を伴わない設定コマンドをキューに追加します。
+     *        キュー上で連続する設定コマンドは ';' で連結した1つのプログラムメッセージにまとめ、1回の viWrite で送信します。
+     *        まとめ書きは次のクエリ (submit されたジョブ) の手前、またはまとめ待ち時間の経過で送出されます。
+     * @param command 改行を含まない設定コマンド。クエリ (containsQuery) を含んではいけません。
+     *                indefinite-length block を含むコマンドは END で終える必要があるため、まとめずに単独で書き込みます。
+     * @param done 書き込み完了時にワーカースレッドから呼ばれるコールバック (viWrite のステータス)。
+     * @param priority, owner submit() と同じ。まとめ書きは同じ投入元・同じクラスの設定コマンドだけを連結します。
+     */
+    void submitWrite(std::string command, WriteCallback done, JobPriority priority = JobPriority::Normal, const void* owner = nullptr);
+
+    /**
+     * @brief まとめ書きで後続の設定コマンドを待つ最大時間を設定します。0 の場合はキューに溜まっている分だけをまとめます。
+     */
+    void setBatchWindow(std::chrono::microseconds window) { batchWindowUs_ = window.count(); }
+
+    /**
+     * @brief ワーカースレッドを論理CPU cpu に固定します。固定はワーカー上のジョブとして行うため、実行中のジョブの後に反映されます。
+     */
+    void pinWorker(unsigned cpu);
+
+    /**
+     * @brief SRQ (サービスリクエスト) による完了通知を有効にします。起動時、コマンドを投入する前に呼び出してください。
+     *        有効にすると、クエリは応答の準備ができたこと (STB の MAV) を SRQ で受けてから viRead を発行し、
+     *        設定コマンドには *OPC を付けて送り、次のコマンドの前に完了 (STB の ESB) を待ちます。
+     *        VISA の読み取りタイムアウトより長い操作 (単発取り込みなど) でも viRead がタイムアウトしなくなります。
+     *        完了を待つ間もワーカースレッドはそのジョブを実行中のままで、この計測器への他のジョブ (他のクライアントや
+     *        優先度の高いものも含む) は待ちが終わるまで実行されません。応答を読み出す前に次のコマンドを書き込むと
+     *        計測器側でクエリが中断されるため、待ちの間に割り込ませることはしません。他の計測器には影響しません。
+     * @param timeout 1回の完了待ちの上限。この計測器の他のジョブが待たされる最長時間でもあります。
+     * @return 計測器の設定とイベントハンドラの登録に成功した場合 true。失敗した場合は同期読み取りのままです。
+     */
+    bool enableServiceRequest(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief クエリを書き込んだ後、応答を読み取れる状態になるまで待ちます。SRQ が無効なら即座に VI_SUCCESS を返します。
+     *        ワーカースレッド上で呼び出してください。待つ間 (最長で enableServiceRequest の timeout) はワーカーを占有します。
+     * @return 待ちがタイムアウトした場合やワーカーが停止中の場合は VI_ERROR_TMO。
+     */
+    ViStatus awaitResponse();
+
+    /**
+     * @brief *OPC を付けて送った設定コマンドの完了を待ちます。待つものがなければ即座に VI_SUCCESS を返します。
+     *        ワーカースレッド上で、次のコマンドを書き込む前に呼び出してください。awaitResponse と同じくワーカーを占有します。
+     */
+    ViStatus awaitOperationComplete();
+
+    /**
+     * @brief 計測器からの SRQ を受け取るリスナーを登録します。リスナーはVISAのコールバックスレッドから、
+     *        SRQ のたびにシリアルポールで読んだステータスバイトとともに呼ばれます。
+     *        SRQ モード (enableServiceRequest) でなくてもイベントハンドラを登録するため、クライアントが設定した *SRE の SRQ も届きます。
+     * @return removeServiceRequestListener に渡す識別子。
+     */
+    std::size_t addServiceRequestListener(ServiceRequestListener listener);
+
+    /**
+     * @brief addServiceRequestListener で登録したリスナーを外します。戻った後はリスナーが呼ばれることはありません。
+     */
+    void removeServiceRequestListener(std::size_t id);
+
+    /**
+     * @brief owner のロックを要求します。要求は owner と priority のキューのジョブとして、先に投入したジョブの後に処理します。
+     *        他の投入元が両立しないロックを保持していれば、解放されるか、要求を処理し始めてから timeout が過ぎるまで待ちます。
+     *        すでにロックを保持している owner の要求は、保持しているロックのまま成功します。
+     * @param key 共有ロックのキー。同じキーの共有ロック同士だけが両立します。排他ロックでは使いません。
+     * @param done ワーカースレッドから呼ばれます。status は成功なら VI_SUCCESS、待ちのタイムアウトなら VI_ERROR_TMO、
+     *             それ以外は viLock のステータス。mode は保持しているロックの種類です。
+     */
+    void lock(const void* owner, LockMode mode, std::string key, std::chrono::milliseconds timeout, LockCallback done,
+        JobPriority priority = JobPriority::Normal);
+
+    /**
+     * @brief owner のロックを解放します。要求は owner と priority のキューのジョブとして、先に投入したジョブの後に処理します。
+     * @param done ワーカースレッドから呼ばれます。status は解放したなら VI_SUCCESS、ロックを保持していなければ VI_ERROR_SESN_NLOCKED。
+     *             mode は解放したロックの種類です。空でもかまいません。
+     */
+    void unlock(const void* owner, LockCallback done, JobPriority priority = JobPriority::Normal);
+
+    /**
+     * @brief 切断した投入元のロックを解放し、待っているロックの要求を取り消します (取り消した要求の done は呼びません)。
+     */
+    void releaseLocks(const void* owner);
+
+    /**
+     * @brief ロックの状態を返します。どのスレッドからでも呼び出せます。
+     * @param owner held に、この投入元がロックを保持しているかどうかを返します。
+     */
+    LockInfo lockInfo(const void* owner = nullptr);
+
+    /**
+     * @brief 実行中のジョブが応答用のバッファをプールの上限を超えて借りてよいかを返します。
+     *        上のクラスのジョブが待っている場合は、大きな応答を送信の完了を待たずに読み切ってセッションを早く譲るため。
+     *        実行中のジョブが High の場合は、遅いクライアントが送信待ちで抱えたバッファに待たされないためです。
+     *        ワーカースレッド上で呼び出してください。
+     */
+    bool mayExceedBufferLimit() const;
+
+    /**
+     * @brief ジョブが行ったVISA操作のステータスを知らせます。接続断を示すステータス (SessionManager::isConnectionLost) や、
+     *        タイムアウトが続いた場合はセッションの開き直しを始めます。ワーカースレッド上で呼び出してください。
+     */
+    void reportStatus(ViStatus status);
+
+    /**
+     * @brief キューに残っているジョブを実行し終えてからワーカースレッドを停止します。
+     */
+    void stop();
+
+    /**
+     * @brief この計測器の応答キャッシュ (既定では無効) を返します。
+     */
+    ResponseCache& cache() { return cache_; }
+
+    /**
+     * @brief この計測器の処理時間とスループットの統計を返します。
+     */
+    InstrumentMetrics& metrics() { return metrics_; }
+
+    /**
+     * @brief readResponse() で読み取り始めた応答の通し番号 (1 始まり) を払い出します。
+     */
+    uint64_t nextResponseSequence() { return responseSequence_.fetch_add(1) + 1; }
+
+    /**
+     * @brief 応答の受信をクライアントへの送信と重ねるための読み取り器を返します。ワーカースレッド上でのみ使ってください。
+     */
+    OverlappedReader& reader() { return reader_; }
+
+    /**
+     * @brief 応答をクライアントへ受け渡すためのバッファプールを返します。
+     */
+    BufferPool& buffers() { return buffers_; }
+
+    const std::string& name() const { return name_; }
+    const std::string& address() const { return address_; }
+
+private:
+    /**
+     * @brief キューの要素。job が空の場合はまとめ書きの対象となる設定コマンドです。
+     */
+    struct Entry {
+        Job job;
+        std::string command;
+        WriteCallback onWritten;
+        bool batchable = true; // 前後のコマンドと ';' で連結してよいか
+        bool lockControl = false; // lock() / unlock() の要求。他の投入元がロックを保持していても取り出す
+        std::chrono::steady_clock::time_point queuedAt; // キュー待ち時間の統計用
+    };
+
+    /**
+     * @brief 投入元と優先度クラスの組。キューの識別子です。
+     */
+    struct QueueKey {
+        JobPriority priority;
+        const void* owner;
+
+        bool operator<(const QueueKey& other) const {
+            return priority != other.priority ? priority < other.priority : owner < other.owner;
+        }
+    };
+
+    /**
+     * @brief 1つの投入元・クラスの FIFO。ready の間は ready_ の巡回順に key が入っています。
+     */
+    struct Queue {
+        std::deque<Entry> entries;
+        bool ready = false;
+    };
+
+    /**
+     * @brief 他の投入元のロックを待っているロックの要求。
+     */
+    struct LockRequest {
+        const void* owner;
+        LockMode mode;
+        std::string key;
+        std::chrono::steady_clock::time_point deadline;
+        LockCallback done;
+    };
+
+    void enqueue(QueueKey key, Entry entry); // mutex_ を保持して呼ぶ
+    bool dequeue(QueueKey& key, Entry& entry); // mutex_ を保持して呼ぶ
+    bool runnable(const QueueKey& key, const Queue& queue) const; // mutex_ を保持して呼ぶ
+    void enqueueLockControl(const void* owner, JobPriority priority, Job job);
+
+    /**
+     * @brief 以下のロックの操作はワーカースレッドから mutex_ を保持して呼びます。
+     *        viLock / viUnlock と done の呼び出しの間は mutex_ を外します。
+     */
+    void acquireLock(std::unique_lock<std::mutex>& lock, LockRequest request);
+    bool lockCompatible(const LockRequest& request) const;
+    ViStatus lockSession(std::unique_lock<std::mutex>& lock, const LockRequest& request);
+    /** @brief owner をロックの保持者から外し、待っている要求を取り消します。@return owner が保持していた場合 true。 */
+    bool releaseOwner(std::unique_lock<std::mutex>& lock, const void* owner, bool notifyWaiters);
+
+    /**
+     * @brief 両立するようになった待ち中のロックの要求を取り、タイムアウトした要求を失敗させます。
+     * @return 待ち中の要求のうち最も早い期限。待ち中の要求がなければ time_point::max()。
+     */
+    std::chrono::steady_clock::time_point serviceLockWaiters(std::unique_lock<std::mutex>& lock);
+    void run();
+    void flushWrites(std::unique_lock<std::mutex>& lock, QueueKey key, Entry first);
+
+    /**
+     * @brief STB の mask のいずれかのビットが立つまで、SRQ の通知を受けながら待ちます。
+     */
+    ViStatus waitForStatus(ViUInt16 mask);
+
+    /**
+     * @brief SRQ のイベントハンドラを登録します (登録済みなら何もしません)。
+     */
+    ViStatus installServiceRequestHandler();
+    void uninstallServiceRequestHandler();
+    ViStatus attachServiceRequestHandler(); // handlerMutex_ を保持して呼ぶ
+    void detachServiceRequestHandler();     // handlerMutex_ を保持して呼ぶ
+
+    /**
+     * @brief 開き直したセッションの準備ができていれば、イベントハンドラと SRQ の設定を移して切り替えます。
+     */
+    void replaceSession();
+
+    static ViStatus _VI_FUNCH onServiceRequest(ViSession vi, ViEventType eventType, ViEvent event, ViAddr userHandle);
+
+    ViSession session_; // ワーカースレッドが replaceSession で差し替える。ハンドラの登録と差し替えは handlerMutex_ で守る
+    std::string name_;
+    std::string address_;
+    ResponseCache cache_;
+    InstrumentMetrics metrics_;
+    std::atomic<uint64_t> responseSequence_{ 0 };
+    OverlappedReader reader_;
+    BufferPool buffers_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<QueueKey, Queue> queues_;
+    std::deque<const void*> ready_[JOB_PRIORITY_COUNT];  // クラスごとの、ジョブが待っている投入元の巡回順
+    unsigned overtaken_[JOB_PRIORITY_COUNT] = {};         // クラスごとの、ジョブが待っている間に上のクラスが実行された回数
+    std::atomic<std::size_t> waiting_[JOB_PRIORITY_COUNT] = {}; // クラスごとの待っているジョブの数
+    std::atomic<int> running_{ static_cast<int>(JobPriority::Normal) }; // 実行中のジョブのクラス
+
+    // ロック (mutex_ で守る)。lockHolders_ が空でなければ、保持している投入元のジョブだけを取り出す
+    std::set<const void*> lockHolders_;
+    LockMode lockMode_ = LockMode::Exclusive;
+    std::string lockKey_;
+    std::deque<LockRequest> lockWaiters_;
+    std::atomic<bool> locked_{ false };
+
+    std::atomic<bool> stopping_{ false };
+    std::atomic<long long> batchWindowUs_{ 0 };
+    std::thread worker_;
+
+    // 接続断からの復旧 (ワーカースレッドのみが操作)
+    SessionManager* sessions_;
+    bool sessionLost_ = false;
+    unsigned consecutiveTimeouts_ = 0;
+
+    // SRQ による完了通知。srqSignalled_ はVISAのコールバックスレッドから立てられる
+    std::atomic<bool> srqEnabled_{ false };
+    std::chrono::milliseconds srqTimeout_{ 0 };
+    std::mutex srqMutex_;
+    std::condition_variable srqCv_;
+    bool srqSignalled_ = false;
+    bool operationPending_ = false; // *OPC の完了待ちがあるか (ワーカースレッドのみが操作)
+
+    // SRQ のイベントハンドラの登録状態と、SRQ を外部へ知らせるリスナー
+    std::mutex handlerMutex_;
+    bool handlerInstalled_ = false;
+    std::mutex listenersMutex_;
+    std::map<std::size_t, ServiceRequestListener> srqListeners_;
+    std::size_t nextListenerId_ = 1;
+};
+
+/**
+ * @brief 応答データの送出先。ワーカースレッドから呼ばれ、バッファ (size() バイトが有効) を送信キューへ渡して即座に戻ります。
+ *        バッファは送信が終わるとプールへ返却されます。false を返すと、それ以降の応答はクライアントへ送られません。
+ */
+using ResponseSink = std::function<bool(BufferPool::Buffer buffer)>;
+
+/**
+ * @brief 1つの応答の通し番号と、VISA 呼び出しが戻った時刻 (steady_clock)。
+ *        複数の計測器の測定の時刻合わせや、応答の欠落・順序の入れ替わりの検出のためにクライアントへ返します。
+ *        通し番号は計測器ごとに readResponse() が払い出します。計測していない値は 0 / 初期値のままです。
+ */
+struct ResponseTiming {
+    uint64_t sequence = 0;
+    std::chrono::steady_clock::time_point written;   // viWrite が戻った時刻
+    std::chrono::steady_clock::time_point firstRead; // 応答の最初の viRead が戻った時刻
+    std::chrono::steady_clock::time_point lastRead;  // END を受けた viRead が戻った時刻
+};
+
+/**
+ * @brief steady_clock の時刻を、サーバー内で共通の単調増加のナノ秒に変換します。初期値 (未計測) は 0 です。
+ */
+uint64_t monotonicNanoseconds(std::chrono::steady_clock::time_point time);
+
+/**
+ * @brief 前の設定コマンドの完了を待ってから、1つのコマンドを計測器に書き込みます。応答は読み取りません。
+ *        ワーカースレッド上で呼び出してください。
+ * @param instr 通信対象のVISA計測器セッション。
+ * @param command 改行を含まないコマンド文字列。
+ * @param instrument instr を所有する計測器。
+ * @param error 失敗した場合に、クライアントへ返すエラーメッセージが格納されます。
+ * @param timing nullptr 以外なら、viWrite が戻った時刻を written に記録します。
+ * @return viWrite (または完了待ち) のステータス。
+ */
+ViStatus writeCommand(ViSession instr, const std::string& command, Instrument& instrument, std::string& error,
+    ResponseTiming* timing = nullptr);
+
+/**
+ * @brief 計測器の応答をENDまでチャンク単位で読み取りながら sink へ転送します。ワーカースレッド上で呼び出してください。
+ *        上のクラスのジョブが待っている間は、チャンクの区切りからクライアントへの送信を待たずに (プールの外のバッファへ) 読み進め、
+ *        遅いクライアントへの大きな転送がセッションを占有し続けないようにします (Instrument::mayExceedBufferLimit)。
+ * @param error 失敗した場合に、クライアントへ返す改行で終わるエラーメッセージが格納されます。応答の途中で失敗した場合も、
+ *              sink へ渡し済みの部分に続けて送るために格納します。sink が false を返して打ち切った場合は空のままです。
+ * @param timing nullptr 以外なら、応答の通し番号と viRead が戻った時刻を記録します。最初のチャンクを sink へ渡す時点で
+ *               sequence と firstRead は記録済みです。
+ * @return 最後の viRead のステータス。失敗した場合は VI_SUCCESS 未満。
+ */
+ViStatus readResponse(ViSession instr, const ResponseSink& sink, Instrument& instrument, std::string& error,
+    ResponseTiming* timing = nullptr);
+
+/**
+ * @brief 1つのコマンドを計測器に送信し、クエリであれば応答をENDまでチャンク単位で読み取りながら sink へ転送します。
+ *        応答全体をメモリに溜めないため、数MBの波形データでも先頭から順に送信されます。ワーカースレッド上で呼び出してください。
+ *        読み取ったバッファは送信完了を待たずに sink へ渡し、すぐに次を読むため、計測器からの受信とクライアントへの送信が重なり、
+ *        大きな応答の転送時間は計測器側とネットワーク側の遅い方に近づきます。使用メモリは計測器のバッファプールの上限に収まります。
+ * @param instr 通信対象のVISA計測器セッション。
+ * @param command 改行を含まないコマンド文字列。
+ * @param sink クライアントへの応答の送出先。
+ * @param instrument instr を所有する計測器。統計の記録と、SRQ が有効な場合の完了待ちに使います。
+ * @param timing nullptr 以外なら、writeCommand() / readResponse() の時刻と通し番号を記録します。
+ * @return 最後に実行したVISA操作のステータス。書き込みまたは読み取りに失敗した場合は VI_SUCCESS 未満。
+ */
+ViStatus executeCommand(ViSession instr, const std::string& command, const ResponseSink& sink, Instrument& instrument,
+    ResponseTiming* timing = nullptr);
@@ -0,0 +1,117 @@
+﻿#include "InstrumentPool.h"
+
+#include "Logger.h"
+#include "StringUtil.h"
+
+#include <algorithm>
+#include <cctype>
+
+InstrumentPool::~InstrumentPool() {
+    closeAll();
+}
+
+Instrument* InstrumentPool::open(ViSession resourceManager, const std::string& name, const std::string& address,
+    const SessionSettings& settings, const Configure& configure) {
+    auto sessions = std::make_unique<SessionManager>(resourceManager, name, address, settings);
+    ViStatus status = sessions->open();
+
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("VISAデバイスのオープンに失敗しました: " << address << " (Status: " << status << ")");
+        return nullptr;
+    }
+
+    LOG_INFO("計測器のオープンに成功: " << name << " = " << address);
+
+    auto instrument = std::make_unique<Instrument>(sessions->session(), name, address,
+        settings.chunkSize ? *settings.chunkSize : Instrument::DEFAULT_CHUNK_SIZE, sessions.get());
+    Instrument* added = instrument.get();
+    if (configure) {
+        configure(*added);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    instruments_.push_back(std::move(instrument));
+    sessions_.push_back(std::move(sessions));
+    return added;
+}
+
+Instrument* InstrumentPool::find(const std::string& selector) const {
+    const std::string lowerSelector = toLower(trim(selector));
+    if (lowerSelector.empty()) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& instrument : instruments_) {
+        if (toLower(instrument->name()) == lowerSelector) {
+            return instrument.get();
+        }
+    }
+
+    if (lowerSelector.size() <= 4
+        && std::all_of(lowerSelector.begin(), lowerSelector.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        const size_t index = std::stoul(lowerSelector);
+        if (index >= 1 && index <= instruments_.size()) {
+            return instruments_[index - 1].get();
+        }
+    }
+
+    return nullptr;
+}
+
+Instrument* InstrumentPool::defaultInstrument() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return instruments_.empty() ? nullptr : instruments_.front().get();
+}
+
+Instrument* InstrumentPool::at(std::size_t index) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index < instruments_.size() ? instruments_[index].get() : nullptr;
+}
+
+std::vector<Instrument*> InstrumentPool::instruments() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Instrument*> result;
+    result.reserve(instruments_.size());
+    for (const auto& instrument : instruments_) {
+        result.push_back(instrument.get());
+    }
+    return result;
+}
+
+Instrument* InstrumentPool::findByAddress(const std::string& address) const {
+    const std::string lowerAddress = toLower(address);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& instrument : instruments_) {
+        if (toLower(instrument->address()) == lowerAddress) {
+            return instrument.get();
+        }
+    }
+    return nullptr;
+}
+
+std::size_t InstrumentPool::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return instruments_.size();
+}
+
+void InstrumentPool::stopAll() {
+    for (Instrument* instrument : instruments()) {
+        instrument->stop();
+    }
+}
+
+void InstrumentPool::closeAll() {
+    // 停止はワーカーの完了を待つため、ロックの外で行う
+    std::vector<std::unique_ptr<Instrument>> instruments;
+    std::vector<std::unique_ptr<SessionManager>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        instruments.swap(instruments_);
+        sessions.swap(sessions_);
+    }
+    for (auto& instrument : instruments) {
+        instrument->stop();
+    }
+    instruments.clear();
+    sessions.clear();
+}
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include "Instrument.h"
+#include "SessionManager.h"
+
+#include <visa.h>
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief サーバーが公開するすべての計測器を保持するクラス。
+ *        計測器ごとにセッションとワーカースレッドを持つため、遅い計測器への通信が他の計測器を妨げません。
+ *        計測器は動作中にも追加できます (ResourceWatcher)。追加した計測器は closeAll() まで削除しないため、
+ *        取得した Instrument* は closeAll() まで有効です。closeAll() 以外はどのスレッドからでも呼び出せます。
+ */
+class InstrumentPool {
+public:
+    InstrumentPool() = default;
+    ~InstrumentPool();
+
+    InstrumentPool(const InstrumentPool&) = delete;
+    InstrumentPool& operator=(const InstrumentPool&) = delete;
+
+    /**
+     * @brief 追加する計測器の初期設定 (SRQ、キャッシュなど)。クライアントのジョブが届く前に呼ばれます。
+     */
+    using Configure = std::function<void(Instrument& instrument)>;
+
+    /**
+     * @brief 計測器のセッションを開き、configure で初期設定してからプールに追加します。
+     *        追加するまではクライアントから見えないため、Instrument::enableServiceRequest なども安全に呼べます。
+     * @param resourceManager VISAリソースマネージャのセッション。
+     * @param name クライアントが宛先として指定する計測器名。
+     * @param address 計測器のリソース記述子。
+     * @param settings オープン直後に設定する属性。設定に失敗した属性は警告を出して既定値のまま使います。
+     * @param configure 空でなければ、プールに追加する前に呼びます。その時点の size() はこの計測器を含みません。
+     * @return 追加した計測器。オープンに失敗した場合は nullptr。
+     */
+    Instrument* open(ViSession resourceManager, const std::string& name, const std::string& address,
+        const SessionSettings& settings = SessionSettings(), const Configure& configure = Configure());
+
+    /**
+     * @brief 名前 (大文字小文字を区別しない) または1始まりの番号で計測器を探します。
+     * @return 見つかった計測器。見つからない場合は nullptr。
+     */
+    Instrument* find(const std::string& selector) const;
+
+    /**
+     * @brief 宛先を指定しないコマンドの送り先 (最初に追加された計測器) を返します。プールが空の場合は nullptr。
+     */
+    Instrument* defaultInstrument() const;
+
+    /**
+     * @brief 0始まりの番号 index の計測器を返します。範囲外の場合は nullptr。
+     */
+    Instrument* at(std::size_t index) const;
+
+    /**
+     * @brief 現在の計測器の一覧 (追加順) を返します。
+     */
+    std::vector<Instrument*> instruments() const;
+
+    /**
+     * @brief address のリソースを開いている計測器を返します。見つからない場合は nullptr。
+     */
+    Instrument* findByAddress(const std::string& address) const;
+
+    std::size_t size() const;
+    bool empty() const { return size() == 0; }
+
+    /**
+     * @brief すべてのワーカースレッドを停止します。キューに残ったジョブを実行し終えてから止まり、以後に投入したジョブは実行されません。
+     *        計測器は closeAll() まで残るため、接続のオブジェクトを破棄する前に呼び出せます。
+     */
+    void stopAll();
+
+    /**
+     * @brief すべてのワーカースレッドを停止し、計測器のセッションを閉じます。
+     */
+    void closeAll();
+
+private:
+    mutable std::mutex mutex_; // instruments_ と sessions_ の追加と参照を守る
+    std::vector<std::unique_ptr<Instrument>> instruments_;
+    std::vector<std::unique_ptr<SessionManager>> sessions_; // instruments_ と同じ順序。計測器の停止後に破棄してセッションを閉じる
+};
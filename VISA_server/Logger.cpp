@@ -0,0 +1,219 @@
+﻿#include "Logger.h"
+
+#include <cctype>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : slots_(new Slot[CAPACITY]) {
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+Logger::~Logger() {
+    stop();
+}
+
+bool Logger::start(LogLevel level, const std::string& filePath) {
+    setLevel(level);
+
+    bool fileOk = true;
+    if (!filePath.empty()) {
+        file_.open(filePath, std::ios::app);
+        fileOk = file_.is_open();
+    }
+
+    stopping_ = false;
+    running_ = true;
+    thread_ = std::thread([this] { run(); });
+    return fileOk;
+}
+
+void Logger::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    stopping_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (file_.is_open()) {
+        file_.close();
+    }
+}
+
+void Logger::flush() {
+    const size_t target = written_.load();
+    while (running_.load() && flushed_.load() < target) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::cout.flush();
+}
+
+void Logger::write(LogLevel level, std::string message) {
+    Record record{ level, std::chrono::system_clock::now(), std::move(message) };
+
+    if (!running_.load()) {
+        std::lock_guard<std::mutex> lock(outputMutex_);
+        output(record);
+        return;
+    }
+
+    if (tryPush(record)) {
+        written_.fetch_add(1);
+    }
+    else {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool Logger::tryPush(Record& record) {
+    // 境界付き MPMC キュー (Vyukov 方式): スロットごとのシーケンス番号で所有権を受け渡す
+    size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    while (true) {
+        Slot& slot = slots_[pos & (CAPACITY - 1)];
+        const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+        if (diff == 0) {
+            if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.record = std::move(record);
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) {
+            return false; // 満杯
+        }
+        else {
+            pos = enqueuePos_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool Logger::tryPop(Record& record) {
+    // 取り出すのは出力スレッドだけ
+    const size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[pos & (CAPACITY - 1)];
+    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1) < 0) {
+        return false; // 空
+    }
+
+    record = std::move(slot.record);
+    dequeuePos_.store(pos + 1, std::memory_order_relaxed);
+    slot.sequence.store(pos + CAPACITY, std::memory_order_release);
+    return true;
+}
+
+void Logger::run() {
+    Record record;
+    while (true) {
+        bool any = false;
+        {
+            std::lock_guard<std::mutex> lock(outputMutex_);
+            while (tryPop(record)) {
+                output(record);
+                flushed_.fetch_add(1);
+                any = true;
+            }
+
+            const size_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                output({ LogLevel::Warning, std::chrono::system_clock::now(),
+                         "ログバッファが満杯のため " + std::to_string(dropped) + " 件のログを破棄しました" });
+            }
+            if (any) {
+                std::cout.flush();
+                if (file_.is_open()) {
+                    file_.flush();
+                }
+            }
+        }
+
+        if (!any) {
+            if (stopping_.load()) {
+                return;
+            }
+            // 書き込み側を待たせないよう通知は使わず、短い間隔で取り出しに行く
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
+
+void Logger::output(const Record& record) {
+    // コンソールは従来どおり本文のみ、ファイルには時刻とレベルを付ける
+    std::ostream& console = record.level >= LogLevel::Warning ? std::cerr : std::cout;
+    console << record.message << '\n';
+
+    if (file_.is_open()) {
+        const std::time_t t = std::chrono::system_clock::to_time_t(record.time);
+        std::tm local{};
+#ifdef _WIN32
+        localtime_s(&local, &t);
+#else
+        localtime_r(&t, &local);
+#endif
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(record.time.time_since_epoch()).count() % 1000;
+        static const char* const names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+        file_ << std::put_time(&local, "%Y-%m-%d %H:%M:%S") << '.' << std::setw(3) << std::setfill('0') << ms
+              << " [" << names[static_cast<int>(record.level)] << "] " << record.message << '\n';
+    }
+}
+
+bool Logger::parseLevel(const std::string& text, LogLevel& level) {
+    std::string lower;
+    for (char c : text) {
+        lower += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+
+    if (lower == "debug") { level = LogLevel::Debug; return true; }
+    if (lower == "info") { level = LogLevel::Info; return true; }
+    if (lower == "warn" || lower == "warning") { level = LogLevel::Warning; return true; }
+    if (lower == "error") { level = LogLevel::Error; return true; }
+    return false;
+}
+
+std::string summarizePayload(const char* data, size_t size, size_t limit) {
+    size_t printable = 0;
+    for (size_t i = 0; i < size && i < limit; ++i) {
+        const unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c >= 0x20 || c == '\r' || c == '\n' || c == '\t') {
+            ++printable;
+        }
+    }
+
+    std::ostringstream out;
+    const size_t shown = size < limit ? size : limit;
+    if (printable == shown) {
+        for (size_t i = 0; i < shown; ++i) {
+            if (data[i] == '\n') {
+                out << "\\n";
+            }
+            else if (data[i] == '\r') {
+                out << "\\r";
+            }
+            else {
+                out << data[i];
+            }
+        }
+        if (size > shown) {
+            out << "... (" << size << " バイト)";
+        }
+        return out.str();
+    }
+
+    // バイナリは先頭16バイトの16進ダンプだけを表示する
+    out << "<バイナリ " << size << " バイト:";
+    for (size_t i = 0; i < size && i < 16; ++i) {
+        out << ' ' << std::hex << std::setw(2) << std::setfill('0')
+            << static_cast<unsigned>(static_cast<unsigned char>(data[i]));
+    }
+    out << (size > 16 ? " ...>" : ">");
+    return out.str();
+}
@@ -0,0 +1,122 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/**
+ * @brief ログの重要度。設定したレベル未満のログは書式化もされずに捨てられます。
+ */
+enum class LogLevel {
+    Debug = 0,
+    Info = 1,
+    Warning = 2,
+    Error = 3,
+};
+
+/**
+ * @brief 非同期ロガー。
+ *        ログはロックフリーのリングバッファに積むだけで呼び出し元に戻り、コンソールやファイルへの出力は
+ *        バックグラウンドスレッドが行います。計測器のワーカースレッドがコンソールI/Oで待たされることはありません。
+ *        リングバッファが満杯の場合、そのログは破棄され、破棄件数だけが後で報告されます。
+ */
+class Logger {
+public:
+    static Logger& instance();
+
+    /**
+     * @brief 出力スレッドを開始します。start 前のログはコンソールに直接出力されます。
+     * @param level 出力する最低レベル。
+     * @param filePath ログファイルのパス。空の場合はコンソールのみに出力します。
+     * @return ログファイルを開けなかった場合 false (コンソール出力は行われます)。
+     */
+    bool start(LogLevel level, const std::string& filePath);
+
+    /**
+     * @brief 溜まっているログをすべて出力してから出力スレッドを停止します。
+     */
+    void stop();
+
+    /**
+     * @brief それまでに積まれたログがすべて出力されるまで待ちます。コンソールに直接表示する前に使います。
+     */
+    void flush();
+
+    bool enabled(LogLevel level) const { return static_cast<int>(level) >= level_.load(std::memory_order_relaxed); }
+    void setLevel(LogLevel level) { level_.store(static_cast<int>(level)); }
+
+    /**
+     * @brief ログを1件積みます。任意のスレッドから呼び出せます。
+     */
+    void write(LogLevel level, std::string message);
+
+    /**
+     * @brief "debug" / "info" / "warn" / "error" をログレベルに変換します。
+     * @return 解釈できた場合 true。
+     */
+    static bool parseLevel(const std::string& text, LogLevel& level);
+
+private:
+    // リングバッファの容量 (2のべき乗)
+    static constexpr size_t CAPACITY = 8192;
+
+    struct Record {
+        LogLevel level = LogLevel::Info;
+        std::chrono::system_clock::time_point time;
+        std::string message;
+    };
+
+    struct Slot {
+        std::atomic<size_t> sequence{ 0 };
+        Record record;
+    };
+
+    Logger();
+    ~Logger();
+
+    bool tryPush(Record& record);
+    bool tryPop(Record& record);
+    void run();
+    void output(const Record& record);
+
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<size_t> enqueuePos_{ 0 };
+    alignas(64) std::atomic<size_t> dequeuePos_{ 0 };
+    std::atomic<size_t> dropped_{ 0 };
+    std::atomic<size_t> written_{ 0 };
+    std::atomic<size_t> flushed_{ 0 };
+    std::atomic<int> level_{ static_cast<int>(LogLevel::Info) };
+    std::atomic<bool> running_{ false };
+    std::atomic<bool> stopping_{ false };
+
+    std::mutex outputMutex_; // start 前の直接出力と出力スレッドの排他
+    std::ofstream file_;
+    std::thread thread_;
+};
+
+/**
+ * @brief 応答データをログ表示用に要約します。
+ *        印字可能な短いテキストはそのまま (改行は \n と表記)、長いテキストは先頭だけ、バイナリは先頭の16進ダンプとサイズを返します。
+ */
+std::string summarizePayload(const char* data, size_t size, size_t limit = 120);
+
+// レベルが有効な場合だけ書式化してログに積むマクロ。例: LOG_INFO("受信: " << command);
+#define VISA_LOG(level, expr)                                            \
+    do {                                                                 \
+        if (Logger::instance().enabled(level)) {                         \
+            std::ostringstream visa_log_stream_;                         \
+            visa_log_stream_ << expr;                                    \
+            Logger::instance().write(level, visa_log_stream_.str());     \
+        }                                                                \
+    } while (0)
+
+#define LOG_DEBUG(expr) VISA_LOG(LogLevel::Debug, expr)
+#define LOG_INFO(expr) VISA_LOG(LogLevel::Info, expr)
+#define LOG_WARN(expr) VISA_LOG(LogLevel::Warning, expr)
+#define LOG_ERROR(expr) VISA_LOG(LogLevel::Error, expr)
@@ -0,0 +1,264 @@
+﻿#include "Lz4.h"
+
+#include <cstring>
+
+namespace {
+
+constexpr std::uint32_t PRIME32_1 = 2654435761U;
+constexpr std::uint32_t PRIME32_2 = 2246822519U;
+constexpr std::uint32_t PRIME32_3 = 3266489917U;
+constexpr std::uint32_t PRIME32_4 = 668265263U;
+constexpr std::uint32_t PRIME32_5 = 374761393U;
+
+constexpr std::uint32_t LZ4_FRAME_MAGIC = 0x184D2204;
+
+// LZ4 のブロック形式の制約。一致は4バイト以上で、最後の12バイトからは始められず、最後の5バイトは必ずリテラル
+constexpr std::size_t MIN_MATCH = 4;
+constexpr std::size_t MF_LIMIT = 12;
+constexpr std::size_t LAST_LITERALS = 5;
+constexpr std::size_t MAX_DISTANCE = 65535;
+
+// ハッシュ表の大きさ (2^12 項目、16 KiB)。一致を探すのは直近に同じハッシュだった位置だけ
+constexpr unsigned HASH_LOG = 12;
+
+// 一致が見つからない間は、進んだ距離に応じて調べる間隔を広げ、圧縮できないデータを速く通す
+constexpr unsigned SKIP_STRENGTH = 6;
+
+std::uint32_t rotl32(std::uint32_t value, unsigned bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+std::uint32_t read32(const unsigned char* p) {
+    std::uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+std::uint32_t readLE32(const unsigned char* p) {
+    return static_cast<std::uint32_t>(p[0]) | (static_cast<std::uint32_t>(p[1]) << 8)
+        | (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+}
+
+void appendLE32(std::uint32_t value, std::string& out) {
+    const char bytes[4] = { static_cast<char>(value), static_cast<char>(value >> 8),
+        static_cast<char>(value >> 16), static_cast<char>(value >> 24) };
+    out.append(bytes, sizeof(bytes));
+}
+
+std::uint32_t hashPosition(std::uint32_t sequence) {
+    return (sequence * PRIME32_1) >> (32 - HASH_LOG);
+}
+
+/**
+ * @brief リテラル長または一致長の 15 以上の部分を 255 単位の追加バイトで書きます。
+ */
+unsigned char* writeLength(unsigned char* op, std::size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = static_cast<unsigned char>(length);
+    return op;
+}
+
+} // namespace
+
+std::uint32_t xxh32(const void* data, std::size_t size, std::uint32_t seed) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* const end = p + size;
+    std::uint32_t hash;
+
+    if (size >= 16) {
+        std::uint32_t v1 = seed + PRIME32_1 + PRIME32_2;
+        std::uint32_t v2 = seed + PRIME32_2;
+        std::uint32_t v3 = seed;
+        std::uint32_t v4 = seed - PRIME32_1;
+        const unsigned char* const limit = end - 16;
+        do {
+            v1 = rotl32(v1 + readLE32(p) * PRIME32_2, 13) * PRIME32_1;
+            v2 = rotl32(v2 + readLE32(p + 4) * PRIME32_2, 13) * PRIME32_1;
+            v3 = rotl32(v3 + readLE32(p + 8) * PRIME32_2, 13) * PRIME32_1;
+            v4 = rotl32(v4 + readLE32(p + 12) * PRIME32_2, 13) * PRIME32_1;
+            p += 16;
+        } while (p <= limit);
+        hash = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    }
+    else {
+        hash = seed + PRIME32_5;
+    }
+
+    hash += static_cast<std::uint32_t>(size);
+    for (; p + 4 <= end; p += 4) {
+        hash = rotl32(hash + readLE32(p) * PRIME32_3, 17) * PRIME32_4;
+    }
+    for (; p < end; ++p) {
+        hash = rotl32(hash + *p * PRIME32_5, 11) * PRIME32_1;
+    }
+
+    hash ^= hash >> 15;
+    hash *= PRIME32_2;
+    hash ^= hash >> 13;
+    hash *= PRIME32_3;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+std::size_t lz4CompressBound(std::size_t size) {
+    return size + size / 255 + 16;
+}
+
+std::size_t lz4CompressBlock(const char* src, std::size_t size, char* dst, std::size_t capacity) {
+    // 表には入力の先頭からの位置を入れる。呼び出しごとに消すため、前の入力の位置を誤って参照しない
+    thread_local std::uint32_t table[1 << HASH_LOG];
+    std::memset(table, 0, sizeof(table));
+
+    const unsigned char* const base = reinterpret_cast<const unsigned char*>(src);
+    const unsigned char* const end = base + size;
+    const unsigned char* anchor = base;
+    unsigned char* op = reinterpret_cast<unsigned char*>(dst);
+    unsigned char* const oend = op + capacity;
+
+    if (size > MF_LIMIT) {
+        const unsigned char* const matchStartLimit = end - MF_LIMIT;
+        const unsigned char* const matchEndLimit = end - LAST_LITERALS;
+        const unsigned char* ip = base + 1;
+
+        while (ip < matchStartLimit) {
+            const std::uint32_t sequence = read32(ip);
+            const std::uint32_t h = hashPosition(sequence);
+            const unsigned char* ref = base + table[h];
+            table[h] = static_cast<std::uint32_t>(ip - base);
+
+            if (ref >= ip || static_cast<std::size_t>(ip - ref) > MAX_DISTANCE || read32(ref) != sequence) {
+                ip += 1 + (static_cast<std::size_t>(ip - anchor) >> SKIP_STRENGTH);
+                continue;
+            }
+
+            // 一致を前後に伸ばす
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            std::size_t matchLength = MIN_MATCH;
+            while (ip + matchLength < matchEndLimit && ip[matchLength] == ref[matchLength]) {
+                ++matchLength;
+            }
+
+            // シーケンス: トークン、リテラル長の追加分、リテラル、距離 (リトルエンディアン16ビット)、一致長の追加分
+            const std::size_t literals = static_cast<std::size_t>(ip - anchor);
+            if (op + 1 + literals / 255 + 1 + literals + 2 + (matchLength - MIN_MATCH) / 255 + 1 > oend) {
+                return 0;
+            }
+            unsigned char* token = op++;
+            *token = 0;
+            if (literals >= 15) {
+                *token = 15 << 4;
+                op = writeLength(op, literals - 15);
+            }
+            else {
+                *token = static_cast<unsigned char>(literals << 4);
+            }
+            std::memcpy(op, anchor, literals);
+            op += literals;
+
+            const std::size_t distance = static_cast<std::size_t>(ip - ref);
+            *op++ = static_cast<unsigned char>(distance);
+            *op++ = static_cast<unsigned char>(distance >> 8);
+
+            const std::size_t extra = matchLength - MIN_MATCH;
+            if (extra >= 15) {
+                *token |= 15;
+                op = writeLength(op, extra - 15);
+            }
+            else {
+                *token |= static_cast<unsigned char>(extra);
+            }
+
+            ip += matchLength;
+            anchor = ip;
+            if (ip < matchStartLimit) {
+                // 一致の直後の位置も登録し、続く繰り返しを見つけやすくする
+                table[hashPosition(read32(ip - 2))] = static_cast<std::uint32_t>(ip - 2 - base);
+            }
+        }
+    }
+
+    // 最後のシーケンスはリテラルだけ
+    const std::size_t literals = static_cast<std::size_t>(end - anchor);
+    if (op + 1 + literals / 255 + 1 + literals > oend) {
+        return 0;
+    }
+    if (literals >= 15) {
+        *op++ = 15 << 4;
+        op = writeLength(op, literals - 15);
+    }
+    else {
+        *op++ = static_cast<unsigned char>(literals << 4);
+    }
+    std::memcpy(op, anchor, literals);
+    op += literals;
+
+    return static_cast<std::size_t>(op - reinterpret_cast<unsigned char*>(dst));
+}
+
+std::string lz4FrameHeader(std::size_t blockSize) {
+    // FLG: バージョン 01、ブロック独立。BD: ブロックの最大サイズ (4 = 64 KiB ... 7 = 4 MiB)
+    unsigned sizeCode = 4;
+    while (sizeCode < 7 && (static_cast<std::size_t>(1) << (8 + 2 * sizeCode)) < blockSize) {
+        ++sizeCode;
+    }
+    const unsigned char descriptor[2] = { 0x60, static_cast<unsigned char>(sizeCode << 4) };
+
+    std::string header;
+    appendLE32(LZ4_FRAME_MAGIC, header);
+    header.append(reinterpret_cast<const char*>(descriptor), sizeof(descriptor));
+    header += static_cast<char>((xxh32(descriptor, sizeof(descriptor), 0) >> 8) & 0xFF);
+    return header;
+}
+
+void lz4AppendBlockHeader(std::uint32_t size, bool compressed, std::string& out) {
+    appendLE32(compressed ? size : (size | 0x80000000U), out);
+}
+
+bool lz4AppendCompressedBlock(const char* src, std::size_t size, std::string& out) {
+    if (size == 0) {
+        return false;
+    }
+    const std::size_t headerAt = out.size();
+    out.resize(headerAt + 4 + lz4CompressBound(size));
+
+    // 圧縮しても小さくならなければ使わない (非圧縮のブロックなら伸長側はそのまま写すだけで済む)
+    const std::size_t compressed = lz4CompressBlock(src, size, &out[headerAt + 4], size - 1);
+    if (compressed == 0) {
+        out.resize(headerAt);
+        return false;
+    }
+    const std::uint32_t blockSize = static_cast<std::uint32_t>(compressed);
+    for (int i = 0; i < 4; ++i) {
+        out[headerAt + i] = static_cast<char>(blockSize >> (8 * i));
+    }
+    out.resize(headerAt + 4 + compressed);
+    return true;
+}
+
+void lz4AppendBlocks(const char* src, std::size_t size, std::size_t blockSize, std::string& out) {
+    if (blockSize == 0 || blockSize > LZ4_MAX_BLOCK_SIZE) {
+        blockSize = LZ4_MAX_BLOCK_SIZE;
+    }
+
+    for (std::size_t offset = 0; offset < size; offset += blockSize) {
+        const std::size_t length = size - offset < blockSize ? size - offset : blockSize;
+        if (!lz4AppendCompressedBlock(src + offset, length, out)) {
+            lz4AppendBlockHeader(static_cast<std::uint32_t>(length), false, out);
+            out.append(src + offset, length);
+        }
+    }
+}
+
+std::string lz4EncodeFrame(const std::string& data) {
+    const std::size_t blockSize = 64 * 1024;
+    std::string frame = lz4FrameHeader(blockSize);
+    lz4AppendBlocks(data.data(), data.size(), blockSize, frame);
+    frame.append(LZ4_FRAME_END, sizeof(LZ4_FRAME_END));
+    return frame;
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// LZ4 フレームの1ブロックの最大バイト数 (フレーム記述子で指定できる最大値)
+constexpr std::size_t LZ4_MAX_BLOCK_SIZE = 4 * 1024 * 1024;
+
+// LZ4 フレームの終端 (EndMark)。大きさ 0 のブロック
+constexpr char LZ4_FRAME_END[4] = { 0, 0, 0, 0 };
+
+/**
+ * @brief xxHash32 を計算します。LZ4 フレーム記述子のヘッダチェックサムに使います。
+ */
+std::uint32_t xxh32(const void* data, std::size_t size, std::uint32_t seed);
+
+/**
+ * @brief LZ4 ブロック形式の圧縮後の最大バイト数を返します。
+ */
+std::size_t lz4CompressBound(std::size_t size);
+
+/**
+ * @brief src を LZ4 ブロック形式で圧縮します (高速な貪欲法、辞書なし)。ハッシュ表はスレッドごとに持つため、どのスレッドからでも呼び出せます。
+ * @param size LZ4_MAX_BLOCK_SIZE 以下のバイト数。
+ * @return 圧縮後のバイト数。capacity に収まらない場合は 0。
+ */
+std::size_t lz4CompressBlock(const char* src, std::size_t size, char* dst, std::size_t capacity);
+
+/**
+ * @brief LZ4 フレームの先頭 (マジックナンバーとフレーム記述子) を返します。
+ *        ブロックは互いに独立で、内容のチェックサムは付けません。
+ * @param blockSize フレーム中のブロックの最大バイト数。記述子には 64 KiB / 256 KiB / 1 MiB / 4 MiB のうちこれ以上で最小のものを書きます。
+ */
+std::string lz4FrameHeader(std::size_t blockSize);
+
+/**
+ * @brief ブロックの先頭 (ブロックの大きさと、非圧縮なら最上位ビット) を out の末尾に追加します。
+ */
+void lz4AppendBlockHeader(std::uint32_t size, bool compressed, std::string& out);
+
+/**
+ * @brief src を1つの圧縮ブロック (先頭を含む) として out の末尾に追加します。
+ * @param size LZ4_MAX_BLOCK_SIZE 以下のバイト数。
+ * @return 圧縮して小さくなり、追加した場合 true。false なら out は変わらないため、呼び出し側で非圧縮のブロックとして送ってください。
+ */
+bool lz4AppendCompressedBlock(const char* src, std::size_t size, std::string& out);
+
+/**
+ * @brief src を1つ以上のブロックとして圧縮し、out の末尾に追加します。圧縮しても小さくならないブロックは非圧縮のまま書きます。
+ * @param blockSize 1ブロックの最大バイト数。lz4FrameHeader() に渡した値以下にしてください。
+ */
+void lz4AppendBlocks(const char* src, std::size_t size, std::size_t blockSize, std::string& out);
+
+/**
+ * @brief data 全体を1つの LZ4 フレーム (先頭、ブロック、終端) にして返します。
+ */
+std::string lz4EncodeFrame(const std::string& data);
@@ -0,0 +1,366 @@
+﻿#include "Macro.h"
+
+#include "Logger.h"
+#include "ScpiParser.h"
+#include "StringUtil.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace {
+
+// %OPC のタイムアウトを省略した場合の値
+constexpr std::chrono::milliseconds DEFAULT_OPC_TIMEOUT{ 60000 };
+
+// %WAITFOR で問い合わせを繰り返す間隔
+constexpr std::chrono::milliseconds WAITFOR_POLL_INTERVAL{ 50 };
+
+// 1回の実行で集めるクエリの応答の合計の上限。波形のような大きな応答は通常のクエリで取得する
+constexpr std::size_t MAX_RESULT_SIZE = 16 * 1024 * 1024;
+
+bool isVariableName(const std::string& name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+        return false;
+    }
+    for (const char c : name) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 先頭の空白区切りの1語を取り出し、残りを rest に返します。
+ */
+std::string nextWord(const std::string& text, std::string& rest) {
+    const size_t end = text.find_first_of(" \t");
+    std::string word = text.substr(0, end);
+    rest = end == std::string::npos ? "" : trim(text.substr(end)); // rest と text は同じ文字列でもよい
+    return word;
+}
+
+std::chrono::milliseconds parseMilliseconds(const std::string& text, std::size_t line) {
+    char* end = nullptr;
+    const unsigned long value = std::strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0') {
+        throw std::runtime_error(std::to_string(line) + " 行目: ミリ秒の値が不正です: " + text);
+    }
+    return std::chrono::milliseconds(value);
+}
+
+/**
+ * @brief "${名前}" を変数の値に置き換えます。
+ * @return 未定義の変数があった場合 false (error にその名前を含むメッセージを格納)。
+ */
+bool substitute(const std::string& text, const std::map<std::string, std::string>& variables, std::string& out, std::string& error) {
+    out.clear();
+    size_t pos = 0;
+    while (true) {
+        const size_t start = text.find("${", pos);
+        const size_t end = start == std::string::npos ? std::string::npos : text.find('}', start + 2);
+        if (end == std::string::npos) {
+            out.append(text, pos, std::string::npos);
+            return true;
+        }
+        const std::string name = text.substr(start + 2, end - start - 2);
+        const auto it = variables.find(name);
+        if (it == variables.end()) {
+            error = "変数が定義されていません: " + name;
+            return false;
+        }
+        out.append(text, pos, start - pos);
+        out += it->second;
+        pos = end + 1;
+    }
+}
+
+/**
+ * @brief 比較用に応答の末尾の改行と前後の空白、両端の引用符を取り除きます。
+ */
+std::string normalizeResponse(const std::string& response) {
+    std::string value = trim(response);
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+        value = value.substr(1, value.size() - 2);
+    }
+    return value;
+}
+
+bool parseNumber(const std::string& text, double& value) {
+    char* end = nullptr;
+    value = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0';
+}
+
+/**
+ * @brief 応答が期待値と一致するかを判定します。両方が数値なら数値として比べ ("+1.000E+00" と "1" は一致)、そうでなければ大文字小文字を区別せずに比べます。
+ */
+bool matchesExpected(const std::string& response, const std::string& expected) {
+    const std::string actual = normalizeResponse(response);
+    double actualValue = 0;
+    double expectedValue = 0;
+    if (parseNumber(actual, actualValue) && parseNumber(expected, expectedValue)) {
+        const double scale = std::fabs(actualValue) > std::fabs(expectedValue) ? std::fabs(actualValue) : std::fabs(expectedValue);
+        return std::fabs(actualValue - expectedValue) <= 1e-12 * scale;
+    }
+    return toLower(actual) == toLower(expected);
+}
+
+/**
+ * @brief マクロの1回の実行の状態。
+ */
+class MacroRun {
+public:
+    MacroRun(ViSession instr, Instrument& instrument, std::map<std::string, std::string>& variables, std::size_t& resultSize)
+        : instr_(instr), instrument_(instrument), variables_(variables), resultSize_(resultSize) {
+    }
+
+    bool execute(const MacroStep& step, std::vector<std::string>& results, std::string& error) {
+        std::string text;
+        if (!substitute(step.text, variables_, text, error)) {
+            return false;
+        }
+
+        switch (step.kind) {
+        case MacroStep::Kind::Set:
+            variables_[step.variable] = text;
+            return true;
+
+        case MacroStep::Kind::Wait:
+            std::this_thread::sleep_for(step.duration);
+            return true;
+
+        case MacroStep::Kind::Opc:
+            return waitForCompletion(step.duration, error);
+
+        case MacroStep::Kind::WaitFor: {
+            std::string expected;
+            return substitute(step.expected, variables_, expected, error) && waitFor(text, expected, step.duration, error);
+        }
+
+        case MacroStep::Kind::Store: {
+            std::string response;
+            if (!query(text, response, error)) {
+                return false;
+            }
+            variables_[step.variable] = normalizeResponse(response);
+            return true;
+        }
+
+        case MacroStep::Kind::Command:
+            break;
+        }
+
+        instrument_.cache().observe(text);
+        if (!containsQuery(text)) {
+            instrument_.metrics().addCommand();
+            if (writeCommand(instr_, text, instrument_, error) < VI_SUCCESS) {
+                trimError(error);
+                return false;
+            }
+            return true;
+        }
+        std::string response;
+        if (!query(text, response, error)) {
+            return false;
+        }
+        response.erase(response.find_last_not_of("\r\n") + 1);
+        resultSize_ += response.size();
+        if (resultSize_ > MAX_RESULT_SIZE) {
+            error = "応答の合計が上限 (" + std::to_string(MAX_RESULT_SIZE) + " バイト) を超えました";
+            return false;
+        }
+        results.push_back(std::move(response));
+        return true;
+    }
+
+private:
+    /**
+     * @brief writeCommand() / readResponse() のエラーメッセージから、行番号の後ろに付けるには不要な "エラー: " と改行を取り除きます。
+     */
+    static void trimError(std::string& error) {
+        static const std::string prefix = "エラー: ";
+        if (error.compare(0, prefix.size(), prefix) == 0) {
+            error.erase(0, prefix.size());
+        }
+        error.erase(error.find_last_not_of("\r\n") + 1);
+    }
+
+    bool query(const std::string& command, std::string& response, std::string& error) {
+        instrument_.metrics().addCommand();
+        const ResponseSink sink = [&](BufferPool::Buffer buffer) {
+            response.append(buffer.data(), buffer.size());
+            return true;
+        };
+        ViStatus status = writeCommand(instr_, command, instrument_, error);
+        if (status >= VI_SUCCESS) {
+            status = readResponse(instr_, sink, instrument_, error);
+        }
+        if (status < VI_SUCCESS) {
+            trimError(error);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief *OPC? を送り、"1" が返るまで待ちます。待つ間だけ VISA のタイムアウトを timeout に延ばすため、長い操作でもタイムアウトを重ねません。
+     */
+    bool waitForCompletion(std::chrono::milliseconds timeout, std::string& error) {
+        ViUInt32 previous = 0;
+        const bool restore = viGetAttribute(instr_, VI_ATTR_TMO_VALUE, &previous) >= VI_SUCCESS;
+        viSetAttribute(instr_, VI_ATTR_TMO_VALUE, static_cast<ViAttrState>(timeout.count()));
+
+        std::string response;
+        const bool completed = query("*OPC?", response, error);
+        if (restore) {
+            viSetAttribute(instr_, VI_ATTR_TMO_VALUE, previous);
+        }
+        if (!completed) {
+            error = "操作の完了を待てませんでした (" + std::to_string(timeout.count()) + "ms): " + error;
+            return false;
+        }
+        if (!matchesExpected(response, "1")) {
+            error = "*OPC? の応答が不正です: " + normalizeResponse(response);
+            return false;
+        }
+        return true;
+    }
+
+    bool waitFor(const std::string& command, const std::string& expected, std::chrono::milliseconds timeout, std::string& error) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            std::string response;
+            if (!query(command, response, error)) {
+                return false;
+            }
+            if (matchesExpected(response, expected)) {
+                return true;
+            }
+            if (std::chrono::steady_clock::now() + WAITFOR_POLL_INTERVAL > deadline) {
+                error = "応答が " + expected + " になりませんでした (" + std::to_string(timeout.count()) + "ms、最後の応答: "
+                    + normalizeResponse(response) + ")";
+                return false;
+            }
+            std::this_thread::sleep_for(WAITFOR_POLL_INTERVAL);
+        }
+    }
+
+    ViSession instr_;
+    Instrument& instrument_;
+    std::map<std::string, std::string>& variables_;
+    std::size_t& resultSize_;
+};
+
+} // namespace
+
+Macro parseMacro(const std::string& name, const std::vector<std::string>& lines) {
+    Macro macro;
+    macro.name = name;
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        const std::string line = trim(lines[i]);
+        if (line.empty() || line.compare(0, 2, "//") == 0) {
+            continue;
+        }
+
+        MacroStep step;
+        step.line = i + 1;
+        if (line.front() != '%') {
+            step.text = line;
+            if (containsQuery(line)) {
+                ++macro.queries;
+            }
+            macro.steps.push_back(std::move(step));
+            continue;
+        }
+
+        std::string rest;
+        const std::string word = nextWord(line, rest);
+        const std::string directive = toLower(word);
+        const std::string prefix = std::to_string(step.line) + " 行目: ";
+        if (directive == "%set" || directive == "%store") {
+            step.kind = directive == "%set" ? MacroStep::Kind::Set : MacroStep::Kind::Store;
+            step.variable = nextWord(rest, step.text);
+            if (!isVariableName(step.variable)) {
+                throw std::runtime_error(prefix + "変数名が不正です: " + step.variable);
+            }
+            if (step.kind == MacroStep::Kind::Store && !containsQuery(step.text)) {
+                throw std::runtime_error(prefix + "%STORE にはクエリを指定してください");
+            }
+        }
+        else if (directive == "%wait") {
+            step.kind = MacroStep::Kind::Wait;
+            step.duration = parseMilliseconds(rest, step.line);
+        }
+        else if (directive == "%opc") {
+            step.kind = MacroStep::Kind::Opc;
+            step.duration = rest.empty() ? DEFAULT_OPC_TIMEOUT : parseMilliseconds(rest, step.line);
+        }
+        else if (directive == "%waitfor") {
+            // "%WAITFOR <タイムアウトms> <期待値> <クエリ>"
+            step.kind = MacroStep::Kind::WaitFor;
+            step.duration = parseMilliseconds(nextWord(rest, rest), step.line);
+            step.expected = nextWord(rest, step.text);
+            if (step.expected.empty() || !containsQuery(step.text)) {
+                throw std::runtime_error(prefix + "%WAITFOR の引数は <タイムアウトms> <期待値> <クエリ> です");
+            }
+        }
+        else {
+            throw std::runtime_error(prefix + "不明な命令です: " + word);
+        }
+        macro.steps.push_back(std::move(step));
+    }
+
+    if (macro.steps.empty()) {
+        throw std::runtime_error("マクロにコマンドがありません");
+    }
+    return macro;
+}
+
+bool runMacro(ViSession instr, Instrument& instrument, const Macro& macro, std::map<std::string, std::string>& variables,
+    std::vector<std::string>& results, std::string& error) {
+    std::size_t resultSize = 0;
+    MacroRun run(instr, instrument, variables, resultSize);
+
+    for (const MacroStep& step : macro.steps) {
+        std::string stepError;
+        if (!run.execute(step, results, stepError)) {
+            LOG_ERROR("マクロ " << macro.name << " の " << step.line << " 行目で失敗しました: " << stepError);
+            error = "マクロ " + macro.name + " の " + std::to_string(step.line) + " 行目で失敗しました: " + stepError;
+            return false;
+        }
+    }
+    return true;
+}
+
+void MacroLibrary::define(std::shared_ptr<const Macro> macro) {
+    const std::string key = toLower(macro->name);
+    std::lock_guard<std::mutex> lock(mutex_);
+    macros_[key] = std::move(macro);
+}
+
+bool MacroLibrary::remove(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return macros_.erase(toLower(name)) > 0;
+}
+
+std::shared_ptr<const Macro> MacroLibrary::find(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = macros_.find(toLower(name));
+    return it == macros_.end() ? nullptr : it->second;
+}
+
+std::vector<std::shared_ptr<const Macro>> MacroLibrary::list() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<const Macro>> macros;
+    macros.reserve(macros_.size());
+    for (const auto& entry : macros_) {
+        macros.push_back(entry.second);
+    }
+    return macros;
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include "Instrument.h"
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief マクロの1行 (ステップ)。
+ */
+struct MacroStep {
+    enum class Kind {
+        Command,  // SCPI コマンド。クエリなら応答を結果に加える
+        Set,      // %SET <変数> <値>
+        Wait,     // %WAIT <ミリ秒>
+        Opc,      // %OPC [タイムアウトms]
+        WaitFor,  // %WAITFOR <タイムアウトms> <期待値> <クエリ>
+        Store,    // %STORE <変数> <クエリ>
+    };
+
+    Kind kind = Kind::Command;
+    std::size_t line = 0;                   // 定義の中の行番号 (1始まり)。エラーメッセージに使う
+    std::string text;                       // Command / WaitFor / Store のコマンド、Set の値 (変数の置換前)
+    std::string variable;                   // Set / Store の変数名
+    std::string expected;                   // WaitFor の期待値 (変数の置換前)
+    std::chrono::milliseconds duration{ 0 }; // Wait の時間、Opc / WaitFor のタイムアウト
+};
+
+/**
+ * @brief サーバー側で実行するコマンド列 (マクロ)。
+ *        1行に1つの SCPI コマンドか、'%' で始まる命令を書きます。"${名前}" は実行時に変数の値に置き換えます。
+ *        空行と "//" で始まる行は無視します。
+ *
+ *        %SET <変数> <値>                       変数を設定する
+ *        %WAIT <ミリ秒>                         待つ
+ *        %OPC [タイムアウトms]                  *OPC? が 1 を返すまで (直前の操作の完了まで) 待つ
+ *        %WAITFOR <タイムアウトms> <期待値> <クエリ>  クエリの応答が期待値と一致するまで問い合わせを繰り返す
+ *        %STORE <変数> <クエリ>                 クエリの応答を変数に入れる (結果には加えない)
+ */
+struct Macro {
+    std::string name;
+    std::vector<MacroStep> steps;
+    std::size_t queries = 0; // 結果を返すクエリの数
+};
+
+/**
+ * @brief マクロの定義を解析します。
+ * @throw std::runtime_error 行番号付きのエラー (不明な命令、引数の不足など)。
+ */
+Macro parseMacro(const std::string& name, const std::vector<std::string>& lines);
+
+/**
+ * @brief マクロを計測器で実行し、クエリの応答を順に集めます。ワーカースレッド上で1つのジョブとして呼び出してください。
+ *        途中で失敗した場合はそこで止めます。
+ * @param variables 実行時に渡された変数。%SET と %STORE で更新されます。
+ * @param results クエリの応答 (末尾の改行を除く) が順に追加されます。
+ * @param error 失敗した場合に、行番号を含むエラーメッセージ (改行なし) が格納されます。
+ * @return すべてのステップが成功した場合 true。
+ */
+bool runMacro(ViSession instr, Instrument& instrument, const Macro& macro, std::map<std::string, std::string>& variables,
+    std::vector<std::string>& results, std::string& error);
+
+/**
+ * @brief すべての接続が共有するマクロの一覧。名前は大文字小文字を区別しません。どのスレッドからでも呼び出せます。
+ */
+class MacroLibrary {
+public:
+    // 1つのマクロの最大行数
+    static constexpr std::size_t MAX_LINES = 10000;
+
+    /**
+     * @brief マクロを登録します。同じ名前のマクロは置き換えます。実行中のマクロは古い定義のまま最後まで実行されます。
+     */
+    void define(std::shared_ptr<const Macro> macro);
+
+    /**
+     * @return 削除した場合 true。
+     */
+    bool remove(const std::string& name);
+
+    /**
+     * @return 見つからない場合は nullptr。
+     */
+    std::shared_ptr<const Macro> find(const std::string& name) const;
+
+    /**
+     * @brief 登録されているマクロを名前順に返します。
+     */
+    std::vector<std::shared_ptr<const Macro>> list() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<const Macro>> macros_; // キーは小文字の名前
+};
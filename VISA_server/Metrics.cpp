@@ -0,0 +1,132 @@
+﻿#include "Metrics.h"
+
+#include <sstream>
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    const uint64_t value = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+
+    buckets_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t current = max_.load(std::memory_order_relaxed);
+    while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::bucketOf(uint64_t micros) {
+    // 0～3us はそのままのバケット、それ以上は最上位ビットの位置と次の2ビットで分類する
+    if (micros < SUB_BUCKETS) {
+        return static_cast<int>(micros);
+    }
+    int exponent = 0;
+    for (uint64_t v = micros; v >= 2 * SUB_BUCKETS; v >>= 1) {
+        ++exponent;
+    }
+    const int sub = static_cast<int>((micros >> exponent) - SUB_BUCKETS);
+    const int bucket = (exponent + 1) * SUB_BUCKETS + sub;
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::upperBoundOf(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return static_cast<uint64_t>(bucket);
+    }
+    const int exponent = bucket / SUB_BUCKETS - 1;
+    const uint64_t sub = static_cast<uint64_t>(bucket % SUB_BUCKETS);
+    return ((SUB_BUCKETS + sub + 1) << exponent) - 1;
+}
+
+uint64_t LatencyHistogram::percentileMicros(double quantile) const {
+    const uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+
+    // 小さい方から数えて ceil(quantile * total) 番目の値を含むバケットを探す
+    const double position = quantile * static_cast<double>(total);
+    uint64_t rank = static_cast<uint64_t>(position);
+    if (static_cast<double>(rank) < position || rank == 0) {
+        ++rank;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            const uint64_t bound = upperBoundOf(i);
+            const uint64_t max = maxMicros();
+            return bound < max ? bound : max;
+        }
+    }
+    return maxMicros();
+}
+
+std::string LatencyHistogram::toJson() const {
+    std::ostringstream out;
+    out << "{\"count\":" << count()
+        << ",\"p50_us\":" << percentileMicros(0.50)
+        << ",\"p99_us\":" << percentileMicros(0.99)
+        << ",\"max_us\":" << maxMicros() << "}";
+    return out.str();
+}
+
+namespace {
+
+int64_t steadyNowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+InstrumentMetrics::InstrumentMetrics() : startedAt_(steadyNowNanos()) {}
+
+void InstrumentMetrics::reset() {
+    socketRead.reset();
+    viWrite.reset();
+    viRead.reset();
+    socketWrite.reset();
+    for (auto& histogram : queueWait) {
+        histogram.reset();
+    }
+    commands.store(0, std::memory_order_relaxed);
+    bytesToInstrument.store(0, std::memory_order_relaxed);
+    bytesFromInstrument.store(0, std::memory_order_relaxed);
+    bytesSpilled.store(0, std::memory_order_relaxed);
+    startedAt_.store(steadyNowNanos());
+}
+
+std::string InstrumentMetrics::toJson(const std::string& name) const {
+    const double seconds = static_cast<double>(steadyNowNanos() - startedAt_.load()) / 1e9;
+    const double elapsed = seconds > 0.0 ? seconds : 1e-9;
+
+    const uint64_t commandCount = commands.load(std::memory_order_relaxed);
+    const uint64_t written = bytesToInstrument.load(std::memory_order_relaxed);
+    const uint64_t read = bytesFromInstrument.load(std::memory_order_relaxed);
+
+    std::ostringstream out;
+    out << "{\"name\":\"" << name << "\""
+        << ",\"elapsed_s\":" << seconds
+        << ",\"commands\":" << commandCount
+        << ",\"commands_per_s\":" << static_cast<double>(commandCount) / elapsed
+        << ",\"write_bytes_per_s\":" << static_cast<double>(written) / elapsed
+        << ",\"read_bytes_per_s\":" << static_cast<double>(read) / elapsed
+        << ",\"socket_read\":" << socketRead.toJson()
+        << ",\"vi_write\":" << viWrite.toJson()
+        << ",\"vi_read\":" << viRead.toJson()
+        << ",\"socket_write\":" << socketWrite.toJson()
+        << ",\"queue_wait\":{\"high\":" << queueWait[0].toJson()
+        << ",\"normal\":" << queueWait[1].toJson()
+        << ",\"low\":" << queueWait[2].toJson() << "}"
+        << ",\"spilled_bytes\":" << bytesSpilled.load(std::memory_order_relaxed)
+        << "}";
+    return out.str();
+}
@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief ロックフリーのレイテンシヒストグラム。
+ *        2のべき乗ごとに4分割した対数バケット (マイクロ秒単位) に atomic で加算するため、
+ *        計測器のワーカースレッドとネットワーク側のスレッドから同時に記録しても待ちが発生しません。
+ */
+class LatencyHistogram {
+public:
+    void record(std::chrono::steady_clock::duration elapsed);
+    void reset();
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t maxMicros() const { return max_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief 分位点 (0.0～1.0) のおおよその値をマイクロ秒で返します。バケットの上端を返すため、誤差は最大で約19%です。
+     */
+    uint64_t percentileMicros(double quantile) const;
+
+    /**
+     * @brief {"count":..,"p50_us":..,"p99_us":..,"max_us":..} 形式のJSON文字列を返します。
+     */
+    std::string toJson() const;
+
+private:
+    static constexpr int SUB_BUCKETS = 4;
+    static constexpr int BUCKETS = 40 * SUB_BUCKETS;
+
+    static int bucketOf(uint64_t micros);
+    static uint64_t upperBoundOf(int bucket);
+
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
+
+/**
+ * @brief 1台の計測器に関する処理時間とスループットの統計。
+ */
+class InstrumentMetrics {
+public:
+    InstrumentMetrics();
+
+    LatencyHistogram socketRead;  // コマンド1行の受信 (クライアントの送信待ちを含む)
+    LatencyHistogram viWrite;     // viWrite 1回
+    LatencyHistogram viRead;      // viRead 1回
+    LatencyHistogram socketWrite; // 応答1チャンクの送信
+    std::array<LatencyHistogram, 3> queueWait; // 投入から実行開始までの待ち時間 (優先度クラス High / Normal / Low ごと)
+
+    std::atomic<uint64_t> commands{ 0 };
+    std::atomic<uint64_t> bytesToInstrument{ 0 };
+    std::atomic<uint64_t> bytesFromInstrument{ 0 };
+    std::atomic<uint64_t> bytesSpilled{ 0 };  // 上のクラスのジョブにセッションを早く渡すため、プール外のバッファに読んだバイト数
+
+    void addCommand() { commands.fetch_add(1, std::memory_order_relaxed); }
+    void addWritten(uint64_t bytes) { bytesToInstrument.fetch_add(bytes, std::memory_order_relaxed); }
+    void addRead(uint64_t bytes) { bytesFromInstrument.fetch_add(bytes, std::memory_order_relaxed); }
+    void addSpilled(uint64_t bytes) { bytesSpilled.fetch_add(bytes, std::memory_order_relaxed); }
+
+    /**
+     * @brief 統計を0に戻し、スループットの計測開始時刻を現在にします。
+     */
+    void reset();
+
+    /**
+     * @brief 統計を1行のJSONオブジェクトとして返します。"name" には name を入れます。
+     */
+    std::string toJson(const std::string& name) const;
+
+private:
+    std::atomic<int64_t> startedAt_; // steady_clock の時刻 (ナノ秒)
+};
+
+/**
+ * @brief スコープの経過時間をヒストグラムに記録するヘルパー。
+ */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(LatencyHistogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.record(std::chrono::steady_clock::now() - start_); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    LatencyHistogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,130 @@
+﻿#include "OverlappedReader.h"
+
+#include "Logger.h"
+
+#include <chrono>
+
+namespace {
+
+// 完了イベントが届かない場合の待ち時間の上限。VISAのタイムアウトにこの余裕を加えた時間だけ待つ
+constexpr std::chrono::milliseconds COMPLETION_GRACE{ 1000 };
+
+} // namespace
+
+OverlappedReader::OverlappedReader(ViSession session) : session_(session) {}
+
+OverlappedReader::~OverlappedReader() {
+    disable();
+}
+
+bool OverlappedReader::enable() {
+    ViStatus status = viInstallHandler(session_, VI_EVENT_IO_COMPLETION, onCompletion, this);
+    if (status >= VI_SUCCESS) {
+        status = viEnableEvent(session_, VI_EVENT_IO_COMPLETION, VI_HNDLR, VI_NULL);
+        if (status < VI_SUCCESS) {
+            viUninstallHandler(session_, VI_EVENT_IO_COMPLETION, onCompletion, this);
+        }
+    }
+    if (status < VI_SUCCESS) {
+        LOG_DEBUG("非同期読み取り (viReadAsync) を使えません (Status: " << status << ")。同期読み取りで動作します");
+        return false;
+    }
+
+    enabled_ = true;
+    return true;
+}
+
+void OverlappedReader::disable() {
+    if (enabled_.exchange(false)) {
+        viDisableEvent(session_, VI_EVENT_IO_COMPLETION, VI_HNDLR);
+        viUninstallHandler(session_, VI_EVENT_IO_COMPLETION, onCompletion, this);
+    }
+}
+
+ViStatus _VI_FUNCH OverlappedReader::onCompletion(ViSession /*vi*/, ViEventType /*eventType*/, ViEvent event, ViAddr userHandle) {
+    auto* self = static_cast<OverlappedReader*>(userHandle);
+
+    Completion completion{ 0, VI_SUCCESS, 0 };
+    viGetAttribute(event, VI_ATTR_JOB_ID, &completion.jobId);
+    viGetAttribute(event, VI_ATTR_STATUS, &completion.status);
+    viGetAttribute(event, VI_ATTR_RET_COUNT_32, &completion.count);
+
+    {
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        self->completions_.push_back(completion);
+    }
+    self->cv_.notify_all();
+    return VI_SUCCESS;
+}
+
+void OverlappedReader::start(char* buffer, std::size_t size) {
+    buffer_ = buffer;
+    size_ = size;
+    pending_ = true;
+    async_ = false;
+    startStatus_ = VI_SUCCESS;
+
+    if (!enabled_.load()) {
+        return; // finish() で同期読み取りする
+    }
+
+    {
+        // 中止した読み取りの古い通知が残っていれば捨てる
+        std::lock_guard<std::mutex> lock(mutex_);
+        completions_.clear();
+    }
+
+    const ViStatus status = viReadAsync(session_, (ViPBuf)buffer, static_cast<ViUInt32>(size), &jobId_);
+    if (status >= VI_SUCCESS) {
+        async_ = true;
+    }
+    else if (status == VI_ERROR_NSUP_OPER) {
+        // 非同期読み取りに対応していないセッションでは以後は同期読み取りにする
+        LOG_DEBUG("viReadAsync に対応していないため同期読み取りに切り替えます");
+        disable();
+    }
+    else {
+        startStatus_ = status;
+    }
+}
+
+ViStatus OverlappedReader::finish(ViUInt32& retCount) {
+    retCount = 0;
+    if (!pending_) {
+        return VI_ERROR_INV_SETUP;
+    }
+    pending_ = false;
+
+    if (!async_) {
+        if (startStatus_ < VI_SUCCESS) {
+            return startStatus_;
+        }
+        return viRead(session_, (ViPBuf)buffer_, static_cast<ViUInt32>(size_), &retCount);
+    }
+
+    ViUInt32 timeoutMs = 0;
+    const bool bounded = viGetAttribute(session_, VI_ATTR_TMO_VALUE, &timeoutMs) >= VI_SUCCESS && timeoutMs != VI_TMO_INFINITE;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs) + COMPLETION_GRACE;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        for (auto it = completions_.begin(); it != completions_.end(); ++it) {
+            if (it->jobId == jobId_) {
+                const Completion completion = *it;
+                completions_.erase(it);
+                retCount = completion.count;
+                return completion.status;
+            }
+        }
+
+        if (!bounded) {
+            cv_.wait(lock);
+        }
+        else if (cv_.wait_until(lock, deadline) == std::cv_status::timeout) {
+            lock.unlock();
+            LOG_ERROR("viReadAsync の完了通知が届きませんでした。読み取りを中止します");
+            viTerminate(session_, VI_NULL, jobId_);
+            return VI_ERROR_TMO;
+        }
+    }
+}
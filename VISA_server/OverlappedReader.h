@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include <visa.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief viReadAsync による重ね合わせ読み取り。start() で読み取りを開始してから finish() で完了を待つまでの間に、
+ *        ワーカースレッドは前のチャンクをクライアントへ送信できます。完了は VI_EVENT_IO_COMPLETION のハンドラで受け取ります。
+ *        非同期入出力が使えないセッションでは finish() が同期の viRead を行うため、呼び出し側は区別する必要がありません。
+ *        1つのセッションで同時に進行できる読み取りは1つだけです。ワーカースレッドからのみ呼び出してください。
+ */
+class OverlappedReader {
+public:
+    explicit OverlappedReader(ViSession session);
+    ~OverlappedReader();
+
+    OverlappedReader(const OverlappedReader&) = delete;
+    OverlappedReader& operator=(const OverlappedReader&) = delete;
+
+    /**
+     * @brief 完了イベントのハンドラを登録し、非同期読み取りを有効にします。
+     * @return 有効にできた場合 true。失敗した場合は同期読み取りのままです。
+     */
+    bool enable();
+
+    /**
+     * @brief ハンドラの登録を外します。セッションをクローズする前に呼び出してください。
+     */
+    void disable();
+
+    bool enabled() const { return enabled_.load(); }
+
+    /**
+     * @brief 読み取りに使うセッションを切り替えます。disable() の後、有効にし直す前に呼び出してください。
+     */
+    void setSession(ViSession session) { session_ = session; }
+
+    /**
+     * @brief buffer への最大 size バイトの読み取りを開始します。buffer は finish() が戻るまで有効でなければなりません。
+     */
+    void start(char* buffer, std::size_t size);
+
+    /**
+     * @brief start() で開始した読み取りの完了を待ちます。
+     * @param retCount 読み取ったバイト数。
+     * @return viRead と同じ意味のステータス (VI_SUCCESS_MAX_CNT なら応答が続く)。
+     */
+    ViStatus finish(ViUInt32& retCount);
+
+private:
+    /**
+     * @brief ハンドラから届いた1件の完了通知。
+     */
+    struct Completion {
+        ViJobId jobId;
+        ViStatus status;
+        ViUInt32 count;
+    };
+
+    static ViStatus _VI_FUNCH onCompletion(ViSession vi, ViEventType eventType, ViEvent event, ViAddr userHandle);
+
+    ViSession session_;
+    std::atomic<bool> enabled_{ false };
+
+    // 進行中の読み取り (ワーカースレッドのみが操作)
+    char* buffer_ = nullptr;
+    std::size_t size_ = 0;
+    bool pending_ = false;
+    bool async_ = false;
+    ViStatus startStatus_ = VI_SUCCESS;
+    ViJobId jobId_ = 0;
+
+    // 完了通知はVISAのコールバックスレッドから追加される。viReadAsync が戻る前に届く場合もある
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Completion> completions_;
+};
@@ -0,0 +1,331 @@
+﻿#include "RawSession.h"
+
+#include "Logger.h"
+
+#include <utility>
+#include <vector>
+
+RawSession::RawSession(boost::asio::ip::tcp::socket socket, InstrumentPool& pool)
+    : socket_(std::move(socket)), instrument_(pool.defaultInstrument()), receiveBuffers_(RECEIVE_BUFFER_SIZE, RECEIVE_BUFFERS) {
+    boost::system::error_code ec;
+    auto endpoint = socket_.remote_endpoint(ec);
+    peer_ = ec ? "不明" : endpoint.address().to_string();
+}
+
+void RawSession::start() {
+    if (instrument_ == nullptr) {
+        LOG_ERROR("rawモードの転送先の計測器がありません。接続を閉じます: " << peer_);
+        close();
+        return;
+    }
+    LOG_INFO("クライアントが接続しました (rawモード): " << peer_ << " -> " << instrument_->name());
+    readSome();
+}
+
+void RawSession::readSome() {
+    if (closing_ || closed_) {
+        return;
+    }
+    if (buffersInUse_ >= RECEIVE_BUFFERS) {
+        readPaused_ = true; // 書き込みが進んでバッファが戻ったら onReceiveBufferReleased で再開する
+        return;
+    }
+
+    ++buffersInUse_;
+    BufferPool::Buffer buffer = receiveBuffers_.acquire();
+    char* data = buffer.data();
+    const std::size_t capacity = buffer.capacity();
+    auto self = shared_from_this();
+    auto shared = std::make_shared<BufferPool::Buffer>(std::move(buffer));
+    socket_.async_read_some(boost::asio::buffer(data, capacity),
+        [this, self, shared](const boost::system::error_code& error, std::size_t bytes) {
+            onRead(error, bytes, std::move(*shared));
+        });
+}
+
+void RawSession::onRead(const boost::system::error_code& error, std::size_t bytes, BufferPool::Buffer buffer) {
+    if (error) {
+        --buffersInUse_;
+        if (error != boost::asio::error::eof && error != boost::asio::error::operation_aborted) {
+            LOG_ERROR("データの受信中にエラーが発生しました (" << peer_ << "): " << error.message());
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            inputClosed_ = true;
+        }
+        cv_.notify_all();
+        // 受信済みのメッセージの書き込みと応答の送信を終えてから閉じる
+        closing_ = true;
+        closeWhenIdle();
+        return;
+    }
+
+    buffer.resize(bytes);
+    std::weak_ptr<RawSession> weak = shared_from_this();
+    std::shared_ptr<BufferPool::Buffer> shared(new BufferPool::Buffer(std::move(buffer)),
+        [weak](BufferPool::Buffer* released) {
+            delete released;
+            if (auto self = weak.lock()) {
+                self->onReceiveBufferReleased();
+            }
+        });
+
+    // メッセージの終端ごとに区間を分け、終端を含む区間にだけ END を付ける
+    std::deque<Segment> segments;
+    std::size_t offset = 0;
+    while (offset < bytes) {
+        const std::size_t length = scanner_.scan(shared->data() + offset, bytes - offset);
+        Segment segment;
+        segment.buffer = shared;
+        segment.offset = offset;
+        segment.length = length;
+        segment.end = scanner_.terminated();
+        segment.query = segment.end && scanner_.hasQuery();
+        segments.push_back(std::move(segment));
+        offset += length;
+    }
+    shared.reset();
+
+    queueSegments(std::move(segments));
+    readSome();
+}
+
+void RawSession::onReceiveBufferReleased() {
+    auto self = shared_from_this();
+    boost::asio::post(socket_.get_executor(), [this, self] {
+        --buffersInUse_;
+        if (readPaused_) {
+            readPaused_ = false;
+            readSome();
+        }
+    });
+}
+
+void RawSession::queueSegments(std::deque<Segment> segments) {
+    bool startWriter = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& segment : segments) {
+            segments_.push_back(std::move(segment));
+        }
+        if (!writerActive_) {
+            writerActive_ = true;
+            startWriter = true;
+        }
+    }
+    cv_.notify_all();
+
+    if (startWriter) {
+        auto self = shared_from_this();
+        instrument_->submit([this, self](ViSession instr) { writeSegments(instr); }, JobPriority::Normal, this);
+    }
+}
+
+void RawSession::writeSegments(ViSession instr) {
+    // 他の接続の書き込みに影響しないよう、変更した属性はジョブの終わりに元へ戻す
+    ViBoolean savedSendEnd = VI_TRUE;
+    viGetAttribute(instr, VI_ATTR_SEND_END_EN, &savedSendEnd);
+    ViBoolean sendEnd = savedSendEnd;
+
+    Segment segment;
+    while (nextSegment(segment)) {
+        if (!messageOpen_) {
+            messageOpen_ = true;
+            instrument_->metrics().addCommand();
+            const ViStatus status = instrument_->awaitOperationComplete();
+            if (status < VI_SUCCESS) {
+                LOG_ERROR("前の設定コマンドの完了待ちに失敗しました (Status: " << status << ")");
+            }
+        }
+
+        if (!discarding_) {
+            const ViStatus status = writeSegment(instr, segment, sendEnd);
+            instrument_->reportStatus(status);
+            if (status < VI_SUCCESS) {
+                LOG_ERROR("rawモードの viWrite に失敗しました (" << peer_ << ", Status: " << status << ")。メッセージの残りを破棄します");
+                discarding_ = true;
+            }
+        }
+
+        if (segment.end) {
+            if (segment.query && !discarding_) {
+                readReply(instr);
+            }
+            messageOpen_ = false;
+            discarding_ = false;
+        }
+        segment = Segment();
+    }
+
+    if (sendEnd != savedSendEnd) {
+        viSetAttribute(instr, VI_ATTR_SEND_END_EN, savedSendEnd);
+    }
+
+    auto self = shared_from_this();
+    boost::asio::post(socket_.get_executor(), [this, self] { closeWhenIdle(); });
+}
+
+bool RawSession::nextSegment(Segment& segment) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (messageOpen_) {
+        // END を送るまでは続きを待ち、他の接続のコマンドが途中に割り込まないようにする
+        const bool arrived = cv_.wait_for(lock, MESSAGE_HOLD_TIMEOUT, [this] { return !segments_.empty() || inputClosed_; });
+        if (!arrived) {
+            LOG_WARN("rawモードのメッセージの続きが " << MESSAGE_HOLD_TIMEOUT.count()
+                << " 秒届かないため、計測器の占有を解除します (" << peer_ << ")");
+        }
+    }
+
+    if (segments_.empty()) {
+        if (messageOpen_ && inputClosed_) {
+            LOG_WARN("rawモードのメッセージの途中で接続が閉じられました (" << peer_ << ")");
+            messageOpen_ = false;
+            discarding_ = false;
+        }
+        writerActive_ = false;
+        return false;
+    }
+
+    segment = std::move(segments_.front());
+    segments_.pop_front();
+    return true;
+}
+
+ViStatus RawSession::writeSegment(ViSession instr, const Segment& segment, ViBoolean& sendEnd) {
+    const ViBoolean wanted = segment.end ? VI_TRUE : VI_FALSE;
+    if (sendEnd != wanted) {
+        const ViStatus status = viSetAttribute(instr, VI_ATTR_SEND_END_EN, wanted);
+        if (status < VI_SUCCESS) {
+            return status;
+        }
+        sendEnd = wanted;
+    }
+
+    InstrumentMetrics& metrics = instrument_->metrics();
+    ScopedTimer timer(metrics.viWrite);
+    const char* data = segment.buffer->data() + segment.offset;
+    std::size_t written = 0;
+    while (written < segment.length) {
+        ViUInt32 retCount = 0;
+        const ViStatus status = viWrite(instr, reinterpret_cast<ViConstBuf>(data + written),
+            static_cast<ViUInt32>(segment.length - written), &retCount);
+        written += retCount;
+        metrics.addWritten(retCount);
+        if (status < VI_SUCCESS) {
+            return status;
+        }
+    }
+    return VI_SUCCESS;
+}
+
+void RawSession::readReply(ViSession instr) {
+    // バイナリの応答が終端文字で途切れないよう、END だけで読み終える
+    ViBoolean savedTermChar = VI_FALSE;
+    viGetAttribute(instr, VI_ATTR_TERMCHAR_EN, &savedTermChar);
+    if (savedTermChar != VI_FALSE) {
+        viSetAttribute(instr, VI_ATTR_TERMCHAR_EN, VI_FALSE);
+    }
+
+    auto self = shared_from_this();
+    std::string error;
+    const ViStatus status = readResponse(instr,
+        [this, self](BufferPool::Buffer buffer) { return sendFromWorker(std::move(buffer)); },
+        *instrument_, error);
+    if (status < VI_SUCCESS) {
+        LOG_ERROR("rawモードの応答の読み取りに失敗しました (" << peer_ << ", Status: " << status << ")");
+    }
+
+    if (savedTermChar != VI_FALSE) {
+        viSetAttribute(instr, VI_ATTR_TERMCHAR_EN, savedTermChar);
+    }
+}
+
+bool RawSession::sendFromWorker(BufferPool::Buffer buffer) {
+    auto self = shared_from_this();
+    auto shared = std::make_shared<BufferPool::Buffer>(std::move(buffer));
+    boost::asio::post(socket_.get_executor(), [this, self, shared] { enqueueWrite(std::move(*shared)); });
+    return !failed_.load();
+}
+
+void RawSession::enqueueWrite(BufferPool::Buffer buffer) {
+    if (closed_) {
+        return; // バッファは破棄とともにプールへ戻る
+    }
+
+    outbox_.push_back(std::move(buffer));
+    writeNext();
+}
+
+void RawSession::writeNext() {
+    if (writing_ > 0 || outbox_.empty()) {
+        return;
+    }
+
+    std::vector<boost::asio::const_buffer> buffers;
+    const std::size_t count = outbox_.size() < MAX_GATHER ? outbox_.size() : MAX_GATHER;
+    for (std::size_t i = 0; i < count; ++i) {
+        buffers.push_back(boost::asio::buffer(outbox_[i].data(), outbox_[i].size()));
+    }
+    writing_ = count;
+
+    const auto queuedAt = std::chrono::steady_clock::now();
+    auto self = shared_from_this();
+    boost::asio::async_write(socket_, buffers,
+        [this, self, queuedAt](const boost::system::error_code& error, std::size_t /*bytes*/) {
+            instrument_->metrics().socketWrite.record(std::chrono::steady_clock::now() - queuedAt);
+            for (std::size_t i = 0; i < writing_; ++i) {
+                outbox_.pop_front();
+            }
+            writing_ = 0;
+
+            if (error || closed_) {
+                if (error) {
+                    LOG_ERROR("応答の送信に失敗しました (" << peer_ << "): " << error.message());
+                }
+                close();
+                outbox_.clear();
+                return;
+            }
+
+            writeNext();
+            closeWhenIdle();
+        });
+}
+
+void RawSession::closeWhenIdle() {
+    if (!closing_ || writing_ > 0 || !outbox_.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (writerActive_) {
+            return; // 書き込みの終わりに writeSegments から呼ばれる
+        }
+    }
+    close();
+}
+
+void RawSession::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    failed_ = true;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        inputClosed_ = true;
+        segments_.clear();
+    }
+    cv_.notify_all();
+
+    // 送信中のデータがあれば、その完了ハンドラで残りを片付ける
+    if (writing_ == 0) {
+        outbox_.clear();
+    }
+
+    boost::system::error_code ignored;
+    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+    LOG_INFO("クライアントが切断しました (rawモード): " << peer_);
+}
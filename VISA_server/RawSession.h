@@ -0,0 +1,106 @@
+﻿#pragma once
+
+#include "BufferPool.h"
+#include "Instrument.h"
+#include "InstrumentPool.h"
+#include "ScpiParser.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief rawモードの1つのTCPクライアント接続を処理するクラス。ソケットのバイト列を既定の計測器へそのまま転送します。
+ *        行の組み立てや改行の除去、文字列へのコピーを行わず、受信バッファをそのまま viWrite に渡し、
+ *        viRead で読んだプールのバッファをそのままソケットへ送ります。任意波形ファイルなど改行を含むバイナリも壊れません。
+ *
+ *        END は ProgramMessageScanner で見つけたプログラムメッセージの終端 (引用符と block の外の '\n') にだけ付けます。
+ *        終端までの途中の書き込みは VI_ATTR_SEND_END_EN を切って行い、終端を含む書き込みで END を送ります。
+ *        メッセージにクエリが含まれていれば、VI_ATTR_TERMCHAR_EN を切って応答を END まで読み、加工せずに返します。
+ *
+ *        1つのメッセージを書き込んでいる間は計測器のワーカーを占有し、他の接続のコマンドが途中に割り込まないようにします。
+ *        クライアントが MESSAGE_HOLD_TIMEOUT の間続きを送ってこなければ、占有をやめて警告を出します。
+ */
+class RawSession : public std::enable_shared_from_this<RawSession> {
+public:
+    RawSession(boost::asio::ip::tcp::socket socket, InstrumentPool& pool);
+
+    /**
+     * @brief バイト列の受信を開始します。
+     */
+    void start();
+
+private:
+    // 受信バッファの大きさと数。すべて計測器への書き込み待ちになるとソケットの読み取りを止める
+    static constexpr std::size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
+    static constexpr std::size_t RECEIVE_BUFFERS = 8;
+
+    // 1回の async_write でまとめて送るバッファの上限
+    static constexpr std::size_t MAX_GATHER = 32;
+
+    // メッセージの途中でクライアントの続きを待ち、ワーカーを占有し続ける最大時間
+    static constexpr std::chrono::seconds MESSAGE_HOLD_TIMEOUT{ 10 };
+
+    /**
+     * @brief 受信バッファの一部。1つのバッファに複数のメッセージの区間が含まれることがあるため、バッファは区間で共有します。
+     */
+    struct Segment {
+        std::shared_ptr<BufferPool::Buffer> buffer;
+        std::size_t offset = 0;
+        std::size_t length = 0;
+        bool end = false;   // メッセージの終端を含む (END を付けて書き込む)
+        bool query = false; // end のとき、メッセージにクエリが含まれる
+    };
+
+    void readSome();
+    void onRead(const boost::system::error_code& error, std::size_t bytes, BufferPool::Buffer buffer);
+    void onReceiveBufferReleased();
+    void queueSegments(std::deque<Segment> segments);
+
+    /**
+     * @brief ワーカースレッドで、受信済みの区間を順に計測器へ書き込みます。メッセージの区切りで区間がなくなれば戻ります。
+     */
+    void writeSegments(ViSession instr);
+    bool nextSegment(Segment& segment);
+    ViStatus writeSegment(ViSession instr, const Segment& segment, ViBoolean& sendEnd);
+    void readReply(ViSession instr);
+
+    bool sendFromWorker(BufferPool::Buffer buffer);
+    void enqueueWrite(BufferPool::Buffer buffer);
+    void writeNext();
+    void closeWhenIdle();
+    void close();
+
+    boost::asio::ip::tcp::socket socket_;
+    Instrument* instrument_;
+    std::string peer_;
+    BufferPool receiveBuffers_;
+    ProgramMessageScanner scanner_;
+
+    // strand 上でのみ操作する
+    std::size_t buffersInUse_ = 0;
+    bool readPaused_ = false;
+    bool closing_ = false;
+    bool closed_ = false;
+    std::deque<BufferPool::Buffer> outbox_;
+    std::size_t writing_ = 0; // 送信中のバッファ数
+    std::atomic<bool> failed_{ false };
+
+    // strand とワーカーの間で受け渡す書き込み待ちの区間
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Segment> segments_;
+    bool writerActive_ = false; // ワーカーで writeSegments を実行中
+    bool inputClosed_ = false;  // これ以上区間が届かない
+
+    // ワーカーのみが操作する
+    bool messageOpen_ = false;  // END を送っていないメッセージの途中
+    bool discarding_ = false;   // 書き込みに失敗したメッセージの残りを読み捨てている
+};
@@ -0,0 +1,494 @@
+﻿#include "Recorder.h"
+
+#include "Logger.h"
+#include "ScpiParser.h"
+
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace {
+
+namespace bip = boost::interprocess;
+
+const char RECORD_FILE_MAGIC[8] = { 'V', 'I', 'S', 'A', 'R', 'E', 'C', '\0' };
+
+// レコードの先頭を揃える境界。読み手がヘッダをそのまま構造体として参照できるようにする
+constexpr std::uint64_t RECORD_ALIGNMENT = 8;
+
+// 取得に失敗したときの次の取得までの最短の間隔。計測器が外れている間にエラーのレコードで埋まらないようにする
+constexpr std::chrono::milliseconds RETRY_AFTER_FAILURE{ 1000 };
+
+std::uint64_t alignRecord(std::uint64_t offset) {
+    return (offset + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+}
+
+std::int64_t unixNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool isValidName(const std::string& name) {
+    if (name.empty()) {
+        return false;
+    }
+    for (const char c : name) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief 1つの記録ファイルと、その取得ループの状態。
+ *        ファイルの内容とレコードの位置の一覧は mutex_ で守り、ワーカースレッドの追記とクライアントの読み出しを並行させます。
+ */
+class Recorder::Recording {
+public:
+    Recording(boost::asio::strand<boost::asio::io_context::executor_type>& strand, std::string name, std::string path,
+        Instrument* instrument, std::string query, std::chrono::milliseconds interval, std::size_t chunkBytes)
+        : name(std::move(name)), instrument(instrument), query(std::move(query)), interval(interval), timer(strand),
+          path_(std::move(path)), chunkBytes_(chunkBytes) {
+    }
+
+    ~Recording() {
+        close();
+    }
+
+    /**
+     * @brief ファイルを作り直して chunkBytes 分を確保し、ヘッダを書き込みます。
+     */
+    void create() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::filesystem::path path(path_);
+        if (path.has_parent_path()) {
+            std::filesystem::create_directories(path.parent_path());
+        }
+        {
+            std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                throw std::runtime_error("記録ファイルを作れません: " + path_);
+            }
+        }
+
+        startedAt_ = unixNanoseconds();
+        dataEnd_ = sizeof(RecordFileHeader);
+        map(chunkBytes_ < dataEnd_ ? dataEnd_ : chunkBytes_);
+        open_ = true;
+        writeFileHeader();
+    }
+
+    /**
+     * @brief 以前に作られたファイルを読み取り専用で開き、レコードの位置の一覧を作ります。
+     */
+    void load() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bip::file_mapping file(path_.c_str(), bip::read_only);
+        bip::mapped_region region(file, bip::read_only);
+        const char* base = static_cast<const char*>(region.get_address());
+        const std::uint64_t size = region.get_size();
+
+        RecordFileHeader header;
+        if (size < sizeof(header)) {
+            throw std::runtime_error("記録ファイルではありません: " + path_);
+        }
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, RECORD_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != RECORD_FILE_VERSION) {
+            throw std::runtime_error("記録ファイルではないか、形式が異なります: " + path_);
+        }
+
+        // 書きかけのレコードは recordCount に含まれないため、ヘッダの件数と終端の範囲だけを信用する
+        const std::uint64_t end = header.dataEnd < size ? header.dataEnd : size;
+        std::uint64_t offset = header.headerSize;
+        while (offsets_.size() < header.recordCount && offset + sizeof(RecordHeader) <= end) {
+            RecordHeader record;
+            std::memcpy(&record, base + offset, sizeof(record));
+            const std::uint64_t next = alignRecord(offset + sizeof(record) + record.payloadSize);
+            if (next > end) {
+                break;
+            }
+            offsets_.push_back(offset);
+            offset = next;
+        }
+        dataEnd_ = offset;
+        startedAt_ = header.startedAt;
+    }
+
+    /**
+     * @brief クエリを1回送り、応答を1件のレコードとして追記します。ワーカースレッド上で呼び出してください。
+     * @param status 最後の viWrite / viRead のステータスが格納されます。
+     * @return 記録を続けられる場合 true。ファイルの拡張に失敗した場合は false。
+     */
+    bool acquire(ViSession instr, ViStatus& status) {
+        const std::int64_t timestamp = unixNanoseconds();
+        std::uint64_t recordStart = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!open_) {
+                return false;
+            }
+            recordStart = dataEnd_;
+        }
+        const std::uint64_t payloadStart = recordStart + sizeof(RecordHeader);
+
+        // definite-length block はヘッダと末尾の改行を除き、中身だけを書く。それ以外は受け取ったまま書き、最後に改行を除く
+        std::uint64_t payloadSize = 0;
+        std::uint64_t limit = std::numeric_limits<std::uint32_t>::max();
+        bool isBlock = false;
+        bool first = true;
+        bool writable = true;
+
+        const ResponseSink sink = [&](BufferPool::Buffer buffer) {
+            const char* data = buffer.data();
+            std::size_t size = buffer.size();
+            if (first) {
+                first = false;
+                BlockHeader header;
+                if (parseBlockHeader(data, size, header)) {
+                    isBlock = true;
+                    data += header.headerSize;
+                    size -= header.headerSize;
+                    if (header.payloadSize < limit) {
+                        limit = header.payloadSize;
+                    }
+                }
+            }
+            if (payloadSize + size > limit) {
+                size = static_cast<std::size_t>(limit - payloadSize);
+            }
+            if (size == 0) {
+                return true; // 残りは末尾の改行か上限を超えた分。読み捨てる
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            writable = writable && open_ && reserve(payloadStart + payloadSize + size);
+            if (!writable) {
+                return false;
+            }
+            std::memcpy(static_cast<char*>(region_->get_address()) + payloadStart + payloadSize, data, size);
+            payloadSize += size;
+            return true;
+        };
+
+        std::string error;
+        status = writeCommand(instr, query, *instrument, error);
+        if (status >= VI_SUCCESS) {
+            status = readResponse(instr, sink, *instrument, error);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!writable || !open_ || !reserve(payloadStart + payloadSize)) {
+            return false;
+        }
+        char* base = static_cast<char*>(region_->get_address());
+        if (!isBlock) {
+            while (payloadSize > 0 && (base[payloadStart + payloadSize - 1] == '\n' || base[payloadStart + payloadSize - 1] == '\r')) {
+                --payloadSize;
+            }
+        }
+
+        RecordHeader record;
+        record.timestamp = timestamp;
+        record.payloadSize = static_cast<std::uint32_t>(payloadSize);
+        record.status = status;
+        std::memcpy(base + recordStart, &record, sizeof(record));
+
+        const std::uint64_t next = alignRecord(payloadStart + payloadSize);
+        if (!reserve(next)) {
+            return false;
+        }
+        std::memset(static_cast<char*>(region_->get_address()) + payloadStart + payloadSize, 0, static_cast<std::size_t>(next - payloadStart - payloadSize));
+        dataEnd_ = next;
+        offsets_.push_back(recordStart);
+        writeFileHeader();
+        return true;
+    }
+
+    /**
+     * @brief ヘッダを書き込んでマッピングを外し、ファイルを使った大きさに切り詰めます。2回目以降は何もしません。
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_) {
+            return;
+        }
+        open_ = false;
+        try {
+            writeFileHeader();
+            region_->flush();
+            region_.reset();
+            file_.reset();
+            std::filesystem::resize_file(path_, dataEnd_);
+            capacity_ = dataEnd_;
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("記録ファイルを閉じられませんでした (" << path_ << "): " << e.what());
+        }
+        LOG_INFO("記録を終了しました: " << name << " (" << offsets_.size() << " 件, " << dataEnd_ << " バイト)");
+    }
+
+    /**
+     * @brief レコード first から最大 count 件を、合計 maxBytes バイトまで (最低1件) 返します。
+     */
+    std::string read(std::uint64_t first, std::uint64_t count, std::size_t maxBytes) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const std::uint64_t recordCount = offsets_.size();
+        if (first >= recordCount || count == 0) {
+            return std::string();
+        }
+        std::uint64_t last = count < recordCount - first ? first + count : recordCount;
+        const std::uint64_t begin = offsets_[first];
+        std::uint64_t end = last < recordCount ? offsets_[last] : dataEnd_;
+        while (last > first + 1 && end - begin > maxBytes) {
+            --last;
+            end = offsets_[last];
+        }
+
+        const std::size_t size = static_cast<std::size_t>(end - begin);
+        std::string data(size, '\0');
+        if (region_) {
+            std::memcpy(&data[0], static_cast<const char*>(region_->get_address()) + begin, size);
+        }
+        else {
+            // 停止済みの記録は必要な範囲だけを読み取り専用でマップする
+            bip::file_mapping file(path_.c_str(), bip::read_only);
+            bip::mapped_region region(file, bip::read_only, static_cast<bip::offset_t>(begin), size);
+            std::memcpy(&data[0], region.get_address(), size);
+        }
+        return data;
+    }
+
+    Status status() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return { name, instrument ? instrument->name() : std::string(), open_, offsets_.size(),
+            dataEnd_ - sizeof(RecordFileHeader) };
+    }
+
+    bool isOpen() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return open_;
+    }
+
+    const std::string name;
+    Instrument* const instrument; // load() で開いた記録では nullptr
+    const std::string query;
+    const std::chrono::milliseconds interval;
+
+    // 取得ループの状態 (Recorder の strand 上でのみ操作する)
+    boost::asio::steady_timer timer;
+    std::chrono::steady_clock::time_point lastStartedAt;
+    bool inFlight = false;
+    bool stopping = false;
+
+private:
+    /**
+     * @brief ファイルを size バイト以上に伸ばしてマップし直します。mutex_ を保持して呼び出してください。
+     * @return 失敗した場合 false (ログを出し、以後の追記をやめる)。
+     */
+    bool reserve(std::uint64_t size) {
+        if (size <= capacity_) {
+            return true;
+        }
+        const std::uint64_t chunk = chunkBytes_ > 0 ? chunkBytes_ : 1;
+        try {
+            // Windows ではマップ中のファイルの大きさを変えられないため、いったん外してから伸ばす
+            region_.reset();
+            file_.reset();
+            map((size + chunk - 1) / chunk * chunk);
+            return true;
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("記録ファイルを拡張できませんでした (" << path_ << "): " << e.what());
+            region_.reset();
+            file_.reset();
+            open_ = false;
+            return false;
+        }
+    }
+
+    void map(std::uint64_t size) {
+        std::filesystem::resize_file(path_, size);
+        file_ = std::make_unique<bip::file_mapping>(path_.c_str(), bip::read_write);
+        region_ = std::make_unique<bip::mapped_region>(*file_, bip::read_write);
+        capacity_ = size;
+    }
+
+    void writeFileHeader() {
+        RecordFileHeader header = {};
+        std::memcpy(header.magic, RECORD_FILE_MAGIC, sizeof(header.magic));
+        header.version = RECORD_FILE_VERSION;
+        header.headerSize = sizeof(RecordFileHeader);
+        header.recordCount = offsets_.size();
+        header.dataEnd = dataEnd_;
+        header.startedAt = startedAt_;
+        header.intervalMs = static_cast<std::uint32_t>(interval.count());
+        std::memcpy(region_->get_address(), &header, sizeof(header));
+    }
+
+    mutable std::mutex mutex_;
+    std::string path_;
+    std::size_t chunkBytes_;
+    std::unique_ptr<bip::file_mapping> file_;
+    std::unique_ptr<bip::mapped_region> region_;
+    std::uint64_t capacity_ = 0;          // 確保済みのファイルの大きさ
+    std::uint64_t dataEnd_ = 0;
+    std::int64_t startedAt_ = 0;
+    std::vector<std::uint64_t> offsets_;  // 書き終えたレコードの先頭の位置
+    bool open_ = false;                   // 書き込み用にマップしているか
+};
+
+Recorder::Recorder(boost::asio::io_context& io, std::string directory, std::size_t chunkBytes)
+    : strand_(boost::asio::make_strand(io)), directory_(std::move(directory)), chunkBytes_(chunkBytes) {
+}
+
+Recorder::~Recorder() {
+    // ファイルを閉じておけば、取得中のジョブは追記せずに終わる
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : recordings_) {
+        entry.second->close();
+    }
+}
+
+void Recorder::start(const std::string& name, Instrument& instrument, const std::string& query, std::chrono::milliseconds interval) {
+    if (!isValidName(name)) {
+        throw std::runtime_error("記録名が不正です (英数字、'_'、'-' のみ): " + name);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = recordings_.find(name);
+    if (it != recordings_.end() && it->second->isOpen()) {
+        throw std::runtime_error("同じ名前の記録が実行中です: " + name);
+    }
+
+    auto recording = std::make_shared<Recording>(strand_, name, pathOf(name), &instrument, query, interval, chunkBytes_);
+    try {
+        recording->create();
+    }
+    catch (const std::exception& e) {
+        throw std::runtime_error("記録ファイルを作れません (" + pathOf(name) + "): " + e.what());
+    }
+    recordings_[name] = recording;
+    LOG_INFO("記録を開始しました: " << name << " (" << instrument.name() << " " << query << ", 間隔 " << interval.count() << "ms) -> " << pathOf(name));
+
+    boost::asio::post(strand_, [this, recording] { runFetch(recording); });
+}
+
+bool Recorder::stop(const std::string& name) {
+    const std::shared_ptr<Recording> recording = find(name);
+    if (!recording || !recording->isOpen()) {
+        return false;
+    }
+
+    boost::asio::post(strand_, [recording] {
+        recording->stopping = true;
+        recording->timer.cancel();
+        if (!recording->inFlight) {
+            recording->close();
+        }
+    });
+    return true;
+}
+
+void Recorder::stopAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : recordings_) {
+        entry.second->stopping = true;
+        entry.second->timer.cancel();
+    }
+}
+
+std::vector<Recorder::Status> Recorder::list() const {
+    std::vector<Status> result;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : recordings_) {
+        result.push_back(entry.second->status());
+    }
+    return result;
+}
+
+std::string Recorder::fetch(const std::string& name, std::uint64_t first, std::uint64_t count) {
+    if (!isValidName(name)) {
+        throw std::runtime_error("記録名が不正です (英数字、'_'、'-' のみ): " + name);
+    }
+
+    std::shared_ptr<Recording> recording = find(name);
+    if (!recording) {
+        // 以前の実行で作られたファイルを開き、次からはその一覧を使う
+        recording = std::make_shared<Recording>(strand_, name, pathOf(name), nullptr, std::string(), std::chrono::milliseconds(0), chunkBytes_);
+        try {
+            recording->load();
+        }
+        catch (const std::exception& e) {
+            throw std::runtime_error("記録ファイルを読めません (" + pathOf(name) + "): " + e.what());
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        recordings_.emplace(name, recording);
+    }
+    return recording->read(first, count, MAX_FETCH_SIZE);
+}
+
+void Recorder::runFetch(const std::shared_ptr<Recording>& recording) {
+    recording->inFlight = true;
+    recording->lastStartedAt = std::chrono::steady_clock::now();
+
+    recording->instrument->submit([this, recording](ViSession instr) {
+        bool ok = false;
+        ViStatus status = VI_SUCCESS;
+        try {
+            ok = recording->acquire(instr, status);
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("記録の取得中に例外発生 (" << recording->name << "): " << e.what());
+        }
+        boost::asio::post(strand_, [this, recording, ok, status] {
+            if (!ok) {
+                recording->stopping = true;
+            }
+            onFetched(recording, status);
+        });
+    }, JobPriority::Low, recording.get());
+}
+
+void Recorder::onFetched(const std::shared_ptr<Recording>& recording, ViStatus status) {
+    recording->inFlight = false;
+    if (recording->stopping || !recording->isOpen()) {
+        recording->close();
+        return;
+    }
+
+    // 間隔は前回の取得の開始から数える。取得に間隔以上かかった場合はすぐに次を始める
+    auto next = recording->lastStartedAt + recording->interval;
+    if (status < VI_SUCCESS && recording->interval < RETRY_AFTER_FAILURE) {
+        next = std::chrono::steady_clock::now() + RETRY_AFTER_FAILURE;
+    }
+    if (next <= std::chrono::steady_clock::now()) {
+        runFetch(recording);
+        return;
+    }
+    recording->timer.expires_at(next);
+    recording->timer.async_wait([this, recording](const boost::system::error_code& error) {
+        if (error || recording->stopping) {
+            return; // stop() で取り消された。ファイルは stop() 側で閉じる
+        }
+        runFetch(recording);
+    });
+}
+
+std::shared_ptr<Recorder::Recording> Recorder::find(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = recordings_.find(name);
+    return it == recordings_.end() ? nullptr : it->second;
+}
+
+std::string Recorder::pathOf(const std::string& name) const {
+    return (std::filesystem::path(directory_) / (name + ".vrec")).string();
+}
@@ -0,0 +1,124 @@
+﻿#pragma once
+
+#include "Instrument.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief 記録ファイル (.vrec) の先頭に置くヘッダ。数値はすべてリトルエンディアンです。
+ *        recordCount と dataEnd は1件書き終えるたびに更新するため、記録中や異常終了後のファイルもここまでは読めます。
+ */
+struct RecordFileHeader {
+    char magic[8];              // "VISAREC" + '\0'
+    std::uint32_t version;      // RECORD_FILE_VERSION
+    std::uint32_t headerSize;   // このヘッダのバイト数。最初のレコードの位置
+    std::uint64_t recordCount;  // 書き終えたレコードの数
+    std::uint64_t dataEnd;      // 最後のレコードの終わりの位置。これより後ろは事前確保した未使用の領域
+    std::int64_t startedAt;     // 記録を始めた時刻 (UNIX時間、ナノ秒)
+    std::uint32_t intervalMs;   // 取得の間隔 (ミリ秒)。0 はできる限り速く
+    std::uint32_t reserved[7];
+};
+
+/**
+ * @brief 1回の取得を表すレコードのヘッダ。直後に payloadSize バイトのデータが続き、次のレコードは8バイト境界から始まります。
+ *        データは definite-length block ならヘッダ ("#<n><len>") と末尾の改行を除いた中身、それ以外は応答から末尾の改行を除いたものです。
+ */
+struct RecordHeader {
+    std::int64_t timestamp;     // クエリを送った時刻 (UNIX時間、ナノ秒)
+    std::uint32_t payloadSize;  // データのバイト数
+    std::int32_t status;        // 最後の viWrite / viRead のステータス。VI_SUCCESS 未満なら途中までのデータ
+};
+
+constexpr std::uint32_t RECORD_FILE_VERSION = 1;
+
+/**
+ * @brief サーバー側での連続取得 (記録) を管理するクラス。
+ *        記録ごとに計測器へクエリを繰り返し送り、応答を事前確保したメモリマップトファイルへ追記します。
+ *        サンプルはネットワークを通らないため、取得の速度は計測器とバスだけで決まります。クライアントは後から fetch() で範囲を取り出します。
+ *
+ *        1回の取得は計測器のキューの優先度の低いクラス (JobPriority::Low) の1ジョブで、クライアントのコマンドが待っていれば後に回ります。
+ *        ファイルは chunkBytes 単位で伸ばし、記録を止めると使った大きさに切り詰めます。
+ */
+class Recorder {
+public:
+    /**
+     * @brief 記録の状態 (list() の結果) の1件。
+     */
+    struct Status {
+        std::string name;
+        std::string instrument; // 以前の実行で作られたファイルを fetch() で開いた場合は空
+        bool running;
+        std::uint64_t records;
+        std::uint64_t bytes;    // レコードの合計バイト数 (ヘッダを含む)
+    };
+
+    // 1回の fetch() で返すデータの上限。超える場合は返すレコードを減らす (最低1件は返す)
+    static constexpr std::size_t MAX_FETCH_SIZE = 64 * 1024 * 1024;
+
+    /**
+     * @param directory 記録ファイルを置くディレクトリ。なければ最初の記録の開始時に作ります。
+     * @param chunkBytes ファイルを事前確保して伸ばす単位のバイト数。
+     */
+    Recorder(boost::asio::io_context& io, std::string directory, std::size_t chunkBytes);
+    ~Recorder();
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    /**
+     * @brief 記録を開始します。ファイル "<directory>/<name>.vrec" は作り直されます。
+     * @param name 記録名 (英数字、'_'、'-')。
+     * @param query 取得に使うクエリ (例: ":WAV:DATA?")。
+     * @param interval 前回の取得の開始から次の取得までの間隔。0 なら前回が終わるとすぐに次を取得します。
+     * @throw std::runtime_error 記録名が不正、同名の記録が実行中、またはファイルを作れない場合。
+     */
+    void start(const std::string& name, Instrument& instrument, const std::string& query, std::chrono::milliseconds interval);
+
+    /**
+     * @brief 記録を停止します。取得中の1回は書き終えてからファイルを閉じます。
+     * @return 実行中の記録が見つかった場合 true。
+     */
+    bool stop(const std::string& name);
+
+    /**
+     * @brief すべての記録の取得ループを止めます。イベントループの停止後 (strand のハンドラが動いていない状態) に呼び出してください。
+     *        ファイルは取得中のジョブが終わった後、デストラクタで閉じます。
+     */
+    void stopAll();
+
+    /**
+     * @brief このサーバーで開始した記録と、fetch() で開いた記録の状態を返します。
+     */
+    std::vector<Status> list() const;
+
+    /**
+     * @brief レコード first から最大 count 件を、ファイル上の並び (RecordHeader + データ + 詰め物) のまま返します。
+     *        記録中でも読めます。このサーバーで開始していない記録名は、ディレクトリにあるファイルを開きます。
+     * @throw std::runtime_error 記録名が不正、またはファイルを読めない場合。
+     */
+    std::string fetch(const std::string& name, std::uint64_t first, std::uint64_t count);
+
+private:
+    class Recording;
+
+    void runFetch(const std::shared_ptr<Recording>& recording);
+    void onFetched(const std::shared_ptr<Recording>& recording, ViStatus status);
+    std::shared_ptr<Recording> find(const std::string& name) const;
+    std::string pathOf(const std::string& name) const;
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    std::string directory_;
+    std::size_t chunkBytes_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<Recording>> recordings_;
+};
@@ -0,0 +1,157 @@
+﻿#include "ResourceWatcher.h"
+
+#include "Discovery.h"
+#include "Logger.h"
+#include "StringUtil.h"
+
+#include <cctype>
+#include <utility>
+
+ResourceWatcher::ResourceWatcher(ViSession resourceManager, InstrumentPool& pool, std::vector<PendingInstrument> pending,
+    std::map<std::string, std::string> idns, SessionSettings defaults, std::chrono::milliseconds interval,
+    OnlineCallback onOnline)
+    : resourceManager_(resourceManager), pool_(pool), pending_(std::move(pending)), idns_(std::move(idns)),
+      defaults_(std::move(defaults)), interval_(interval), onOnline_(std::move(onOnline)) {}
+
+ResourceWatcher::~ResourceWatcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void ResourceWatcher::start() {
+    if (thread_.joinable()) {
+        return;
+    }
+    const std::vector<std::string> resources = listResources(resourceManager_);
+    baseline_.insert(resources.begin(), resources.end());
+    LOG_INFO("リソースの一覧を " << interval_.count() << " ms ごとに取り直し、見つかっていない計測器 ("
+        << pending_.size() << " 台) と新しく接続された計測器を探します");
+    thread_ = std::thread([this] { run(); });
+}
+
+void ResourceWatcher::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cv_.wait_for(lock, interval_, [this] { return stopping_; })) {
+        lock.unlock();
+        scan();
+        lock.lock();
+    }
+}
+
+void ResourceWatcher::scan() {
+    const std::vector<std::string> resources = listResources(resourceManager_);
+
+    // 消えたリソースを忘れ、差し直されたら問い合わせ直す
+    std::set<std::string> listed(resources.begin(), resources.end());
+    for (auto it = idns_.begin(); it != idns_.end();) {
+        it = listed.count(it->first) > 0 ? std::next(it) : idns_.erase(it);
+    }
+    for (auto it = baseline_.begin(); it != baseline_.end();) {
+        it = listed.count(*it) > 0 ? std::next(it) : baseline_.erase(it);
+    }
+
+    // 新しいリソースのうち、プールの計測器が開いていないものだけを問い合わせる
+    std::vector<std::string> fresh;
+    for (const auto& resource : resources) {
+        if (idns_.count(resource) == 0 && pool_.findByAddress(resource) == nullptr) {
+            fresh.push_back(resource);
+        }
+    }
+    if (fresh.empty()) {
+        return;
+    }
+    LOG_INFO("新しいリソースが見つかりました: " << fresh.size() << " 件");
+
+    std::vector<std::string> probed(fresh.size());
+    std::vector<std::thread> probes;
+    for (size_t i = 0; i < fresh.size(); ++i) {
+        // アドレスを指定された計測器のリソースは問い合わせずに開く
+        bool byAddress = false;
+        for (const auto& pending : pending_) {
+            byAddress = byAddress || (!pending.address.empty() && toLower(pending.address) == toLower(fresh[i]));
+        }
+        if (!byAddress) {
+            probes.emplace_back([this, &fresh, &probed, i] { probed[i] = getInstrumentIdn(resourceManager_, fresh[i].c_str()); });
+        }
+    }
+    for (auto& probe : probes) {
+        probe.join();
+    }
+
+    // 一覧の順序で、まだ見つかっていない計測器に割り当てる。1つのリソースは1台にだけ割り当てる
+    for (size_t i = 0; i < fresh.size(); ++i) {
+        idns_[fresh[i]] = probed[i];
+        const std::string lowerIdn = toLower(probed[i]);
+        auto it = pending_.begin();
+        for (; it != pending_.end(); ++it) {
+            const bool matched = it->address.empty()
+                ? !lowerIdn.empty() && lowerIdn.find(toLower(it->key)) != std::string::npos
+                : toLower(it->address) == toLower(fresh[i]);
+            if (matched) {
+                break;
+            }
+        }
+        if (it != pending_.end()) {
+            LOG_INFO("==> 対象の計測器が接続されました (" << it->name << "): " << fresh[i]);
+            if (open(it->name, fresh[i], it->settings, probed[i])) {
+                pending_.erase(it);
+            }
+        }
+        else if (baseline_.count(fresh[i]) == 0 && !probed[i].empty()) {
+            const std::string name = nameFor(probed[i]);
+            LOG_INFO("==> 新しい計測器が接続されました (" << name << "): " << fresh[i] << " (" << probed[i] << ")");
+            open(name, fresh[i], defaults_, probed[i]);
+        }
+    }
+}
+
+bool ResourceWatcher::open(const std::string& name, const std::string& resource, const SessionSettings& settings,
+    const std::string& idn) {
+    Instrument* instrument = pool_.open(resourceManager_, name, resource, settings,
+        [this, &idn](Instrument& opened) { onOnline_(opened, idn); });
+    if (instrument == nullptr) {
+        idns_.erase(resource); // 開けなかったリソースは次の検索で問い合わせ直す
+        return false;
+    }
+    return true;
+}
+
+std::string ResourceWatcher::nameFor(const std::string& idn) const {
+    // "<製造者>,<型番>,<シリアル>,<版>" の製造者と型番を、小文字の英数字と '_' だけにしてつなぐ
+    const std::vector<std::string> fields = splitList(idn);
+    std::string base;
+    for (size_t i = 0; i < fields.size() && i < 2; ++i) {
+        if (!base.empty()) {
+            base += '_';
+        }
+        for (const char c : fields[i]) {
+            base += std::isalnum(static_cast<unsigned char>(c)) ? static_cast<char>(std::tolower(static_cast<unsigned char>(c))) : '_';
+        }
+    }
+    if (base.empty()) {
+        base = "instrument";
+    }
+
+    const auto taken = [this](const std::string& name) {
+        if (pool_.find(name) != nullptr) {
+            return true;
+        }
+        for (const auto& pending : pending_) {
+            if (toLower(pending.name) == name) {
+                return true;
+            }
+        }
+        return false;
+    };
+    std::string name = base;
+    for (unsigned n = 2; taken(name); ++n) {
+        name = base + "_" + std::to_string(n);
+    }
+    return name;
+}
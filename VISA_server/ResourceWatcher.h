@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include "InstrumentPool.h"
+#include "SessionManager.h"
+
+#include <visa.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief 起動時に見つからなかった計測器と、後から接続された計測器をバックグラウンドで探し続けるクラス。
+ *        一定間隔で viFindRsrc のリソース一覧を取り、リソース記述子から IDN への対応表 (前回までの問い合わせ結果) と比べて、
+ *        新しく現れたリソースにだけ *IDN? を並列に問い合わせます。一覧に変化がなければ計測器には触れません。
+ *        見つかった計測器はプールに追加し、以後は他の計測器と同じように接続から使えます。
+ *        プールの計測器のリソースには問い合わせず、動作中のセッションには影響しません。
+ *
+ *        まだ見つかっていない計測器のキーまたはアドレスに一致したリソースは、その計測器として開きます。
+ *        どれにも一致しないリソースは、監視を始めた後に接続されたもの (start() の時点で一覧になかったもの) だけを
+ *        IDN の製造者と型番から付けた名前 ("agilent_34401a" など。重なれば "_2" などを付ける) と既定の属性で開きます。
+ *        起動時からつながっていて指定のない計測器は公開しません。
+ *
+ *        一覧から消えたリソースは対応表からも消し、差し直されたら問い合わせ直します (新しく接続されたものとして扱います)。
+ *        問い合わせに失敗したリソースも一覧に残っている間は問い合わせ直しません。
+ */
+class ResourceWatcher {
+public:
+    /**
+     * @brief まだ見つかっていない計測器の指定。
+     */
+    struct PendingInstrument {
+        std::string name;
+        std::string key;      // IDN に含まれるキーワード (大文字小文字を区別しない)。address があれば使わない
+        std::string address;  // リソース記述子の指定。一覧に現れたときに開き直す
+        SessionSettings settings;
+    };
+
+    /**
+     * @brief 開いた計測器を、プールに追加する (クライアントから見える) 前に初期設定するコールバック。監視スレッドから呼ばれます。
+     */
+    using OnlineCallback = std::function<void(Instrument& instrument, const std::string& idn)>;
+
+    /**
+     * @param resourceManager VISAリソースマネージャのセッション。このオブジェクトより長く開いておく必要があります。
+     * @param idns 起動時の検索で問い合わせたリソースの IDN (失敗は空文字列)。これらは問い合わせ直しません。
+     * @param defaults 指定のない計測器を開くときの属性。
+     * @param interval 一覧を取り直す間隔。
+     */
+    ResourceWatcher(ViSession resourceManager, InstrumentPool& pool, std::vector<PendingInstrument> pending,
+        std::map<std::string, std::string> idns, SessionSettings defaults, std::chrono::milliseconds interval,
+        OnlineCallback onOnline);
+
+    /**
+     * @brief 監視を止めます。問い合わせ中なら終わるまで待ちます。
+     */
+    ~ResourceWatcher();
+
+    ResourceWatcher(const ResourceWatcher&) = delete;
+    ResourceWatcher& operator=(const ResourceWatcher&) = delete;
+
+    /**
+     * @brief その時点のリソース一覧を記録し、監視スレッドを開始します。
+     */
+    void start();
+
+private:
+    void run();
+
+    /**
+     * @brief 一覧を1回取り直し、新しいリソースを問い合わせて、一致した計測器をプールに追加します。
+     */
+    void scan();
+
+    /**
+     * @brief resource を name の計測器として開き、初期設定してプールに追加します。
+     * @return 追加できたか。失敗したリソースは次の検索で問い合わせ直します。
+     */
+    bool open(const std::string& name, const std::string& resource, const SessionSettings& settings, const std::string& idn);
+
+    /**
+     * @brief IDN から、プールとまだ見つかっていない計測器のどれとも重ならない計測器名を作ります。
+     */
+    std::string nameFor(const std::string& idn) const;
+
+    ViSession resourceManager_;
+    InstrumentPool& pool_;
+    std::vector<PendingInstrument> pending_;   // 監視スレッドだけが操作する
+    std::map<std::string, std::string> idns_;  // リソース記述子から IDN (問い合わせ失敗は空文字列)。監視スレッドだけが操作する
+    std::set<std::string> baseline_;           // start() の時点で一覧にあり、その後消えていないリソース。監視スレッドだけが操作する
+    SessionSettings defaults_;
+    std::chrono::milliseconds interval_;
+    OnlineCallback onOnline_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
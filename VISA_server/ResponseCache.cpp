@@ -0,0 +1,89 @@
+﻿#include "ResponseCache.h"
+
+#include "StringUtil.h"
+
+#include <cctype>
+#include <utility>
+
+void ResponseCache::enable(const std::vector<std::string>& queries, std::chrono::seconds ttl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    enabled_ = true;
+    ttl_ = ttl;
+    allowList_.clear();
+    for (const auto& query : queries) {
+        const std::string normalized = normalize(query);
+        if (!normalized.empty()) {
+            allowList_.insert(normalized);
+        }
+    }
+}
+
+bool ResponseCache::enabled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return enabled_;
+}
+
+bool ResponseCache::isCacheable(const std::string& command) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return enabled_ && allowList_.count(normalize(command)) > 0;
+}
+
+bool ResponseCache::lookup(const std::string& command, std::string& response) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!enabled_) {
+        return false;
+    }
+
+    const auto it = entries_.find(normalize(command));
+    if (it == entries_.end()) {
+        return false;
+    }
+    if (ttl_.count() > 0 && std::chrono::steady_clock::now() - it->second.storedAt > ttl_) {
+        entries_.erase(it);
+        return false;
+    }
+
+    response = it->second.response;
+    return true;
+}
+
+void ResponseCache::store(const std::string& command, std::string response) {
+    if (response.empty() || response.size() > MAX_RESPONSE_SIZE) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string key = normalize(command);
+    if (!enabled_ || allowList_.count(key) == 0) {
+        return;
+    }
+    entries_[std::move(key)] = { std::move(response), std::chrono::steady_clock::now() };
+}
+
+void ResponseCache::observe(const std::string& command) {
+    // *RST / *RCL は計測器の設定を入れ替えるため、それ以前の応答は信用できない
+    const std::string lower = toLower(command);
+    if (lower.find("*rst") == std::string::npos && lower.find("*rcl") == std::string::npos) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
+
+std::string ResponseCache::normalize(const std::string& command) {
+    const std::string trimmed = toLower(trim(command));
+
+    std::string normalized;
+    normalized.reserve(trimmed.size());
+    bool previousSpace = false;
+    for (char c : trimmed) {
+        const bool space = std::isspace(static_cast<unsigned char>(c)) != 0;
+        if (space && previousSpace) {
+            continue;
+        }
+        normalized += space ? ' ' : c;
+        previousSpace = space;
+    }
+    return normalized;
+}
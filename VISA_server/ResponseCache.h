@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief 静的な問い合わせ (*IDN?、*OPT? など) の応答を計測器ごとに保持するキャッシュ。
+ *        許可リストに含まれるクエリだけを対象とし、*RST などの状態を初期化するコマンドや有効期限で無効化します。
+ *        ネットワーク側のスレッドとワーカースレッドの両方から呼ばれるため、内部で排他制御します。
+ */
+class ResponseCache {
+public:
+    // キャッシュする応答の最大サイズ。静的な問い合わせの応答はこれより十分小さい
+    static constexpr size_t MAX_RESPONSE_SIZE = 4096;
+
+    /**
+     * @brief キャッシュを有効にします。既定では無効で、何もキャッシュしません。
+     * @param queries キャッシュを許可するクエリの一覧 (大文字小文字・空白は正規化して比較)。
+     * @param ttl 応答の有効期限。0 の場合は無効化コマンドを受けるまで保持します。
+     */
+    void enable(const std::vector<std::string>& queries, std::chrono::seconds ttl);
+
+    bool enabled() const;
+
+    /**
+     * @brief command が許可リストに含まれるクエリかを判定します。
+     */
+    bool isCacheable(const std::string& command) const;
+
+    /**
+     * @brief 有効な応答がキャッシュにあれば response に格納します。
+     * @return キャッシュヒットした場合 true。
+     */
+    bool lookup(const std::string& command, std::string& response);
+
+    /**
+     * @brief 応答を保存します。許可リストにないクエリや大きすぎる応答は無視します。
+     */
+    void store(const std::string& command, std::string response);
+
+    /**
+     * @brief 計測器に送るコマンドを確認し、*RST や *RCL を含む場合はキャッシュ全体を破棄します。
+     */
+    void observe(const std::string& command);
+
+    /**
+     * @brief 比較用にコマンドを正規化します (小文字化、前後の空白除去、連続する空白の圧縮)。
+     */
+    static std::string normalize(const std::string& command);
+
+private:
+    struct Entry {
+        std::string response;
+        std::chrono::steady_clock::time_point storedAt;
+    };
+
+    mutable std::mutex mutex_;
+    bool enabled_ = false;
+    std::set<std::string> allowList_;
+    std::chrono::seconds ttl_{ 0 };
+    std::unordered_map<std::string, Entry> entries_;
+};
@@ -0,0 +1,247 @@
+﻿#include "ScpiParser.h"
+
+#include "StringUtil.h"
+
+namespace {
+
+bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/**
+ * @brief ユニットのヘッダ (最初の空白まで) が '?' で終わるかを返します。
+ */
+bool isQueryUnit(const std::string& unit) {
+    const size_t end = unit.find_first_of(" \t");
+    const std::string header = unit.substr(0, end);
+    return !header.empty() && header.back() == '?';
+}
+
+/**
+ * @brief message[pos] の '#' から始まる arbitrary block の直後の位置を返します。
+ *        ブロックでなければ pos + 1、indefinite-length block やメッセージ末尾を越えるブロックは message.size() です。
+ */
+size_t skipBlock(const std::string& message, size_t pos, bool& indefinite) {
+    if (pos + 1 >= message.size() || !isDigit(message[pos + 1])) {
+        return pos + 1; // "#H1F" などの非10進数値
+    }
+    const size_t digits = static_cast<size_t>(message[pos + 1] - '0');
+    if (digits == 0) {
+        indefinite = true;
+        return message.size();
+    }
+
+    const size_t lengthBegin = pos + 2;
+    if (lengthBegin + digits > message.size()) {
+        return message.size();
+    }
+    size_t length = 0;
+    for (size_t i = lengthBegin; i < lengthBegin + digits; ++i) {
+        if (!isDigit(message[i])) {
+            return pos + 1;
+        }
+        length = length * 10 + static_cast<size_t>(message[i] - '0');
+    }
+
+    const size_t dataBegin = lengthBegin + digits;
+    return length > message.size() - dataBegin ? message.size() : dataBegin + length;
+}
+
+} // namespace
+
+ProgramMessage parseProgramMessage(const std::string& message) {
+    ProgramMessage result;
+    size_t unitBegin = 0;
+
+    auto addUnit = [&](size_t end) {
+        std::string unit = trim(message.substr(unitBegin, end - unitBegin));
+        if (!unit.empty()) {
+            if (isQueryUnit(unit)) {
+                ++result.queries;
+            }
+            result.units.push_back(std::move(unit));
+        }
+        unitBegin = end + 1;
+    };
+
+    size_t pos = 0;
+    while (pos < message.size()) {
+        const char c = message[pos];
+        if (c == '"' || c == '\'') {
+            // 閉じ引用符まで読み飛ばす。"" のように二重にした引用符は文字列の一部
+            size_t i = pos + 1;
+            while (i < message.size()) {
+                if (message[i] == c) {
+                    if (i + 1 < message.size() && message[i + 1] == c) {
+                        i += 2;
+                        continue;
+                    }
+                    break;
+                }
+                ++i;
+            }
+            pos = i + 1;
+        }
+        else if (c == '#') {
+            pos = skipBlock(message, pos, result.indefiniteBlock);
+        }
+        else if (c == ';') {
+            addUnit(pos);
+            ++pos;
+        }
+        else {
+            ++pos;
+        }
+    }
+    if (unitBegin < message.size()) {
+        addUnit(message.size());
+    }
+    return result;
+}
+
+bool containsQuery(const std::string& message) {
+    return parseProgramMessage(message).expectsResponse();
+}
+
+bool parseBlockHeader(const char* data, std::size_t size, BlockHeader& header) {
+    if (size < 2 || data[0] != '#' || data[1] < '1' || data[1] > '9') {
+        return false;
+    }
+    const std::size_t digits = static_cast<std::size_t>(data[1] - '0');
+    if (size < 2 + digits) {
+        return false;
+    }
+
+    std::size_t length = 0;
+    for (std::size_t i = 0; i < digits; ++i) {
+        const char c = data[2 + i];
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        length = length * 10 + static_cast<std::size_t>(c - '0');
+    }
+
+    header.headerSize = 2 + digits;
+    header.payloadSize = length;
+    return true;
+}
+
+void ProgramMessageScanner::endHeader() {
+    if (state_ == State::Header && lastHeaderChar_ == '?') {
+        hasQuery_ = true;
+    }
+    state_ = State::Body;
+}
+
+std::size_t ProgramMessageScanner::scan(const char* data, std::size_t size) {
+    if (terminated_) {
+        terminated_ = false;
+        hasQuery_ = false;
+        state_ = State::UnitStart;
+    }
+
+    std::size_t pos = 0;
+    while (pos < size) {
+        const char c = data[pos];
+        switch (state_) {
+        case State::UnitStart:
+            if (c == ' ' || c == '\t' || c == '\r') {
+                ++pos;
+                continue;
+            }
+            state_ = State::Header;
+            lastHeaderChar_ = 0;
+            continue; // 同じ文字をヘッダとして読み直す
+
+        case State::Header:
+            if (c == ' ' || c == '\t' || c == '\r') {
+                endHeader();
+                ++pos;
+                continue;
+            }
+            if (c == ';' || c == '\n' || c == '"' || c == '\'' || c == '#') {
+                endHeader();
+                continue; // 区切りや引用符として読み直す
+            }
+            lastHeaderChar_ = c;
+            ++pos;
+            continue;
+
+        case State::Body:
+            if (c == '"' || c == '\'') {
+                quote_ = c;
+                state_ = State::Quoted;
+            }
+            else if (c == '#') {
+                state_ = State::BlockStart;
+            }
+            else if (c == ';') {
+                state_ = State::UnitStart;
+            }
+            else if (c == '\n') {
+                terminated_ = true;
+                return pos + 1;
+            }
+            ++pos;
+            continue;
+
+        case State::Quoted:
+            if (c == quote_) {
+                state_ = State::QuoteEnd;
+            }
+            ++pos;
+            continue;
+
+        case State::QuoteEnd:
+            if (c == quote_) {
+                state_ = State::Quoted; // "" は文字列の一部
+                ++pos;
+                continue;
+            }
+            state_ = State::Body;
+            continue;
+
+        case State::BlockStart:
+            if (!isDigit(c)) {
+                state_ = State::Body; // "#H1F" などの非10進数値
+                continue;
+            }
+            lengthDigits_ = static_cast<std::size_t>(c - '0');
+            blockRemaining_ = 0;
+            state_ = lengthDigits_ == 0 ? State::Indefinite : State::BlockLength;
+            ++pos;
+            continue;
+
+        case State::BlockLength:
+            if (!isDigit(c)) {
+                state_ = State::Body;
+                continue;
+            }
+            blockRemaining_ = blockRemaining_ * 10 + static_cast<std::size_t>(c - '0');
+            ++pos;
+            if (--lengthDigits_ == 0) {
+                state_ = blockRemaining_ > 0 ? State::BlockData : State::Body;
+            }
+            continue;
+
+        case State::BlockData: {
+            const std::size_t skip = size - pos < blockRemaining_ ? size - pos : blockRemaining_;
+            pos += skip;
+            blockRemaining_ -= skip;
+            if (blockRemaining_ == 0) {
+                state_ = State::Body;
+            }
+            continue;
+        }
+
+        case State::Indefinite:
+            if (c == '\n') {
+                terminated_ = true;
+                return pos + 1;
+            }
+            ++pos;
+            continue;
+        }
+    }
+    return size;
+}
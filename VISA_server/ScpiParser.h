@@ -0,0 +1,95 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @brief SCPI プログラムメッセージを ';' で区切ったプログラムメッセージユニットの一覧。
+ */
+struct ProgramMessage {
+    std::vector<std::string> units; // 前後の空白を除いたユニット。空のユニットは含まない
+    std::size_t queries = 0;        // ヘッダが '?' で終わるユニット (クエリ) の数
+    bool indefiniteBlock = false;   // indefinite-length block ("#0...") を含む。END まで続くため後ろに連結できない
+
+    /**
+     * @brief 計測器から応答を読み取る必要があるかを返します。
+     *        IEEE 488.2 では複数のクエリを含むメッセージへの応答も ';' 区切りの1つの応答メッセージになり、END で1回終わります。
+     */
+    bool expectsResponse() const { return queries > 0; }
+};
+
+/**
+ * @brief プログラムメッセージを ';' でユニットに分割し、クエリの数を数えます。
+ *        引用符 ("..." / '...'、二重にした引用符はエスケープ) と arbitrary block ("#<n><len><data>" / "#0<data>") の
+ *        中の ';' や '?' は区切りやクエリとして扱いません。
+ * @param message 改行を含まないプログラムメッセージ。
+ */
+ProgramMessage parseProgramMessage(const std::string& message);
+
+/**
+ * @brief メッセージにクエリが1つ以上含まれるかを返します。parseProgramMessage(message).expectsResponse() と同じです。
+ */
+bool containsQuery(const std::string& message);
+
+/**
+ * @brief IEEE 488.2 の definite-length arbitrary block ("#<n><len><data>") のヘッダ情報。
+ */
+struct BlockHeader {
+    std::size_t headerSize = 0;  // "#<n><len>" 部分のバイト数
+    std::size_t payloadSize = 0; // <data> 部分のバイト数
+};
+
+/**
+ * @brief 応答の先頭が definite-length block ヘッダであれば解析します。
+ * @return ヘッダとして解釈できた場合 true。"#0" (indefinite-length) や不完全なヘッダは false。
+ */
+bool parseBlockHeader(const char* data, std::size_t size, BlockHeader& header);
+
+/**
+ * @brief 分割して届くバイト列からプログラムメッセージの終端 (引用符と arbitrary block の外の '\n') を探す走査器。
+ *        データをコピーせずに1バイトずつ状態を進めるため、受信したバイト列をそのまま計測器へ転送しながら END を付ける位置を決められます。
+ *        definite-length block ("#<n><len><data>") のデータ部は長さ分をまとめて読み飛ばします。
+ *        indefinite-length block ("#0...") は本来 END で終わりますが、バイト列には END がないため次の '\n' を終端とみなします。
+ */
+class ProgramMessageScanner {
+public:
+    /**
+     * @brief data を先頭から走査します。直前の呼び出しでメッセージが終わっていれば、新しいメッセージとして走査を始めます。
+     * @return メッセージの終端が見つかれば終端の '\n' の直後までのバイト数 (terminated() が true になる)。見つからなければ size。
+     */
+    std::size_t scan(const char* data, std::size_t size);
+
+    /**
+     * @brief 直前の scan() でメッセージの終端に達したかを返します。
+     */
+    bool terminated() const { return terminated_; }
+
+    /**
+     * @brief 現在のメッセージ (終端に達していれば終わったメッセージ) にクエリが含まれるかを返します。
+     */
+    bool hasQuery() const { return hasQuery_; }
+
+private:
+    enum class State {
+        UnitStart,   // ユニットの先頭の空白
+        Header,      // プログラムヘッダ
+        Body,        // ヘッダより後ろ
+        Quoted,      // 引用符の中
+        QuoteEnd,    // 閉じ引用符の候補の直後 (二重にした引用符かどうか未確定)
+        BlockStart,  // '#' の直後
+        BlockLength, // definite-length block の長さ
+        BlockData,   // definite-length block のデータ
+        Indefinite,  // indefinite-length block のデータ
+    };
+
+    void endHeader();
+
+    State state_ = State::UnitStart;
+    bool terminated_ = false;
+    bool hasQuery_ = false;
+    char lastHeaderChar_ = 0;
+    char quote_ = 0;
+    std::size_t lengthDigits_ = 0;   // 残りの長さの桁数
+    std::size_t blockRemaining_ = 0; // 残りのブロックデータのバイト数
+};
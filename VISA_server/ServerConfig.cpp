@@ -0,0 +1,216 @@
+﻿#include "ServerConfig.h"
+
+#include "StringUtil.h"
+
+#include <stdexcept>
+
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace {
+
+unsigned long parseNumber(const std::string& key, const std::string& value) {
+    try {
+        size_t used = 0;
+        const unsigned long number = std::stoul(value, &used, 0); // "0x0A" のような16進数も受け付ける
+        if (used == value.size()) {
+            return number;
+        }
+    }
+    catch (const std::exception&) {
+    }
+    throw std::runtime_error(key + " の値が数値ではありません: " + value);
+}
+
+unsigned short parsePort(const std::string& key, const std::string& value) {
+    const unsigned long port = parseNumber(key, value);
+    if (port > 65535) {
+        throw std::runtime_error(key + " の値がポート番号の範囲外です: " + value);
+    }
+    return static_cast<unsigned short>(port);
+}
+
+bool parseBool(const std::string& key, const std::string& value) {
+    const std::string lower = toLower(value);
+    if (lower == "true" || lower == "yes" || lower == "on" || lower == "1") {
+        return true;
+    }
+    if (lower == "false" || lower == "no" || lower == "off" || lower == "0") {
+        return false;
+    }
+    throw std::runtime_error(key + " の値が true / false ではありません: " + value);
+}
+
+void applyServerSetting(ServerConfig& config, const std::string& key, const std::string& value) {
+    if (key == "port") {
+        config.port = parsePort(key, value);
+    }
+    else if (key == "framed_port") {
+        config.framedPort = parsePort(key, value);
+    }
+    else if (key == "hislip_port") {
+        config.hislipPort = parsePort(key, value);
+    }
+    else if (key == "raw_port") {
+        config.rawPort = parsePort(key, value);
+    }
+    else if (key == "batch_window_ms") {
+        config.batchWindowMs = static_cast<unsigned>(parseNumber(key, value));
+    }
+    else if (key == "cache") {
+        config.cacheEnabled = parseBool(key, value);
+    }
+    else if (key == "cache_queries") {
+        config.cacheEnabled = true;
+        config.cacheQueries = splitList(value);
+    }
+    else if (key == "cache_ttl_sec") {
+        config.cacheTtlSec = static_cast<unsigned>(parseNumber(key, value));
+    }
+    else if (key == "srq") {
+        config.srqEnabled = parseBool(key, value);
+    }
+    else if (key == "srq_timeout_ms") {
+        config.srqTimeoutMs = static_cast<unsigned>(parseNumber(key, value));
+    }
+    else if (key == "record_dir") {
+        config.recordDir = value;
+    }
+    else if (key == "record_chunk_mb") {
+        config.recordChunkMb = static_cast<unsigned>(parseNumber(key, value));
+        if (config.recordChunkMb == 0) {
+            throw std::runtime_error("record_chunk_mb は1以上にしてください");
+        }
+    }
+    else if (key == "rescan_sec") {
+        config.rescanSec = static_cast<unsigned>(parseNumber(key, value));
+    }
+    else if (key == "discovery_cache") {
+        config.discoveryCache = value;
+    }
+    else if (key == "io_threads") {
+        config.ioThreads = static_cast<unsigned>(parseNumber(key, value));
+    }
+    else if (key == "pin_threads") {
+        config.pinThreads = parseBool(key, value);
+    }
+    else if (key == "log_level") {
+        if (!Logger::parseLevel(value, config.logLevel)) {
+            throw std::runtime_error("不明なログレベルです: " + value);
+        }
+    }
+    else if (key == "log_file") {
+        config.logFile = value;
+    }
+    else {
+        LOG_WARN("設定ファイルの不明な項目を無視します: [server] " << key);
+    }
+}
+
+} // namespace
+
+bool applySessionSetting(SessionSettings& settings, const std::string& key, const std::string& value) {
+    if (key == "timeout_ms") {
+        settings.timeoutMs = static_cast<ViUInt32>(parseNumber(key, value));
+    }
+    else if (key == "read_buffer") {
+        settings.readBufferSize = static_cast<ViUInt32>(parseNumber(key, value));
+    }
+    else if (key == "write_buffer") {
+        settings.writeBufferSize = static_cast<ViUInt32>(parseNumber(key, value));
+    }
+    else if (key == "chunk_size") {
+        const unsigned long size = parseNumber(key, value);
+        if (size == 0) {
+            throw std::runtime_error("chunk_size は1以上にしてください");
+        }
+        settings.chunkSize = size;
+    }
+    else if (key == "termchar") {
+        const std::string lower = toLower(value);
+        if (lower == "off" || lower == "none") {
+            settings.termCharEnabled = false;
+            return true;
+        }
+        unsigned long termChar = 0;
+        if (lower == "lf" || lower == "\\n") {
+            termChar = '\n';
+        }
+        else if (lower == "cr" || lower == "\\r") {
+            termChar = '\r';
+        }
+        else {
+            termChar = parseNumber(key, value);
+            if (termChar > 0xFF) {
+                throw std::runtime_error("termchar は1バイトの値にしてください: " + value);
+            }
+        }
+        settings.termChar = static_cast<ViUInt8>(termChar);
+        settings.termCharEnabled = true;
+    }
+    else if (key == "send_end") {
+        settings.sendEnd = parseBool(key, value);
+    }
+    else if (key == "warm_standby") {
+        settings.warmStandby = parseBool(key, value);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+void loadConfigFile(const std::string& path, ServerConfig& config) {
+    boost::property_tree::ptree tree;
+    try {
+        boost::property_tree::ini_parser::read_ini(path, tree);
+    }
+    catch (const boost::property_tree::ini_parser_error& e) {
+        throw std::runtime_error("設定ファイルを読めません: " + std::string(e.what()));
+    }
+
+    std::vector<InstrumentSpec> specs;
+    for (const auto& section : tree) {
+        const std::string& name = section.first;
+        if (section.second.empty()) {
+            LOG_WARN("設定ファイルのセクション外の項目を無視します: " << name);
+            continue;
+        }
+
+        if (name == "server") {
+            for (const auto& item : section.second) {
+                applyServerSetting(config, item.first, trim(item.second.data()));
+            }
+            continue;
+        }
+        if (name == "defaults") {
+            for (const auto& item : section.second) {
+                if (!applySessionSetting(config.defaults, item.first, trim(item.second.data()))) {
+                    LOG_WARN("設定ファイルの不明な項目を無視します: [defaults] " << item.first);
+                }
+            }
+            continue;
+        }
+
+        InstrumentSpec spec;
+        spec.name = name;
+        spec.key = name;
+        for (const auto& item : section.second) {
+            const std::string value = trim(item.second.data());
+            if (item.first == "key") {
+                spec.key = value;
+            }
+            else if (item.first == "address") {
+                spec.address = value;
+            }
+            else if (!applySessionSetting(spec.settings, item.first, value)) {
+                LOG_WARN("設定ファイルの不明な項目を無視します: [" << name << "] " << item.first);
+            }
+        }
+        specs.push_back(std::move(spec));
+    }
+
+    if (!specs.empty()) {
+        config.specs = std::move(specs);
+    }
+}
@@ -0,0 +1,99 @@
+﻿#pragma once
+
+#include "InstrumentPool.h"
+#include "Logger.h"
+
+#include <string>
+#include <vector>
+
+// テキストモードの既定の待ち受けポート
+constexpr unsigned short DEFAULT_PORT = 55555;
+
+/**
+ * @brief 公開する計測器の指定。address があれば検索せずにそのリソースを開き、なければIDNに key を含む計測器を探します。
+ */
+struct InstrumentSpec {
+    std::string name;         // クライアントが宛先として指定する名前
+    std::string key;          // IDNに含まれるべきキーワード
+    std::string address;      // リソース記述子 (例: "USB0::0x0B21::0x0039::91KC12345::INSTR")
+    SessionSettings settings; // この計測器だけに設定する属性。値のない項目は ServerConfig::defaults を使う
+};
+
+/**
+ * @brief 設定ファイルとコマンドラインで指定されたサーバーの設定。
+ */
+struct ServerConfig {
+    std::vector<InstrumentSpec> specs;
+    SessionSettings defaults;            // すべての計測器に設定する属性
+    unsigned short port = DEFAULT_PORT;  // テキストモードの待ち受けポート
+    unsigned batchWindowMs = 0;          // 設定コマンドのまとめ待ち時間 (ミリ秒)
+    bool cacheEnabled = false;           // 静的な問い合わせの応答キャッシュを使うか
+    std::vector<std::string> cacheQueries = { "*IDN?", "*OPT?" };
+    unsigned cacheTtlSec = 0;            // キャッシュの有効期限 (秒)。0 は無期限
+    bool srqEnabled = false;             // SRQ による完了通知を使うか
+    unsigned srqTimeoutMs = 60000;       // SRQ 1回の完了待ちの上限 (ミリ秒)。待つ間、その計測器の他のジョブは実行されない
+    unsigned short framedPort = 0;       // フレームモードの待ち受けポート。0 なら待ち受けない
+    unsigned short hislipPort = 0;       // HiSLIP の待ち受けポート。0 なら待ち受けない
+    unsigned short rawPort = 0;          // rawモード (バイト列の素通し) の待ち受けポート。0 なら待ち受けない
+    std::string recordDir = "recordings"; // サーバー側の記録ファイル (.vrec) を置くディレクトリ
+    unsigned recordChunkMb = 64;           // 記録ファイルを事前確保して伸ばす単位 (MiB)
+    unsigned rescanSec = 5;              // 見つからなかった計測器と新しく接続された計測器を探す間隔 (秒)。0 なら探さない
+    std::string discoveryCache = "discovery_cache.txt"; // 計測器の検索結果を保存するファイル。空なら保存せず、毎回すべて検索する
+    unsigned ioThreads = 0;              // ネットワーク処理 (io_context) のスレッド数。0 なら論理CPUの数
+    bool pinThreads = false;             // ネットワーク処理と計測器のワーカーのスレッドを論理CPUに固定するか
+    LogLevel logLevel = LogLevel::Info;
+    std::string logFile;                 // 空ならコンソールのみ
+};
+
+/**
+ * @brief INI形式の設定ファイルを読み、config に上書きします。ファイルにない項目は config の値のままです。
+ *        [server] にサーバー全体の設定、[defaults] に全計測器の属性を書き、それ以外のセクションは
+ *        セクション名を計測器名とする計測器の指定です。計測器のセクションが1つでもあれば config.specs を置き換えます。
+ *
+ *        [server]
+ *        port = 55555
+ *        framed_port = 55557
+ *        hislip_port = 4880
+ *        raw_port = 55558
+ *        record_dir = recordings
+ *        record_chunk_mb = 64
+ *        batch_window_ms = 2
+ *        cache = true
+ *        cache_queries = *IDN?,*OPT?
+ *        cache_ttl_sec = 0
+ *        srq = true
+ *        srq_timeout_ms = 60000
+ *        rescan_sec = 5
+ *        discovery_cache = discovery_cache.txt
+ *        io_threads = 4
+ *        pin_threads = true
+ *        log_level = info
+ *        log_file = server.log
+ *
+ *        [defaults]
+ *        timeout_ms = 5000
+ *
+ *        ; key でIDNを検索する。address を書けば検索せずにそのリソースを開く
+ *        [scope]
+ *        key = yokogawa
+ *        timeout_ms = 20000
+ *        read_buffer = 4194304
+ *        write_buffer = 1048576
+ *        chunk_size = 1048576
+ *        termchar = lf
+ *        send_end = true
+ *        warm_standby = true
+ *
+ *        read_buffer / write_buffer は viSetBuf、chunk_size は1回の viRead で読む最大バイト数、
+ *        termchar は lf / cr / 数値 (10, 0x0A) / off、warm_standby は接続断に備えて予備のセッションを開いておくかです。コメントは ';' で始まる行に書きます。
+ *
+ * @throw std::runtime_error ファイルを読めない場合や値が不正な場合。
+ */
+void loadConfigFile(const std::string& path, ServerConfig& config);
+
+/**
+ * @brief 属性1つを "キー=値" の形で settings に設定します。キーは設定ファイルの計測器セクションと同じです。
+ * @return キーが計測器の属性のものであれば true。
+ * @throw std::runtime_error 値が不正な場合。
+ */
+bool applySessionSetting(SessionSettings& settings, const std::string& key, const std::string& value);
@@ -0,0 +1,213 @@
+﻿#include "SessionManager.h"
+
+#include "Logger.h"
+
+#include <chrono>
+#include <utility>
+
+namespace {
+
+// 開き直しに失敗したときの再試行の間隔。失敗するたびに倍にし、上限で止める
+constexpr std::chrono::milliseconds RETRY_INITIAL{ 100 };
+constexpr std::chrono::milliseconds RETRY_MAX{ 5000 };
+
+/**
+ * @brief 1つの属性の設定結果をログに残します。インターフェースが対応していない属性もあるため、失敗しても続行します。
+ */
+void reportSetting(const std::string& name, const char* attribute, ViStatus status) {
+    if (status < VI_SUCCESS) {
+        LOG_WARN("計測器 " << name << " の " << attribute << " を設定できませんでした (Status: " << status << ")");
+    }
+}
+
+void applySettings(ViSession instr, const std::string& name, const SessionSettings& settings) {
+    if (settings.timeoutMs) {
+        reportSetting(name, "VI_ATTR_TMO_VALUE", viSetAttribute(instr, VI_ATTR_TMO_VALUE, *settings.timeoutMs));
+    }
+    if (settings.readBufferSize) {
+        reportSetting(name, "読み取りバッファ (viSetBuf)", viSetBuf(instr, VI_READ_BUF, *settings.readBufferSize));
+    }
+    if (settings.writeBufferSize) {
+        reportSetting(name, "書き込みバッファ (viSetBuf)", viSetBuf(instr, VI_WRITE_BUF, *settings.writeBufferSize));
+    }
+    if (settings.termChar) {
+        reportSetting(name, "VI_ATTR_TERMCHAR", viSetAttribute(instr, VI_ATTR_TERMCHAR, *settings.termChar));
+    }
+    if (settings.termCharEnabled) {
+        reportSetting(name, "VI_ATTR_TERMCHAR_EN",
+            viSetAttribute(instr, VI_ATTR_TERMCHAR_EN, *settings.termCharEnabled ? VI_TRUE : VI_FALSE));
+    }
+    if (settings.sendEnd) {
+        reportSetting(name, "VI_ATTR_SEND_END_EN",
+            viSetAttribute(instr, VI_ATTR_SEND_END_EN, *settings.sendEnd ? VI_TRUE : VI_FALSE));
+    }
+}
+
+} // namespace
+
+void SessionSettings::fillFrom(const SessionSettings& defaults) {
+    if (!timeoutMs) timeoutMs = defaults.timeoutMs;
+    if (!readBufferSize) readBufferSize = defaults.readBufferSize;
+    if (!writeBufferSize) writeBufferSize = defaults.writeBufferSize;
+    if (!termChar) termChar = defaults.termChar;
+    if (!termCharEnabled) termCharEnabled = defaults.termCharEnabled;
+    if (!sendEnd) sendEnd = defaults.sendEnd;
+    if (!chunkSize) chunkSize = defaults.chunkSize;
+    if (!warmStandby) warmStandby = defaults.warmStandby;
+}
+
+SessionManager::SessionManager(ViSession resourceManager, std::string name, std::string address, SessionSettings settings)
+    : resourceManager_(resourceManager), name_(std::move(name)), address_(std::move(address)), settings_(std::move(settings)) {}
+
+SessionManager::~SessionManager() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    for (ViSession session : { primary_, standby_, replacement_ }) {
+        if (session != VI_NULL) {
+            viClose(session);
+        }
+    }
+}
+
+ViStatus SessionManager::openSession(ViSession& session) {
+    session = VI_NULL;
+    const ViStatus status = viOpen(resourceManager_, address_.c_str(), VI_NULL, VI_NULL, &session);
+    if (status < VI_SUCCESS) {
+        session = VI_NULL;
+        return status;
+    }
+    applySettings(session, name_, settings_);
+    return status;
+}
+
+ViStatus SessionManager::open() {
+    const ViStatus status = openSession(primary_);
+    if (status < VI_SUCCESS || !settings_.warmStandby.value_or(false)) {
+        return status;
+    }
+
+    const ViStatus standbyStatus = openSession(standby_);
+    if (standbyStatus < VI_SUCCESS) {
+        LOG_WARN("予備のセッションを開けませんでした (" << name_ << ", Status: " << standbyStatus << ")。予備なしで動作します");
+    }
+    else {
+        LOG_INFO("予備のセッションを開きました (" << name_ << ")");
+    }
+    return status;
+}
+
+bool SessionManager::isConnectionLost(ViStatus status) {
+    switch (status) {
+    case VI_ERROR_CONN_LOST:    // TCPIP の接続断
+    case VI_ERROR_INV_OBJECT:   // セッションが無効になった
+    case VI_ERROR_RSRC_NFOUND:  // USB の再列挙中
+    case VI_ERROR_IO:           // USB の取り外しなどによる入出力エラー
+    case VI_ERROR_NLISTENERS:   // GPIB の計測器の電源断
+        return true;
+    default:
+        return false;
+    }
+}
+
+void SessionManager::requestReconnect() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || reconnecting_ || replacement_ != VI_NULL) {
+        return;
+    }
+    reconnecting_ = true;
+    if (!thread_.joinable()) {
+        thread_ = std::thread([this] { run(); });
+    }
+    cv_.notify_all();
+}
+
+ViSession SessionManager::readyReplacement() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return replacement_;
+}
+
+void SessionManager::commitReplacement() {
+    ViSession old = VI_NULL;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (replacement_ == VI_NULL) {
+            return;
+        }
+        old = primary_;
+        primary_ = replacement_;
+        replacement_ = VI_NULL;
+    }
+    if (old != VI_NULL) {
+        viClose(old);
+    }
+}
+
+void SessionManager::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || reconnecting_; });
+        if (stopping_) {
+            return;
+        }
+
+        const auto startedAt = std::chrono::steady_clock::now();
+        ViSession candidate = standby_;
+        standby_ = VI_NULL;
+        lock.unlock();
+
+        // 予備が生きているかはシリアルポールで確かめる。主セッションと同じ原因で使えなくなっていることもある
+        if (candidate != VI_NULL) {
+            ViUInt16 statusByte = 0;
+            const ViStatus status = viReadSTB(candidate, &statusByte);
+            if (status < VI_SUCCESS) {
+                LOG_INFO("予備のセッションも使えません (" << name_ << ", Status: " << status << ")。開き直します");
+                viClose(candidate);
+                candidate = VI_NULL;
+            }
+        }
+
+        auto delay = RETRY_INITIAL;
+        bool reported = false;
+        while (candidate == VI_NULL) {
+            const ViStatus status = openSession(candidate);
+            if (status >= VI_SUCCESS) {
+                break;
+            }
+            if (!reported) {
+                LOG_WARN("計測器を開き直せません (" << name_ << " = " << address_ << ", Status: " << status << ")。再試行を続けます");
+                reported = true;
+            }
+
+            lock.lock();
+            if (cv_.wait_for(lock, delay, [this] { return stopping_; })) {
+                reconnecting_ = false;
+                return;
+            }
+            lock.unlock();
+            delay = delay * 2 < RETRY_MAX ? delay * 2 : RETRY_MAX;
+        }
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startedAt);
+        LOG_INFO("計測器のセッションを開き直しました (" << name_ << ", " << elapsed.count() << " ms)");
+
+        lock.lock();
+        replacement_ = candidate;
+        reconnecting_ = false;
+
+        // 差し替えを待たせないよう、新しい予備は差し替え用のセッションを渡してから開く
+        if (settings_.warmStandby.value_or(false) && standby_ == VI_NULL && !stopping_) {
+            lock.unlock();
+            ViSession nextStandby = VI_NULL;
+            openSession(nextStandby);
+            lock.lock();
+            standby_ = nextStandby;
+        }
+    }
+}
@@ -0,0 +1,112 @@
+﻿#pragma once
+
+#include <visa.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+/**
+ * @brief 計測器のセッションを開いたときに設定するVISA属性。値のない項目はVISAの既定値のままにします。
+ */
+struct SessionSettings {
+    std::optional<ViUInt32> timeoutMs;        // VI_ATTR_TMO_VALUE
+    std::optional<ViUInt32> readBufferSize;   // viSetBuf (VI_READ_BUF)
+    std::optional<ViUInt32> writeBufferSize;  // viSetBuf (VI_WRITE_BUF)
+    std::optional<ViUInt8> termChar;          // VI_ATTR_TERMCHAR
+    std::optional<bool> termCharEnabled;      // VI_ATTR_TERMCHAR_EN
+    std::optional<bool> sendEnd;              // VI_ATTR_SEND_END_EN
+    std::optional<std::size_t> chunkSize;     // 1回の viRead で読む最大バイト数 (応答バッファの大きさ)
+    std::optional<bool> warmStandby;          // 予備のセッションを開いておき、接続断からの復旧に使うか
+
+    /**
+     * @brief 値のない項目を defaults の値で埋めます。
+     */
+    void fillFrom(const SessionSettings& defaults);
+};
+
+/**
+ * @brief 1台の計測器のVISAセッションを所有し、接続が失われたときに裏で開き直すクラス。
+ *        電源の入れ直しやUSBの再列挙でセッションが使えなくなっても、検索をやり直さずに同じリソース記述子で開き直します。
+ *
+ *        warmStandby を指定すると同じリソースにもう1つセッション (予備) を開いておきます。接続断の通知を受けると、
+ *        予備が生きていればそれを即座に差し替え用にし、新しい予備を開き直します。予備も使えなければ、
+ *        開けるようになるまで間隔を延ばしながら viOpen を繰り返します。
+ *
+ *        差し替えは計測器のワーカースレッドがジョブの合間に readyReplacement() と commitReplacement() で行います。
+ */
+class SessionManager {
+public:
+    /**
+     * @param resourceManager VISAリソースマネージャのセッション。このオブジェクトより長く開いておく必要があります。
+     * @param name ログに出す計測器名。
+     * @param address 計測器のリソース記述子。
+     * @param settings セッションを開くたびに設定する属性。
+     */
+    SessionManager(ViSession resourceManager, std::string name, std::string address, SessionSettings settings);
+
+    /**
+     * @brief 再接続を止め、所有するすべてのセッションを閉じます。
+     */
+    ~SessionManager();
+
+    SessionManager(const SessionManager&) = delete;
+    SessionManager& operator=(const SessionManager&) = delete;
+
+    /**
+     * @brief 主セッションを開いて属性を設定し、warmStandby なら予備も開きます (予備の失敗は警告のみ)。
+     * @return 主セッションの viOpen のステータス。
+     */
+    ViStatus open();
+
+    /**
+     * @brief 現在の主セッションを返します。
+     */
+    ViSession session() const { return primary_; }
+
+    /**
+     * @brief 主セッションの接続が失われたことを知らせ、裏で差し替え用のセッションの準備を始めます。準備中なら何もしません。
+     */
+    void requestReconnect();
+
+    /**
+     * @brief 差し替え用のセッションの準備ができていれば返します。なければ VI_NULL。
+     *        返したセッションは commitReplacement() を呼ぶまで主セッションになりません。
+     */
+    ViSession readyReplacement();
+
+    /**
+     * @brief readyReplacement() で受け取ったセッションを主セッションにし、古い主セッションを閉じます。
+     *        古いセッションのイベントハンドラを外してから呼び出してください。
+     */
+    void commitReplacement();
+
+    /**
+     * @brief 接続が失われたことを示すステータスかを返します。
+     */
+    static bool isConnectionLost(ViStatus status);
+
+    const std::string& address() const { return address_; }
+    const SessionSettings& settings() const { return settings_; }
+
+private:
+    ViStatus openSession(ViSession& session);
+    void run();
+
+    ViSession resourceManager_;
+    std::string name_;
+    std::string address_;
+    SessionSettings settings_;
+    ViSession primary_ = VI_NULL; // ワーカースレッドのみが差し替える
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+    bool stopping_ = false;
+    bool reconnecting_ = false;          // 差し替え用のセッションを準備中
+    ViSession standby_ = VI_NULL;        // 予備のセッション
+    ViSession replacement_ = VI_NULL;    // 準備ができた差し替え用のセッション
+};
@@ -0,0 +1,42 @@
+﻿#include "StringUtil.h"
+
+#include <algorithm>
+#include <cctype>
+
+std::string toLower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(),
+        [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    const char* whitespace = " \t\r\n";
+    const size_t first = s.find_first_not_of(whitespace);
+    if (first == std::string::npos) {
+        return "";
+    }
+    const size_t last = s.find_last_not_of(whitespace);
+    return s.substr(first, last - first + 1);
+}
+
+bool startsWithIgnoreCase(const std::string& s, const std::string& prefix) {
+    if (s.size() < prefix.size()) {
+        return false;
+    }
+    return std::equal(prefix.begin(), prefix.end(), s.begin(),
+        [](unsigned char a, unsigned char b) { return std::tolower(a) == std::tolower(b); });
+}
+
+std::vector<std::string> splitList(const std::string& list) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t comma = list.find(',', begin);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        items.push_back(trim(list.substr(begin, comma - begin)));
+        begin = comma + 1;
+    }
+    return items;
+}
@@ -0,0 +1,16 @@
+﻿#pragma once
+
+#include <string>
+#include <vector>
+
+// 文字列を小文字に変換するヘルパー関数
+std::string toLower(std::string s);
+
+// 前後の空白文字 (スペース、タブ、CR、LF) を取り除くヘルパー関数
+std::string trim(const std::string& s);
+
+// s が prefix で始まるかを大文字小文字を区別せずに判定するヘルパー関数
+bool startsWithIgnoreCase(const std::string& s, const std::string& prefix);
+
+// カンマ区切りの一覧を、各要素の前後の空白を取り除いて分割するヘルパー関数
+std::vector<std::string> splitList(const std::string& list);
@@ -0,0 +1,171 @@
+﻿#include "SubscriptionHub.h"
+
+#include "Logger.h"
+#include "StringUtil.h"
+
+#include <utility>
+
+SubscriptionHub::SubscriptionHub(boost::asio::io_context& io)
+    : strand_(boost::asio::make_strand(io)) {
+}
+
+SubscriptionHub::~SubscriptionHub() {
+    stop();
+}
+
+void SubscriptionHub::stop() {
+    for (auto& entry : polls_) {
+        entry.second->timer.cancel();
+        entry.second->subscribers.clear();
+    }
+    polls_.clear();
+    owners_.clear();
+}
+
+std::size_t SubscriptionHub::subscribe(Instrument& instrument, const std::string& query, std::chrono::milliseconds interval, Listener listener) {
+    const std::size_t id = nextId_++;
+    if (interval < MIN_INTERVAL) {
+        interval = MIN_INTERVAL;
+    }
+
+    boost::asio::post(strand_, [this, id, instrument = &instrument, query = trim(query), interval, listener = std::move(listener)]() mutable {
+        addSubscriber(id, instrument, std::move(query), interval, std::move(listener));
+    });
+    return id;
+}
+
+void SubscriptionHub::unsubscribe(std::size_t id) {
+    boost::asio::post(strand_, [this, id] { removeSubscriber(id); });
+}
+
+void SubscriptionHub::addSubscriber(std::size_t id, Instrument* instrument, std::string query, std::chrono::milliseconds interval, Listener listener) {
+    PollKey key(instrument, toLower(query));
+    auto& poll = polls_[key];
+    const bool created = !poll;
+    if (created) {
+        poll = std::make_shared<Poll>(strand_);
+        poll->instrument = instrument;
+        poll->query = std::move(query);
+    }
+
+    // 新しい購読者には次の問い合わせの結果をすぐに配る
+    poll->subscribers[id] = { interval, std::chrono::steady_clock::time_point(), std::move(listener) };
+    owners_[id] = key;
+
+    const auto period = shortestInterval(*poll);
+    if (created || period < poll->period) {
+        poll->period = period;
+        LOG_INFO("購読の問い合わせ周期: " << instrument->name() << " " << poll->query << " " << period.count() << "ms (購読者 " << poll->subscribers.size() << ")");
+        schedule(poll, std::chrono::steady_clock::now());
+    }
+}
+
+void SubscriptionHub::removeSubscriber(std::size_t id) {
+    const auto owner = owners_.find(id);
+    if (owner == owners_.end()) {
+        return;
+    }
+    const auto it = polls_.find(owner->second);
+    owners_.erase(owner);
+    if (it == polls_.end()) {
+        return;
+    }
+
+    const std::shared_ptr<Poll> poll = it->second;
+    poll->subscribers.erase(id);
+    if (poll->subscribers.empty()) {
+        // 実行中の問い合わせは最後まで行い、結果は誰にも配らずに捨てる
+        LOG_INFO("購読の問い合わせを停止しました: " << poll->instrument->name() << " " << poll->query);
+        poll->timer.cancel();
+        polls_.erase(it);
+        return;
+    }
+    // 周期が延びる場合は次の満了から新しい周期で回る
+    poll->period = shortestInterval(*poll);
+}
+
+void SubscriptionHub::schedule(const std::shared_ptr<Poll>& poll, std::chrono::steady_clock::time_point at) {
+    poll->timer.expires_at(at);
+    const unsigned generation = ++poll->generation;
+    std::weak_ptr<Poll> weak = poll;
+    poll->timer.async_wait([this, weak, at, generation](const boost::system::error_code& error) {
+        const std::shared_ptr<Poll> poll = weak.lock();
+        if (error || !poll || poll->generation != generation || poll->subscribers.empty()) {
+            return; // 周期の変更または停止で取り消された
+        }
+
+        // 前回の問い合わせが終わっていなければこの回は飛ばし、計測器のキューに溜めない
+        if (!poll->inFlight) {
+            runPoll(poll);
+        }
+
+        // 処理が遅れて周期を過ぎていても追いつこうとせず、今から1周期後にする
+        const auto now = std::chrono::steady_clock::now();
+        auto next = at + poll->period;
+        if (next <= now) {
+            next = now + poll->period;
+        }
+        schedule(poll, next);
+    });
+}
+
+void SubscriptionHub::runPoll(const std::shared_ptr<Poll>& poll) {
+    poll->inFlight = true;
+
+    Instrument& instrument = *poll->instrument;
+    instrument.submit([this, poll, &instrument, query = poll->query](ViSession instr) {
+        std::string response;
+        std::string error;
+        const ResponseSink sink = [&](BufferPool::Buffer buffer) {
+            response.append(buffer.data(), buffer.size());
+            return true;
+        };
+
+        try {
+            if (writeCommand(instr, query, instrument, error) >= VI_SUCCESS) {
+                readResponse(instr, sink, instrument, error);
+            }
+        }
+        catch (const std::exception& e) {
+            LOG_ERROR("購読の問い合わせ中に例外発生: " << e.what());
+            error = std::string("サーバーエラー: ") + e.what() + "\n";
+        }
+        // 途中で失敗した応答は配らず、エラーメッセージに差し替える
+        if (response.empty() || !error.empty()) {
+            response = std::move(error);
+        }
+
+        boost::asio::post(strand_, [this, poll, response = std::move(response)] {
+            poll->inFlight = false;
+            deliver(poll, response);
+        });
+    }, JobPriority::Normal, poll.get());
+}
+
+void SubscriptionHub::deliver(const std::shared_ptr<Poll>& poll, const std::string& response) {
+    if (response.empty()) {
+        return;
+    }
+
+    // 各購読者の間隔の経過を判定する。問い合わせ周期の揺らぎで1回分遅れないよう、周期の半分までは早めに配る
+    const auto now = std::chrono::steady_clock::now();
+    const auto slack = poll->period / 2;
+    for (auto& entry : poll->subscribers) {
+        Subscriber& subscriber = entry.second;
+        if (now - subscriber.deliveredAt + slack < subscriber.interval) {
+            continue;
+        }
+        subscriber.deliveredAt = now;
+        subscriber.listener(entry.first, response);
+    }
+}
+
+std::chrono::milliseconds SubscriptionHub::shortestInterval(const Poll& poll) {
+    auto shortest = poll.subscribers.begin()->second.interval;
+    for (const auto& entry : poll.subscribers) {
+        if (entry.second.interval < shortest) {
+            shortest = entry.second.interval;
+        }
+    }
+    return shortest;
+}
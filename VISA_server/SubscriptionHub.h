@@ -0,0 +1,97 @@
+﻿#pragma once
+
+#include "Instrument.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief 定期的な問い合わせ (購読) をまとめて実行するクラス。
+ *        複数のクライアントが同じ計測器の同じクエリを購読しても、計測器への問い合わせは (計測器, クエリ) ごとに1本だけ行い、
+ *        結果をすべての購読者へ配ります。バスの負荷は購読者数ではなく、異なるクエリの数に比例します。
+ *
+ *        問い合わせの周期は購読者の中で最も短い間隔です。前回の問い合わせが終わっていなければその回は飛ばします。
+ *        購読者には、それぞれが指定した間隔が経過するごとに最新の結果を配ります。
+ *        状態はすべて専用の strand 上で操作するため、どのスレッドからでも呼び出せます。
+ */
+class SubscriptionHub {
+public:
+    /**
+     * @brief 購読の結果を受け取るリスナー。ハブの strand から呼ばれるため、受け取った側の strand へ投げてすぐに戻ってください。
+     * @param id subscribe() が返した購読ID。
+     * @param response 応答 (END まで、改行を含む)。問い合わせに失敗した場合はエラーメッセージ。
+     */
+    using Listener = std::function<void(std::size_t id, const std::string& response)>;
+
+    // 購読の間隔の下限。これより短い間隔は下限に切り上げる
+    static constexpr std::chrono::milliseconds MIN_INTERVAL{ 10 };
+
+    explicit SubscriptionHub(boost::asio::io_context& io);
+    ~SubscriptionHub();
+
+    SubscriptionHub(const SubscriptionHub&) = delete;
+    SubscriptionHub& operator=(const SubscriptionHub&) = delete;
+
+    /**
+     * @brief 計測器のクエリを購読します。同じ計測器の同じクエリ (大文字小文字と前後の空白を区別しない) の問い合わせは共有されます。
+     * @return unsubscribe に渡す購読ID (1以上)。
+     */
+    std::size_t subscribe(Instrument& instrument, const std::string& query, std::chrono::milliseconds interval, Listener listener);
+
+    /**
+     * @brief 購読を解除します。最後の購読者がいなくなった問い合わせは止まります。解除の前に配られた結果は届くことがあります。
+     */
+    void unsubscribe(std::size_t id);
+
+    /**
+     * @brief すべての問い合わせを止めます。イベントループの停止後 (strand のハンドラが動いていない状態) に呼び出してください。
+     *        実行中の問い合わせの結果は配りません。
+     */
+    void stop();
+
+private:
+    struct Subscriber {
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point deliveredAt; // 最後に結果を配った時刻
+        Listener listener;
+    };
+
+    /**
+     * @brief (計測器, クエリ) ごとの問い合わせ。
+     */
+    struct Poll {
+        explicit Poll(boost::asio::strand<boost::asio::io_context::executor_type>& strand) : timer(strand) {}
+
+        Instrument* instrument = nullptr;
+        std::string query;
+        boost::asio::steady_timer timer;
+        std::chrono::milliseconds period{ 0 };
+        std::map<std::size_t, Subscriber> subscribers;
+        bool inFlight = false;
+        unsigned generation = 0; // schedule() のたびに進め、満了済みで取り消せなかった古い待ちを無視する
+    };
+
+    using PollKey = std::pair<Instrument*, std::string>;
+
+    void addSubscriber(std::size_t id, Instrument* instrument, std::string query, std::chrono::milliseconds interval, Listener listener);
+    void removeSubscriber(std::size_t id);
+    void schedule(const std::shared_ptr<Poll>& poll, std::chrono::steady_clock::time_point at);
+    void runPoll(const std::shared_ptr<Poll>& poll);
+    void deliver(const std::shared_ptr<Poll>& poll, const std::string& response);
+    static std::chrono::milliseconds shortestInterval(const Poll& poll);
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    std::atomic<std::size_t> nextId_{ 1 };
+
+    // strand 上でのみ操作する
+    std::map<PollKey, std::shared_ptr<Poll>> polls_;
+    std::map<std::size_t, PollKey> owners_; // 購読ID から問い合わせへの対応
+};
@@ -0,0 +1,45 @@
+﻿#include "TcpServer.h"
+
+#include "ClientSession.h"
+#include "FramedSession.h"
+#include "Logger.h"
+#include "RawSession.h"
+
+#include <memory>
+
+TcpServer::TcpServer(boost::asio::io_context& io, unsigned short port, InstrumentPool& pool, Protocol protocol,
+    SessionServices services)
+    : io_(io),
+      acceptor_(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+      pool_(pool),
+      protocol_(protocol),
+      services_(services) {
+    accept();
+}
+
+void TcpServer::accept() {
+    acceptor_.async_accept(boost::asio::make_strand(io_),
+        [this](const boost::system::error_code& error, boost::asio::ip::tcp::socket socket) {
+            if (error) {
+                if (error == boost::asio::error::operation_aborted) {
+                    return; // サーバー停止
+                }
+                LOG_ERROR("クライアント接続の受け付けに失敗しました: " << error.message());
+            }
+            else {
+                // 応答末尾の短い書き込み (ブロック後の改行など) が Nagle と遅延ACKで数十ms待たされないようにする
+                boost::system::error_code ignored;
+                socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+                if (protocol_ == Protocol::Framed) {
+                    std::make_shared<FramedSession>(std::move(socket), pool_)->start();
+                }
+                else if (protocol_ == Protocol::Raw) {
+                    std::make_shared<RawSession>(std::move(socket), pool_)->start();
+                }
+                else {
+                    std::make_shared<ClientSession>(std::move(socket), pool_, services_)->start();
+                }
+            }
+            accept();
+        });
+}
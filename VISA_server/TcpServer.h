@@ -0,0 +1,37 @@
+﻿#pragma once
+
+#include "ClientSession.h"
+#include "InstrumentPool.h"
+
+#include <boost/asio.hpp>
+
+/**
+ * @brief TCP接続を非同期に受け付け、接続ごとに ClientSession を起動するクラス。
+ *        各接続は独自のstrandで動作するため、複数のクライアントが同時に接続を維持できます。
+ */
+class TcpServer {
+public:
+    /**
+     * @brief 接続に使うプロトコル。
+     */
+    enum class Protocol {
+        Text,   // 改行区切りのコマンド (ClientSession)
+        Framed, // 長さ付きバイナリフレーム (FramedSession)
+        Raw,    // 既定の計測器へのバイト列の素通し (RawSession)
+    };
+
+    /**
+     * @param services テキストモードの接続が使うサーバー側の機能。
+     */
+    TcpServer(boost::asio::io_context& io, unsigned short port, InstrumentPool& pool, Protocol protocol = Protocol::Text,
+        SessionServices services = SessionServices());
+
+private:
+    void accept();
+
+    boost::asio::io_context& io_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    InstrumentPool& pool_;
+    Protocol protocol_;
+    SessionServices services_;
+};
@@ -0,0 +1,7 @@
+﻿#pragma once
+
+// 論理CPUの数を返すヘルパー関数。取得できない場合は 1
+unsigned hardwareThreadCount();
+
+// 呼び出したスレッドを論理CPU cpu (0始まり) だけで実行させるヘルパー関数。失敗した場合は false
+bool pinCurrentThread(unsigned cpu);
@@ -9,11 +9,28 @@
 #include <algorithm> 
 #include <cctype>    
 #include <locale.h> // setlocale
+#include <csignal>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include <boost/asio.hpp>
 
-// グローバルな定数 (ポート番号)
-constexpr int PORT = 55555;
+#include "Discovery.h"
+#include "HislipServer.h"
+#include "InstrumentPool.h"
+#include "Logger.h"
+#include "Macro.h"
+#include "Recorder.h"
+#include "ResourceWatcher.h"
+#include "ServerConfig.h"
+#include "StringUtil.h"
+#include "SubscriptionHub.h"
+#include "TcpServer.h"
+#include "ThreadAffinity.h"
 
 /**
  * @brief 現在のマシンのプライマリIPv4アドレスを取得します。
@@ -36,262 +53,413 @@ std::string getIPV4Address() {
         }
     }
     catch (const std::exception& e) {
-        std::cerr << "IPv4アドレスの取得に失敗しました: " << e.what() << std::endl;
+        LOG_ERROR("IPv4アドレスの取得に失敗しました: " << e.what());
     }
     return ""; // 見つからないかエラー
 }
 
 /**
- * @brief 指定されたリソース記述子 (instrDesc) の計測器を一時的に開き、*IDN? を問い合わせます。
- * @param resourceManager VISAリソースマネージャのセッション。
- * @param instrDesc 問い合わせ対象の計測器のリソース記述子。
- * @return 計測器のIDN文字列。失敗した場合は空文字列。
+ * @brief コマンドライン引数を解析します。"--config <ファイル>" があれば先に読み、その後ろの引数で上書きします。
+ *        計測器の指定は "名前=キー"、"名前=リソース記述子" または "キー" で、指定すると設定ファイルの計測器を置き換えます。
+ *        設定ファイルにもコマンドラインにも計測器の指定がなければ yokogawa の1台です。
+ *        --timeout などの属性の指定はすべての計測器に適用され、設定ファイルの [defaults] より優先されます。
+ *        例: VISA_server.exe --config server.ini --port 55555 --batch-window 2 --cache --srq --framed-port 55557 --hislip --raw-port 55558
+ *                            --record-dir D:\recordings --io-threads 4 --pin-threads --rescan 5 --discovery-cache cache.txt --timeout 5000 --read-buffer 4194304 --chunk-size 1048576 --termchar lf --warm-standby --log-level warn --log-file server.log
+ *                            scope=yokogawa dmm=keithley
  */
-std::string getInstrumentIdn(ViSession resourceManager, const ViChar* instrDesc) {
-    ViSession instrument;
-    ViStatus status;
-
-    status = viOpen(resourceManager, instrDesc, VI_NULL, VI_NULL, &instrument);
-    if (status < VI_SUCCESS) {
-        std::cerr << "getInstrumentIdn: 計測器のオープンに失敗しました (" << instrDesc << ", Status: " << status << ")" << std::endl;
-        return "";
-    }
-
-    std::array<char, 256> idnBuffer = { 0 };
-    status = viQueryf(instrument, "%s", "%255t", "*IDN?\n", idnBuffer.data());
-
-    viClose(instrument);
-
-    if (status < VI_SUCCESS) {
-        std::cerr << "getInstrumentIdn: *IDN? の問い合わせに失敗しました (" << instrDesc << ", Status: " << status << ")" << std::endl;
-        return "";
-    }
-
-    return std::string(idnBuffer.data());
-}
-
-// 文字列を小文字に変換するヘルパー関数
-std::string toLower(std::string s) {
-    std::transform(s.begin(), s.end(), s.begin(),
-        [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
-    return s;
-}
-
-/**
- * @brief 接続されている計測器を検索し、IDNに指定されたキー文字列 (key) を含む最初の計測器を見つけます。(大文字小文字を区別しない)
- * @param resourceManager VISAリソースマネージャのセッション。
- * @param key IDNに含まれるべきキーワード (例: "TEKTRONIX")。
- * @return 見つかった計測器のリソース記述子文字列。見つからない場合は空文字列。
- */
-std::string findInstrument(ViSession resourceManager, const std::string& key) {
-    ViStatus status;
-    ViFindList findList;
-    ViUInt32 numInstrs = 0;
-
-    std::array<ViChar, VI_FIND_BUFLEN> instrDesc;
-
-    status = viFindRsrc(resourceManager, "?*INSTR", &findList, &numInstrs, instrDesc.data());
-    if (status < VI_SUCCESS) {
-        std::cerr << "findInstrument: 計測器の検索 (viFindRsrc) に失敗しました (Status: " << status << ")" << std::endl;
-        return "";
-    }
-    if (numInstrs == 0) {
-        std::cout << "findInstrument: 計測器が見つかりませんでした。" << std::endl;
-        return "";
+ServerConfig parseCommandLine(int argc, char* argv[]) {
+    ServerConfig options;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--config") {
+            loadConfigFile(argv[i + 1], options);
+        }
     }
 
-    std::cout << "見つかった計測器の数: " << numInstrs << std::endl;
-
-    std::string foundAddress = "";
-    const std::string lower_key = toLower(key);
-
-    for (ViUInt32 i = 0; i < numInstrs; ++i) {
-        if (i > 0) {
-            status = viFindNext(findList, instrDesc.data());
-            if (status < VI_SUCCESS) continue;
+    // 計測器の属性のオプション名と設定ファイルのキーの対応
+    const std::pair<const char*, const char*> sessionOptions[] = {
+        { "--timeout", "timeout_ms" },
+        { "--read-buffer", "read_buffer" },
+        { "--write-buffer", "write_buffer" },
+        { "--chunk-size", "chunk_size" },
+        { "--termchar", "termchar" },
+        { "--send-end", "send_end" },
+    };
+
+    std::vector<InstrumentSpec> specs;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--config" && i + 1 < argc) {
+            ++i; // 読み込み済み
+            continue;
         }
-
-        std::string idn = getInstrumentIdn(resourceManager, instrDesc.data());
-
-        std::cout << "  " << (i + 1) << ": " << instrDesc.data()
-            << (idn.empty() ? " (IDN取得失敗)" : " (IDN: " + idn + ")") << std::endl;
-
-        if (!idn.empty()) {
-            std::string lower_idn = toLower(idn);
-            if (lower_idn.find(lower_key) != std::string::npos) {
-                std::cout << "==> 対象の計測器が見つかりました: " << instrDesc.data() << std::endl;
-                foundAddress = std::string(instrDesc.data());
+        if (arg == "--warm-standby") {
+            options.defaults.warmStandby = true;
+            continue;
+        }
+        if (arg == "--port" && i + 1 < argc) {
+            options.port = static_cast<unsigned short>(std::stoul(argv[++i]));
+            continue;
+        }
+        bool sessionOption = false;
+        for (const auto& option : sessionOptions) {
+            if (arg == option.first && i + 1 < argc) {
+                applySessionSetting(options.defaults, option.second, argv[++i]);
+                sessionOption = true;
                 break;
             }
         }
-    }
-
-    viClose(findList);
-
-    if (foundAddress.empty()) {
-        std::cout << "findInstrument: 対象の計測器 (" << key << ") が見つかりませんでした (大文字小文字無視)。" << std::endl;
-    }
-
-    return foundAddress;
-}
-
-/**
- * @brief TCPクライアントからの接続を処理し、受信したコマンドをVISA計測器に転送します。
- * @param socket クライアントとの通信用ソケット。
- * @param instr 通信対象のVISA計測器セッション。
- */
-void handle_client(boost::asio::ip::tcp::socket& socket, ViSession instr) {
-    using boost::asio::ip::tcp;
-    constexpr size_t READ_BUFFER_SIZE = 2048;
-
-    try {
-        boost::asio::streambuf buf;
-        boost::system::error_code read_error;
-        boost::asio::read_until(socket, buf, "\n", read_error);
-
-        if (read_error == boost::asio::error::eof) {
-            std::cout << "クライアントがコマンド送信前に切断しました。" << std::endl;
-            return;
+        if (sessionOption) {
+            continue;
         }
-        else if (read_error) {
-            throw boost::system::system_error(read_error);
+        if (arg == "--batch-window" && i + 1 < argc) {
+            options.batchWindowMs = static_cast<unsigned>(std::stoul(argv[++i]));
+            continue;
         }
-
-        std::istream is(&buf);
-        std::string command;
-        std::getline(is, command);
-
-        command.erase(command.find_last_not_of("\r\n") + 1);
-        if (command.empty()) {
-            return;
+        if (arg == "--cache") {
+            options.cacheEnabled = true;
+            continue;
         }
-
-        std::cout << "受信: " << command << std::endl;
-
-        std::string visa_command = command + "\n";
-        ViUInt32 writeCount;
-        ViStatus status = viWrite(instr, (ViBuf)visa_command.c_str(), visa_command.length(), &writeCount);
-
-        if (status < VI_SUCCESS) {
-            std::cerr << "viWrite に失敗しました (Status: " << status << ")" << std::endl;
-            boost::asio::write(socket, boost::asio::buffer("エラー: 計測器への書き込みに失敗しました\n"));
-            return;
+        if (arg == "--cache-queries" && i + 1 < argc) {
+            // カンマ区切りのクエリ一覧。指定するとキャッシュも有効になる
+            options.cacheEnabled = true;
+            options.cacheQueries = splitList(argv[++i]);
+            continue;
         }
-
-        std::string reply = "コマンド送信完了 (応答なし)";
-
-        if (command.back() == '?') {
-            std::vector<char> response_buffer(READ_BUFFER_SIZE, 0);
-            ViUInt32 retCount = 0;
-
-            status = viRead(instr, (ViBuf)response_buffer.data(), READ_BUFFER_SIZE - 1, &retCount);
-
-            if (status >= VI_SUCCESS) {
-                reply = std::string(response_buffer.data(), retCount);
-            }
-            else {
-                std::cerr << "viRead に失敗しました (Status: " << status << ")" << std::endl;
-                reply = "エラー: 応答の読み取りに失敗しました";
+        if (arg == "--cache-ttl" && i + 1 < argc) {
+            options.cacheTtlSec = static_cast<unsigned>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--srq") {
+            options.srqEnabled = true;
+            continue;
+        }
+        if (arg == "--srq-timeout" && i + 1 < argc) {
+            options.srqEnabled = true;
+            options.srqTimeoutMs = static_cast<unsigned>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--framed-port" && i + 1 < argc) {
+            options.framedPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--hislip") {
+            options.hislipPort = HISLIP_DEFAULT_PORT;
+            continue;
+        }
+        if (arg == "--hislip-port" && i + 1 < argc) {
+            options.hislipPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--raw-port" && i + 1 < argc) {
+            options.rawPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--record-dir" && i + 1 < argc) {
+            options.recordDir = argv[++i];
+            continue;
+        }
+        if (arg == "--rescan" && i + 1 < argc) {
+            options.rescanSec = static_cast<unsigned>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--discovery-cache" && i + 1 < argc) {
+            options.discoveryCache = argv[++i];
+            continue;
+        }
+        if (arg == "--io-threads" && i + 1 < argc) {
+            options.ioThreads = static_cast<unsigned>(std::stoul(argv[++i]));
+            continue;
+        }
+        if (arg == "--pin-threads") {
+            options.pinThreads = true;
+            continue;
+        }
+        if (arg == "--log-level" && i + 1 < argc) {
+            if (!Logger::parseLevel(argv[++i], options.logLevel)) {
+                throw std::invalid_argument(std::string("不明なログレベルです: ") + argv[i]);
             }
+            continue;
+        }
+        if (arg == "--log-file" && i + 1 < argc) {
+            options.logFile = argv[++i];
+            continue;
         }
 
-        std::cout << "送信: " << reply;
-
-        boost::asio::write(socket, boost::asio::buffer(reply));
-
-    }
-    catch (const std::exception& e) {
-        std::cerr << "handle_client で例外発生: " << e.what() << std::endl;
-        try {
-            boost::asio::write(socket, boost::asio::buffer(std::string("サーバーエラー: ") + e.what() + "\n"));
+        InstrumentSpec spec;
+        const size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            spec.name = toLower(arg);
+            spec.key = arg;
+        }
+        else {
+            spec.name = arg.substr(0, eq);
+            spec.key = arg.substr(eq + 1);
         }
-        catch (...) {
-            // 通知失敗
+        if (spec.key.find("::") != std::string::npos) {
+            spec.address = spec.key; // リソース記述子なら検索しない
         }
+        specs.push_back(std::move(spec));
+    }
+    if (!specs.empty()) {
+        options.specs = std::move(specs);
+    }
+    if (options.specs.empty()) {
+        InstrumentSpec spec;
+        spec.name = "yokogawa";
+        spec.key = "yokogawa";
+        options.specs.push_back(std::move(spec));
     }
+    return options;
 }
 
-
-int main() {
+int main(int argc, char* argv[]) {
     // Windowsコンソールでの日本語文字化け対策
     setlocale(LC_ALL, "japanese");
 
     using boost::asio::ip::tcp;
 
-    std::cout << "VISA USBTMC Over IP サーバーを起動します..." << std::endl;
+    ServerConfig options;
+    try {
+        options = parseCommandLine(argc, argv);
+    }
+    catch (const std::exception& e) {
+        LOG_ERROR("コマンドライン引数または設定ファイルが不正です: " << e.what());
+        return 1;
+    }
+
+    if (!Logger::instance().start(options.logLevel, options.logFile)) {
+        LOG_WARN("ログファイルを開けませんでした: " << options.logFile);
+    }
+
+    LOG_INFO("VISA USBTMC Over IP サーバーを起動します...");
 
     ViSession defaultRM = VI_NULL;
-    ViSession instr = VI_NULL;
     ViStatus status;
 
     status = viOpenDefaultRM(&defaultRM);
     if (status < VI_SUCCESS) {
-        std::cerr << "VISAリソースマネージャのオープンに失敗しました (Status: " << status << ")" << std::endl;
+        LOG_ERROR("VISAリソースマネージャのオープンに失敗しました (Status: " << status << ")");
         return 1;
     }
 
-    std::string instrAddress = findInstrument(defaultRM, "yokogawa");
+    // リソース記述子で指定された計測器は検索せず、それ以外をまとめて検索する
+    const std::vector<InstrumentSpec>& specs = options.specs;
+    // 前回の検索結果があれば、各計測器名に前回割り当てたリソースだけを確かめる。1台でも確かめられなければすべて検索し直す
+    std::map<std::string, CachedInstrument> cached;
+    if (!options.discoveryCache.empty()) {
+        cached = loadDiscoveryCache(options.discoveryCache);
+    }
+    std::vector<std::string> keys;
+    std::vector<std::string> candidates;
+    for (const auto& spec : specs) {
+        if (spec.address.empty()) {
+            keys.push_back(spec.key);
+            const auto it = cached.find(spec.name);
+            candidates.push_back(it != cached.end() ? it->second.address : std::string());
+        }
+    }
 
-    if (instrAddress.empty()) {
-        std::cerr << "対象の計測器 (yokogawa) の検索に失敗しました。" << std::endl;
-        viClose(defaultRM);
-        return 1;
+    std::map<std::string, std::string> probedIdns;
+    std::vector<DiscoveredInstrument> found;
+    if (!cached.empty()) {
+        found = findCachedInstruments(defaultRM, keys, candidates, &probedIdns);
+    }
+    const bool cacheMissed = found.size() != keys.size() ||
+        std::any_of(found.begin(), found.end(), [](const DiscoveredInstrument& d) { return d.address.empty(); });
+    if (cacheMissed) {
+        found = findInstruments(defaultRM, keys, &probedIdns);
+    }
+    std::vector<DiscoveredInstrument> discovered;
+    size_t next = 0;
+    for (const auto& spec : specs) {
+        if (spec.address.empty()) {
+            discovered.push_back(found[next++]);
+        }
+        else {
+            discovered.push_back({ spec.address, std::string() });
+        }
     }
 
-    status = viOpen(defaultRM, (ViRsrc)instrAddress.c_str(), VI_NULL, VI_NULL, &instr);
+    // ネットワーク処理のスレッドは前の論理CPUから、計測器のワーカーは後ろの論理CPUから割り当てる。
+    // ワーカーはほとんどの時間を VISA 呼び出しの中で待つため、論理CPUの数を超えても共有させる
+    const unsigned cpuCount = hardwareThreadCount();
+    const unsigned ioThreads = options.ioThreads != 0 ? options.ioThreads : cpuCount;
+
+    // 起動時と、後から接続された計測器 (ResourceWatcher) とで同じ設定を、プールに追加する前 (クライアントから見える前) にする
+    InstrumentPool pool;
+    // 次回の起動のために、キーで見つけて開いた計測器の割り当てを記録する (後から接続された計測器は ResourceWatcher のスレッドから)
+    std::map<std::string, CachedInstrument> discoveryCache;
+    std::mutex discoveryCacheMutex;
+    const auto configureInstrument = [&options, &pool, cpuCount, &discoveryCache, &discoveryCacheMutex](Instrument& instrument, std::string idn) {
+        if (!idn.empty()) {
+            std::lock_guard<std::mutex> lock(discoveryCacheMutex);
+            discoveryCache[instrument.name()] = { instrument.address(), idn };
+        }
+        instrument.setBatchWindow(std::chrono::milliseconds(options.batchWindowMs));
+        if (options.srqEnabled) {
+            instrument.enableServiceRequest(std::chrono::milliseconds(options.srqTimeoutMs));
+        }
+        if (options.cacheEnabled) {
+            instrument.cache().enable(options.cacheQueries, std::chrono::seconds(options.cacheTtlSec));
+            // 検索時の *IDN? 応答を登録しておき、*IDN? ではバスに触れないようにする
+            if (!idn.empty() && idn.back() != '\n') {
+                idn += '\n';
+            }
+            instrument.cache().store("*IDN?", std::move(idn));
+        }
+        if (options.pinThreads) {
+            const unsigned index = static_cast<unsigned>(pool.size()); // プールに追加する前に呼ばれる
+            instrument.pinWorker(cpuCount - 1 - index % cpuCount);
+        }
+    };
+
+    std::vector<ResourceWatcher::PendingInstrument> pending;
+    for (size_t i = 0; i < specs.size(); ++i) {
+        SessionSettings settings = specs[i].settings;
+        settings.fillFrom(options.defaults);
+        if (discovered[i].address.empty()) {
+            LOG_ERROR("対象の計測器 (" << specs[i].key << ") の検索に失敗しました。");
+            pending.push_back({ specs[i].name, specs[i].key, std::string(), settings });
+            continue;
+        }
+        const std::string& idn = discovered[i].idn;
+        Instrument* instrument = pool.open(defaultRM, specs[i].name, discovered[i].address, settings,
+            [&configureInstrument, &idn](Instrument& opened) { configureInstrument(opened, idn); });
+        if (instrument == nullptr) {
+            probedIdns.erase(discovered[i].address); // ResourceWatcher に問い合わせ直させる
+            pending.push_back({ specs[i].name, specs[i].key, specs[i].address, settings });
+        }
+    }
 
-    if (status < VI_SUCCESS) {
-        std::cerr << "VISAデバイスのオープンに失敗しました: " << instrAddress << " (Status: " << status << ")" << std::endl;
-        viClose(defaultRM);
-        return 1;
+    // 探し直す計測器があれば、起動時に1台も開けなくても待ち受けて接続を待つ
+    const bool rescanning = options.rescanSec != 0 && !pending.empty();
+    if (pool.empty()) {
+        if (!rescanning) {
+            LOG_ERROR("公開できる計測器がありません。");
+            viClose(defaultRM);
+            return 1;
+        }
+        LOG_WARN("公開できる計測器がまだありません。計測器が接続されるまで探し続けます。");
+    }
+
+    if (!options.discoveryCache.empty() && !saveDiscoveryCache(options.discoveryCache, discoveryCache)) {
+        LOG_WARN("次回の起動ではすべてのリソースを検索します");
     }
 
-    std::cout << "計測器のオープンに成功: " << instrAddress << std::endl;
+    // 見つからなかった計測器と後から接続された計測器を、裏で探し続ける
+    std::unique_ptr<ResourceWatcher> watcher;
+    if (options.rescanSec != 0) {
+        watcher = std::make_unique<ResourceWatcher>(defaultRM, pool, std::move(pending), std::move(probedIdns),
+            options.defaults, std::chrono::seconds(options.rescanSec), configureInstrument);
+        watcher->start();
+    }
 
     try {
         boost::asio::io_context io;
-        tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), PORT));
+        SubscriptionHub subscriptions(io);
+        Recorder recorder(io, options.recordDir, static_cast<std::size_t>(options.recordChunkMb) * 1024 * 1024);
+        MacroLibrary macros;
+        SessionServices services;
+        services.subscriptions = &subscriptions;
+        services.recorder = &recorder;
+        services.macros = &macros;
+        TcpServer server(io, options.port, pool, TcpServer::Protocol::Text, services);
+        std::unique_ptr<TcpServer> framedServer;
+        if (options.framedPort != 0) {
+            framedServer = std::make_unique<TcpServer>(io, options.framedPort, pool, TcpServer::Protocol::Framed);
+        }
+        std::unique_ptr<TcpServer> rawServer;
+        if (options.rawPort != 0) {
+            rawServer = std::make_unique<TcpServer>(io, options.rawPort, pool, TcpServer::Protocol::Raw);
+        }
+        std::unique_ptr<HislipServer> hislipServer;
+        if (options.hislipPort != 0) {
+            hislipServer = std::make_unique<HislipServer>(io, options.hislipPort, pool);
+        }
+
+        // Ctrl+C でイベントループを止め、後片付けへ進む
+        boost::asio::signal_set signals(io, SIGINT, SIGTERM);
+        signals.async_wait([&io](const boost::system::error_code&, int) { io.stop(); });
 
         std::string ip = getIPV4Address();
         if (ip.empty()) {
-            std::cerr << "警告: ローカルIPアドレスを決定できませんでした。'YOUR_IP_ADDRESS' を使用します。" << std::endl;
+            LOG_WARN("ローカルIPアドレスを決定できませんでした。'YOUR_IP_ADDRESS' を使用します。");
             ip = "YOUR_IP_ADDRESS";
         }
 
+        Logger::instance().flush();
         std::cout << "\n========================================================" << std::endl;
         std::cout << "サーバー待機中。以下のVISAアドレスで接続してください:" << std::endl;
-        std::cout << "TCPIP0::" << ip << "::" << PORT << "::SOCKET" << std::endl;
+        std::cout << "TCPIP0::" << ip << "::" << options.port << "::SOCKET" << std::endl;
+        if (framedServer) {
+            std::cout << "フレームモード (長さ付きバイナリ): " << ip << ":" << options.framedPort << std::endl;
+        }
+        if (rawServer && pool.defaultInstrument() != nullptr) {
+            std::cout << "rawモード (" << pool.defaultInstrument()->name() << " へ素通し): TCPIP0::" << ip << "::" << options.rawPort << "::SOCKET" << std::endl;
+        }
+        if (hislipServer) {
+            // 既定のポート以外では VISA のリソース記述子にポート番号を付ける
+            std::cout << "HiSLIP: TCPIP0::" << ip << "::hislip0"
+                << (options.hislipPort == HISLIP_DEFAULT_PORT ? "" : "," + std::to_string(options.hislipPort)) << "::INSTR" << std::endl;
+        }
+        std::cout << "公開中の計測器 (既定の宛先は 1 番):" << std::endl;
+        const auto instruments = pool.instruments();
+        for (size_t i = 0; i < instruments.size(); ++i) {
+            std::cout << "  " << (i + 1) << ": " << instruments[i]->name() << " = " << instruments[i]->address() << std::endl;
+        }
+        std::cout << "宛先の切り替え: :SERVER:SELECT <名前>  /  コマンド単位: @<名前> <コマンド>" << std::endl;
+        std::cout << "優先度: :SERVER:PRIORITY HIGH|NORMAL|LOW  (高いクラスのコマンドは大きな転送の途中でも先に処理)" << std::endl;
+        std::cout << "定期問い合わせ: :SERVER:SUBSCRIBE <間隔ms>,<クエリ>  /  解除: :SERVER:UNSUBSCRIBE <ID>|ALL" << std::endl;
+        std::cout << "サーバー側の記録: :SERVER:RECORD:START <名前>,<間隔ms>,<クエリ>  /  :SERVER:RECORD:STOP <名前>  (保存先: " << options.recordDir << ")" << std::endl;
+        std::cout << "ロック: :SERVER:LOCK [EXCLUSIVE|SHARED,<キー>][,<タイムアウトms>]  /  解放: :SERVER:UNLOCK" << std::endl;
+        std::cout << "時刻: :SERVER:TIMESTAMP ON|OFF  (応答の先頭に \"<通し番号>,<viWrite の時刻ns>,<viRead の時刻ns>;\" を付ける)" << std::endl;
+        std::cout << "マクロ: :SERVER:MACRO:DEFINE <名前> ... :SERVER:MACRO:END  /  実行: :SERVER:MACRO:RUN <名前>[,<変数>=<値>...]" << std::endl;
+        std::cout << "ネットワーク処理のスレッド: " << ioThreads << (options.pinThreads ? " (論理CPUに固定)" : "") << std::endl;
         std::cout << "========================================================\n" << std::endl;
 
-        while (true) {
-            tcp::socket socket(io);
-            acceptor.accept(socket);
-
+        // セッションはそれぞれの strand 上で動くため、イベントループを複数のスレッドで回す
+        const auto runIo = [&io, &options, cpuCount](unsigned index) {
+            if (options.pinThreads && !pinCurrentThread(index % cpuCount)) {
+                LOG_WARN("ネットワーク処理のスレッドを CPU " << (index % cpuCount) << " に固定できませんでした");
+            }
             try {
-                std::cout << "クライアントが接続しました: " << socket.remote_endpoint().address().to_string() << std::endl;
-
-                handle_client(socket, instr);
-
-                std::cout << "クライアントが切断しました。\n\n";
-
+                io.run();
             }
             catch (const std::exception& e) {
-                std::cerr << "クライアント接続処理中にエラーが発生しました: " << e.what() << std::endl;
+                LOG_ERROR("イベントループで例外発生: " << e.what());
+                io.stop();
             }
+        };
+        std::vector<std::thread> ioPool;
+        for (unsigned i = 1; i < ioThreads; ++i) {
+            ioPool.emplace_back(runIo, i);
+        }
+        runIo(0);
+        for (auto& thread : ioPool) {
+            thread.join();
         }
 
+        // ワーカーに残ったジョブはハブ・記録・接続の strand へ結果を投げるため、それらを破棄する前にワーカーを止める。
+        // 計測器自体は接続のデストラクタが参照するため、io_context の後で閉じる
+        LOG_INFO("シャットダウンしています...");
+        subscriptions.stop();
+        recorder.stopAll();
+        watcher.reset();
+        pool.stopAll();
     }
     catch (const std::exception& e) {
-        std::cerr << "サーバーのセットアップに失敗、または致命的なエラーが発生しました: " << e.what() << std::endl;
+        LOG_ERROR("サーバーのセットアップに失敗、または致命的なエラーが発生しました: " << e.what());
     }
 
-    std::cout << "シャットダウンしています..." << std::endl;
-    if (instr != VI_NULL) {
-        viClose(instr);
+    watcher.reset();
+    pool.closeAll();
+    if (!options.discoveryCache.empty()) {
+        saveDiscoveryCache(options.discoveryCache, discoveryCache);
     }
     if (defaultRM != VI_NULL) {
         viClose(defaultRM);
     }
 
+    Logger::instance().stop();
     return 0;
 }
\ No newline at end of file